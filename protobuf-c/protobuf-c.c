@@ -60,6 +60,18 @@
 # define inline __inline
 #endif
 
+/*
+ * Vectorized kernels are compiled with per-function target attributes and
+ * selected at run time, so no special compiler flags are needed. Define
+ * PROTOBUF_C_DISABLE_SIMD to build only the portable code.
+ */
+#if !defined(PROTOBUF_C_DISABLE_SIMD) && \
+    (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+# define PROTOBUF_C_X86_SIMD 1
+# include <immintrin.h>
+#endif
+
 /**
  * \defgroup internal Internal functions and macros
  *
@@ -185,6 +197,217 @@ static ProtobufCAllocator protobuf_c__allocator = {
 	.allocator_data = NULL,
 };
 
+/* === SIMD support === */
+
+#if defined(PROTOBUF_C_X86_SIMD)
+
+/** Vector extensions usable by the kernels for packed varint arrays. */
+typedef enum {
+	SIMD_LEVEL_UNKNOWN,
+	SIMD_LEVEL_NONE,
+	SIMD_LEVEL_SSE41,	/**< SSE4.1 and POPCNT */
+	SIMD_LEVEL_AVX2		/**< AVX2 and POPCNT */
+} SimdLevel;
+
+static SimdLevel
+get_simd_level(void)
+{
+	static int level = SIMD_LEVEL_UNKNOWN;
+	int rv = __atomic_load_n(&level, __ATOMIC_RELAXED);
+
+	if (rv == SIMD_LEVEL_UNKNOWN) {
+		__builtin_cpu_init();
+		if (!__builtin_cpu_supports("popcnt"))
+			rv = SIMD_LEVEL_NONE;
+		else if (__builtin_cpu_supports("avx2"))
+			rv = SIMD_LEVEL_AVX2;
+		else if (__builtin_cpu_supports("sse4.1"))
+			rv = SIMD_LEVEL_SSE41;
+		else
+			rv = SIMD_LEVEL_NONE;
+		__atomic_store_n(&level, rv, __ATOMIC_RELAXED);
+	}
+	return (SimdLevel) rv;
+}
+
+#endif /* PROTOBUF_C_X86_SIMD */
+
+/* === arena === */
+
+/** Alignment of every allocation handed out by a `ProtobufCArena`. */
+typedef union {
+	void		*p;
+	uint64_t	u64;
+	double		d;
+} arena_align_t;
+
+#define ARENA_ALIGNMENT		sizeof(arena_align_t)
+#define ARENA_ALIGN(n)		(((n) + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1))
+
+/** Minimum size of a block obtained from the block allocator. */
+#define ARENA_MIN_BLOCK_SIZE	4096
+
+/** Header of a block obtained from the block allocator. */
+typedef struct ArenaBlock ArenaBlock;
+struct ArenaBlock {
+	ArenaBlock	*next;
+	size_t		size;		/**< Usable bytes following the header. */
+};
+
+#define ARENA_BLOCK_HEADER_SIZE	ARENA_ALIGN(sizeof(ArenaBlock))
+#define ARENA_BLOCK_DATA(block)	((uint8_t *) (block) + ARENA_BLOCK_HEADER_SIZE)
+
+static inline ProtobufCAllocator *
+arena_block_allocator(ProtobufCArena *arena)
+{
+	if (arena->block_allocator == NULL)
+		return &protobuf_c__allocator;
+	return arena->block_allocator;
+}
+
+static void
+arena_use_block(ProtobufCArena *arena, ArenaBlock *block)
+{
+	block->next = arena->blocks;
+	arena->blocks = block;
+	arena->ptr = ARENA_BLOCK_DATA(block);
+	arena->end = arena->ptr + block->size;
+}
+
+/**
+ * Slow path of arena_alloc(): move on to a block with at least `size` bytes.
+ */
+static void *
+arena_alloc_block(ProtobufCArena *arena, size_t size)
+{
+	ArenaBlock *block = arena->spare;
+	size_t block_size;
+	void *rv;
+
+	if (block != NULL && block->size >= size) {
+		arena->spare = NULL;
+	} else {
+		block_size = arena->next_block_size;
+		if (block_size < size)
+			block_size = size;
+		if (block_size > SIZE_MAX - ARENA_BLOCK_HEADER_SIZE)
+			return NULL;
+		block = do_alloc(arena_block_allocator(arena),
+				 ARENA_BLOCK_HEADER_SIZE + block_size);
+		if (block == NULL)
+			return NULL;
+		block->size = block_size;
+		if (block_size <= SIZE_MAX / 2)
+			arena->next_block_size = block_size * 2;
+	}
+	arena_use_block(arena, block);
+	rv = arena->ptr;
+	arena->ptr += size;
+	return rv;
+}
+
+static void *
+arena_alloc(void *allocator_data, size_t size)
+{
+	ProtobufCArena *arena = allocator_data;
+	void *rv;
+
+	if (size > SIZE_MAX - ARENA_ALIGNMENT)
+		return NULL;
+	size = ARENA_ALIGN(size);
+	if (size > (size_t) (arena->end - arena->ptr))
+		return arena_alloc_block(arena, size);
+	rv = arena->ptr;
+	arena->ptr += size;
+	return rv;
+}
+
+static void
+arena_free(void *allocator_data, void *data)
+{
+	/* Memory is only reclaimed by protobuf_c_arena_reset(). */
+	(void) allocator_data;
+	(void) data;
+}
+
+static void
+arena_free_blocks(ProtobufCArena *arena, ArenaBlock *block)
+{
+	while (block != NULL) {
+		ArenaBlock *next = block->next;
+		do_free(arena_block_allocator(arena), block);
+		block = next;
+	}
+}
+
+/**
+ * Point the arena at its initial block, aligning the start if necessary.
+ */
+static void
+arena_rewind(ProtobufCArena *arena)
+{
+	uintptr_t start = (uintptr_t) arena->initial_block;
+	uintptr_t aligned = ARENA_ALIGN(start);
+
+	if (arena->initial_block == NULL ||
+	    aligned - start >= arena->initial_size)
+	{
+		arena->ptr = arena->end = NULL;
+		return;
+	}
+	arena->ptr = arena->initial_block + (aligned - start);
+	arena->end = arena->initial_block + arena->initial_size;
+}
+
+void
+protobuf_c_arena_init(ProtobufCArena *arena,
+		      void *initial_block,
+		      size_t initial_size,
+		      ProtobufCAllocator *block_allocator)
+{
+	arena->base.alloc = &arena_alloc;
+	arena->base.free = &arena_free;
+	arena->base.allocator_data = arena;
+	arena->block_allocator = block_allocator;
+	arena->initial_block = initial_block;
+	arena->initial_size = initial_size;
+	arena->blocks = NULL;
+	arena->spare = NULL;
+	arena->next_block_size = ARENA_MIN_BLOCK_SIZE;
+	if (arena->next_block_size < initial_size)
+		arena->next_block_size = initial_size;
+	arena_rewind(arena);
+}
+
+void
+protobuf_c_arena_reset(ProtobufCArena *arena)
+{
+	ArenaBlock *keep = arena->blocks;
+
+	/*
+	 * Blocks only grow, so the newest one is the largest. Keep it (or the
+	 * spare kept by a previous reset, if nothing was allocated since).
+	 */
+	if (keep != NULL) {
+		arena_free_blocks(arena, keep->next);
+		arena_free_blocks(arena, arena->spare);
+		keep->next = NULL;
+		arena->spare = keep;
+	}
+	arena->blocks = NULL;
+	arena_rewind(arena);
+}
+
+void
+protobuf_c_arena_destroy(ProtobufCArena *arena)
+{
+	arena_free_blocks(arena, arena->blocks);
+	arena_free_blocks(arena, arena->spare);
+	arena->blocks = NULL;
+	arena->spare = NULL;
+	arena_rewind(arena);
+}
+
 /* === buffer-simple === */
 
 void
@@ -227,6 +450,113 @@ protobuf_c_buffer_simple_append(ProtobufCBuffer *buffer,
  * @{
  */
 
+/** Number of sub-message sizes a `SizeCache` holds before allocating. */
+#define SIZE_CACHE_STACK_ENTRIES	64
+
+/**
+ * Sizes of the sub-messages of a message being packed, in the order in which
+ * they are visited. protobuf_c_message_pack_to_buffer() sizes each top-level
+ * sub-message once, recording the sizes of everything nested in it, and then
+ * reads the recorded sizes back while emitting the length prefixes. Without
+ * it every sub-message would be re-sized once for each enclosing message.
+ *
+ * The cache lives on the packer's stack and the messages are never written
+ * to, so several threads may pack the same message concurrently. Entries
+ * that do not fit (because growing the table failed) are recomputed.
+ */
+typedef struct SizeCache SizeCache;
+
+struct SizeCache {
+	/** Recorded sizes, indexed by visiting order. */
+	size_t		*sizes;
+	/** Capacity of `sizes`. */
+	size_t		max_sizes;
+	/** Number of sub-messages sized so far. */
+	size_t		n_sizes;
+	/** Index of the next sub-message to be emitted. */
+	size_t		next;
+	/** Initial storage for `sizes`. */
+	size_t		stack_sizes[SIZE_CACHE_STACK_ENTRIES];
+};
+
+static size_t
+message_get_packed_size(const ProtobufCMessage *message, SizeCache *cache);
+
+static void
+size_cache_init(SizeCache *cache)
+{
+	cache->sizes = cache->stack_sizes;
+	cache->max_sizes = SIZE_CACHE_STACK_ENTRIES;
+	cache->n_sizes = 0;
+	cache->next = 0;
+}
+
+static void
+size_cache_destroy(SizeCache *cache)
+{
+	if (cache->sizes != cache->stack_sizes)
+		do_free(&protobuf_c__allocator, cache->sizes);
+}
+
+/**
+ * Double the capacity of a size cache. Failure is not an error: the entries
+ * that do not fit are simply not cached.
+ */
+static void
+size_cache_grow(SizeCache *cache)
+{
+	size_t new_max = cache->max_sizes * 2;
+	size_t *sizes;
+
+	if (new_max > SIZE_MAX / sizeof(size_t))
+		return;
+	sizes = do_alloc(&protobuf_c__allocator, new_max * sizeof(size_t));
+	if (sizes == NULL)
+		return;
+	memcpy(sizes, cache->sizes, cache->max_sizes * sizeof(size_t));
+	size_cache_destroy(cache);
+	cache->sizes = sizes;
+	cache->max_sizes = new_max;
+}
+
+/**
+ * Calculate the serialized size of a sub-message, recording it and the sizes
+ * of the messages nested in it in `cache` (if not NULL).
+ */
+static size_t
+sub_message_get_packed_size(const ProtobufCMessage *message, SizeCache *cache)
+{
+	size_t idx;
+	size_t rv;
+
+	if (cache == NULL)
+		return message_get_packed_size(message, NULL);
+	idx = cache->n_sizes++;
+	if (idx == cache->max_sizes)
+		size_cache_grow(cache);
+	rv = message_get_packed_size(message, cache);
+	if (idx < cache->max_sizes)
+		cache->sizes[idx] = rv;
+	return rv;
+}
+
+/**
+ * Return the serialized size of the next sub-message to be emitted. The first
+ * sub-message of a subtree triggers the sizing of the whole subtree; the
+ * sub-messages nested in it are then answered from the cache.
+ */
+static size_t
+size_cache_next(SizeCache *cache, const ProtobufCMessage *message)
+{
+	size_t idx = cache->next++;
+
+	if (idx == cache->n_sizes)
+		return sub_message_get_packed_size(message, cache);
+	if (idx < cache->max_sizes)
+		return cache->sizes[idx];
+	return message_get_packed_size(message, NULL);
+}
+
 /**
  * Return the number of bytes required to store the tag for the field. Includes
  * 3 bits for the wire-type, and a single bit that denotes the end-of-tag.
@@ -399,6 +729,167 @@ sint64_size(int64_t v)
 	return uint64_size(zigzag64(v));
 }
 
+static size_t
+varint_array_size_scalar(ProtobufCType type, size_t i, size_t count,
+			 const void *array)
+{
+	size_t rv = 0;
+
+	switch (type) {
+	case PROTOBUF_C_TYPE_SINT32:
+		for (; i < count; i++)
+			rv += sint32_size(((const int32_t *) array)[i]);
+		break;
+	case PROTOBUF_C_TYPE_ENUM:
+	case PROTOBUF_C_TYPE_INT32:
+		for (; i < count; i++)
+			rv += int32_size(((const int32_t *) array)[i]);
+		break;
+	case PROTOBUF_C_TYPE_UINT32:
+		for (; i < count; i++)
+			rv += uint32_size(((const uint32_t *) array)[i]);
+		break;
+	case PROTOBUF_C_TYPE_SINT64:
+		for (; i < count; i++)
+			rv += sint64_size(((const int64_t *) array)[i]);
+		break;
+	case PROTOBUF_C_TYPE_INT64:
+	case PROTOBUF_C_TYPE_UINT64:
+		for (; i < count; i++)
+			rv += uint64_size(((const uint64_t *) array)[i]);
+		break;
+	default:
+		PROTOBUF_C__ASSERT_NOT_REACHED();
+	}
+	return rv;
+}
+
+#if defined(PROTOBUF_C_X86_SIMD)
+
+/** Broadcast the 32-bit threshold `t` biased for an unsigned comparison. */
+#define UNSIGNED_GT_32(t)	_mm256_set1_epi32((int32_t) ((t) ^ 0x80000000U))
+
+/** Broadcast the 64-bit threshold `t` biased for an unsigned comparison. */
+#define UNSIGNED_GT_64(t)	\
+	_mm256_set1_epi64x((int64_t) ((t) ^ UINT64_C(0x8000000000000000)))
+
+/*
+ * Classify 8 (or 4) values at a time: every size boundary a value exceeds
+ * adds one byte, and negative int32 values take 10 bytes.
+ */
+__attribute__((target("avx2")))
+static size_t
+varint_array_size_avx2(ProtobufCType type, size_t count, const void *array)
+{
+	size_t i = 0;
+	size_t rv;
+
+	switch (type) {
+	case PROTOBUF_C_TYPE_SINT32:
+	case PROTOBUF_C_TYPE_ENUM:
+	case PROTOBUF_C_TYPE_INT32:
+	case PROTOBUF_C_TYPE_UINT32: {
+		const __m256i bias = _mm256_set1_epi32((int32_t) 0x80000000U);
+		__m256i acc = _mm256_setzero_si256();
+		__m128i sum;
+
+		for (; i + 8 <= count; i += 8) {
+			__m256i v = _mm256_loadu_si256(
+				(const __m256i *) ((const uint32_t *) array + i));
+			__m256i x;
+
+			if (type == PROTOBUF_C_TYPE_SINT32)
+				v = _mm256_xor_si256(_mm256_slli_epi32(v, 1),
+						     _mm256_srai_epi32(v, 31));
+			x = _mm256_xor_si256(v, bias);
+			acc = _mm256_sub_epi32(acc, _mm256_cmpgt_epi32(x, UNSIGNED_GT_32(0x7fU)));
+			acc = _mm256_sub_epi32(acc, _mm256_cmpgt_epi32(x, UNSIGNED_GT_32(0x3fffU)));
+			acc = _mm256_sub_epi32(acc, _mm256_cmpgt_epi32(x, UNSIGNED_GT_32(0x1fffffU)));
+			acc = _mm256_sub_epi32(acc, _mm256_cmpgt_epi32(x, UNSIGNED_GT_32(0xfffffffU)));
+			if (type != PROTOBUF_C_TYPE_SINT32 &&
+			    type != PROTOBUF_C_TYPE_UINT32)
+				acc = _mm256_add_epi32(acc, _mm256_and_si256(
+					_mm256_srai_epi32(v, 31),
+					_mm256_set1_epi32(5)));
+		}
+		sum = _mm_add_epi32(_mm256_castsi256_si128(acc),
+				    _mm256_extracti128_si256(acc, 1));
+		sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4e));
+		sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xb1));
+		rv = i + (uint32_t) _mm_cvtsi128_si32(sum);
+		break;
+	}
+	case PROTOBUF_C_TYPE_SINT64:
+	case PROTOBUF_C_TYPE_INT64:
+	case PROTOBUF_C_TYPE_UINT64: {
+		const __m256i bias = _mm256_set1_epi64x(INT64_MIN);
+		__m256i acc = _mm256_setzero_si256();
+		__m256i t[9];
+		uint64_t lanes[4];
+		unsigned k;
+
+		for (k = 0; k < 9; k++)
+			t[k] = UNSIGNED_GT_64((UINT64_C(1) << (7 * k + 7)) - 1);
+
+		for (; i + 4 <= count; i += 4) {
+			__m256i v = _mm256_loadu_si256(
+				(const __m256i *) ((const uint64_t *) array + i));
+			__m256i x;
+
+			if (type == PROTOBUF_C_TYPE_SINT64)
+				v = _mm256_xor_si256(_mm256_slli_epi64(v, 1),
+					_mm256_cmpgt_epi64(_mm256_setzero_si256(), v));
+			x = _mm256_xor_si256(v, bias);
+			acc = _mm256_sub_epi64(acc, _mm256_cmpgt_epi64(x, t[0]));
+			acc = _mm256_sub_epi64(acc, _mm256_cmpgt_epi64(x, t[1]));
+			acc = _mm256_sub_epi64(acc, _mm256_cmpgt_epi64(x, t[2]));
+			acc = _mm256_sub_epi64(acc, _mm256_cmpgt_epi64(x, t[3]));
+			acc = _mm256_sub_epi64(acc, _mm256_cmpgt_epi64(x, t[4]));
+			acc = _mm256_sub_epi64(acc, _mm256_cmpgt_epi64(x, t[5]));
+			acc = _mm256_sub_epi64(acc, _mm256_cmpgt_epi64(x, t[6]));
+			acc = _mm256_sub_epi64(acc, _mm256_cmpgt_epi64(x, t[7]));
+			acc = _mm256_sub_epi64(acc, _mm256_cmpgt_epi64(x, t[8]));
+		}
+		_mm256_storeu_si256((__m256i *) lanes, acc);
+		rv = i + lanes[0] + lanes[1] + lanes[2] + lanes[3];
+		break;
+	}
+	default:
+		PROTOBUF_C__ASSERT_NOT_REACHED();
+		return 0;
+	}
+	_mm256_zeroupper();
+	return rv + varint_array_size_scalar(type, i, count, array);
+}
+
+#undef UNSIGNED_GT_32
+#undef UNSIGNED_GT_64
+
+#endif /* PROTOBUF_C_X86_SIMD */
+
+/**
+ * Return the number of bytes required to store an array of varint-encoded
+ * values, not counting tags.
+ *
+ * \param type
+ *      Field type; one of the 32- or 64-bit integer types or enum.
+ * \param count
+ *      Number of elements in `array`.
+ * \param array
+ *      The elements.
+ * \return
+ *      Number of bytes required.
+ */
+static size_t
+varint_array_size(ProtobufCType type, size_t count, const void *array)
+{
+#if defined(PROTOBUF_C_X86_SIMD)
+	if (count >= 8 && get_simd_level() == SIMD_LEVEL_AVX2)
+		return varint_array_size_avx2(type, count, array);
+#endif
+	return varint_array_size_scalar(type, 0, count, array);
+}
+
 /**
  * Calculate the serialized size of a single required message field, including
  * the space needed by the preceding tag.
@@ -407,12 +898,14 @@ sint64_size(int64_t v)
  *      Field descriptor for member.
  * \param member
  *      Field to encode.
+ * \param cache
+ *      Where to record the sizes of sub-messages, or NULL.
  * \return
  *      Number of bytes required.
  */
 static size_t
 required_field_get_packed_size(const ProtobufCFieldDescriptor *field,
-			       const void *member)
+			       const void *member, SizeCache *cache)
 {
 	size_t rv = get_tag_size(field->id);
 
@@ -452,7 +945,7 @@ required_field_get_packed_size(const ProtobufCFieldDescriptor *field,
 	}
 	case PROTOBUF_C_TYPE_MESSAGE: {
 		const ProtobufCMessage *msg = *(ProtobufCMessage * const *) member;
-		size_t subrv = msg ? protobuf_c_message_get_packed_size(msg) : 0;
+		size_t subrv = msg ? sub_message_get_packed_size(msg, cache) : 0;
 		return rv + uint32_size(subrv) + subrv;
 	}
 	}
@@ -471,13 +964,15 @@ required_field_get_packed_size(const ProtobufCFieldDescriptor *field,
  *      Enum value that selects the field in the oneof.
  * \param member
  *      Field to encode.
+ * \param cache
+ *      Where to record the sizes of sub-messages, or NULL.
  * \return
  *      Number of bytes required.
  */
 static size_t
 oneof_field_get_packed_size(const ProtobufCFieldDescriptor *field,
 			    uint32_t oneof_case,
-			    const void *member)
+			    const void *member, SizeCache *cache)
 {
 	if (oneof_case != field->id) {
 		return 0;
@@ -489,7 +984,7 @@ oneof_field_get_packed_size(const ProtobufCFieldDescriptor *field,
 		if (ptr == NULL || ptr == field->default_value)
 			return 0;
 	}
-	return required_field_get_packed_size(field, member);
+	return required_field_get_packed_size(field, member, cache);
 }
 
 /**
@@ -503,13 +998,15 @@ oneof_field_get_packed_size(const ProtobufCFieldDescriptor *field,
  *      True if the field exists, false if not.
  * \param member
  *      Field to encode.
+ * \param cache
+ *      Where to record the sizes of sub-messages, or NULL.
  * \return
  *      Number of bytes required.
  */
 static size_t
 optional_field_get_packed_size(const ProtobufCFieldDescriptor *field,
 			       const protobuf_c_boolean has,
-			       const void *member)
+			       const void *member, SizeCache *cache)
 {
 	if (field->type == PROTOBUF_C_TYPE_MESSAGE ||
 	    field->type == PROTOBUF_C_TYPE_STRING)
@@ -521,7 +1018,7 @@ optional_field_get_packed_size(const ProtobufCFieldDescriptor *field,
 		if (!has)
 			return 0;
 	}
-	return required_field_get_packed_size(field, member);
+	return required_field_get_packed_size(field, member, cache);
 }
 
 static protobuf_c_boolean
@@ -581,16 +1078,18 @@ field_is_zeroish(const ProtobufCFieldDescriptor *field,
  *      Field descriptor for member.
  * \param member
  *      Field to encode.
+ * \param cache
+ *      Where to record the sizes of sub-messages, or NULL.
  * \return
  *      Number of bytes required.
  */
 static size_t
 unlabeled_field_get_packed_size(const ProtobufCFieldDescriptor *field,
-				const void *member)
+				const void *member, SizeCache *cache)
 {
 	if (field_is_zeroish(field, member))
 		return 0;
-	return required_field_get_packed_size(field, member);
+	return required_field_get_packed_size(field, member, cache);
 }
 
 /**
@@ -604,12 +1103,15 @@ unlabeled_field_get_packed_size(const ProtobufCFieldDescriptor *field,
  *      Number of repeated field members.
  * \param member
  *      Field to encode.
+ * \param cache
+ *      Where to record the sizes of sub-messages, or NULL.
  * \return
  *      Number of bytes required.
  */
 static size_t
 repeated_field_get_packed_size(const ProtobufCFieldDescriptor *field,
-			       size_t count, const void *member)
+			       size_t count, const void *member,
+			       SizeCache *cache)
 {
 	size_t header_size;
 	size_t rv = 0;
@@ -624,26 +1126,13 @@ repeated_field_get_packed_size(const ProtobufCFieldDescriptor *field,
 
 	switch (field->type) {
 	case PROTOBUF_C_TYPE_SINT32:
-		for (i = 0; i < count; i++)
-			rv += sint32_size(((int32_t *) array)[i]);
-		break;
 	case PROTOBUF_C_TYPE_ENUM:
 	case PROTOBUF_C_TYPE_INT32:
-		for (i = 0; i < count; i++)
-			rv += int32_size(((int32_t *) array)[i]);
-		break;
 	case PROTOBUF_C_TYPE_UINT32:
-		for (i = 0; i < count; i++)
-			rv += uint32_size(((uint32_t *) array)[i]);
-		break;
 	case PROTOBUF_C_TYPE_SINT64:
-		for (i = 0; i < count; i++)
-			rv += sint64_size(((int64_t *) array)[i]);
-		break;
 	case PROTOBUF_C_TYPE_INT64:
 	case PROTOBUF_C_TYPE_UINT64:
-		for (i = 0; i < count; i++)
-			rv += uint64_size(((uint64_t *) array)[i]);
+		rv += varint_array_size(field->type, count, array);
 		break;
 	case PROTOBUF_C_TYPE_SFIXED32:
 	case PROTOBUF_C_TYPE_FIXED32:
@@ -672,8 +1161,8 @@ repeated_field_get_packed_size(const ProtobufCFieldDescriptor *field,
 		break;
 	case PROTOBUF_C_TYPE_MESSAGE:
 		for (i = 0; i < count; i++) {
-			size_t len = protobuf_c_message_get_packed_size(
-				((ProtobufCMessage **) array)[i]);
+			size_t len = sub_message_get_packed_size(
+				((ProtobufCMessage **) array)[i], cache);
 			rv += uint32_size(len) + len;
 		}
 		break;
@@ -700,12 +1189,18 @@ unknown_field_get_packed_size(const ProtobufCMessageUnknownField *field)
 	return get_tag_size(field->tag) + field->len;
 }
 
-/**@}*/
-
-/*
+/**
  * Calculate the serialized size of the message.
+ *
+ * \param message
+ *      The message.
+ * \param cache
+ *      Where to record the sizes of sub-messages, or NULL.
+ * \return
+ *      Number of bytes required.
  */
-size_t protobuf_c_message_get_packed_size(const ProtobufCMessage *message)
+static size_t
+message_get_packed_size(const ProtobufCMessage *message, SizeCache *cache)
 {
 	unsigned i;
 	size_t rv = 0;
@@ -720,31 +1215,36 @@ size_t protobuf_c_message_get_packed_size(const ProtobufCMessage *message)
 			((const char *) message) + field->quantifier_offset;
 
 		if (field->label == PROTOBUF_C_LABEL_REQUIRED) {
-			rv += required_field_get_packed_size(field, member);
+			rv += required_field_get_packed_size(field, member,
+							     cache);
 		} else if ((field->label == PROTOBUF_C_LABEL_OPTIONAL ||
 			    field->label == PROTOBUF_C_LABEL_NONE) &&
 			   (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_ONEOF))) {
 			rv += oneof_field_get_packed_size(
 				field,
 				*(const uint32_t *) qmember,
-				member
+				member,
+				cache
 			);
 		} else if (field->label == PROTOBUF_C_LABEL_OPTIONAL) {
 			rv += optional_field_get_packed_size(
 				field,
 				*(protobuf_c_boolean *) qmember,
-				member
+				member,
+				cache
 			);
 		} else if (field->label == PROTOBUF_C_LABEL_NONE) {
 			rv += unlabeled_field_get_packed_size(
 				field,
-				member
+				member,
+				cache
 			);
 		} else {
 			rv += repeated_field_get_packed_size(
 				field,
 				*(const size_t *) qmember,
-				member
+				member,
+				cache
 			);
 		}
 	}
@@ -753,6 +1253,13 @@ size_t protobuf_c_message_get_packed_size(const ProtobufCMessage *message)
 	return rv;
 }
 
+/**@}*/
+
+size_t protobuf_c_message_get_packed_size(const ProtobufCMessage *message)
+{
+	return message_get_packed_size(message, NULL);
+}
+
 /**
  * \defgroup pack protobuf_c_message_pack() implementation
  *
@@ -976,46 +1483,194 @@ boolean_pack(protobuf_c_boolean value, uint8_t *out)
 	return 1;
 }
 
-/**
- * Pack a NUL-terminated C string and return the number of bytes written. The
- * output includes a length delimiter.
- *
- * The NULL pointer is treated as an empty string. This isn't really necessary,
- * but it allows people to leave required strings blank. (See Issue #13 in the
- * bug tracker for a little more explanation).
- *
- * \param str
- *      String to encode.
- * \param[out] out
- *      Packed value.
- * \return
- *      Number of bytes written to `out`.
- */
-static inline size_t
-string_pack(const char *str, uint8_t *out)
+static size_t
+varint_array_pack_scalar(ProtobufCType type, size_t i, size_t count,
+			 const void *array, uint8_t *out)
 {
-	if (str == NULL) {
-		out[0] = 0;
-		return 1;
-	} else {
-		size_t len = strlen(str);
-		size_t rv = uint32_pack(len, out);
-		memcpy(out + rv, str, len);
-		return rv + len;
-	}
-}
+	size_t rv = 0;
 
-/**
- * Pack a ProtobufCBinaryData and return the number of bytes written. The output
- * includes a length delimiter.
- *
- * \param bd
- *      ProtobufCBinaryData to encode.
- * \param[out] out
- *      Packed value.
- * \return
- *      Number of bytes written to `out`.
- */
+	switch (type) {
+	case PROTOBUF_C_TYPE_SINT32:
+		for (; i < count; i++)
+			rv += sint32_pack(((const int32_t *) array)[i], out + rv);
+		break;
+	case PROTOBUF_C_TYPE_ENUM:
+	case PROTOBUF_C_TYPE_INT32:
+		for (; i < count; i++)
+			rv += int32_pack(((const int32_t *) array)[i], out + rv);
+		break;
+	case PROTOBUF_C_TYPE_UINT32:
+		for (; i < count; i++)
+			rv += uint32_pack(((const uint32_t *) array)[i], out + rv);
+		break;
+	case PROTOBUF_C_TYPE_SINT64:
+		for (; i < count; i++)
+			rv += sint64_pack(((const int64_t *) array)[i], out + rv);
+		break;
+	case PROTOBUF_C_TYPE_INT64:
+	case PROTOBUF_C_TYPE_UINT64:
+		for (; i < count; i++)
+			rv += uint64_pack(((const uint64_t *) array)[i], out + rv);
+		break;
+	default:
+		PROTOBUF_C__ASSERT_NOT_REACHED();
+	}
+	return rv;
+}
+
+#if defined(PROTOBUF_C_X86_SIMD)
+
+/*
+ * Blocks of 8 (or 4) values that all fit in one byte are narrowed to bytes
+ * with a shuffle and stored at once; other blocks are packed one by one.
+ */
+__attribute__((target("avx2")))
+static size_t
+varint_array_pack_avx2(ProtobufCType type, size_t count, const void *array,
+		       uint8_t *out)
+{
+	size_t i = 0;
+	size_t rv = 0;
+
+	switch (type) {
+	case PROTOBUF_C_TYPE_SINT32:
+	case PROTOBUF_C_TYPE_ENUM:
+	case PROTOBUF_C_TYPE_INT32:
+	case PROTOBUF_C_TYPE_UINT32: {
+		const __m256i high = _mm256_set1_epi32(~0x7f);
+		const __m256i spread = _mm256_setr_epi8(
+			0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+			0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+
+		for (; i + 8 <= count; i += 8) {
+			__m256i v = _mm256_loadu_si256(
+				(const __m256i *) ((const uint32_t *) array + i));
+			uint32_t lo, hi;
+
+			if (type == PROTOBUF_C_TYPE_SINT32)
+				v = _mm256_xor_si256(_mm256_slli_epi32(v, 1),
+						     _mm256_srai_epi32(v, 31));
+			if (!_mm256_testz_si256(v, high)) {
+				_mm256_zeroupper();
+				rv += varint_array_pack_scalar(type, i, i + 8,
+							       array, out + rv);
+				continue;
+			}
+			v = _mm256_shuffle_epi8(v, spread);
+			lo = (uint32_t) _mm_cvtsi128_si32(_mm256_castsi256_si128(v));
+			hi = (uint32_t) _mm_cvtsi128_si32(_mm256_extracti128_si256(v, 1));
+			memcpy(out + rv, &lo, 4);
+			memcpy(out + rv + 4, &hi, 4);
+			rv += 8;
+		}
+		break;
+	}
+	case PROTOBUF_C_TYPE_SINT64:
+	case PROTOBUF_C_TYPE_INT64:
+	case PROTOBUF_C_TYPE_UINT64: {
+		const __m256i high = _mm256_set1_epi64x(~(int64_t) 0x7f);
+		const __m256i spread = _mm256_setr_epi8(
+			0, 8, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+			0, 8, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+
+		for (; i + 4 <= count; i += 4) {
+			__m256i v = _mm256_loadu_si256(
+				(const __m256i *) ((const uint64_t *) array + i));
+			uint16_t lo, hi;
+
+			if (type == PROTOBUF_C_TYPE_SINT64)
+				v = _mm256_xor_si256(_mm256_slli_epi64(v, 1),
+					_mm256_cmpgt_epi64(_mm256_setzero_si256(), v));
+			if (!_mm256_testz_si256(v, high)) {
+				_mm256_zeroupper();
+				rv += varint_array_pack_scalar(type, i, i + 4,
+							       array, out + rv);
+				continue;
+			}
+			v = _mm256_shuffle_epi8(v, spread);
+			lo = (uint16_t) _mm_cvtsi128_si32(_mm256_castsi256_si128(v));
+			hi = (uint16_t) _mm_cvtsi128_si32(_mm256_extracti128_si256(v, 1));
+			memcpy(out + rv, &lo, 2);
+			memcpy(out + rv + 2, &hi, 2);
+			rv += 4;
+		}
+		break;
+	}
+	default:
+		PROTOBUF_C__ASSERT_NOT_REACHED();
+		return 0;
+	}
+	_mm256_zeroupper();
+	return rv + varint_array_pack_scalar(type, i, count, array, out + rv);
+}
+
+#endif /* PROTOBUF_C_X86_SIMD */
+
+/**
+ * Pack an array of values as consecutive varints, without tags.
+ *
+ * \param type
+ *      Field type; one of the 32- or 64-bit integer types or enum.
+ * \param count
+ *      Number of elements in `array`.
+ * \param array
+ *      The elements.
+ * \param[out] out
+ *      Packed values. Must have room for varint_array_size() bytes.
+ * \return
+ *      Number of bytes written to `out`.
+ */
+static size_t
+varint_array_pack(ProtobufCType type, size_t count, const void *array,
+		  uint8_t *out)
+{
+#if defined(PROTOBUF_C_X86_SIMD)
+	if (count >= 8 && get_simd_level() == SIMD_LEVEL_AVX2)
+		return varint_array_pack_avx2(type, count, array, out);
+#endif
+	return varint_array_pack_scalar(type, 0, count, array, out);
+}
+
+/**
+ * Pack a NUL-terminated C string and return the number of bytes written. The
+ * output includes a length delimiter.
+ *
+ * The NULL pointer is treated as an empty string. This isn't really necessary,
+ * but it allows people to leave required strings blank. (See Issue #13 in the
+ * bug tracker for a little more explanation).
+ *
+ * \param str
+ *      String to encode.
+ * \param[out] out
+ *      Packed value.
+ * \return
+ *      Number of bytes written to `out`.
+ */
+static inline size_t
+string_pack(const char *str, uint8_t *out)
+{
+	if (str == NULL) {
+		out[0] = 0;
+		return 1;
+	} else {
+		size_t len = strlen(str);
+		size_t rv = uint32_pack(len, out);
+		memcpy(out + rv, str, len);
+		return rv + len;
+	}
+}
+
+/**
+ * Pack a ProtobufCBinaryData and return the number of bytes written. The output
+ * includes a length delimiter.
+ *
+ * \param bd
+ *      ProtobufCBinaryData to encode.
+ * \param[out] out
+ *      Packed value.
+ * \return
+ *      Number of bytes written to `out`.
+ */
 static inline size_t
 binary_data_pack(const ProtobufCBinaryData *bd, uint8_t *out)
 {
@@ -1311,30 +1966,44 @@ copy_to_little_endian_64(void *out, const void *in, const unsigned n)
 }
 
 /**
- * Get the minimum number of bytes required to pack a field value of a
- * particular type.
+ * Get the packed size of an array of same field type.
  *
- * \param type
- *      Field type.
+ * \param field
+ *      Field descriptor.
+ * \param count
+ *      Number of elements of this type.
+ * \param array
+ *      The elements to get the size of.
  * \return
- *      Number of bytes.
+ *      Number of bytes required.
  */
-static unsigned
-get_type_min_size(ProtobufCType type)
+static size_t
+get_packed_payload_length(const ProtobufCFieldDescriptor *field,
+			  size_t count, const void *array)
 {
-	if (type == PROTOBUF_C_TYPE_SFIXED32 ||
-	    type == PROTOBUF_C_TYPE_FIXED32 ||
-	    type == PROTOBUF_C_TYPE_FLOAT)
-	{
-		return 4;
-	}
-	if (type == PROTOBUF_C_TYPE_SFIXED64 ||
-	    type == PROTOBUF_C_TYPE_FIXED64 ||
-	    type == PROTOBUF_C_TYPE_DOUBLE)
-	{
-		return 8;
+	switch (field->type) {
+	case PROTOBUF_C_TYPE_SFIXED32:
+	case PROTOBUF_C_TYPE_FIXED32:
+	case PROTOBUF_C_TYPE_FLOAT:
+		return count * 4;
+	case PROTOBUF_C_TYPE_SFIXED64:
+	case PROTOBUF_C_TYPE_FIXED64:
+	case PROTOBUF_C_TYPE_DOUBLE:
+		return count * 8;
+	case PROTOBUF_C_TYPE_ENUM:
+	case PROTOBUF_C_TYPE_INT32:
+	case PROTOBUF_C_TYPE_SINT32:
+	case PROTOBUF_C_TYPE_UINT32:
+	case PROTOBUF_C_TYPE_SINT64:
+	case PROTOBUF_C_TYPE_INT64:
+	case PROTOBUF_C_TYPE_UINT64:
+		return varint_array_size(field->type, count, array);
+	case PROTOBUF_C_TYPE_BOOL:
+		return count;
+	default:
+		PROTOBUF_C__ASSERT_NOT_REACHED();
 	}
-	return 1;
+	return 0;
 }
 
 /**
@@ -1360,22 +2029,17 @@ repeated_field_pack(const ProtobufCFieldDescriptor *field,
 	unsigned i;
 
 	if (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_PACKED)) {
-		unsigned header_len;
-		unsigned len_start;
-		unsigned min_length;
-		unsigned payload_len;
-		unsigned length_size_min;
-		unsigned actual_length_size;
+		size_t header_len;
+		size_t payload_len;
 		uint8_t *payload_at;
 
 		if (count == 0)
 			return 0;
+		/* the payload is sized exactly, so the length prefix is final */
+		payload_len = get_packed_payload_length(field, count, array);
 		header_len = tag_pack(field->id, out);
 		out[0] |= PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
-		len_start = header_len;
-		min_length = get_type_min_size(field->type) * count;
-		length_size_min = uint32_size(min_length);
-		header_len += length_size_min;
+		header_len += uint32_pack(payload_len, out + header_len);
 		payload_at = out + header_len;
 
 		switch (field->type) {
@@ -1383,65 +2047,26 @@ repeated_field_pack(const ProtobufCFieldDescriptor *field,
 		case PROTOBUF_C_TYPE_FIXED32:
 		case PROTOBUF_C_TYPE_FLOAT:
 			copy_to_little_endian_32(payload_at, array, count);
-			payload_at += count * 4;
 			break;
 		case PROTOBUF_C_TYPE_SFIXED64:
 		case PROTOBUF_C_TYPE_FIXED64:
 		case PROTOBUF_C_TYPE_DOUBLE:
 			copy_to_little_endian_64(payload_at, array, count);
-			payload_at += count * 8;
-			break;
-		case PROTOBUF_C_TYPE_ENUM:
-		case PROTOBUF_C_TYPE_INT32: {
-			const int32_t *arr = (const int32_t *) array;
-			for (i = 0; i < count; i++)
-				payload_at += int32_pack(arr[i], payload_at);
-			break;
-		}
-		case PROTOBUF_C_TYPE_SINT32: {
-			const int32_t *arr = (const int32_t *) array;
-			for (i = 0; i < count; i++)
-				payload_at += sint32_pack(arr[i], payload_at);
-			break;
-		}
-		case PROTOBUF_C_TYPE_SINT64: {
-			const int64_t *arr = (const int64_t *) array;
-			for (i = 0; i < count; i++)
-				payload_at += sint64_pack(arr[i], payload_at);
-			break;
-		}
-		case PROTOBUF_C_TYPE_UINT32: {
-			const uint32_t *arr = (const uint32_t *) array;
-			for (i = 0; i < count; i++)
-				payload_at += uint32_pack(arr[i], payload_at);
-			break;
-		}
-		case PROTOBUF_C_TYPE_INT64:
-		case PROTOBUF_C_TYPE_UINT64: {
-			const uint64_t *arr = (const uint64_t *) array;
-			for (i = 0; i < count; i++)
-				payload_at += uint64_pack(arr[i], payload_at);
 			break;
-		}
 		case PROTOBUF_C_TYPE_BOOL: {
 			const protobuf_c_boolean *arr = (const protobuf_c_boolean *) array;
 			for (i = 0; i < count; i++)
-				payload_at += boolean_pack(arr[i], payload_at);
+				boolean_pack(arr[i], payload_at + i);
 			break;
 		}
-		default:
-			PROTOBUF_C__ASSERT_NOT_REACHED();
+		default: {
+			size_t tmp = varint_array_pack(field->type, count, array,
+						       payload_at);
+			assert(tmp == payload_len);
+			(void) tmp;
+			break;
 		}
-
-		payload_len = payload_at - (out + header_len);
-		actual_length_size = uint32_size(payload_len);
-		if (length_size_min != actual_length_size) {
-			assert(actual_length_size == length_size_min + 1);
-			memmove(out + header_len + 1, out + header_len,
-				payload_len);
-			header_len++;
 		}
-		uint32_pack(payload_len, out + len_start);
 		return header_len + payload_len;
 	} else {
 		/* not "packed" cased */
@@ -1457,13 +2082,41 @@ repeated_field_pack(const ProtobufCFieldDescriptor *field,
 	}
 }
 
-static size_t
-unknown_field_pack(const ProtobufCMessageUnknownField *field, uint8_t *out)
+/**
+ * Whether the tag and data of an unknown field immediately follow the data
+ * of the previous one in memory, as they do when unpacked together.
+ */
+static inline protobuf_c_boolean
+unknown_field_follows(const ProtobufCMessageUnknownField *prev,
+		      const ProtobufCMessageUnknownField *field)
 {
-	size_t rv = tag_pack(field->tag, out);
-	out[0] |= field->wire_type;
-	memcpy(out + rv, field->data, field->len);
-	return rv + field->len;
+	return (uintptr_t) field->data - get_tag_size(field->tag) ==
+		(uintptr_t) prev->data + prev->len;
+}
+
+/**
+ * Number of unknown fields from `fields[0]` on that can be packed by copying
+ * the bytes from the data of the first one to the end of the data of the last
+ * one: each further field follows the previous one, preceded by its tag in
+ * the form tag_pack() writes it.
+ */
+static unsigned
+unknown_field_run(const ProtobufCMessageUnknownField *fields, unsigned n)
+{
+	unsigned i;
+
+	for (i = 1; i < n; i++) {
+		uint8_t tag[MAX_UINT64_ENCODED_SIZE];
+		size_t tag_len;
+
+		if (!unknown_field_follows(fields + i - 1, fields + i))
+			break;
+		tag_len = tag_pack(fields[i].tag, tag);
+		tag[0] |= fields[i].wire_type;
+		if (memcmp(fields[i].data - tag_len, tag, tag_len) != 0)
+			break;
+	}
+	return i;
 }
 
 /**@}*/
@@ -1517,8 +2170,20 @@ protobuf_c_message_pack(const ProtobufCMessage *message, uint8_t *out)
 				member, out + rv);
 		}
 	}
-	for (i = 0; i < message->n_unknown_fields; i++)
-		rv += unknown_field_pack(&message->unknown_fields[i], out + rv);
+	for (i = 0; i < message->n_unknown_fields; ) {
+		const ProtobufCMessageUnknownField *ufield =
+			message->unknown_fields + i;
+		unsigned n = unknown_field_run(ufield,
+					       message->n_unknown_fields - i);
+		size_t tag_len = tag_pack(ufield->tag, out + rv);
+		size_t len = ufield[n - 1].data + ufield[n - 1].len -
+			ufield->data;
+
+		out[rv] |= ufield->wire_type;
+		memcpy(out + rv + tag_len, ufield->data, len);
+		rv += tag_len + len;
+		i += n;
+	}
 	return rv;
 }
 
@@ -1540,12 +2205,19 @@ protobuf_c_message_pack(const ProtobufCMessage *message, uint8_t *out)
  *      The element to be packed.
  * \param[out] buffer
  *      Virtual buffer to append data to.
+ * \param cache
+ *      Sizes of the sub-messages.
  * \return
  *      Number of bytes packed.
  */
 static size_t
+message_pack_to_buffer(const ProtobufCMessage *message,
+		       ProtobufCBuffer *buffer, SizeCache *cache);
+
+static size_t
 required_field_pack_to_buffer(const ProtobufCFieldDescriptor *field,
-			      const void *member, ProtobufCBuffer *buffer)
+			      const void *member, ProtobufCBuffer *buffer,
+			      SizeCache *cache)
 {
 	size_t rv;
 	uint8_t scratch[MAX_UINT64_ENCODED_SIZE * 2];
@@ -1628,10 +2300,10 @@ required_field_pack_to_buffer(const ProtobufCFieldDescriptor *field,
 			rv += uint32_pack(0, scratch + rv);
 			buffer->append(buffer, rv, scratch);
 		} else {
-			size_t sublen = protobuf_c_message_get_packed_size(msg);
+			size_t sublen = size_cache_next(cache, msg);
 			rv += uint32_pack(sublen, scratch + rv);
 			buffer->append(buffer, rv, scratch);
-			protobuf_c_message_pack_to_buffer(msg, buffer);
+			message_pack_to_buffer(msg, buffer, cache);
 			rv += sublen;
 		}
 		break;
@@ -1653,13 +2325,16 @@ required_field_pack_to_buffer(const ProtobufCFieldDescriptor *field,
  *      The element to be packed.
  * \param[out] buffer
  *      Virtual buffer to append data to.
+ * \param cache
+ *      Sizes of the sub-messages.
  * \return
  *      Number of bytes serialised to `buffer`.
  */
 static size_t
 oneof_field_pack_to_buffer(const ProtobufCFieldDescriptor *field,
 			   uint32_t oneof_case,
-			   const void *member, ProtobufCBuffer *buffer)
+			   const void *member, ProtobufCBuffer *buffer,
+			   SizeCache *cache)
 {
 	if (oneof_case != field->id) {
 		return 0;
@@ -1671,7 +2346,7 @@ oneof_field_pack_to_buffer(const ProtobufCFieldDescriptor *field,
 		if (ptr == NULL || ptr == field->default_value)
 			return 0;
 	}
-	return required_field_pack_to_buffer(field, member, buffer);
+	return required_field_pack_to_buffer(field, member, buffer, cache);
 }
 
 /**
@@ -1685,13 +2360,16 @@ oneof_field_pack_to_buffer(const ProtobufCFieldDescriptor *field,
  *      The element to be packed.
  * \param[out] buffer
  *      Virtual buffer to append data to.
+ * \param cache
+ *      Sizes of the sub-messages.
  * \return
  *      Number of bytes serialised to `buffer`.
  */
 static size_t
 optional_field_pack_to_buffer(const ProtobufCFieldDescriptor *field,
 			      const protobuf_c_boolean has,
-			      const void *member, ProtobufCBuffer *buffer)
+			      const void *member, ProtobufCBuffer *buffer,
+			      SizeCache *cache)
 {
 	if (field->type == PROTOBUF_C_TYPE_MESSAGE ||
 	    field->type == PROTOBUF_C_TYPE_STRING)
@@ -1703,7 +2381,7 @@ optional_field_pack_to_buffer(const ProtobufCFieldDescriptor *field,
 		if (!has)
 			return 0;
 	}
-	return required_field_pack_to_buffer(field, member, buffer);
+	return required_field_pack_to_buffer(field, member, buffer, cache);
 }
 
 /**
@@ -1715,85 +2393,23 @@ optional_field_pack_to_buffer(const ProtobufCFieldDescriptor *field,
  *      The element to be packed.
  * \param[out] buffer
  *      Virtual buffer to append data to.
+ * \param cache
+ *      Sizes of the sub-messages.
  * \return
  *      Number of bytes serialised to `buffer`.
  */
 static size_t
 unlabeled_field_pack_to_buffer(const ProtobufCFieldDescriptor *field,
-			       const void *member, ProtobufCBuffer *buffer)
+			       const void *member, ProtobufCBuffer *buffer,
+			       SizeCache *cache)
 {
 	if (field_is_zeroish(field, member))
 		return 0;
-	return required_field_pack_to_buffer(field, member, buffer);
+	return required_field_pack_to_buffer(field, member, buffer, cache);
 }
 
-/**
- * Get the packed size of an array of same field type.
- *
- * \param field
- *      Field descriptor.
- * \param count
- *      Number of elements of this type.
- * \param array
- *      The elements to get the size of.
- * \return
- *      Number of bytes required.
- */
-static size_t
-get_packed_payload_length(const ProtobufCFieldDescriptor *field,
-			  unsigned count, const void *array)
-{
-	unsigned rv = 0;
-	unsigned i;
-
-	switch (field->type) {
-	case PROTOBUF_C_TYPE_SFIXED32:
-	case PROTOBUF_C_TYPE_FIXED32:
-	case PROTOBUF_C_TYPE_FLOAT:
-		return count * 4;
-	case PROTOBUF_C_TYPE_SFIXED64:
-	case PROTOBUF_C_TYPE_FIXED64:
-	case PROTOBUF_C_TYPE_DOUBLE:
-		return count * 8;
-	case PROTOBUF_C_TYPE_ENUM:
-	case PROTOBUF_C_TYPE_INT32: {
-		const int32_t *arr = (const int32_t *) array;
-		for (i = 0; i < count; i++)
-			rv += int32_size(arr[i]);
-		break;
-	}
-	case PROTOBUF_C_TYPE_SINT32: {
-		const int32_t *arr = (const int32_t *) array;
-		for (i = 0; i < count; i++)
-			rv += sint32_size(arr[i]);
-		break;
-	}
-	case PROTOBUF_C_TYPE_UINT32: {
-		const uint32_t *arr = (const uint32_t *) array;
-		for (i = 0; i < count; i++)
-			rv += uint32_size(arr[i]);
-		break;
-	}
-	case PROTOBUF_C_TYPE_SINT64: {
-		const int64_t *arr = (const int64_t *) array;
-		for (i = 0; i < count; i++)
-			rv += sint64_size(arr[i]);
-		break;
-	}
-	case PROTOBUF_C_TYPE_INT64:
-	case PROTOBUF_C_TYPE_UINT64: {
-		const uint64_t *arr = (const uint64_t *) array;
-		for (i = 0; i < count; i++)
-			rv += uint64_size(arr[i]);
-		break;
-	}
-	case PROTOBUF_C_TYPE_BOOL:
-		return count;
-	default:
-		PROTOBUF_C__ASSERT_NOT_REACHED();
-	}
-	return rv;
-}
+/** Number of varints pack_buffer_packed_payload() encodes per append. */
+#define PACKED_CHUNK_ELEMENTS	64
 
 /**
  * Pack an array of same field type to a virtual buffer.
@@ -1849,44 +2465,28 @@ pack_buffer_packed_payload(const ProtobufCFieldDescriptor *field,
 #endif
 	case PROTOBUF_C_TYPE_ENUM:
 	case PROTOBUF_C_TYPE_INT32:
-		for (i = 0; i < count; i++) {
-			unsigned len = int32_pack(((int32_t *) array)[i], scratch);
-			buffer->append(buffer, len, scratch);
-			rv += len;
-		}
-		break;
 	case PROTOBUF_C_TYPE_SINT32:
-		for (i = 0; i < count; i++) {
-			unsigned len = sint32_pack(((int32_t *) array)[i], scratch);
-			buffer->append(buffer, len, scratch);
-			rv += len;
-		}
-		break;
 	case PROTOBUF_C_TYPE_UINT32:
-		for (i = 0; i < count; i++) {
-			unsigned len = uint32_pack(((uint32_t *) array)[i], scratch);
-			buffer->append(buffer, len, scratch);
+	case PROTOBUF_C_TYPE_SINT64:
+	case PROTOBUF_C_TYPE_INT64:
+	case PROTOBUF_C_TYPE_UINT64: {
+		/* pack the varints a chunk at a time */
+		uint8_t chunk[PACKED_CHUNK_ELEMENTS * MAX_UINT64_ENCODED_SIZE];
+		size_t siz = sizeof_elt_in_repeated_array(field->type);
+
+		for (i = 0; i < count; i += PACKED_CHUNK_ELEMENTS) {
+			unsigned n = count - i < PACKED_CHUNK_ELEMENTS ?
+				count - i : PACKED_CHUNK_ELEMENTS;
+			size_t len = varint_array_pack(field->type, n,
+				(const char *) array + i * siz, chunk);
+			buffer->append(buffer, len, chunk);
 			rv += len;
 		}
 		break;
-	case PROTOBUF_C_TYPE_SINT64:
+	}
+	case PROTOBUF_C_TYPE_BOOL:
 		for (i = 0; i < count; i++) {
-			unsigned len = sint64_pack(((int64_t *) array)[i], scratch);
-			buffer->append(buffer, len, scratch);
-			rv += len;
-		}
-		break;
-	case PROTOBUF_C_TYPE_INT64:
-	case PROTOBUF_C_TYPE_UINT64:
-		for (i = 0; i < count; i++) {
-			unsigned len = uint64_pack(((uint64_t *) array)[i], scratch);
-			buffer->append(buffer, len, scratch);
-			rv += len;
-		}
-		break;
-	case PROTOBUF_C_TYPE_BOOL:
-		for (i = 0; i < count; i++) {
-			unsigned len = boolean_pack(((protobuf_c_boolean *) array)[i], scratch);
+			unsigned len = boolean_pack(((protobuf_c_boolean *) array)[i], scratch);
 			buffer->append(buffer, len, scratch);
 		}
 		return count;
@@ -1905,7 +2505,7 @@ no_packing_needed:
 static size_t
 repeated_field_pack_to_buffer(const ProtobufCFieldDescriptor *field,
 			      unsigned count, const void *member,
-			      ProtobufCBuffer *buffer)
+			      ProtobufCBuffer *buffer, SizeCache *cache)
 {
 	char *array = *(char * const *) member;
 
@@ -1932,7 +2532,8 @@ repeated_field_pack_to_buffer(const ProtobufCFieldDescriptor *field,
 
 		siz = sizeof_elt_in_repeated_array(field->type);
 		for (i = 0; i < count; i++) {
-			rv += required_field_pack_to_buffer(field, array, buffer);
+			rv += required_field_pack_to_buffer(field, array, buffer,
+							    cache);
 			array += siz;
 		}
 		return rv;
@@ -1952,11 +2553,21 @@ unknown_field_pack_to_buffer(const ProtobufCMessageUnknownField *field,
 	return rv + field->len;
 }
 
-/**@}*/
-
-size_t
-protobuf_c_message_pack_to_buffer(const ProtobufCMessage *message,
-				  ProtobufCBuffer *buffer)
+/**
+ * Pack a message to a virtual buffer.
+ *
+ * \param message
+ *      The message.
+ * \param[out] buffer
+ *      Virtual buffer to append data to.
+ * \param cache
+ *      Sizes of the sub-messages, filled in as they are first needed.
+ * \return
+ *      Number of bytes packed.
+ */
+static size_t
+message_pack_to_buffer(const ProtobufCMessage *message,
+		       ProtobufCBuffer *buffer, SizeCache *cache)
 {
 	unsigned i;
 	size_t rv = 0;
@@ -1971,7 +2582,8 @@ protobuf_c_message_pack_to_buffer(const ProtobufCMessage *message,
 			((const char *) message) + field->quantifier_offset;
 
 		if (field->label == PROTOBUF_C_LABEL_REQUIRED) {
-			rv += required_field_pack_to_buffer(field, member, buffer);
+			rv += required_field_pack_to_buffer(field, member, buffer,
+							    cache);
 		} else if ((field->label == PROTOBUF_C_LABEL_OPTIONAL ||
 			    field->label == PROTOBUF_C_LABEL_NONE) &&
 			   (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_ONEOF))) {
@@ -1979,1436 +2591,5595 @@ protobuf_c_message_pack_to_buffer(const ProtobufCMessage *message,
 				field,
 				*(const uint32_t *) qmember,
 				member,
-				buffer
+				buffer,
+				cache
 			);
 		} else if (field->label == PROTOBUF_C_LABEL_OPTIONAL) {
 			rv += optional_field_pack_to_buffer(
 				field,
 				*(const protobuf_c_boolean *) qmember,
 				member,
-				buffer
+				buffer,
+				cache
 			);
 		} else if (field->label == PROTOBUF_C_LABEL_NONE) {
 			rv += unlabeled_field_pack_to_buffer(
 				field,
 				member,
-				buffer
+				buffer,
+				cache
 			);
 		} else {
 			rv += repeated_field_pack_to_buffer(
 				field,
 				*(const size_t *) qmember,
 				member,
-				buffer
+				buffer,
+				cache
 			);
 		}
 	}
-	for (i = 0; i < message->n_unknown_fields; i++)
-		rv += unknown_field_pack_to_buffer(&message->unknown_fields[i], buffer);
+	for (i = 0; i < message->n_unknown_fields; ) {
+		const ProtobufCMessageUnknownField *ufield =
+			message->unknown_fields + i;
+		unsigned n = unknown_field_run(ufield,
+					       message->n_unknown_fields - i);
+		ProtobufCMessageUnknownField span = *ufield;
+
+		span.len = ufield[n - 1].data + ufield[n - 1].len - ufield->data;
+		rv += unknown_field_pack_to_buffer(&span, buffer);
+		i += n;
+	}
+
+	return rv;
+}
+
+/**@}*/
+
+size_t
+protobuf_c_message_pack_to_buffer(const ProtobufCMessage *message,
+				  ProtobufCBuffer *buffer)
+{
+	SizeCache cache;
+	size_t rv;
 
+	size_cache_init(&cache);
+	rv = message_pack_to_buffer(message, buffer, &cache);
+	size_cache_destroy(&cache);
 	return rv;
 }
 
 /**
- * \defgroup unpack unpacking implementation
+ * \defgroup packrev protobuf_c_message_pack_reverse() implementation
  *
- * Routines mainly used by the unpacking functions.
+ * Routines mainly used by protobuf_c_message_pack_reverse() and
+ * protobuf_c_message_pack_to_reverse_buffer(). Fields are emitted last to
+ * first, each value before its length prefix and tag, into the free space in
+ * front of the contents of a `ProtobufCReverseBuffer`.
  *
  * \ingroup internal
  * @{
  */
 
-static inline int
-int_range_lookup(unsigned n_ranges, const ProtobufCIntRange *ranges, int value)
+static void *
+fixed_alloc(void *allocator_data, size_t size)
 {
-	unsigned n;
-	unsigned start;
+	(void) allocator_data;
+	(void) size;
+	return NULL;
+}
 
-	if (n_ranges == 0)
-		return -1;
-	start = 0;
-	n = n_ranges;
-	while (n > 1) {
-		unsigned mid = start + n / 2;
+static void
+fixed_free(void *allocator_data, void *data)
+{
+	(void) allocator_data;
+	(void) data;
+}
 
-		if (value < ranges[mid].start_value) {
-			n = mid - start;
-		} else if (value >= ranges[mid].start_value +
-			   (int) (ranges[mid + 1].orig_index -
-				  ranges[mid].orig_index))
-		{
-			unsigned new_start = mid + 1;
-			n = start + n - new_start;
-			start = new_start;
-		} else
-			return (value - ranges[mid].start_value) +
-			    ranges[mid].orig_index;
-	}
-	if (n > 0) {
-		unsigned start_orig_index = ranges[start].orig_index;
-		unsigned range_size =
-			ranges[start + 1].orig_index - start_orig_index;
+/*
+ * Allocator that never succeeds. It makes a reverse buffer wrapped around a
+ * caller-provided array fail instead of growing.
+ */
+static ProtobufCAllocator protobuf_c__fixed_allocator = {
+	.alloc = &fixed_alloc,
+	.free = &fixed_free,
+	.allocator_data = NULL,
+};
 
-		if (ranges[start].start_value <= value &&
-		    value < (int) (ranges[start].start_value + range_size))
-		{
-			return (value - ranges[start].start_value) +
-			    start_orig_index;
+/**
+ * Reallocate a reverse buffer so that at least `len` more bytes fit in front
+ * of its contents, which are moved to the end of the new storage.
+ *
+ * \return
+ *      TRUE on success, FALSE if memory could not be allocated.
+ */
+static protobuf_c_boolean
+reverse_buffer_grow(ProtobufCReverseBuffer *rb, size_t len)
+{
+	ProtobufCAllocator *allocator = rb->allocator;
+	size_t new_len;
+	size_t new_alloced;
+	uint8_t *new_data;
+
+	if (allocator == NULL)
+		allocator = &protobuf_c__allocator;
+	if (len > SIZE_MAX - rb->len)
+		return FALSE;
+	new_len = rb->len + len;
+	new_alloced = rb->alloced < 64 ? 64 : rb->alloced;
+	while (new_alloced < new_len) {
+		if (new_alloced > SIZE_MAX / 2) {
+			new_alloced = new_len;
+			break;
 		}
+		new_alloced *= 2;
 	}
-	return -1;
+	new_data = do_alloc(allocator, new_alloced);
+	if (new_data == NULL)
+		return FALSE;
+	if (rb->len != 0)
+		memcpy(new_data + new_alloced - rb->len,
+		       rb->data + rb->alloced - rb->len, rb->len);
+	if (rb->must_free_data)
+		do_free(allocator, rb->data);
+	else
+		rb->must_free_data = TRUE;
+	rb->data = new_data;
+	rb->alloced = new_alloced;
+	return TRUE;
 }
 
-static size_t
-parse_tag_and_wiretype(size_t len,
-		       const uint8_t *data,
-		       uint32_t *tag_out,
-		       uint8_t *wiretype_out)
+/**
+ * Claim `len` bytes in front of the contents of a reverse buffer.
+ *
+ * \return
+ *      Where to write the bytes, or NULL if the buffer could not grow.
+ */
+static inline uint8_t *
+reverse_buffer_reserve(ProtobufCReverseBuffer *rb, size_t len)
 {
-	unsigned max_rv = len > 5 ? 5 : len;
-	uint32_t tag = (data[0] & 0x7f) >> 3;
-	unsigned shift = 4;
-	unsigned rv;
+	if (rb->alloced - rb->len < len && !reverse_buffer_grow(rb, len))
+		return NULL;
+	rb->len += len;
+	return rb->data + rb->alloced - rb->len;
+}
 
-	/* 0 is not a valid tag value */
-	if ((data[0] & 0xf8) == 0) {
-		return 0;
-	}
+static protobuf_c_boolean
+reverse_pack_tag(uint32_t id, uint8_t wire_type, ProtobufCReverseBuffer *rb)
+{
+	uint8_t *out = reverse_buffer_reserve(rb, get_tag_size(id));
 
-	*wiretype_out = data[0] & 7;
-	if ((data[0] & 0x80) == 0) {
-		*tag_out = tag;
-		return 1;
-	}
-	for (rv = 1; rv < max_rv; rv++) {
-		if (data[rv] & 0x80) {
-			tag |= (data[rv] & 0x7f) << shift;
-			shift += 7;
-		} else {
-			tag |= data[rv] << shift;
-			*tag_out = tag;
-			return rv + 1;
-		}
-	}
-	return 0; /* error: bad header */
+	if (out == NULL)
+		return FALSE;
+	tag_pack(id, out);
+	out[0] |= wire_type;
+	return TRUE;
 }
 
-/* sizeof(ScannedMember) must be <= (1UL<<BOUND_SIZEOF_SCANNED_MEMBER_LOG2) */
-#define BOUND_SIZEOF_SCANNED_MEMBER_LOG2 5
-typedef struct ScannedMember ScannedMember;
-/** Field as it's being read. */
-struct ScannedMember {
-	uint32_t tag;              /**< Field tag. */
-	uint8_t wire_type;         /**< Field type. */
-	uint8_t length_prefix_len; /**< Prefix length. */
-	const ProtobufCFieldDescriptor *field; /**< Field descriptor. */
-	size_t len;                /**< Field length. */
-	const uint8_t *data;       /**< Pointer to field data. */
-};
-
-static inline size_t
-scan_length_prefixed_data(size_t len, const uint8_t *data,
-			  size_t *prefix_len_out)
+static protobuf_c_boolean
+reverse_pack_length(size_t len, ProtobufCReverseBuffer *rb)
 {
-	unsigned hdr_max = len < 5 ? len : 5;
-	unsigned hdr_len;
-	size_t val = 0;
-	unsigned i;
-	unsigned shift = 0;
+	uint8_t *out = reverse_buffer_reserve(rb, uint32_size(len));
 
-	for (i = 0; i < hdr_max; i++) {
-		val |= ((size_t)data[i] & 0x7f) << shift;
-		shift += 7;
-		if ((data[i] & 0x80) == 0)
-			break;
-	}
-	if (i == hdr_max) {
-		PROTOBUF_C_UNPACK_ERROR("error parsing length for length-prefixed data");
-		return 0;
-	}
-	hdr_len = i + 1;
-	*prefix_len_out = hdr_len;
-	if (val > INT_MAX) {
-		// Protobuf messages should always be less than 2 GiB in size.
-		// We also want to return early here so that hdr_len + val does
-		// not overflow on 32-bit systems.
-		PROTOBUF_C_UNPACK_ERROR("length prefix of %lu is too large",
-			(unsigned long int)val);
-		return 0;
-	}
-	if (hdr_len + val > len) {
-		PROTOBUF_C_UNPACK_ERROR("data too short after length-prefix of %lu",
-			(unsigned long int)val);
-		return 0;
-	}
-	return hdr_len + val;
+	if (out == NULL)
+		return FALSE;
+	uint32_pack(len, out);
+	return TRUE;
 }
 
-static size_t
-max_b128_numbers(size_t len, const uint8_t *data)
+static protobuf_c_boolean
+reverse_pack_data(const void *data, size_t len, ProtobufCReverseBuffer *rb)
 {
-	size_t rv = 0;
-	while (len--)
-		if ((*data++ & 0x80) == 0)
-			++rv;
-	return rv;
+	uint8_t *out = reverse_buffer_reserve(rb, len);
+
+	if (out == NULL)
+		return FALSE;
+	if (len != 0)
+		memcpy(out, data, len);
+	return reverse_pack_length(len, rb);
 }
 
-/**@}*/
+static protobuf_c_boolean
+message_pack_reverse(const ProtobufCMessage *message,
+		     ProtobufCReverseBuffer *rb);
 
 /**
- * Merge earlier message into a latter message.
+ * Pack a required field in front of the contents of a reverse buffer.
  *
- * For numeric types and strings, if the same value appears multiple
- * times, the parser accepts the last value it sees. For embedded
- * message fields, the parser merges multiple instances of the same
- * field. That is, all singular scalar fields in the latter instance
- * replace those in the former, singular embedded messages are merged,
- * and repeated fields are concatenated.
- *
- * The earlier message should be freed after calling this function, as
- * some of its fields may have been reused and changed to their default
- * values during the merge.
+ * \param field
+ *      Field descriptor.
+ * \param member
+ *      The field member.
+ * \param rb
+ *      Buffer to prepend the packed field to.
+ * \return
+ *      TRUE on success, FALSE if the buffer could not grow.
  */
 static protobuf_c_boolean
-merge_messages(ProtobufCMessage *earlier_msg,
-	       ProtobufCMessage *latter_msg,
-	       ProtobufCAllocator *allocator)
+required_field_pack_reverse(const ProtobufCFieldDescriptor *field,
+			    const void *member, ProtobufCReverseBuffer *rb)
 {
-	unsigned i;
-	const ProtobufCFieldDescriptor *fields =
-		latter_msg->descriptor->fields;
-	for (i = 0; i < latter_msg->descriptor->n_fields; i++) {
-		if (fields[i].label == PROTOBUF_C_LABEL_REPEATED) {
-			size_t *n_earlier =
-				STRUCT_MEMBER_PTR(size_t, earlier_msg,
-						  fields[i].quantifier_offset);
-			uint8_t **p_earlier =
-				STRUCT_MEMBER_PTR(uint8_t *, earlier_msg,
-						  fields[i].offset);
-			size_t *n_latter =
-				STRUCT_MEMBER_PTR(size_t, latter_msg,
-						  fields[i].quantifier_offset);
-			uint8_t **p_latter =
-				STRUCT_MEMBER_PTR(uint8_t *, latter_msg,
-						  fields[i].offset);
-
-			if (*n_earlier > 0) {
-				if (*n_latter > 0) {
-					/* Concatenate the repeated field */
-					size_t el_size =
-						sizeof_elt_in_repeated_array(fields[i].type);
-					uint8_t *new_field;
-
-					new_field = do_alloc(allocator,
-						(*n_earlier + *n_latter) * el_size);
-					if (!new_field)
-						return FALSE;
-
-					memcpy(new_field, *p_earlier,
-					       *n_earlier * el_size);
-					memcpy(new_field +
-					       *n_earlier * el_size,
-					       *p_latter,
-					       *n_latter * el_size);
+	uint8_t wire_type = PROTOBUF_C_WIRE_TYPE_VARINT;
+	uint8_t *out;
 
-					do_free(allocator, *p_latter);
-					do_free(allocator, *p_earlier);
-					*p_latter = new_field;
-					*n_latter = *n_earlier + *n_latter;
+	switch (field->type) {
+	case PROTOBUF_C_TYPE_SINT32: {
+		int32_t v = *(const int32_t *) member;
+		if ((out = reverse_buffer_reserve(rb, sint32_size(v))) == NULL)
+			return FALSE;
+		sint32_pack(v, out);
+		break;
+	}
+	case PROTOBUF_C_TYPE_ENUM:
+	case PROTOBUF_C_TYPE_INT32: {
+		int32_t v = *(const int32_t *) member;
+		if ((out = reverse_buffer_reserve(rb, int32_size(v))) == NULL)
+			return FALSE;
+		int32_pack(v, out);
+		break;
+	}
+	case PROTOBUF_C_TYPE_UINT32: {
+		uint32_t v = *(const uint32_t *) member;
+		if ((out = reverse_buffer_reserve(rb, uint32_size(v))) == NULL)
+			return FALSE;
+		uint32_pack(v, out);
+		break;
+	}
+	case PROTOBUF_C_TYPE_SINT64: {
+		int64_t v = *(const int64_t *) member;
+		if ((out = reverse_buffer_reserve(rb, sint64_size(v))) == NULL)
+			return FALSE;
+		sint64_pack(v, out);
+		break;
+	}
+	case PROTOBUF_C_TYPE_INT64:
+	case PROTOBUF_C_TYPE_UINT64: {
+		uint64_t v = *(const uint64_t *) member;
+		if ((out = reverse_buffer_reserve(rb, uint64_size(v))) == NULL)
+			return FALSE;
+		uint64_pack(v, out);
+		break;
+	}
+	case PROTOBUF_C_TYPE_SFIXED32:
+	case PROTOBUF_C_TYPE_FIXED32:
+	case PROTOBUF_C_TYPE_FLOAT:
+		if ((out = reverse_buffer_reserve(rb, 4)) == NULL)
+			return FALSE;
+		fixed32_pack(*(const uint32_t *) member, out);
+		wire_type = PROTOBUF_C_WIRE_TYPE_32BIT;
+		break;
+	case PROTOBUF_C_TYPE_SFIXED64:
+	case PROTOBUF_C_TYPE_FIXED64:
+	case PROTOBUF_C_TYPE_DOUBLE:
+		if ((out = reverse_buffer_reserve(rb, 8)) == NULL)
+			return FALSE;
+		fixed64_pack(*(const uint64_t *) member, out);
+		wire_type = PROTOBUF_C_WIRE_TYPE_64BIT;
+		break;
+	case PROTOBUF_C_TYPE_BOOL:
+		if ((out = reverse_buffer_reserve(rb, 1)) == NULL)
+			return FALSE;
+		boolean_pack(*(const protobuf_c_boolean *) member, out);
+		break;
+	case PROTOBUF_C_TYPE_STRING: {
+		const char *str = *(char * const *) member;
+		if (!reverse_pack_data(str, str ? strlen(str) : 0, rb))
+			return FALSE;
+		wire_type = PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
+		break;
+	}
+	case PROTOBUF_C_TYPE_BYTES: {
+		const ProtobufCBinaryData *bd = member;
+		if (!reverse_pack_data(bd->data, bd->len, rb))
+			return FALSE;
+		wire_type = PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
+		break;
+	}
+	case PROTOBUF_C_TYPE_MESSAGE: {
+		const ProtobufCMessage *msg = *(ProtobufCMessage * const *) member;
+		size_t end = rb->len;
+		if (msg != NULL && !message_pack_reverse(msg, rb))
+			return FALSE;
+		if (!reverse_pack_length(rb->len - end, rb))
+			return FALSE;
+		wire_type = PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
+		break;
+	}
+	default:
+		PROTOBUF_C__ASSERT_NOT_REACHED();
+	}
+	return reverse_pack_tag(field->id, wire_type, rb);
+}
+
+/**
+ * Pack a oneof field in front of the contents of a reverse buffer. Only packs
+ * the field that is selected by the case enum.
+ *
+ * \param field
+ *      Field descriptor.
+ * \param oneof_case
+ *      Enum value that selects the field in the oneof.
+ * \param member
+ *      The field member.
+ * \param rb
+ *      Buffer to prepend the packed field to.
+ * \return
+ *      TRUE on success, FALSE if the buffer could not grow.
+ */
+static protobuf_c_boolean
+oneof_field_pack_reverse(const ProtobufCFieldDescriptor *field,
+			 uint32_t oneof_case,
+			 const void *member, ProtobufCReverseBuffer *rb)
+{
+	if (oneof_case != field->id) {
+		return TRUE;
+	}
+	if (field->type == PROTOBUF_C_TYPE_MESSAGE ||
+	    field->type == PROTOBUF_C_TYPE_STRING)
+	{
+		const void *ptr = *(const void * const *) member;
+		if (ptr == NULL || ptr == field->default_value)
+			return TRUE;
+	}
+	return required_field_pack_reverse(field, member, rb);
+}
+
+/**
+ * Pack an optional field in front of the contents of a reverse buffer.
+ *
+ * \param field
+ *      Field descriptor.
+ * \param has
+ *      Whether the field is set.
+ * \param member
+ *      The field member.
+ * \param rb
+ *      Buffer to prepend the packed field to.
+ * \return
+ *      TRUE on success, FALSE if the buffer could not grow.
+ */
+static protobuf_c_boolean
+optional_field_pack_reverse(const ProtobufCFieldDescriptor *field,
+			    const protobuf_c_boolean has,
+			    const void *member, ProtobufCReverseBuffer *rb)
+{
+	if (field->type == PROTOBUF_C_TYPE_MESSAGE ||
+	    field->type == PROTOBUF_C_TYPE_STRING)
+	{
+		const void *ptr = *(const void * const *) member;
+		if (ptr == NULL || ptr == field->default_value)
+			return TRUE;
+	} else {
+		if (!has)
+			return TRUE;
+	}
+	return required_field_pack_reverse(field, member, rb);
+}
+
+/**
+ * Pack an unlabeled field in front of the contents of a reverse buffer.
+ *
+ * \param field
+ *      Field descriptor.
+ * \param member
+ *      The field member.
+ * \param rb
+ *      Buffer to prepend the packed field to.
+ * \return
+ *      TRUE on success, FALSE if the buffer could not grow.
+ */
+static protobuf_c_boolean
+unlabeled_field_pack_reverse(const ProtobufCFieldDescriptor *field,
+			     const void *member, ProtobufCReverseBuffer *rb)
+{
+	if (field_is_zeroish(field, member))
+		return TRUE;
+	return required_field_pack_reverse(field, member, rb);
+}
+
+/**
+ * Pack the elements of a repeated field in front of the contents of a reverse
+ * buffer, last element first. For a packed field the payload length is known
+ * once the elements are written, so no space has to be guessed for it.
+ *
+ * \param field
+ *      Field descriptor.
+ * \param count
+ *      Number of elements in the repeated field array.
+ * \param member
+ *      Pointer to the elements for this repeated field.
+ * \param rb
+ *      Buffer to prepend the packed field to.
+ * \return
+ *      TRUE on success, FALSE if the buffer could not grow.
+ */
+static protobuf_c_boolean
+repeated_field_pack_reverse(const ProtobufCFieldDescriptor *field,
+			    size_t count, const void *member,
+			    ProtobufCReverseBuffer *rb)
+{
+	const void *array = *(const void * const *) member;
+	size_t end = rb->len;
+	uint8_t *out;
+	size_t i;
+
+	if (count == 0)
+		return TRUE;
+	if (0 == (field->flags & PROTOBUF_C_FIELD_FLAG_PACKED)) {
+		size_t siz = sizeof_elt_in_repeated_array(field->type);
+
+		for (i = count; i-- > 0; ) {
+			if (!required_field_pack_reverse(field,
+				(const char *) array + i * siz, rb))
+				return FALSE;
+		}
+		return TRUE;
+	}
+
+	switch (field->type) {
+	case PROTOBUF_C_TYPE_SFIXED32:
+	case PROTOBUF_C_TYPE_FIXED32:
+	case PROTOBUF_C_TYPE_FLOAT:
+		if ((out = reverse_buffer_reserve(rb, count * 4)) == NULL)
+			return FALSE;
+		copy_to_little_endian_32(out, array, count);
+		break;
+	case PROTOBUF_C_TYPE_SFIXED64:
+	case PROTOBUF_C_TYPE_FIXED64:
+	case PROTOBUF_C_TYPE_DOUBLE:
+		if ((out = reverse_buffer_reserve(rb, count * 8)) == NULL)
+			return FALSE;
+		copy_to_little_endian_64(out, array, count);
+		break;
+	case PROTOBUF_C_TYPE_ENUM:
+	case PROTOBUF_C_TYPE_INT32:
+	case PROTOBUF_C_TYPE_SINT32:
+	case PROTOBUF_C_TYPE_UINT32:
+	case PROTOBUF_C_TYPE_SINT64:
+	case PROTOBUF_C_TYPE_INT64:
+	case PROTOBUF_C_TYPE_UINT64: {
+		size_t len = varint_array_size(field->type, count, array);
+		if ((out = reverse_buffer_reserve(rb, len)) == NULL)
+			return FALSE;
+		varint_array_pack(field->type, count, array, out);
+		break;
+	}
+	case PROTOBUF_C_TYPE_BOOL: {
+		const protobuf_c_boolean *arr = (const protobuf_c_boolean *) array;
+		if ((out = reverse_buffer_reserve(rb, count)) == NULL)
+			return FALSE;
+		for (i = 0; i < count; i++)
+			boolean_pack(arr[i], out + i);
+		break;
+	}
+	default:
+		PROTOBUF_C__ASSERT_NOT_REACHED();
+	}
+	if (!reverse_pack_length(rb->len - end, rb))
+		return FALSE;
+	return reverse_pack_tag(field->id, PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED,
+				rb);
+}
+
+static protobuf_c_boolean
+unknown_field_pack_reverse(const ProtobufCMessageUnknownField *field,
+			   ProtobufCReverseBuffer *rb)
+{
+	uint8_t *out = reverse_buffer_reserve(rb, field->len);
+
+	if (out == NULL)
+		return FALSE;
+	if (field->len != 0)
+		memcpy(out, field->data, field->len);
+	return reverse_pack_tag(field->tag, field->wire_type, rb);
+}
+
+/**
+ * Pack a message in front of the contents of a reverse buffer: unknown fields
+ * last to first, then the known fields last to first, which yields the same
+ * bytes as protobuf_c_message_pack().
+ *
+ * \param message
+ *      The message.
+ * \param rb
+ *      Buffer to prepend the packed message to.
+ * \return
+ *      TRUE on success, FALSE if the buffer could not grow.
+ */
+static protobuf_c_boolean
+message_pack_reverse(const ProtobufCMessage *message,
+		     ProtobufCReverseBuffer *rb)
+{
+	unsigned i;
+
+	ASSERT_IS_MESSAGE(message);
+	for (i = message->n_unknown_fields; i-- > 0; ) {
+		if (!unknown_field_pack_reverse(&message->unknown_fields[i], rb))
+			return FALSE;
+	}
+	for (i = message->descriptor->n_fields; i-- > 0; ) {
+		const ProtobufCFieldDescriptor *field =
+			message->descriptor->fields + i;
+		const void *member =
+			((const char *) message) + field->offset;
+		const void *qmember =
+			((const char *) message) + field->quantifier_offset;
+		protobuf_c_boolean ok;
+
+		if (field->label == PROTOBUF_C_LABEL_REQUIRED) {
+			ok = required_field_pack_reverse(field, member, rb);
+		} else if ((field->label == PROTOBUF_C_LABEL_OPTIONAL ||
+			    field->label == PROTOBUF_C_LABEL_NONE) &&
+			   (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_ONEOF))) {
+			ok = oneof_field_pack_reverse(
+				field,
+				*(const uint32_t *) qmember,
+				member,
+				rb
+			);
+		} else if (field->label == PROTOBUF_C_LABEL_OPTIONAL) {
+			ok = optional_field_pack_reverse(
+				field,
+				*(const protobuf_c_boolean *) qmember,
+				member,
+				rb
+			);
+		} else if (field->label == PROTOBUF_C_LABEL_NONE) {
+			ok = unlabeled_field_pack_reverse(field, member, rb);
+		} else {
+			ok = repeated_field_pack_reverse(
+				field,
+				*(const size_t *) qmember,
+				member,
+				rb
+			);
+		}
+		if (!ok)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/**@}*/
+
+uint8_t *
+protobuf_c_message_pack_reverse(const ProtobufCMessage *message,
+				uint8_t *out, size_t max_len)
+{
+	ProtobufCReverseBuffer rb;
+
+	rb.alloced = max_len;
+	rb.len = 0;
+	rb.data = out;
+	rb.must_free_data = FALSE;
+	rb.allocator = &protobuf_c__fixed_allocator;
+	if (!message_pack_reverse(message, &rb))
+		return NULL;
+	return out + max_len - rb.len;
+}
+
+uint8_t *
+protobuf_c_message_pack_to_reverse_buffer(const ProtobufCMessage *message,
+					  ProtobufCReverseBuffer *buffer)
+{
+	size_t len = buffer->len;
+
+	if (!message_pack_reverse(message, buffer)) {
+		buffer->len = len;
+		return NULL;
+	}
+	return buffer->data + buffer->alloced - buffer->len;
+}
+
+/**
+ * \defgroup unpack unpacking implementation
+ *
+ * Routines mainly used by the unpacking functions.
+ *
+ * \ingroup internal
+ * @{
+ */
+
+static inline int
+int_range_lookup(unsigned n_ranges, const ProtobufCIntRange *ranges, int value)
+{
+	unsigned n;
+	unsigned start;
+
+	if (n_ranges == 0)
+		return -1;
+	start = 0;
+	n = n_ranges;
+	while (n > 1) {
+		unsigned mid = start + n / 2;
+
+		if (value < ranges[mid].start_value) {
+			n = mid - start;
+		} else if (value >= ranges[mid].start_value +
+			   (int) (ranges[mid + 1].orig_index -
+				  ranges[mid].orig_index))
+		{
+			unsigned new_start = mid + 1;
+			n = start + n - new_start;
+			start = new_start;
+		} else
+			return (value - ranges[mid].start_value) +
+			    ranges[mid].orig_index;
+	}
+	if (n > 0) {
+		unsigned start_orig_index = ranges[start].orig_index;
+		unsigned range_size =
+			ranges[start + 1].orig_index - start_orig_index;
+
+		if (ranges[start].start_value <= value &&
+		    value < (int) (ranges[start].start_value + range_size))
+		{
+			return (value - ranges[start].start_value) +
+			    start_orig_index;
+		}
+	}
+	return -1;
+}
+
+static size_t
+parse_tag_and_wiretype(size_t len,
+		       const uint8_t *data,
+		       uint32_t *tag_out,
+		       uint8_t *wiretype_out)
+{
+	unsigned max_rv = len > 5 ? 5 : len;
+	uint32_t tag = (data[0] & 0x7f) >> 3;
+	unsigned shift = 4;
+	unsigned rv;
+
+	/* 0 is not a valid tag value */
+	if ((data[0] & 0xf8) == 0) {
+		return 0;
+	}
+
+	*wiretype_out = data[0] & 7;
+	if ((data[0] & 0x80) == 0) {
+		*tag_out = tag;
+		return 1;
+	}
+	for (rv = 1; rv < max_rv; rv++) {
+		if (data[rv] & 0x80) {
+			tag |= (data[rv] & 0x7f) << shift;
+			shift += 7;
+		} else {
+			tag |= data[rv] << shift;
+			*tag_out = tag;
+			return rv + 1;
+		}
+	}
+	return 0; /* error: bad header */
+}
+
+typedef struct RetainedStorage RetainedStorage;
+/**
+ * Memory taken over from a field's previous value by
+ * protobuf_c_message_unpack_into(), to be reused for its new value.
+ */
+struct RetainedStorage {
+	/** Repeated field array, string, byte buffer or sub-message. */
+	void *data;
+	/** Elements in the array, or bytes in the string or byte buffer. */
+	size_t capacity;
+	/** Number of array slots still holding a string, buffer or message. */
+	size_t n_spare;
+};
+
+/**
+ * Number of fields for which message_unpack_into() and
+ * protobuf_c_message_unpack_with_flags() need no RetainedStorage allocation.
+ */
+#define RETAINED_STORAGE_STACK_ENTRIES	32
+
+/** A compiled field mask, for one message type. */
+struct ProtobufCFieldMask {
+	/** The message type the mask applies to. */
+	const ProtobufCMessageDescriptor *descriptor;
+	/** Bitwise-or of `ProtobufCFieldMaskFlag` values. */
+	unsigned flags;
+	/**
+	 * For each field in `descriptor->fields`, NULL if the field is not
+	 * selected, `&field_mask_all` if it is selected with all its sub-fields,
+	 * or the mask of the selected sub-fields of a message field.
+	 */
+	ProtobufCFieldMask **fields;
+};
+
+/** Marks a field selected with everything in it. */
+static ProtobufCFieldMask field_mask_all;
+
+typedef struct ScannedMember ScannedMember;
+/** Field as it's being read. */
+struct ScannedMember {
+	uint32_t tag;              /**< Field tag. */
+	uint8_t wire_type;         /**< Field type. */
+	uint8_t length_prefix_len; /**< Prefix length. */
+	const ProtobufCFieldDescriptor *field; /**< Field descriptor. */
+	size_t len;                /**< Field length. */
+	const uint8_t *data;       /**< Pointer to field data. */
+	RetainedStorage *retained; /**< Storage to reuse, or NULL. */
+	const ProtobufCFieldMask *mask; /**< Sub-message selection, or NULL. */
+	ProtobufCUnpackContext *context; /**< Context of the call, or NULL. */
+};
+
+static inline size_t
+scan_length_prefixed_data(size_t len, const uint8_t *data,
+			  size_t *prefix_len_out)
+{
+	unsigned hdr_max = len < 5 ? len : 5;
+	unsigned hdr_len;
+	size_t val = 0;
+	unsigned i;
+	unsigned shift = 0;
+
+	for (i = 0; i < hdr_max; i++) {
+		val |= ((size_t)data[i] & 0x7f) << shift;
+		shift += 7;
+		if ((data[i] & 0x80) == 0)
+			break;
+	}
+	if (i == hdr_max) {
+		PROTOBUF_C_UNPACK_ERROR("error parsing length for length-prefixed data");
+		return 0;
+	}
+	hdr_len = i + 1;
+	*prefix_len_out = hdr_len;
+	if (val > INT_MAX) {
+		// Protobuf messages should always be less than 2 GiB in size.
+		// We also want to return early here so that hdr_len + val does
+		// not overflow on 32-bit systems.
+		PROTOBUF_C_UNPACK_ERROR("length prefix of %lu is too large",
+			(unsigned long int)val);
+		return 0;
+	}
+	if (hdr_len + val > len) {
+		PROTOBUF_C_UNPACK_ERROR("data too short after length-prefix of %lu",
+			(unsigned long int)val);
+		return 0;
+	}
+	return hdr_len + val;
+}
+
+#if defined(PROTOBUF_C_X86_SIMD)
+
+/*
+ * Count the bytes without the continuation bit, 64 or 16 at a time using the
+ * sign-bit mask of each block.
+ */
+__attribute__((target("avx2,popcnt")))
+static size_t
+max_b128_numbers_avx2(size_t len, const uint8_t *data)
+{
+	size_t rv = 0;
+
+	for (; len >= 64; len -= 64, data += 64) {
+		uint64_t lo = (uint32_t) _mm256_movemask_epi8(
+			_mm256_loadu_si256((const __m256i *) data));
+		uint64_t hi = (uint32_t) _mm256_movemask_epi8(
+			_mm256_loadu_si256((const __m256i *) (data + 32)));
+		rv += 64 - __builtin_popcountll(lo | (hi << 32));
+	}
+	for (; len >= 16; len -= 16, data += 16)
+		rv += 16 - __builtin_popcount(_mm_movemask_epi8(
+			_mm_loadu_si128((const __m128i *) data)));
+	while (len--)
+		if ((*data++ & 0x80) == 0)
+			++rv;
+	return rv;
+}
+
+__attribute__((target("sse4.1,popcnt")))
+static size_t
+max_b128_numbers_sse41(size_t len, const uint8_t *data)
+{
+	size_t rv = 0;
+
+	for (; len >= 64; len -= 64, data += 64) {
+		uint64_t m0 = (unsigned) _mm_movemask_epi8(
+			_mm_loadu_si128((const __m128i *) data));
+		uint64_t m1 = (unsigned) _mm_movemask_epi8(
+			_mm_loadu_si128((const __m128i *) (data + 16)));
+		uint64_t m2 = (unsigned) _mm_movemask_epi8(
+			_mm_loadu_si128((const __m128i *) (data + 32)));
+		uint64_t m3 = (unsigned) _mm_movemask_epi8(
+			_mm_loadu_si128((const __m128i *) (data + 48)));
+		rv += 64 - __builtin_popcountll(m0 | (m1 << 16) |
+						(m2 << 32) | (m3 << 48));
+	}
+	for (; len >= 16; len -= 16, data += 16)
+		rv += 16 - __builtin_popcount(_mm_movemask_epi8(
+			_mm_loadu_si128((const __m128i *) data)));
+	while (len--)
+		if ((*data++ & 0x80) == 0)
+			++rv;
+	return rv;
+}
+
+#endif /* PROTOBUF_C_X86_SIMD */
+
+/**
+ * Count the varint terminators (bytes without the continuation bit) in a
+ * packed payload, which is the number of elements it holds.
+ */
+static size_t
+max_b128_numbers(size_t len, const uint8_t *data)
+{
+	size_t rv = 0;
+
+#if defined(PROTOBUF_C_X86_SIMD)
+	if (len >= 32) {
+		switch (get_simd_level()) {
+		case SIMD_LEVEL_AVX2:
+			return max_b128_numbers_avx2(len, data);
+		case SIMD_LEVEL_SSE41:
+			return max_b128_numbers_sse41(len, data);
+		default:
+			break;
+		}
+	}
+#endif
+	while (len--)
+		if ((*data++ & 0x80) == 0)
+			++rv;
+	return rv;
+}
+
+/**@}*/
+
+/**
+ * Number of elements allocated for a repeated array (or the unknown fields
+ * array) holding `n` elements while a message is being unpacked.
+ *
+ * Arrays grow geometrically as elements are appended, so the capacity is a
+ * function of the element count alone and does not need to be stored.
+ */
+static inline size_t
+repeated_capacity(size_t n)
+{
+	size_t cap = 4;
+
+	if (n == 0)
+		return 0;
+	while (cap < n)
+		cap <<= 1;
+	return cap;
+}
+
+typedef struct PointerStack PointerStack;
+/** Stack of pointers, kept on the C stack until it outgrows `local`. */
+struct PointerStack {
+	void **items;      /**< The pointers, `local` or allocated. */
+	size_t n;          /**< Number of pointers on the stack. */
+	size_t capacity;   /**< Number of pointers `items` has room for. */
+	void *local[32];   /**< Initial storage. */
+};
+
+static void
+pointer_stack_init(PointerStack *stack)
+{
+	stack->items = stack->local;
+	stack->n = 0;
+	stack->capacity = sizeof(stack->local) / sizeof(stack->local[0]);
+}
+
+static protobuf_c_boolean
+pointer_stack_push(PointerStack *stack, void *item,
+		   ProtobufCAllocator *allocator)
+{
+	if (stack->n == stack->capacity) {
+		void **items;
+
+		if (stack->capacity > SIZE_MAX / 2 / sizeof(void *))
+			return FALSE;
+		items = do_alloc(allocator, stack->capacity * 2 * sizeof(void *));
+		if (items == NULL)
+			return FALSE;
+		memcpy(items, stack->items, stack->n * sizeof(void *));
+		if (stack->items != stack->local)
+			do_free(allocator, stack->items);
+		stack->items = items;
+		stack->capacity *= 2;
+	}
+	stack->items[stack->n++] = item;
+	return TRUE;
+}
+
+static void
+pointer_stack_clear(PointerStack *stack, ProtobufCAllocator *allocator)
+{
+	if (stack->items != stack->local)
+		do_free(allocator, stack->items);
+	pointer_stack_init(stack);
+}
+
+static protobuf_c_boolean
+merge_message_fields(ProtobufCMessage *earlier_msg,
+		     ProtobufCMessage *latter_msg,
+		     ProtobufCAllocator *allocator,
+		     PointerStack *pending);
+
+/**
+ * Merge earlier message into a latter message.
+ *
+ * For numeric types and strings, if the same value appears multiple
+ * times, the parser accepts the last value it sees. For embedded
+ * message fields, the parser merges multiple instances of the same
+ * field. That is, all singular scalar fields in the latter instance
+ * replace those in the former, singular embedded messages are merged,
+ * and repeated fields and unknown fields are concatenated.
+ *
+ * The earlier message should be freed after calling this function, as
+ * some of its fields may have been reused and changed to their default
+ * values during the merge.
+ *
+ * Pairs of sub-messages to merge are kept on a stack rather than merged
+ * recursively, so that the depth of the messages doesn't matter.
+ */
+static protobuf_c_boolean
+merge_messages(ProtobufCMessage *earlier_msg,
+	       ProtobufCMessage *latter_msg,
+	       ProtobufCAllocator *allocator)
+{
+	PointerStack pending;
+	protobuf_c_boolean rv;
+
+	pointer_stack_init(&pending);
+	rv = merge_message_fields(earlier_msg, latter_msg, allocator, &pending);
+	while (rv && pending.n != 0) {
+		latter_msg = pending.items[--pending.n];
+		earlier_msg = pending.items[--pending.n];
+		rv = merge_message_fields(earlier_msg, latter_msg, allocator,
+					  &pending);
+	}
+	pointer_stack_clear(&pending, allocator);
+	return rv;
+}
+
+/**
+ * Merge the fields of one pair of messages for merge_messages(), pushing
+ * the pairs of their sub-messages that need merging in turn on `pending`.
+ */
+static protobuf_c_boolean
+merge_message_fields(ProtobufCMessage *earlier_msg,
+		     ProtobufCMessage *latter_msg,
+		     ProtobufCAllocator *allocator,
+		     PointerStack *pending)
+{
+	unsigned i;
+	const ProtobufCFieldDescriptor *fields =
+		latter_msg->descriptor->fields;
+	for (i = 0; i < latter_msg->descriptor->n_fields; i++) {
+		if (fields[i].label == PROTOBUF_C_LABEL_REPEATED) {
+			size_t *n_earlier =
+				STRUCT_MEMBER_PTR(size_t, earlier_msg,
+						  fields[i].quantifier_offset);
+			uint8_t **p_earlier =
+				STRUCT_MEMBER_PTR(uint8_t *, earlier_msg,
+						  fields[i].offset);
+			size_t *n_latter =
+				STRUCT_MEMBER_PTR(size_t, latter_msg,
+						  fields[i].quantifier_offset);
+			uint8_t **p_latter =
+				STRUCT_MEMBER_PTR(uint8_t *, latter_msg,
+						  fields[i].offset);
+
+			if (*n_earlier > 0) {
+				if (*n_latter > 0) {
+					/* Concatenate the repeated field */
+					size_t el_size =
+						sizeof_elt_in_repeated_array(fields[i].type);
+					uint8_t *new_field;
+
+					new_field = do_alloc(allocator,
+						repeated_capacity(*n_earlier + *n_latter) *
+						el_size);
+					if (!new_field)
+						return FALSE;
+
+					memcpy(new_field, *p_earlier,
+					       *n_earlier * el_size);
+					memcpy(new_field +
+					       *n_earlier * el_size,
+					       *p_latter,
+					       *n_latter * el_size);
+
+					do_free(allocator, *p_latter);
+					do_free(allocator, *p_earlier);
+					*p_latter = new_field;
+					*n_latter = *n_earlier + *n_latter;
 				} else {
 					/* Zero copy the repeated field from the earlier message */
 					*n_latter = *n_earlier;
 					*p_latter = *p_earlier;
 				}
-				/* Make sure the field does not get double freed */
-				*n_earlier = 0;
-				*p_earlier = 0;
+				/* Make sure the field does not get double freed */
+				*n_earlier = 0;
+				*p_earlier = 0;
+			}
+		} else {
+			const ProtobufCFieldDescriptor *field;
+			uint32_t *earlier_case_p = STRUCT_MEMBER_PTR(uint32_t,
+								     earlier_msg,
+								     fields[i].
+								     quantifier_offset);
+			uint32_t *latter_case_p = STRUCT_MEMBER_PTR(uint32_t,
+								    latter_msg,
+								    fields[i].
+								    quantifier_offset);
+			protobuf_c_boolean need_to_merge = FALSE;
+			void *earlier_elem;
+			void *latter_elem;
+			const void *def_val;
+
+			if (fields[i].flags & PROTOBUF_C_FIELD_FLAG_ONEOF) {
+				if (*latter_case_p == 0) {
+					/* lookup correct oneof field */
+					int field_index =
+						int_range_lookup(
+							latter_msg->descriptor
+							->n_field_ranges,
+							latter_msg->descriptor
+							->field_ranges,
+							*earlier_case_p);
+					if (field_index < 0)
+						return FALSE;
+					field = latter_msg->descriptor->fields +
+						field_index;
+				} else {
+					/* Oneof is present in the latter message, move on */
+					continue;
+				}
+			} else {
+				field = &fields[i];
+			}
+
+			earlier_elem = STRUCT_MEMBER_P(earlier_msg, field->offset);
+			latter_elem = STRUCT_MEMBER_P(latter_msg, field->offset);
+			def_val = field->default_value;
+
+			switch (field->type) {
+			case PROTOBUF_C_TYPE_MESSAGE: {
+				ProtobufCMessage *em = *(ProtobufCMessage **) earlier_elem;
+				ProtobufCMessage *lm = *(ProtobufCMessage **) latter_elem;
+				if (em != NULL) {
+					if (lm != NULL) {
+						if (!pointer_stack_push(pending, em, allocator) ||
+						    !pointer_stack_push(pending, lm, allocator))
+							return FALSE;
+						/* Already merged */
+						need_to_merge = FALSE;
+					} else {
+						/* Zero copy the message */
+						need_to_merge = TRUE;
+					}
+				}
+				break;
+			}
+			case PROTOBUF_C_TYPE_BYTES: {
+				uint8_t *e_data =
+					((ProtobufCBinaryData *) earlier_elem)->data;
+				uint8_t *l_data =
+					((ProtobufCBinaryData *) latter_elem)->data;
+				const ProtobufCBinaryData *d_bd =
+					(ProtobufCBinaryData *) def_val;
+
+				need_to_merge =
+					(e_data != NULL &&
+					 (d_bd == NULL ||
+					  e_data != d_bd->data)) &&
+					(l_data == NULL ||
+					 (d_bd != NULL &&
+					  l_data == d_bd->data));
+				break;
+			}
+			case PROTOBUF_C_TYPE_STRING: {
+				char *e_str = *(char **) earlier_elem;
+				char *l_str = *(char **) latter_elem;
+				const char *d_str = def_val;
+
+				need_to_merge = e_str != d_str && l_str == d_str;
+				break;
+			}
+			default: {
+				/* Could be has field or case enum, the logic is
+				 * equivalent, since 0 (FALSE) means not set for
+				 * oneof */
+				need_to_merge = (*earlier_case_p != 0) &&
+						(*latter_case_p == 0);
+				break;
+			}
+			}
+
+			if (need_to_merge) {
+				size_t el_size =
+					sizeof_elt_in_repeated_array(field->type);
+				memcpy(latter_elem, earlier_elem, el_size);
+				/*
+				 * Reset the element from the old message to 0
+				 * to make sure earlier message deallocation
+				 * doesn't corrupt zero-copied data in the new
+				 * message, earlier message will be freed after
+				 * this function is called anyway
+				 */
+				memset(earlier_elem, 0, el_size);
+
+				if (field->quantifier_offset != 0) {
+					/* Set the has field or the case enum,
+					 * if applicable */
+					*latter_case_p = *earlier_case_p;
+					*earlier_case_p = 0;
+				}
+			}
+		}
+	}
+
+	/* Unknown fields are concatenated too */
+	if (earlier_msg->n_unknown_fields > 0) {
+		unsigned n_earlier = earlier_msg->n_unknown_fields;
+		unsigned n_latter = latter_msg->n_unknown_fields;
+		ProtobufCMessageUnknownField *ufields;
+
+		if (n_latter > 0) {
+			ufields = do_alloc(allocator,
+				repeated_capacity(n_earlier + n_latter) *
+				sizeof(ProtobufCMessageUnknownField));
+			if (!ufields)
+				return FALSE;
+			memcpy(ufields, earlier_msg->unknown_fields,
+			       n_earlier * sizeof(ProtobufCMessageUnknownField));
+			memcpy(ufields + n_earlier, latter_msg->unknown_fields,
+			       n_latter * sizeof(ProtobufCMessageUnknownField));
+			do_free(allocator, latter_msg->unknown_fields);
+			do_free(allocator, earlier_msg->unknown_fields);
+		} else {
+			ufields = earlier_msg->unknown_fields;
+		}
+		latter_msg->unknown_fields = ufields;
+		latter_msg->n_unknown_fields = n_earlier + n_latter;
+		earlier_msg->unknown_fields = NULL;
+		earlier_msg->n_unknown_fields = 0;
+	}
+	return TRUE;
+}
+
+/**
+ * Count packed elements.
+ *
+ * Given a raw slab of packed-repeated values, determine the number of
+ * elements. This function detects certain kinds of errors but not
+ * others; the remaining error checking is done by
+ * parse_packed_repeated_member().
+ */
+static protobuf_c_boolean
+count_packed_elements(ProtobufCType type,
+		      size_t len, const uint8_t *data, size_t *count_out)
+{
+	switch (type) {
+	case PROTOBUF_C_TYPE_SFIXED32:
+	case PROTOBUF_C_TYPE_FIXED32:
+	case PROTOBUF_C_TYPE_FLOAT:
+		if (len % 4 != 0) {
+			PROTOBUF_C_UNPACK_ERROR("length must be a multiple of 4 for fixed-length 32-bit types");
+			return FALSE;
+		}
+		*count_out = len / 4;
+		return TRUE;
+	case PROTOBUF_C_TYPE_SFIXED64:
+	case PROTOBUF_C_TYPE_FIXED64:
+	case PROTOBUF_C_TYPE_DOUBLE:
+		if (len % 8 != 0) {
+			PROTOBUF_C_UNPACK_ERROR("length must be a multiple of 8 for fixed-length 64-bit types");
+			return FALSE;
+		}
+		*count_out = len / 8;
+		return TRUE;
+	case PROTOBUF_C_TYPE_ENUM:
+	case PROTOBUF_C_TYPE_INT32:
+	case PROTOBUF_C_TYPE_SINT32:
+	case PROTOBUF_C_TYPE_UINT32:
+	case PROTOBUF_C_TYPE_INT64:
+	case PROTOBUF_C_TYPE_SINT64:
+	case PROTOBUF_C_TYPE_UINT64:
+		*count_out = max_b128_numbers(len, data);
+		return TRUE;
+	case PROTOBUF_C_TYPE_BOOL:
+		*count_out = len;
+		return TRUE;
+	case PROTOBUF_C_TYPE_STRING:
+	case PROTOBUF_C_TYPE_BYTES:
+	case PROTOBUF_C_TYPE_MESSAGE:
+	default:
+		PROTOBUF_C_UNPACK_ERROR("bad protobuf-c type %u for packed-repeated", type);
+		return FALSE;
+	}
+}
+
+static inline uint32_t
+parse_uint32(unsigned len, const uint8_t *data)
+{
+	uint32_t rv = data[0] & 0x7f;
+	if (len > 1) {
+		rv |= ((uint32_t) (data[1] & 0x7f) << 7);
+		if (len > 2) {
+			rv |= ((uint32_t) (data[2] & 0x7f) << 14);
+			if (len > 3) {
+				rv |= ((uint32_t) (data[3] & 0x7f) << 21);
+				if (len > 4)
+					rv |= ((uint32_t) (data[4]) << 28);
+			}
+		}
+	}
+	return rv;
+}
+
+static inline uint32_t
+parse_int32(unsigned len, const uint8_t *data)
+{
+	return parse_uint32(len, data);
+}
+
+static inline int32_t
+unzigzag32(uint32_t v)
+{
+	// Note:  Using unsigned types prevents undefined behavior
+	return (int32_t)((v >> 1) ^ -(v & 1));
+}
+
+static inline uint32_t
+parse_fixed_uint32(const uint8_t *data)
+{
+#if !defined(WORDS_BIGENDIAN)
+	uint32_t t;
+	memcpy(&t, data, 4);
+	return t;
+#else
+	return data[0] |
+		((uint32_t) (data[1]) << 8) |
+		((uint32_t) (data[2]) << 16) |
+		((uint32_t) (data[3]) << 24);
+#endif
+}
+
+static uint64_t
+parse_uint64(unsigned len, const uint8_t *data)
+{
+	unsigned shift, i;
+	uint64_t rv;
+
+	if (len < 5)
+		return parse_uint32(len, data);
+	rv = ((uint64_t) (data[0] & 0x7f)) |
+		((uint64_t) (data[1] & 0x7f) << 7) |
+		((uint64_t) (data[2] & 0x7f) << 14) |
+		((uint64_t) (data[3] & 0x7f) << 21);
+	shift = 28;
+	for (i = 4; i < len; i++) {
+		rv |= (((uint64_t) (data[i] & 0x7f)) << shift);
+		shift += 7;
+	}
+	return rv;
+}
+
+static inline int64_t
+unzigzag64(uint64_t v)
+{
+	// Note:  Using unsigned types prevents undefined behavior
+	return (int64_t)((v >> 1) ^ -(v & 1));
+}
+
+static inline uint64_t
+parse_fixed_uint64(const uint8_t *data)
+{
+#if !defined(WORDS_BIGENDIAN)
+	uint64_t t;
+	memcpy(&t, data, 8);
+	return t;
+#else
+	return (uint64_t) parse_fixed_uint32(data) |
+		(((uint64_t) parse_fixed_uint32(data + 4)) << 32);
+#endif
+}
+
+static protobuf_c_boolean
+parse_boolean(unsigned len, const uint8_t *data)
+{
+	unsigned i;
+	for (i = 0; i < len; i++)
+		if (data[i] & 0x7f)
+			return TRUE;
+	return FALSE;
+}
+
+static ProtobufCMessage *
+message_unpack(const ProtobufCMessageDescriptor *desc,
+	       ProtobufCAllocator *allocator,
+	       unsigned flags,
+	       ProtobufCUnpackContext *context,
+	       const ProtobufCFieldMask *mask,
+	       size_t len, const uint8_t *data);
+
+static protobuf_c_boolean
+message_unpack_into(ProtobufCMessage *message,
+		    ProtobufCAllocator *allocator,
+		    unsigned flags,
+		    ProtobufCUnpackContext *context,
+		    size_t len, const uint8_t *data);
+
+static void
+free_message_members(ProtobufCMessage *message,
+		     ProtobufCAllocator *allocator);
+
+static protobuf_c_boolean
+message_unpack_fields(ProtobufCMessage *rv,
+		      ProtobufCAllocator *allocator,
+		      unsigned flags,
+		      ProtobufCUnpackContext *context,
+		      size_t len, const uint8_t *data,
+		      RetainedStorage *retained,
+		      const ProtobufCFieldMask *mask);
+
+static void
+message_reset(const ProtobufCMessageDescriptor *desc,
+	      ProtobufCMessage *message);
+
+static protobuf_c_boolean
+unborrow_arrays(ProtobufCMessage *message, ProtobufCAllocator *allocator);
+
+typedef struct UnpackJob UnpackJob;
+/** Sub-message queued on a `ProtobufCUnpackContext` to be parsed later. */
+struct UnpackJob {
+	ProtobufCMessage *message; /**< Message to parse into, or NULL. */
+	size_t len;                /**< Length of the serialised fields. */
+	const uint8_t *data;       /**< The serialised fields. */
+	unsigned depth;            /**< Nesting depth of the parent. */
+};
+
+/**
+ * Whether the sub-messages met while parsing `scanned_member` are queued on
+ * its context rather than parsed recursively.
+ */
+static inline protobuf_c_boolean
+defers_submessages(const ScannedMember *scanned_member)
+{
+	return scanned_member->context != NULL;
+}
+
+/**
+ * Queue the serialised fields of a sub-message, to be parsed into `message`
+ * once the message being parsed is done.
+ */
+static protobuf_c_boolean
+push_unpack_job(ProtobufCUnpackContext *context,
+		ProtobufCMessage *message,
+		size_t len, const uint8_t *data)
+{
+	UnpackJob *jobs = context->jobs;
+	UnpackJob *job;
+
+	if (context->n_jobs == context->jobs_capacity) {
+		size_t new_cap = context->jobs_capacity == 0 ?
+			16 : context->jobs_capacity * 2;
+
+		if (new_cap > SIZE_MAX / sizeof(UnpackJob))
+			return FALSE;
+		/* the old stack is released with the rest of the scratch */
+		jobs = do_alloc(&context->scratch.base,
+				new_cap * sizeof(UnpackJob));
+		if (jobs == NULL)
+			return FALSE;
+		if (context->n_jobs != 0)
+			memcpy(jobs, context->jobs,
+			       context->n_jobs * sizeof(UnpackJob));
+		context->jobs = jobs;
+		context->jobs_capacity = new_cap;
+	}
+	job = jobs + context->n_jobs++;
+	job->message = message;
+	job->len = len;
+	job->data = data;
+	job->depth = context->depth;
+	return TRUE;
+}
+
+/**
+ * Drop the job of a message that is about to be freed. Its job can only have
+ * been queued by the message being parsed, and is usually among the last.
+ */
+static void
+cancel_unpack_job(ProtobufCUnpackContext *context,
+		  const ProtobufCMessage *message)
+{
+	UnpackJob *jobs = context->jobs;
+	size_t i;
+
+	for (i = context->n_jobs; i > context->jobs_base; i--) {
+		if (jobs[i - 1].message == message) {
+			jobs[i - 1].message = NULL;
+			break;
+		}
+	}
+}
+
+/**
+ * Parse a singular value into `member`.
+ *
+ * If `member` does not hold a value of its own yet and `reuse` holds storage
+ * left over from the previous message that is large enough, the value is
+ * decoded into that storage, and `reuse->data` is set to NULL.
+ */
+static protobuf_c_boolean
+parse_required_member(ScannedMember *scanned_member,
+		      void *member,
+		      ProtobufCAllocator *allocator,
+		      unsigned flags,
+		      protobuf_c_boolean maybe_clear,
+		      RetainedStorage *reuse)
+{
+	unsigned len = scanned_member->len;
+	const uint8_t *data = scanned_member->data;
+	uint8_t wire_type = scanned_member->wire_type;
+
+	switch (scanned_member->field->type) {
+	case PROTOBUF_C_TYPE_ENUM:
+	case PROTOBUF_C_TYPE_INT32:
+		if (wire_type != PROTOBUF_C_WIRE_TYPE_VARINT)
+			return FALSE;
+		*(int32_t *) member = parse_int32(len, data);
+		return TRUE;
+	case PROTOBUF_C_TYPE_UINT32:
+		if (wire_type != PROTOBUF_C_WIRE_TYPE_VARINT)
+			return FALSE;
+		*(uint32_t *) member = parse_uint32(len, data);
+		return TRUE;
+	case PROTOBUF_C_TYPE_SINT32:
+		if (wire_type != PROTOBUF_C_WIRE_TYPE_VARINT)
+			return FALSE;
+		*(int32_t *) member = unzigzag32(parse_uint32(len, data));
+		return TRUE;
+	case PROTOBUF_C_TYPE_SFIXED32:
+	case PROTOBUF_C_TYPE_FIXED32:
+	case PROTOBUF_C_TYPE_FLOAT:
+		if (wire_type != PROTOBUF_C_WIRE_TYPE_32BIT)
+			return FALSE;
+		*(uint32_t *) member = parse_fixed_uint32(data);
+		return TRUE;
+	case PROTOBUF_C_TYPE_INT64:
+	case PROTOBUF_C_TYPE_UINT64:
+		if (wire_type != PROTOBUF_C_WIRE_TYPE_VARINT)
+			return FALSE;
+		*(uint64_t *) member = parse_uint64(len, data);
+		return TRUE;
+	case PROTOBUF_C_TYPE_SINT64:
+		if (wire_type != PROTOBUF_C_WIRE_TYPE_VARINT)
+			return FALSE;
+		*(int64_t *) member = unzigzag64(parse_uint64(len, data));
+		return TRUE;
+	case PROTOBUF_C_TYPE_SFIXED64:
+	case PROTOBUF_C_TYPE_FIXED64:
+	case PROTOBUF_C_TYPE_DOUBLE:
+		if (wire_type != PROTOBUF_C_WIRE_TYPE_64BIT)
+			return FALSE;
+		*(uint64_t *) member = parse_fixed_uint64(data);
+		return TRUE;
+	case PROTOBUF_C_TYPE_BOOL:
+		*(protobuf_c_boolean *) member = parse_boolean(len, data);
+		return TRUE;
+	case PROTOBUF_C_TYPE_STRING: {
+		char **pstr = member;
+		unsigned pref_len = scanned_member->length_prefix_len;
+
+		if (wire_type != PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED)
+			return FALSE;
+
+		if (maybe_clear && *pstr != NULL) {
+			const char *def = scanned_member->field->default_value;
+			if (*pstr != def)
+				do_free(allocator, *pstr);
+		}
+		if (reuse != NULL && reuse->data != NULL &&
+		    reuse->capacity > len - pref_len)
+		{
+			*pstr = reuse->data;
+			reuse->data = NULL;
+		} else {
+			*pstr = do_alloc(allocator, len - pref_len + 1);
+			if (*pstr == NULL)
+				return FALSE;
+		}
+		memcpy(*pstr, data + pref_len, len - pref_len);
+		(*pstr)[len - pref_len] = 0;
+		return TRUE;
+	}
+	case PROTOBUF_C_TYPE_BYTES: {
+		ProtobufCBinaryData *bd = member;
+		const ProtobufCBinaryData *def_bd;
+		unsigned pref_len = scanned_member->length_prefix_len;
+
+		if (wire_type != PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED)
+			return FALSE;
+
+		def_bd = scanned_member->field->default_value;
+		if (maybe_clear &&
+		    bd->data != NULL &&
+		    (def_bd == NULL || bd->data != def_bd->data))
+		{
+			do_free(allocator, bd->data);
+		}
+		if (len > pref_len &&
+		    (flags & PROTOBUF_C_UNPACK_FLAG_ZERO_COPY))
+		{
+			bd->data = (uint8_t *) data + pref_len;
+		} else if (len > pref_len &&
+			   reuse != NULL && reuse->data != NULL &&
+			   reuse->capacity >= len - pref_len)
+		{
+			bd->data = reuse->data;
+			reuse->data = NULL;
+			memcpy(bd->data, data + pref_len, len - pref_len);
+		} else if (len > pref_len) {
+			bd->data = do_alloc(allocator, len - pref_len);
+			if (bd->data == NULL)
+				return FALSE;
+			memcpy(bd->data, data + pref_len, len - pref_len);
+		} else {
+			bd->data = NULL;
+		}
+		bd->len = len - pref_len;
+		return TRUE;
+	}
+	case PROTOBUF_C_TYPE_MESSAGE: {
+		ProtobufCMessage **pmessage = member;
+		ProtobufCMessage *subm;
+		const ProtobufCMessage *def_mess;
+		protobuf_c_boolean merge_successful = TRUE;
+		unsigned pref_len = scanned_member->length_prefix_len;
+
+		if (wire_type != PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED)
+			return FALSE;
+
+		def_mess = scanned_member->field->default_value;
+		if (reuse != NULL && reuse->data != NULL &&
+		    (*pmessage == NULL || *pmessage == def_mess))
+		{
+			subm = reuse->data;
+			reuse->data = NULL;
+			if (!message_unpack_into(subm, allocator, flags,
+						 scanned_member->context,
+						 len - pref_len,
+						 data + pref_len))
+			{
+				protobuf_c_message_free_unpacked(subm, allocator);
+				return FALSE;
+			}
+			*pmessage = subm;
+			return TRUE;
+		}
+		if (maybe_clear && *pmessage != NULL && *pmessage != def_mess &&
+		    (!(flags & PROTOBUF_C_UNPACK_FLAG_ZERO_COPY) ||
+		     defers_submessages(scanned_member)))
+		{
+			/*
+			 * A later occurrence of the field is merged by parsing
+			 * it straight into the message, so that its repeated
+			 * fields grow in place rather than being copied into a
+			 * new array for every occurrence. Borrowed zero-copy
+			 * arrays can't grow in place, so those messages are
+			 * unpacked separately and merged, unless the merge
+			 * is queued: jobs copy the arrays before they run.
+			 */
+			if (defers_submessages(scanned_member))
+				return push_unpack_job(scanned_member->context,
+						       *pmessage,
+						       len - pref_len,
+						       data + pref_len);
+			return message_unpack_fields(*pmessage, allocator, flags,
+						     scanned_member->context,
+						     len - pref_len,
+						     data + pref_len, NULL,
+						     scanned_member->mask);
+		}
+		if (len < pref_len)
+			return FALSE;
+		if (defers_submessages(scanned_member)) {
+			const ProtobufCMessageDescriptor *desc =
+				scanned_member->field->descriptor;
+
+			subm = do_alloc(allocator, desc->sizeof_message);
+			if (subm == NULL)
+				return FALSE;
+			message_reset(desc, subm);
+			if (!push_unpack_job(scanned_member->context, subm,
+					     len - pref_len, data + pref_len))
+			{
+				do_free(allocator, subm);
+				return FALSE;
+			}
+			*pmessage = subm;
+			return TRUE;
+		}
+
+		subm = message_unpack(scanned_member->field->descriptor,
+				      allocator, flags,
+				      scanned_member->context,
+				      scanned_member->mask,
+				      len - pref_len,
+				      data + pref_len);
+
+		if (maybe_clear &&
+		    *pmessage != NULL &&
+		    *pmessage != def_mess)
+		{
+			if (subm != NULL)
+				merge_successful = merge_messages(*pmessage, subm, allocator);
+			/* Delete the previous message */
+			protobuf_c_message_free_unpacked(*pmessage, allocator);
+		}
+		*pmessage = subm;
+		if (subm == NULL || !merge_successful)
+			return FALSE;
+		return TRUE;
+	}
+	}
+	return FALSE;
+}
+
+/**
+ * Free the value of the member of a oneof that is set, if any, and zero it.
+ *
+ * \param oneof_case
+ *      The oneof's case member, holding the number of the field that is set.
+ * \param member
+ *      The oneof's union.
+ * \param context
+ *      Context whose queued job for a message member is to be dropped, or
+ *      NULL.
+ */
+static protobuf_c_boolean
+clear_oneof(ProtobufCMessage *message,
+	    uint32_t *oneof_case,
+	    void *member,
+	    ProtobufCAllocator *allocator,
+	    ProtobufCUnpackContext *context)
+{
+	const ProtobufCFieldDescriptor *old_field;
+	size_t el_size;
+	int field_index;
+
+	if (*oneof_case == 0)
+		return TRUE;
+
+	/* lookup field */
+	field_index = int_range_lookup(message->descriptor->n_field_ranges,
+				       message->descriptor->field_ranges,
+				       *oneof_case);
+	if (field_index < 0)
+		return FALSE;
+	old_field = message->descriptor->fields + field_index;
+	el_size = sizeof_elt_in_repeated_array(old_field->type);
+
+	switch (old_field->type) {
+	case PROTOBUF_C_TYPE_STRING: {
+		char **pstr = member;
+		const char *def = old_field->default_value;
+		if (*pstr != NULL && *pstr != def)
+			do_free(allocator, *pstr);
+		break;
+	}
+	case PROTOBUF_C_TYPE_BYTES: {
+		ProtobufCBinaryData *bd = member;
+		const ProtobufCBinaryData *def_bd = old_field->default_value;
+		if (bd->data != NULL &&
+		   (def_bd == NULL || bd->data != def_bd->data))
+		{
+			do_free(allocator, bd->data);
+		}
+		break;
+	}
+	case PROTOBUF_C_TYPE_MESSAGE: {
+		ProtobufCMessage **pmessage = member;
+		const ProtobufCMessage *def_mess = old_field->default_value;
+		if (*pmessage != NULL && *pmessage != def_mess) {
+			if (context != NULL)
+				cancel_unpack_job(context, *pmessage);
+			protobuf_c_message_free_unpacked(*pmessage, allocator);
+		}
+		break;
+	}
+	default:
+		break;
+	}
+
+	memset (member, 0, el_size);
+	*oneof_case = 0;
+	return TRUE;
+}
+
+static protobuf_c_boolean
+parse_oneof_member (ScannedMember *scanned_member,
+		    void *member,
+		    ProtobufCMessage *message,
+		    ProtobufCAllocator *allocator,
+		    unsigned flags)
+{
+	uint32_t *oneof_case = STRUCT_MEMBER_PTR(uint32_t, message,
+					       scanned_member->field->quantifier_offset);
+
+	/* If we have already parsed a member of this oneof, free it. */
+	if (!clear_oneof(message, oneof_case, member, allocator,
+			 defers_submessages(scanned_member) ?
+			 scanned_member->context : NULL))
+		return FALSE;
+	if (!parse_required_member (scanned_member, member, allocator, flags,
+				    TRUE, scanned_member->retained))
+		return FALSE;
+
+	*oneof_case = scanned_member->tag;
+	return TRUE;
+}
+
+
+static protobuf_c_boolean
+parse_optional_member(ScannedMember *scanned_member,
+		      void *member,
+		      ProtobufCMessage *message,
+		      ProtobufCAllocator *allocator,
+		      unsigned flags)
+{
+	if (!parse_required_member(scanned_member, member, allocator, flags,
+				   TRUE, scanned_member->retained))
+		return FALSE;
+	if (scanned_member->field->quantifier_offset != 0)
+		STRUCT_MEMBER(protobuf_c_boolean,
+			      message,
+			      scanned_member->field->quantifier_offset) = TRUE;
+	return TRUE;
+}
+
+/**
+ * Make room for `count` more elements in an array of `siz`-byte elements
+ * currently holding `n`, growing it if necessary.
+ *
+ * If `retained` holds an array left over from the previous message, that
+ * array is used instead of a new one, and its capacity is tracked there
+ * rather than derived from `n`. Slots past `n` that still hold spare
+ * elements are carried over when it has to grow.
+ *
+ * On failure the array is left untouched, so that it can still be freed.
+ */
+static protobuf_c_boolean
+reserve_array(void **parray, size_t siz, size_t n, size_t count,
+	      RetainedStorage *retained, ProtobufCAllocator *allocator)
+{
+	size_t new_cap;
+	void *array;
+
+	if (retained != NULL && retained->data != NULL) {
+		size_t keep = n > retained->n_spare ? n : retained->n_spare;
+
+		*parray = retained->data;
+		if (n + count <= retained->capacity)
+			return TRUE;
+		new_cap = repeated_capacity(n + count);
+		if (new_cap > SIZE_MAX / siz)
+			return FALSE;
+		array = do_alloc(allocator, new_cap * siz);
+		if (array == NULL)
+			return FALSE;
+		memcpy(array, retained->data, keep * siz);
+		do_free(allocator, retained->data);
+		*parray = retained->data = array;
+		retained->capacity = new_cap;
+		return TRUE;
+	}
+	if (count == 1) {
+		/* fast path: the array is full when n is 0 or a power of 2 >= 4 */
+		if (n != 0 && (n < 4 || (n & (n - 1)) != 0))
+			return TRUE;
+	} else if (n + count <= repeated_capacity(n)) {
+		return TRUE;
+	}
+	new_cap = repeated_capacity(n + count);
+	if (new_cap > SIZE_MAX / siz)
+		return FALSE;
+	array = do_alloc(allocator, new_cap * siz);
+	if (array == NULL)
+		return FALSE;
+	if (n != 0)
+		memcpy(array, *parray, n * siz);
+	do_free(allocator, *parray);
+	*parray = array;
+	return TRUE;
+}
+
+static protobuf_c_boolean
+parse_repeated_member(ScannedMember *scanned_member,
+		      void *member,
+		      ProtobufCMessage *message,
+		      ProtobufCAllocator *allocator,
+		      unsigned flags)
+{
+	const ProtobufCFieldDescriptor *field = scanned_member->field;
+	size_t *p_n = STRUCT_MEMBER_PTR(size_t, message, field->quantifier_offset);
+	size_t siz = sizeof_elt_in_repeated_array(field->type);
+	RetainedStorage *retained = scanned_member->retained;
+	RetainedStorage spare = { NULL, 0, 0 };
+	char *array;
+	void *slot;
+	protobuf_c_boolean ok;
+
+	if (!reserve_array(member, siz, *p_n, 1, retained, allocator))
+		return FALSE;
+	array = *(char **) member;
+	slot = array + siz * (*p_n);
+	if (retained != NULL && *p_n < retained->n_spare) {
+		/* the slot still holds an element of the previous message */
+		switch (field->type) {
+		case PROTOBUF_C_TYPE_STRING:
+			spare.data = *(char **) slot;
+			if (spare.data != NULL)
+				spare.capacity = strlen(spare.data) + 1;
+			break;
+		case PROTOBUF_C_TYPE_BYTES:
+			spare.data = ((ProtobufCBinaryData *) slot)->data;
+			spare.capacity = ((ProtobufCBinaryData *) slot)->len;
+			break;
+		default:
+			spare.data = *(ProtobufCMessage **) slot;
+			break;
+		}
+		memset(slot, 0, siz);
+	}
+	ok = parse_required_member(scanned_member, slot, allocator, flags,
+				   FALSE, &spare);
+	if (spare.data != NULL) {
+		if (field->type == PROTOBUF_C_TYPE_MESSAGE)
+			protobuf_c_message_free_unpacked(spare.data, allocator);
+		else
+			do_free(allocator, spare.data);
+	}
+	if (!ok)
+		return FALSE;
+	*p_n += 1;
+	return TRUE;
+}
+
+static unsigned
+scan_varint(unsigned len, const uint8_t *data)
+{
+	unsigned i;
+	if (len > 10)
+		len = 10;
+	for (i = 0; i < len; i++)
+		if ((data[i] & 0x80) == 0)
+			break;
+	if (i == len)
+		return 0;
+	return i + 1;
+}
+
+/**
+ * Whether a repeated field is a packed fixed-width array that
+ * PROTOBUF_C_UNPACK_FLAG_ZERO_COPY may point straight into the input.
+ */
+static inline protobuf_c_boolean
+is_borrowable_array(const ProtobufCFieldDescriptor *field)
+{
+#if !defined(WORDS_BIGENDIAN)
+	switch (field->type) {
+	case PROTOBUF_C_TYPE_SFIXED32:
+	case PROTOBUF_C_TYPE_FIXED32:
+	case PROTOBUF_C_TYPE_FLOAT:
+	case PROTOBUF_C_TYPE_SFIXED64:
+	case PROTOBUF_C_TYPE_FIXED64:
+	case PROTOBUF_C_TYPE_DOUBLE:
+		return TRUE;
+	default:
+		break;
+	}
+#else
+	(void) field;
+#endif
+	return FALSE;
+}
+
+/**
+ * \defgroup packedvarint Packed varint array decoding
+ *
+ * Decoders for the payload of a packed repeated varint field. The element
+ * count has already been established by count_packed_elements(), so every
+ * decoder stores exactly one element per varint terminator and only has to
+ * reject varints that are longer than 10 bytes or run past the payload.
+ *
+ * On x86 the payload is examined 16 or 32 bytes at a time: a window whose
+ * bytes all lack the continuation bit holds as many single-byte varints,
+ * which are widened (and unzigzagged) in registers; otherwise the
+ * continuation bits of the window give the length of every varint that ends
+ * in it without a byte-by-byte scan.
+ *
+ * \ingroup internal
+ * @{
+ */
+
+/** How the varints of a packed array are turned into elements. */
+typedef enum {
+	PACKED_VARINT_32,		/**< int32, uint32 and enum */
+	PACKED_VARINT_ZIGZAG32,		/**< sint32 */
+	PACKED_VARINT_64,		/**< int64 and uint64 */
+	PACKED_VARINT_ZIGZAG64,		/**< sint64 */
+	PACKED_VARINT_BOOL		/**< bool */
+} PackedVarintKind;
+
+/**
+ * Store the `len`-byte varint at `at` as element `i` of `out`, exactly as the
+ * non-packed parsers would.
+ */
+static inline void
+store_packed_varint(PackedVarintKind kind, void *out, size_t i,
+		    unsigned len, const uint8_t *at)
+{
+	switch (kind) {
+	case PACKED_VARINT_32:
+		((uint32_t *) out)[i] = parse_uint32(len, at);
+		break;
+	case PACKED_VARINT_ZIGZAG32:
+		((int32_t *) out)[i] = unzigzag32(parse_uint32(len, at));
+		break;
+	case PACKED_VARINT_64:
+		((uint64_t *) out)[i] = parse_uint64(len, at);
+		break;
+	case PACKED_VARINT_ZIGZAG64:
+		((int64_t *) out)[i] = unzigzag64(parse_uint64(len, at));
+		break;
+	case PACKED_VARINT_BOOL:
+		((protobuf_c_boolean *) out)[i] = parse_boolean(len, at);
+		break;
+	}
+}
+
+static inline size_t
+sizeof_packed_varint(PackedVarintKind kind)
+{
+	switch (kind) {
+	case PACKED_VARINT_64:
+	case PACKED_VARINT_ZIGZAG64:
+		return 8;
+	case PACKED_VARINT_BOOL:
+		return sizeof(protobuf_c_boolean);
+	default:
+		return 4;
+	}
+}
+
+static protobuf_c_boolean
+decode_packed_varints_scalar(PackedVarintKind kind, size_t rem,
+			     const uint8_t *at, void *out, size_t *count)
+{
+	while (rem > 0) {
+		unsigned s = (at[0] & 0x80) == 0 ? 1 : scan_varint(rem, at);
+		if (s == 0)
+			return FALSE;
+		store_packed_varint(kind, out, (*count)++, s, at);
+		at += s;
+		rem -= s;
+	}
+	return TRUE;
+}
+
+#if defined(PROTOBUF_C_X86_SIMD)
+
+/**
+ * Decode the varints that end in a window starting at a varint boundary.
+ * Bit `n` of `term` is set if byte `n` of the window ends a varint.
+ *
+ * \return
+ *      Number of bytes consumed (up to and including the last terminator),
+ *      or 0 if the window contains a varint longer than 10 bytes.
+ */
+static inline size_t
+decode_varint_window(PackedVarintKind kind, const uint8_t *at, uint64_t term,
+		     void *out, size_t *count)
+{
+	size_t start = 0;
+
+	while (term != 0) {
+		unsigned end = __builtin_ctzll(term);
+		unsigned len = end + 1 - start;
+
+		if (len > MAX_UINT64_ENCODED_SIZE)
+			return 0;
+		store_packed_varint(kind, out, (*count)++, len, at + start);
+		start = end + 1;
+		term &= term - 1;
+	}
+	return start;
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i
+widen_single_byte_32_sse41(PackedVarintKind kind, __m128i bytes)
+{
+	__m128i v = _mm_cvtepu8_epi32(bytes);
+
+	if (kind == PACKED_VARINT_ZIGZAG32)
+		v = _mm_xor_si128(_mm_srli_epi32(v, 1),
+			_mm_sub_epi32(_mm_setzero_si128(),
+				      _mm_and_si128(v, _mm_set1_epi32(1))));
+	else if (kind == PACKED_VARINT_BOOL)
+		v = _mm_andnot_si128(_mm_cmpeq_epi32(v, _mm_setzero_si128()),
+				     _mm_set1_epi32(1));
+	return v;
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i
+widen_single_byte_64_sse41(PackedVarintKind kind, __m128i bytes)
+{
+	__m128i v = _mm_cvtepu8_epi64(bytes);
+
+	if (kind == PACKED_VARINT_ZIGZAG64)
+		v = _mm_xor_si128(_mm_srli_epi64(v, 1),
+			_mm_sub_epi64(_mm_setzero_si128(),
+				      _mm_and_si128(v, _mm_set1_epi64x(1))));
+	return v;
+}
+
+__attribute__((target("sse4.1")))
+static protobuf_c_boolean
+decode_packed_varints_sse41(PackedVarintKind kind, size_t rem,
+			    const uint8_t *at, void *out, size_t *count)
+{
+	while (rem >= 16) {
+		__m128i bytes = _mm_loadu_si128((const __m128i *) at);
+		unsigned cont = _mm_movemask_epi8(bytes);
+		size_t used;
+
+		if (cont == 0) {
+			if (sizeof_packed_varint(kind) == 4) {
+				__m128i *dst = (__m128i *) ((uint32_t *) out + *count);
+				_mm_storeu_si128(dst + 0, widen_single_byte_32_sse41(kind, bytes));
+				_mm_storeu_si128(dst + 1, widen_single_byte_32_sse41(kind, _mm_srli_si128(bytes, 4)));
+				_mm_storeu_si128(dst + 2, widen_single_byte_32_sse41(kind, _mm_srli_si128(bytes, 8)));
+				_mm_storeu_si128(dst + 3, widen_single_byte_32_sse41(kind, _mm_srli_si128(bytes, 12)));
+			} else {
+				__m128i *dst = (__m128i *) ((uint64_t *) out + *count);
+				_mm_storeu_si128(dst + 0, widen_single_byte_64_sse41(kind, bytes));
+				_mm_storeu_si128(dst + 1, widen_single_byte_64_sse41(kind, _mm_srli_si128(bytes, 2)));
+				_mm_storeu_si128(dst + 2, widen_single_byte_64_sse41(kind, _mm_srli_si128(bytes, 4)));
+				_mm_storeu_si128(dst + 3, widen_single_byte_64_sse41(kind, _mm_srli_si128(bytes, 6)));
+				_mm_storeu_si128(dst + 4, widen_single_byte_64_sse41(kind, _mm_srli_si128(bytes, 8)));
+				_mm_storeu_si128(dst + 5, widen_single_byte_64_sse41(kind, _mm_srli_si128(bytes, 10)));
+				_mm_storeu_si128(dst + 6, widen_single_byte_64_sse41(kind, _mm_srli_si128(bytes, 12)));
+				_mm_storeu_si128(dst + 7, widen_single_byte_64_sse41(kind, _mm_srli_si128(bytes, 14)));
+			}
+			*count += 16;
+			at += 16;
+			rem -= 16;
+			continue;
+		}
+		used = decode_varint_window(kind, at, ~cont & 0xffff, out, count);
+		if (used == 0)
+			return FALSE;
+		at += used;
+		rem -= used;
+	}
+	return decode_packed_varints_scalar(kind, rem, at, out, count);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+widen_single_byte_32_avx2(PackedVarintKind kind, __m128i bytes)
+{
+	__m256i v = _mm256_cvtepu8_epi32(bytes);
+
+	if (kind == PACKED_VARINT_ZIGZAG32)
+		v = _mm256_xor_si256(_mm256_srli_epi32(v, 1),
+			_mm256_sub_epi32(_mm256_setzero_si256(),
+					 _mm256_and_si256(v, _mm256_set1_epi32(1))));
+	else if (kind == PACKED_VARINT_BOOL)
+		v = _mm256_andnot_si256(_mm256_cmpeq_epi32(v, _mm256_setzero_si256()),
+					_mm256_set1_epi32(1));
+	return v;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+widen_single_byte_64_avx2(PackedVarintKind kind, __m128i bytes)
+{
+	__m256i v = _mm256_cvtepu8_epi64(bytes);
+
+	if (kind == PACKED_VARINT_ZIGZAG64)
+		v = _mm256_xor_si256(_mm256_srli_epi64(v, 1),
+			_mm256_sub_epi64(_mm256_setzero_si256(),
+					 _mm256_and_si256(v, _mm256_set1_epi64x(1))));
+	return v;
+}
+
+__attribute__((target("avx2")))
+static protobuf_c_boolean
+decode_packed_varints_avx2(PackedVarintKind kind, size_t rem,
+			   const uint8_t *at, void *out, size_t *count)
+{
+	while (rem >= 32) {
+		__m256i bytes = _mm256_loadu_si256((const __m256i *) at);
+		uint32_t cont = (uint32_t) _mm256_movemask_epi8(bytes);
+		size_t used;
+
+		if (cont == 0) {
+			__m128i lo = _mm256_castsi256_si128(bytes);
+			__m128i hi = _mm256_extracti128_si256(bytes, 1);
+
+			if (sizeof_packed_varint(kind) == 4) {
+				__m256i *dst = (__m256i *) ((uint32_t *) out + *count);
+				_mm256_storeu_si256(dst + 0, widen_single_byte_32_avx2(kind, lo));
+				_mm256_storeu_si256(dst + 1, widen_single_byte_32_avx2(kind, _mm_srli_si128(lo, 8)));
+				_mm256_storeu_si256(dst + 2, widen_single_byte_32_avx2(kind, hi));
+				_mm256_storeu_si256(dst + 3, widen_single_byte_32_avx2(kind, _mm_srli_si128(hi, 8)));
+			} else {
+				__m256i *dst = (__m256i *) ((uint64_t *) out + *count);
+				_mm256_storeu_si256(dst + 0, widen_single_byte_64_avx2(kind, lo));
+				_mm256_storeu_si256(dst + 1, widen_single_byte_64_avx2(kind, _mm_srli_si128(lo, 4)));
+				_mm256_storeu_si256(dst + 2, widen_single_byte_64_avx2(kind, _mm_srli_si128(lo, 8)));
+				_mm256_storeu_si256(dst + 3, widen_single_byte_64_avx2(kind, _mm_srli_si128(lo, 12)));
+				_mm256_storeu_si256(dst + 4, widen_single_byte_64_avx2(kind, hi));
+				_mm256_storeu_si256(dst + 5, widen_single_byte_64_avx2(kind, _mm_srli_si128(hi, 4)));
+				_mm256_storeu_si256(dst + 6, widen_single_byte_64_avx2(kind, _mm_srli_si128(hi, 8)));
+				_mm256_storeu_si256(dst + 7, widen_single_byte_64_avx2(kind, _mm_srli_si128(hi, 12)));
+			}
+			*count += 32;
+			at += 32;
+			rem -= 32;
+			continue;
+		}
+		used = decode_varint_window(kind, at, ~cont, out, count);
+		if (used == 0)
+			return FALSE;
+		at += used;
+		rem -= used;
+	}
+	return decode_packed_varints_sse41(kind, rem, at, out, count);
+}
+
+#endif /* PROTOBUF_C_X86_SIMD */
+
+/**
+ * Decode the `rem` bytes of packed varints at `at` into the array `out`,
+ * using the widest kernel the CPU supports.
+ *
+ * \param[in,out] count
+ *      Incremented for each element stored in `out`.
+ * \return
+ *      TRUE on success, FALSE if a varint is malformed.
+ */
+static protobuf_c_boolean
+decode_packed_varints(PackedVarintKind kind, size_t rem,
+		      const uint8_t *at, void *out, size_t *count)
+{
+#if defined(PROTOBUF_C_X86_SIMD)
+	if (rem >= 16) {
+		switch (get_simd_level()) {
+		case SIMD_LEVEL_AVX2:
+			return decode_packed_varints_avx2(kind, rem, at, out, count);
+		case SIMD_LEVEL_SSE41:
+			return decode_packed_varints_sse41(kind, rem, at, out, count);
+		default:
+			break;
+		}
+	}
+#endif
+	return decode_packed_varints_scalar(kind, rem, at, out, count);
+}
+
+/**@}*/
+
+static protobuf_c_boolean
+parse_packed_repeated_member(ScannedMember *scanned_member,
+			     void *member,
+			     ProtobufCMessage *message,
+			     ProtobufCAllocator *allocator,
+			     unsigned flags)
+{
+	const ProtobufCFieldDescriptor *field = scanned_member->field;
+	size_t *p_n = STRUCT_MEMBER_PTR(size_t, message, field->quantifier_offset);
+	size_t siz = sizeof_elt_in_repeated_array(field->type);
+	void *array;
+	const uint8_t *at = scanned_member->data + scanned_member->length_prefix_len;
+	size_t rem = scanned_member->len - scanned_member->length_prefix_len;
+	size_t count = 0;
+	size_t n_elements;
+#if defined(WORDS_BIGENDIAN)
+	unsigned i;
+#endif
+
+	if (!count_packed_elements(field->type, rem, at, &n_elements))
+		return FALSE;
+#if !defined(WORDS_BIGENDIAN)
+	/*
+	 * Zero-copy: point the first chunk of a fixed-width array into the
+	 * input if it is suitably aligned.
+	 */
+	if ((flags & PROTOBUF_C_UNPACK_FLAG_ZERO_COPY) &&
+	    *p_n == 0 && n_elements != 0 &&
+	    is_borrowable_array(field) && ((uintptr_t) at % siz) == 0)
+	{
+		*(const uint8_t **) member = at;
+		*p_n = n_elements;
+		return TRUE;
+	}
+#else
+	(void) flags;
+#endif
+	if (!reserve_array(member, siz, *p_n, n_elements,
+			   scanned_member->retained, allocator))
+		return FALSE;
+	array = *(char **) member + siz * (*p_n);
+
+	switch (field->type) {
+	case PROTOBUF_C_TYPE_SFIXED32:
+	case PROTOBUF_C_TYPE_FIXED32:
+	case PROTOBUF_C_TYPE_FLOAT:
+		count = (scanned_member->len - scanned_member->length_prefix_len) / 4;
+#if !defined(WORDS_BIGENDIAN)
+		goto no_unpacking_needed;
+#else
+		for (i = 0; i < count; i++) {
+			((uint32_t *) array)[i] = parse_fixed_uint32(at);
+			at += 4;
+		}
+		break;
+#endif
+	case PROTOBUF_C_TYPE_SFIXED64:
+	case PROTOBUF_C_TYPE_FIXED64:
+	case PROTOBUF_C_TYPE_DOUBLE:
+		count = (scanned_member->len - scanned_member->length_prefix_len) / 8;
+#if !defined(WORDS_BIGENDIAN)
+		goto no_unpacking_needed;
+#else
+		for (i = 0; i < count; i++) {
+			((uint64_t *) array)[i] = parse_fixed_uint64(at);
+			at += 8;
+		}
+		break;
+#endif
+	case PROTOBUF_C_TYPE_ENUM:
+	case PROTOBUF_C_TYPE_INT32:
+		if (!decode_packed_varints(PACKED_VARINT_32, rem, at, array, &count)) {
+			PROTOBUF_C_UNPACK_ERROR("bad packed-repeated int32 value");
+			return FALSE;
+		}
+		break;
+	case PROTOBUF_C_TYPE_SINT32:
+		if (!decode_packed_varints(PACKED_VARINT_ZIGZAG32, rem, at, array, &count)) {
+			PROTOBUF_C_UNPACK_ERROR("bad packed-repeated sint32 value");
+			return FALSE;
+		}
+		break;
+	case PROTOBUF_C_TYPE_UINT32:
+		if (!decode_packed_varints(PACKED_VARINT_32, rem, at, array, &count)) {
+			PROTOBUF_C_UNPACK_ERROR("bad packed-repeated enum or uint32 value");
+			return FALSE;
+		}
+		break;
+
+	case PROTOBUF_C_TYPE_SINT64:
+		if (!decode_packed_varints(PACKED_VARINT_ZIGZAG64, rem, at, array, &count)) {
+			PROTOBUF_C_UNPACK_ERROR("bad packed-repeated sint64 value");
+			return FALSE;
+		}
+		break;
+	case PROTOBUF_C_TYPE_INT64:
+	case PROTOBUF_C_TYPE_UINT64:
+		if (!decode_packed_varints(PACKED_VARINT_64, rem, at, array, &count)) {
+			PROTOBUF_C_UNPACK_ERROR("bad packed-repeated int64/uint64 value");
+			return FALSE;
+		}
+		break;
+	case PROTOBUF_C_TYPE_BOOL:
+		if (!decode_packed_varints(PACKED_VARINT_BOOL, rem, at, array, &count)) {
+			PROTOBUF_C_UNPACK_ERROR("bad packed-repeated boolean value");
+			return FALSE;
+		}
+		break;
+	default:
+		PROTOBUF_C__ASSERT_NOT_REACHED();
+	}
+	*p_n += count;
+	return TRUE;
+
+#if !defined(WORDS_BIGENDIAN)
+no_unpacking_needed:
+	memcpy(array, at, count * siz);
+	*p_n += count;
+	return TRUE;
+#endif
+}
+
+static protobuf_c_boolean
+is_packable_type(ProtobufCType type)
+{
+	return
+		type != PROTOBUF_C_TYPE_STRING &&
+		type != PROTOBUF_C_TYPE_BYTES &&
+		type != PROTOBUF_C_TYPE_MESSAGE;
+}
+
+/**
+ * Whether unknown fields of a message of type `desc` are skipped rather than
+ * kept in `unknown_fields`.
+ */
+static inline protobuf_c_boolean
+discards_unknown_fields(const ProtobufCMessageDescriptor *desc, unsigned flags)
+{
+	return (flags & PROTOBUF_C_UNPACK_FLAG_DISCARD_UNKNOWN) != 0 ||
+		((uintptr_t) desc->reserved3 &
+		 PROTOBUF_C_MESSAGE_FLAG_DISCARD_UNKNOWN) != 0;
+}
+
+/**
+ * Copy the data of the unknown fields of a message from `first` on, which is
+ * borrowed from the input, into one new block. The block holds each field as
+ * it is packed, tag and data, so that the fields follow each other and
+ * protobuf_c_message_pack() can copy them all at once.
+ *
+ * On failure the data is left borrowed.
+ */
+static protobuf_c_boolean
+copy_unknown_fields(ProtobufCMessage *message, unsigned first,
+		    ProtobufCAllocator *allocator)
+{
+	ProtobufCMessageUnknownField *fields = message->unknown_fields;
+	unsigned n = message->n_unknown_fields;
+	size_t size = 0;
+	uint8_t *block;
+	unsigned i;
+
+	for (i = first; i < n; i++)
+		size += unknown_field_get_packed_size(fields + i);
+	block = do_alloc(allocator, size);
+	if (block == NULL)
+		return FALSE;
+	if (first > 0 && allocator->free != &arena_free &&
+	    block == fields[first - 1].data + fields[first - 1].len)
+	{
+		/*
+		 * free_unknown_field_data() would take the block for part of
+		 * the previous one: get another.
+		 */
+		uint8_t *other = do_alloc(allocator, size);
+
+		do_free(allocator, block);
+		if (other == NULL)
+			return FALSE;
+		block = other;
+	}
+	for (i = first; i < n; i++) {
+		size_t tag_len = tag_pack(fields[i].tag, block);
+
+		block[0] |= fields[i].wire_type;
+		memcpy(block + tag_len, fields[i].data, fields[i].len);
+		fields[i].data = block + tag_len;
+		block += tag_len + fields[i].len;
+	}
+	return TRUE;
+}
+
+static protobuf_c_boolean
+parse_member(ScannedMember *scanned_member,
+	     ProtobufCMessage *message,
+	     ProtobufCAllocator *allocator,
+	     unsigned flags)
+{
+	const ProtobufCFieldDescriptor *field = scanned_member->field;
+	void *member;
+
+	if (field == NULL) {
+		ProtobufCMessageUnknownField *ufield;
+
+		if (discards_unknown_fields(message->descriptor, flags))
+			return TRUE;
+		if (!reserve_array((void **) &message->unknown_fields,
+				   sizeof(ProtobufCMessageUnknownField),
+				   message->n_unknown_fields, 1,
+				   scanned_member->retained, allocator))
+			return FALSE;
+		ufield = message->unknown_fields + message->n_unknown_fields;
+		ufield->tag = scanned_member->tag;
+		ufield->wire_type = scanned_member->wire_type;
+		ufield->len = scanned_member->len;
+		ufield->data = (uint8_t *) scanned_member->data;
+		message->n_unknown_fields++;
+		if (!(flags & PROTOBUF_C_UNPACK_FLAG_ZERO_COPY) &&
+		    !copy_unknown_fields(message, message->n_unknown_fields - 1,
+					 allocator))
+		{
+			message->n_unknown_fields--;
+			return FALSE;
+		}
+		return TRUE;
+	}
+	member = (char *) message + field->offset;
+	switch (field->label) {
+	case PROTOBUF_C_LABEL_REQUIRED:
+		return parse_required_member(scanned_member, member,
+					     allocator, flags, TRUE,
+					     scanned_member->retained);
+	case PROTOBUF_C_LABEL_OPTIONAL:
+	case PROTOBUF_C_LABEL_NONE:
+		if (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_ONEOF)) {
+			return parse_oneof_member(scanned_member, member,
+						  message, allocator, flags);
+		} else {
+			return parse_optional_member(scanned_member, member,
+						     message, allocator, flags);
+		}
+	case PROTOBUF_C_LABEL_REPEATED:
+		if (scanned_member->wire_type ==
+		    PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED &&
+		    (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_PACKED) ||
+		     is_packable_type(field->type)))
+		{
+			return parse_packed_repeated_member(scanned_member,
+							    member, message,
+							    allocator, flags);
+		} else {
+			return parse_repeated_member(scanned_member,
+						     member, message,
+						     allocator, flags);
+		}
+	}
+	PROTOBUF_C__ASSERT_NOT_REACHED();
+	return 0;
+}
+
+/**
+ * Initialise messages generated by old code.
+ *
+ * This function is used if desc->message_init == NULL (which occurs
+ * for old code, and which would be useful to support allocating
+ * descriptors dynamically).
+ */
+static void
+message_init_generic(const ProtobufCMessageDescriptor *desc,
+		     ProtobufCMessage *message)
+{
+	unsigned i;
+
+	memset(message, 0, desc->sizeof_message);
+	message->descriptor = desc;
+	for (i = 0; i < desc->n_fields; i++) {
+		if (desc->fields[i].default_value != NULL &&
+		    desc->fields[i].label != PROTOBUF_C_LABEL_REPEATED)
+		{
+			void *field =
+				STRUCT_MEMBER_P(message, desc->fields[i].offset);
+			const void *dv = desc->fields[i].default_value;
+
+			switch (desc->fields[i].type) {
+			case PROTOBUF_C_TYPE_INT32:
+			case PROTOBUF_C_TYPE_SINT32:
+			case PROTOBUF_C_TYPE_SFIXED32:
+			case PROTOBUF_C_TYPE_UINT32:
+			case PROTOBUF_C_TYPE_FIXED32:
+			case PROTOBUF_C_TYPE_FLOAT:
+			case PROTOBUF_C_TYPE_ENUM:
+				memcpy(field, dv, 4);
+				break;
+			case PROTOBUF_C_TYPE_INT64:
+			case PROTOBUF_C_TYPE_SINT64:
+			case PROTOBUF_C_TYPE_SFIXED64:
+			case PROTOBUF_C_TYPE_UINT64:
+			case PROTOBUF_C_TYPE_FIXED64:
+			case PROTOBUF_C_TYPE_DOUBLE:
+				memcpy(field, dv, 8);
+				break;
+			case PROTOBUF_C_TYPE_BOOL:
+				memcpy(field, dv, sizeof(protobuf_c_boolean));
+				break;
+			case PROTOBUF_C_TYPE_BYTES:
+				memcpy(field, dv, sizeof(ProtobufCBinaryData));
+				break;
+
+			case PROTOBUF_C_TYPE_STRING:
+			case PROTOBUF_C_TYPE_MESSAGE:
+				/*
+				 * The next line essentially implements a cast
+				 * from const, which is totally unavoidable.
+				 */
+				*(const void **) field = dv;
+				break;
+			}
+		}
+	}
+}
+
+/**@}*/
+
+/*
+ * Unpacking is done in a single pass over the input, without keeping a record
+ * per wire field: each field is parsed into the message as soon as its extent
+ * is known. Repeated fields and unknown fields are appended to arrays that
+ * grow geometrically (see repeated_capacity()), so a message with a million
+ * repeated elements needs no scratch memory beyond the arrays themselves.
+ */
+
+#define REQUIRED_FIELD_BITMAP_SET(index)	\
+	(required_fields_bitmap[(index)/8] |= (1UL<<((index)%8)))
+
+#define REQUIRED_FIELD_BITMAP_IS_SET(index)	\
+	(required_fields_bitmap[(index)/8] & (1UL<<((index)%8)))
+
+#define BORROWED_FIELD_BITMAP_SET(index)	\
+	(borrowed_fields_bitmap[(index)/8] |= (1UL<<((index)%8)))
+
+#define BORROWED_FIELD_BITMAP_CLEAR(index)	\
+	(borrowed_fields_bitmap[(index)/8] &= ~(1UL<<((index)%8)))
+
+#define BORROWED_FIELD_BITMAP_IS_SET(index)	\
+	(borrowed_fields_bitmap[(index)/8] & (1UL<<((index)%8)))
+
+/**
+ * Find the extent of the data of a field whose tag has already been read.
+ *
+ * \param rem
+ *      Number of bytes left in the message after the tag.
+ * \param at
+ *      Start of the field data.
+ * \param[in,out] member
+ *      The field, with `wire_type` filled in. `data`, `len` and
+ *      `length_prefix_len` are set.
+ * \return
+ *      Number of bytes taken up by the field data.
+ * \retval 0
+ *      If the field is malformed.
+ */
+static inline size_t
+scan_member_data(size_t rem, const uint8_t *at, ScannedMember *member)
+{
+	member->data = at;
+	member->length_prefix_len = 0;
+
+	switch (member->wire_type) {
+	case PROTOBUF_C_WIRE_TYPE_VARINT: {
+		unsigned max_len = rem < 10 ? rem : 10;
+		unsigned i;
+
+		for (i = 0; i < max_len; i++)
+			if ((at[i] & 0x80) == 0)
+				break;
+		if (i == max_len) {
+			PROTOBUF_C_UNPACK_ERROR("unterminated varint");
+			return 0;
+		}
+		member->len = i + 1;
+		break;
+	}
+	case PROTOBUF_C_WIRE_TYPE_64BIT:
+		if (rem < 8) {
+			PROTOBUF_C_UNPACK_ERROR("too short after 64bit wiretype");
+			return 0;
+		}
+		member->len = 8;
+		break;
+	case PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED: {
+		size_t pref_len;
+
+		member->len = scan_length_prefixed_data(rem, at, &pref_len);
+		if (member->len == 0) {
+			/* NOTE: scan_length_prefixed_data calls UNPACK_ERROR */
+			return 0;
+		}
+		member->length_prefix_len = pref_len;
+		break;
+	}
+	case PROTOBUF_C_WIRE_TYPE_32BIT:
+		if (rem < 4) {
+			PROTOBUF_C_UNPACK_ERROR("too short after 32bit wiretype");
+			return 0;
+		}
+		member->len = 4;
+		break;
+	default:
+		PROTOBUF_C_UNPACK_ERROR("unsupported tag %u",
+					member->wire_type);
+		return 0;
+	}
+	return member->len;
+}
+
+/**
+ * Read the tag, wire type and extent of the field starting at `at`.
+ *
+ * \param rem
+ *      Number of bytes left in the message.
+ * \param at
+ *      Start of the field.
+ * \param[out] member
+ *      The field. `field` is left for the caller to fill in.
+ * \return
+ *      Number of bytes taken up by the tag and the field.
+ * \retval 0
+ *      If the field is malformed.
+ */
+static inline size_t
+scan_member(size_t rem, const uint8_t *at, ScannedMember *member)
+{
+	uint32_t tag;
+	uint8_t wire_type;
+	size_t used = parse_tag_and_wiretype(rem, at, &tag, &wire_type);
+
+	if (used == 0) {
+		PROTOBUF_C_UNPACK_ERROR("error parsing tag/wiretype");
+		return 0;
+	}
+	member->tag = tag;
+	member->wire_type = wire_type;
+	if (scan_member_data(rem - used, at + used, member) == 0)
+		return 0;
+	return used + member->len;
+}
+
+/**
+ * Look up the field whose encoded tag starts at `at` in a field table.
+ *
+ * \return
+ *      The matching entry, or NULL if the tag is not in the table, in which
+ *      case the field must be looked up with find_field_index().
+ */
+static inline const ProtobufCFieldTableEntry *
+field_table_lookup(const ProtobufCFieldTableEntry *table,
+		   size_t rem, const uint8_t *at)
+{
+	const ProtobufCFieldTableEntry *entry = table + ((at[0] >> 3) & 0x1f);
+
+	if (entry->tag_len == 1) {
+		if (at[0] == entry->encoded_tag)
+			return entry;
+	} else if (entry->tag_len == 2) {
+		if (rem >= 2 &&
+		    (at[0] | ((unsigned) at[1] << 8)) == entry->encoded_tag)
+			return entry;
+	}
+	return NULL;
+}
+
+/**
+ * Decode a singular scalar field straight into the message, for a field
+ * table entry whose op is not `PROTOBUF_C_FIELD_TABLE_OP_GENERIC`. The tag
+ * has already been matched, so the wire type is known to be right.
+ *
+ * \param rem
+ *      Number of bytes left in the message after the tag.
+ * \param at
+ *      Start of the field data.
+ * \return
+ *      Number of bytes taken up by the field data.
+ * \retval 0
+ *      If the field is malformed.
+ */
+static inline size_t
+parse_table_member(const ProtobufCFieldTableEntry *entry,
+		   const ProtobufCFieldDescriptor *field,
+		   ProtobufCMessage *message,
+		   size_t rem, const uint8_t *at)
+{
+	void *member = (char *) message + field->offset;
+	unsigned len;
+
+	switch (entry->op) {
+	case PROTOBUF_C_FIELD_TABLE_OP_FIXED32:
+		if (rem < 4) {
+			PROTOBUF_C_UNPACK_ERROR("too short after 32bit wiretype");
+			return 0;
+		}
+		*(uint32_t *) member = parse_fixed_uint32(at);
+		len = 4;
+		break;
+	case PROTOBUF_C_FIELD_TABLE_OP_FIXED64:
+		if (rem < 8) {
+			PROTOBUF_C_UNPACK_ERROR("too short after 64bit wiretype");
+			return 0;
+		}
+		*(uint64_t *) member = parse_fixed_uint64(at);
+		len = 8;
+		break;
+	default: {
+		unsigned max_len = rem < 10 ? rem : 10;
+
+		for (len = 0; len < max_len; len++)
+			if ((at[len] & 0x80) == 0)
+				break;
+		if (len == max_len) {
+			PROTOBUF_C_UNPACK_ERROR("unterminated varint");
+			return 0;
+		}
+		len++;
+
+		switch (entry->op) {
+		case PROTOBUF_C_FIELD_TABLE_OP_VARINT32:
+			*(uint32_t *) member = parse_uint32(len, at);
+			break;
+		case PROTOBUF_C_FIELD_TABLE_OP_SINT32:
+			*(int32_t *) member = unzigzag32(parse_uint32(len, at));
+			break;
+		case PROTOBUF_C_FIELD_TABLE_OP_VARINT64:
+			*(uint64_t *) member = parse_uint64(len, at);
+			break;
+		case PROTOBUF_C_FIELD_TABLE_OP_SINT64:
+			*(int64_t *) member = unzigzag64(parse_uint64(len, at));
+			break;
+		case PROTOBUF_C_FIELD_TABLE_OP_BOOL:
+			*(protobuf_c_boolean *) member = parse_boolean(len, at);
+			break;
+		default:
+			PROTOBUF_C_UNPACK_ERROR("bad field table op %u for %s",
+						entry->op, field->name);
+			return 0;
+		}
+	}
+	}
+	if (field->quantifier_offset != 0)
+		STRUCT_MEMBER(protobuf_c_boolean, message,
+			      field->quantifier_offset) = TRUE;
+	return len;
+}
+
+/**
+ * Find the index of the field with number `tag` in `desc->fields`.
+ *
+ * \param desc
+ *      The message descriptor.
+ * \param tag
+ *      The field number.
+ * \param last_index
+ *      Index of the previously seen field. Fields are usually packed in
+ *      order, and repeated fields come back to back, so this field and the
+ *      one after it are checked first.
+ * \return
+ *      The field index, or -1 if the field is unknown.
+ */
+static inline int
+find_field_index(const ProtobufCMessageDescriptor *desc,
+		 uint32_t tag, unsigned last_index)
+{
+	const uint16_t *index_table = desc->reserved2;
+
+	if (last_index < desc->n_fields) {
+		if (desc->fields[last_index].id == tag)
+			return last_index;
+		if (last_index + 1 < desc->n_fields &&
+		    desc->fields[last_index + 1].id == tag)
+			return last_index + 1;
+	}
+	if (index_table != NULL) {
+		uint16_t index;
+
+		if (tag > desc->fields[desc->n_fields - 1].id)
+			return -1;
+		index = index_table[tag];
+		return index == PROTOBUF_C_FIELD_INDEX_NONE ? -1 : (int) index;
+	}
+	return int_range_lookup(desc->n_field_ranges, desc->field_ranges, tag);
+}
+
+/**
+ * Give a zero-copy array borrowed from the input an allocated copy, so that
+ * more elements can be appended to it.
+ */
+static protobuf_c_boolean
+unborrow_array(const ProtobufCFieldDescriptor *field,
+	       ProtobufCMessage *message,
+	       ProtobufCAllocator *allocator)
+{
+	size_t n = STRUCT_MEMBER(size_t, message, field->quantifier_offset);
+	size_t siz = sizeof_elt_in_repeated_array(field->type);
+	void **parray = STRUCT_MEMBER_PTR(void *, message, field->offset);
+	void *array;
+
+	array = do_alloc(allocator, repeated_capacity(n) * siz);
+	if (array == NULL)
+		return FALSE;
+	memcpy(array, *parray, n * siz);
+	*parray = array;
+	return TRUE;
+}
+
+/**
+ * Give every non-empty array of a zero-copy message that could be borrowed
+ * from the input an allocated copy, before more of the message is parsed
+ * into it. Copying an array that was allocated already only costs room in
+ * the arena zero-copy unpacking takes place in.
+ */
+static protobuf_c_boolean
+unborrow_arrays(ProtobufCMessage *message, ProtobufCAllocator *allocator)
+{
+	const ProtobufCMessageDescriptor *desc = message->descriptor;
+	unsigned f;
+
+	for (f = 0; f < desc->n_fields; f++) {
+		const ProtobufCFieldDescriptor *field = desc->fields + f;
+
+		if (field->label == PROTOBUF_C_LABEL_REPEATED &&
+		    is_borrowable_array(field) &&
+		    STRUCT_MEMBER(size_t, message, field->quantifier_offset) != 0 &&
+		    !unborrow_array(field, message, allocator))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * Reverse the jobs queued by the message being parsed, so that they are
+ * taken off the stack in the order their fields came in. The order matters
+ * when several occurrences of a field are merged into the same message.
+ */
+static void
+reverse_unpack_jobs(ProtobufCUnpackContext *context)
+{
+	UnpackJob *jobs = context->jobs;
+	size_t i = context->jobs_base;
+	size_t j = context->n_jobs;
+
+	while (i + 1 < j) {
+		UnpackJob tmp = jobs[i];
+
+		jobs[i++] = jobs[--j];
+		jobs[j] = tmp;
+	}
+}
+
+/**
+ * Parse the sub-messages queued by the outermost message, and all those they
+ * queue in turn, depth first.
+ */
+static protobuf_c_boolean
+run_unpack_jobs(ProtobufCUnpackContext *context,
+		ProtobufCAllocator *allocator,
+		unsigned flags)
+{
+	size_t base = context->jobs_base;
+	unsigned depth = context->depth;
+
+	while (context->n_jobs > base) {
+		/* the stack may move while the job runs */
+		UnpackJob job = ((UnpackJob *) context->jobs)[--context->n_jobs];
+
+		if (job.message == NULL)
+			continue;
+		context->depth = job.depth;
+		/* an earlier job may have left it arrays borrowed from the input */
+		if ((flags & PROTOBUF_C_UNPACK_FLAG_ZERO_COPY) &&
+		    !unborrow_arrays(job.message, allocator))
+		{
+			context->depth = depth;
+			return FALSE;
+		}
+		if (!message_unpack_fields(job.message, allocator, flags,
+					   context, job.len, job.data,
+					   NULL, NULL))
+		{
+			context->depth = depth;
+			return FALSE;
+		}
+	}
+	context->depth = depth;
+	return TRUE;
+}
+
+/**
+ * Parse the fields of a serialised message into `rv`, which has been
+ * initialised to its default values, or already holds fields to merge the
+ * message into.
+ *
+ * With a context, sub-messages are queued rather than parsed recursively.
+ * The outermost call parses them all before returning.
+ *
+ * \param context
+ *      Context of a protobuf_c_message_unpack_with_context() call, which
+ *      provides scratch memory and limits the nesting depth, or NULL.
+ * \param retained
+ *      Storage taken from the previous contents of `rv`, one entry per field
+ *      followed by one for the unknown fields, or NULL.
+ * \param mask
+ *      The fields to decode, or NULL for all of them.
+ * \return
+ *      TRUE on success. On failure `rv` may be partially filled in, and
+ *      needs to be freed or cleared.
+ */
+static protobuf_c_boolean
+message_unpack_fields(ProtobufCMessage *rv,
+		      ProtobufCAllocator *allocator,
+		      unsigned flags,
+		      ProtobufCUnpackContext *context,
+		      size_t len, const uint8_t *data,
+		      RetainedStorage *retained,
+		      const ProtobufCFieldMask *mask)
+{
+	const ProtobufCMessageDescriptor *desc = rv->descriptor;
+	size_t rem = len;
+	const uint8_t *at = data;
+	unsigned f;
+	unsigned last_field_index = 0;
+	unsigned required_fields_bitmap_len;
+	unsigned char required_fields_bitmap_stack[16];
+	unsigned char *required_fields_bitmap = required_fields_bitmap_stack;
+	protobuf_c_boolean required_fields_bitmap_alloced = FALSE;
+	/* with PROTOBUF_C_UNPACK_FLAG_ZERO_COPY, fields borrowed from `data` */
+	unsigned char *borrowed_fields_bitmap = NULL;
+	/* the field table decodes fields before the mask could be consulted */
+	const ProtobufCFieldTableEntry *field_table =
+		mask == NULL ? desc->reserved1 : NULL;
+	/* unknown fields are borrowed from `data` until they are all parsed */
+	unsigned first_unknown = rv->n_unknown_fields;
+	protobuf_c_boolean outermost = FALSE;
+	size_t jobs_base = 0;
+
+	if (context != NULL) {
+		if (context->max_depth != 0 &&
+		    context->depth >= context->max_depth)
+		{
+			PROTOBUF_C_UNPACK_ERROR("message '%s' nested more than %u deep",
+						desc->name, context->max_depth);
+			return FALSE;
+		}
+		outermost = context->depth == 0;
+		context->depth++;
+		if (context->depth > context->stats.max_depth)
+			context->stats.max_depth = context->depth;
+		jobs_base = context->jobs_base;
+		context->jobs_base = context->n_jobs;
+	}
+
+	required_fields_bitmap_len = (desc->n_fields + 7) / 8;
+	if (flags & PROTOBUF_C_UNPACK_FLAG_ZERO_COPY)
+		required_fields_bitmap_len *= 2;
+	if (required_fields_bitmap_len > sizeof(required_fields_bitmap_stack)) {
+		if (context != NULL) {
+			/* released by the context after the whole call */
+			required_fields_bitmap =
+				do_alloc(&context->scratch.base,
+					 required_fields_bitmap_len);
+		} else {
+			required_fields_bitmap =
+				do_alloc(allocator, required_fields_bitmap_len);
+			required_fields_bitmap_alloced = TRUE;
+		}
+		if (!required_fields_bitmap) {
+			required_fields_bitmap_alloced = FALSE;
+			goto error_cleanup;
+		}
+	}
+	memset(required_fields_bitmap, 0, required_fields_bitmap_len);
+	if (flags & PROTOBUF_C_UNPACK_FLAG_ZERO_COPY)
+		borrowed_fields_bitmap = required_fields_bitmap +
+			required_fields_bitmap_len / 2;
+
+	while (rem > 0) {
+		ScannedMember tmp;
+		const ProtobufCFieldTableEntry *entry = NULL;
+		size_t used;
+		int field_index;
+		protobuf_c_boolean borrowable;
+
+		if (field_table != NULL)
+			entry = field_table_lookup(field_table, rem, at);
+		if (entry != NULL) {
+			field_index = entry->field_index;
+			tmp.field = desc->fields + field_index;
+			if (entry->op != PROTOBUF_C_FIELD_TABLE_OP_GENERIC) {
+				used = parse_table_member(entry, tmp.field, rv,
+							  rem - entry->tag_len,
+							  at + entry->tag_len);
+				if (used == 0) {
+					PROTOBUF_C_UNPACK_ERROR("error parsing member %s of %s",
+								tmp.field->name, desc->name);
+					goto error_cleanup;
+				}
+				if (tmp.field->label == PROTOBUF_C_LABEL_REQUIRED)
+					REQUIRED_FIELD_BITMAP_SET(field_index);
+				last_field_index = field_index;
+				used += entry->tag_len;
+				at += used;
+				rem -= used;
+				continue;
 			}
-		} else if (fields[i].label == PROTOBUF_C_LABEL_OPTIONAL ||
-			   fields[i].label == PROTOBUF_C_LABEL_NONE) {
-			const ProtobufCFieldDescriptor *field;
-			uint32_t *earlier_case_p = STRUCT_MEMBER_PTR(uint32_t,
-								     earlier_msg,
-								     fields[i].
-								     quantifier_offset);
-			uint32_t *latter_case_p = STRUCT_MEMBER_PTR(uint32_t,
-								    latter_msg,
-								    fields[i].
-								    quantifier_offset);
-			protobuf_c_boolean need_to_merge = FALSE;
-			void *earlier_elem;
-			void *latter_elem;
-			const void *def_val;
+			tmp.tag = tmp.field->id;
+			tmp.wire_type = at[0] & 7;
+			used = scan_member_data(rem - entry->tag_len,
+						at + entry->tag_len, &tmp);
+			if (used == 0)
+				goto error_cleanup;
+			used += entry->tag_len;
+		} else {
+			used = scan_member(rem, at, &tmp);
+			if (used == 0)
+				goto error_cleanup;
+			field_index = find_field_index(desc, tmp.tag,
+						       last_field_index);
+		}
+
+		tmp.mask = NULL;
+		tmp.context = context;
+		if (mask != NULL) {
+			const ProtobufCFieldMask *sel = NULL;
+
+			if (field_index >= 0)
+				sel = mask->fields[field_index];
+			if (field_index >= 0 ? sel == NULL :
+			    (mask->flags & PROTOBUF_C_FIELD_MASK_DROP_UNKNOWN) != 0)
+			{
+				/* not selected: skip it by its length */
+				at += used;
+				rem -= used;
+				continue;
+			}
+			if (sel != &field_mask_all)
+				tmp.mask = sel;
+		}
+
+		tmp.retained = NULL;
+		if (retained != NULL)
+			tmp.retained = retained +
+				(field_index < 0 ? desc->n_fields : (unsigned) field_index);
+		if (field_index < 0) {
+			tmp.field = NULL;
+		} else {
+			tmp.field = desc->fields + field_index;
+			last_field_index = field_index;
+			if (tmp.field->label == PROTOBUF_C_LABEL_REQUIRED)
+				REQUIRED_FIELD_BITMAP_SET(field_index);
+		}
+
+		borrowable = borrowed_fields_bitmap != NULL &&
+			tmp.field != NULL &&
+			tmp.field->label == PROTOBUF_C_LABEL_REPEATED &&
+			is_borrowable_array(tmp.field);
+		if (borrowable &&
+		    BORROWED_FIELD_BITMAP_IS_SET(field_index))
+		{
+			if (!unborrow_array(tmp.field, rv, allocator))
+				goto error_cleanup;
+			BORROWED_FIELD_BITMAP_CLEAR(field_index);
+		}
+
+		if (!parse_member(&tmp, rv, allocator,
+				  tmp.field == NULL ?
+				  flags | PROTOBUF_C_UNPACK_FLAG_ZERO_COPY : flags))
+		{
+			PROTOBUF_C_UNPACK_ERROR("error parsing member %s of %s",
+						tmp.field ? tmp.field->name : "*unknown-field*",
+						desc->name);
+			goto error_cleanup;
+		}
+
+		if (borrowable &&
+		    STRUCT_MEMBER(void *, rv, tmp.field->offset) ==
+		    tmp.data + tmp.length_prefix_len)
+		{
+			BORROWED_FIELD_BITMAP_SET(field_index);
+		}
+
+		at += used;
+		rem -= used;
+	}
+
+	if (context != NULL) {
+		reverse_unpack_jobs(context);
+		if (outermost && !run_unpack_jobs(context, allocator, flags))
+			goto error_cleanup;
+	}
+
+	/* check that all required fields have been set */
+	for (f = 0; f < desc->n_fields; f++) {
+		const ProtobufCFieldDescriptor *field = desc->fields + f;
+		if (field->label == PROTOBUF_C_LABEL_REQUIRED &&
+		    field->default_value == NULL &&
+		    (mask == NULL || mask->fields[f] != NULL) &&
+		    !REQUIRED_FIELD_BITMAP_IS_SET(f))
+		{
+			PROTOBUF_C_UNPACK_ERROR("message '%s': missing required field '%s'",
+						desc->name, field->name);
+			goto error_cleanup;
+		}
+	}
+
+	if (!(flags & PROTOBUF_C_UNPACK_FLAG_ZERO_COPY) &&
+	    rv->n_unknown_fields > first_unknown &&
+	    !copy_unknown_fields(rv, first_unknown, allocator))
+		goto error_cleanup;
+
+	/* cleanup */
+	if (required_fields_bitmap_alloced)
+		do_free(allocator, required_fields_bitmap);
+	if (context != NULL) {
+		context->depth--;
+		context->jobs_base = jobs_base;
+	}
+	return TRUE;
+
+error_cleanup:
+	if (!(flags & PROTOBUF_C_UNPACK_FLAG_ZERO_COPY))
+		rv->n_unknown_fields = first_unknown;
+	if (required_fields_bitmap_alloced)
+		do_free(allocator, required_fields_bitmap);
+	if (context != NULL) {
+		/* whatever is left is reachable from the caller's message */
+		context->n_jobs = context->jobs_base;
+		context->depth--;
+		context->jobs_base = jobs_base;
+	}
+	return FALSE;
+}
+
+/**
+ * Set every field of a message to its default value, without freeing
+ * anything.
+ */
+static void
+message_reset(const ProtobufCMessageDescriptor *desc,
+	      ProtobufCMessage *message)
+{
+	/*
+	 * Generated code always defines "message_init". However, we provide a
+	 * fallback for (1) users of old protobuf-c generated-code that do not
+	 * provide the function, and (2) descriptors constructed from some other
+	 * source (most likely, direct construction from the .proto file).
+	 */
+	if (desc->message_init != NULL)
+		protobuf_c_message_init(desc, message);
+	else
+		message_init_generic(desc, message);
+}
+
+/*
+ * Single-block unpacking.
+ *
+ * With PROTOBUF_C_UNPACK_FLAG_SINGLE_BLOCK, single_block_size() first works
+ * out how many bytes unpacking the message takes from an arena, following
+ * the growth of every repeated field array as message_unpack() appends to
+ * it. That many bytes are obtained from the allocator in one block, and the
+ * message is unpacked into an arena over it. Should the estimate fall short,
+ * which only happens when a singular sub-message occurs several times and its
+ * repeated fields keep growing, the arena gets more blocks from the
+ * allocator.
+ *
+ * The top-level message is the first thing in the block, immediately followed
+ * by a SingleBlockHeader and the message's unknown field array. Nothing in
+ * an arbitrary message tells whether it was laid out this way, so the tree
+ * is freed with protobuf_c_message_free_unpacked_single_block(), which
+ * finds the header right after the message.
+ */
 
-			if (fields[i].flags & PROTOBUF_C_FIELD_FLAG_ONEOF) {
-				if (*latter_case_p == 0) {
-					/* lookup correct oneof field */
-					int field_index =
-						int_range_lookup(
-							latter_msg->descriptor
-							->n_field_ranges,
-							latter_msg->descriptor
-							->field_ranges,
-							*earlier_case_p);
-					if (field_index < 0)
-						return FALSE;
-					field = latter_msg->descriptor->fields +
-						field_index;
-				} else {
-					/* Oneof is present in the latter message, move on */
-					continue;
-				}
-			} else {
-				field = &fields[i];
+typedef struct {
+	/** The block obtained from the allocator. */
+	void *block;
+	/** Any further blocks the arena had to obtain, newest first. */
+	ArenaBlock *overflow;
+} SingleBlockHeader;
+
+#define SINGLE_BLOCK_HEADER_SIZE	ARENA_ALIGN(sizeof(SingleBlockHeader))
+
+/** Fields whose arrays single_block_size() follows in one pass. */
+#define SINGLE_BLOCK_COUNTED_FIELDS	64
+
+/** Free a message tree unpacked with PROTOBUF_C_UNPACK_FLAG_SINGLE_BLOCK. */
+static void
+single_block_free(SingleBlockHeader *header, ProtobufCAllocator *allocator)
+{
+	ArenaBlock *block = header->overflow;
+
+	while (block != NULL) {
+		ArenaBlock *next = block->next;
+
+		do_free(allocator, block);
+		block = next;
+	}
+	do_free(allocator, header->block);
+}
+
+/**
+ * Number of elements an occurrence of a repeated field adds, or 0 if it is
+ * malformed.
+ */
+static size_t
+count_occurrence_elements(const ScannedMember *member)
+{
+	const ProtobufCFieldDescriptor *field = member->field;
+	size_t n;
+
+	if (member->wire_type == PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED &&
+	    (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_PACKED) ||
+	     is_packable_type(field->type)))
+	{
+		if (!count_packed_elements(field->type,
+					   member->len - member->length_prefix_len,
+					   member->data + member->length_prefix_len,
+					   &n))
+			return 0;
+		return n;
+	}
+	return 1;
+}
+
+/**
+ * Bytes an array of `siz`-byte elements holding `n` elements takes from an
+ * arena to grow by `count`, like reserve_array() does.
+ */
+static inline size_t
+array_growth_size(size_t siz, size_t n, size_t count)
+{
+	if (n + count <= repeated_capacity(n))
+		return 0;
+	if (repeated_capacity(n + count) > SIZE_MAX / 2 / siz)
+		return SIZE_MAX / 2;
+	return ARENA_ALIGN(repeated_capacity(n + count) * siz);
+}
+
+/**
+ * Bytes the array of a repeated field takes from an arena as every
+ * occurrence is appended to it, for fields single_block_size() doesn't
+ * follow along.
+ */
+static size_t
+field_array_size(const ProtobufCMessageDescriptor *desc, unsigned f,
+		 size_t len, const uint8_t *data)
+{
+	size_t siz = sizeof_elt_in_repeated_array(desc->fields[f].type);
+	const uint8_t *at = data;
+	size_t rem = len;
+	size_t size = 0;
+	size_t n = 0;
+
+	while (rem > 0) {
+		ScannedMember tmp;
+		size_t used = scan_member(rem, at, &tmp);
+
+		if (used == 0)
+			break;
+		if (tmp.tag == desc->fields[f].id) {
+			size_t count;
+
+			tmp.field = desc->fields + f;
+			count = count_occurrence_elements(&tmp);
+			size += array_growth_size(siz, n, count);
+			n += count;
+		}
+		at += used;
+		rem -= used;
+	}
+	return size;
+}
+
+/** A message single_block_size() has yet to size, or validate_message() to check. */
+typedef struct {
+	const ProtobufCMessageDescriptor *desc;
+	unsigned depth;    /**< Number of messages it is nested in. */
+	size_t len;
+	const uint8_t *data;
+} SizingJob;
+
+/** Stack of SizingJob, kept on the C stack until it outgrows `local`. */
+typedef struct {
+	SizingJob *jobs;
+	size_t n;
+	size_t capacity;
+	SizingJob local[16];
+} SizingStack;
+
+static protobuf_c_boolean
+sizing_stack_push(SizingStack *stack, const SizingJob *job,
+		  ProtobufCAllocator *allocator)
+{
+	if (stack->n == stack->capacity) {
+		SizingJob *jobs;
+
+		if (stack->capacity > SIZE_MAX / 2 / sizeof(SizingJob))
+			return FALSE;
+		jobs = do_alloc(allocator, stack->capacity * 2 * sizeof(SizingJob));
+		if (jobs == NULL)
+			return FALSE;
+		memcpy(jobs, stack->jobs, stack->n * sizeof(SizingJob));
+		if (stack->jobs != stack->local)
+			do_free(allocator, stack->jobs);
+		stack->jobs = jobs;
+		stack->capacity *= 2;
+	}
+	stack->jobs[stack->n++] = *job;
+	return TRUE;
+}
+
+/**
+ * Add to `*p_size` the number of bytes message_unpack() takes from an arena
+ * for one message, including the message itself, and push its
+ * sub-messages on `pending` to be sized in turn.
+ *
+ * \param max_depth
+ *      Maximum nesting depth, or 0 for no limit.
+ * \param[out] p_n_unknown
+ *      If not NULL, receives the number of unknown fields of the message,
+ *      whose array is then left out of the size.
+ * \retval FALSE
+ *      If the message is malformed, too large, or nested too deep, or
+ *      memory runs out.
+ */
+static protobuf_c_boolean
+single_block_message_size(const SizingJob *job, unsigned flags,
+			  unsigned max_depth, SizingStack *pending,
+			  ProtobufCAllocator *allocator,
+			  size_t *p_size, size_t *p_n_unknown)
+{
+	const ProtobufCMessageDescriptor *desc = job->desc;
+	size_t len = job->len;
+	const uint8_t *data = job->data;
+	protobuf_c_boolean discard_unknown =
+		discards_unknown_fields(desc, flags);
+	size_t counts[SINGLE_BLOCK_COUNTED_FIELDS];
+	unsigned n_counted = desc->n_fields < SINGLE_BLOCK_COUNTED_FIELDS ?
+		desc->n_fields : SINGLE_BLOCK_COUNTED_FIELDS;
+	unsigned last_field_index = 0;
+	const uint8_t *at = data;
+	size_t rem = len;
+	size_t size = ARENA_ALIGN(desc->sizeof_message);
+	size_t n_unknown = 0;
+	size_t unknown_size = 0;
+	unsigned f;
+
+	if (max_depth != 0 && job->depth >= max_depth)
+		return FALSE;
+	if ((desc->n_fields + 7) / 8 > 16)
+		size += ARENA_ALIGN((desc->n_fields + 7) / 8);
+	memset(counts, 0, n_counted * sizeof(size_t));
+
+	while (rem > 0) {
+		const ProtobufCFieldDescriptor *field;
+		ScannedMember tmp;
+		size_t used = scan_member(rem, at, &tmp);
+		size_t payload;
+		int field_index;
+
+		if (used == 0)
+			return FALSE;
+		at += used;
+		rem -= used;
+		field_index = find_field_index(desc, tmp.tag, last_field_index);
+		if (field_index < 0) {
+			if (discard_unknown)
+				continue;
+			if (p_n_unknown == NULL)
+				size += array_growth_size(
+					sizeof(ProtobufCMessageUnknownField),
+					n_unknown, 1);
+			n_unknown++;
+			unknown_size += get_tag_size(tmp.tag) + tmp.len;
+			continue;
+		}
+		field = tmp.field = desc->fields + field_index;
+		last_field_index = field_index;
+		payload = tmp.len - tmp.length_prefix_len;
+		if (field->label == PROTOBUF_C_LABEL_REPEATED) {
+			size_t count = count_occurrence_elements(&tmp);
+
+			if ((unsigned) field_index < n_counted) {
+				size += array_growth_size(
+					sizeof_elt_in_repeated_array(field->type),
+					counts[field_index], count);
+				counts[field_index] += count;
 			}
+			if (count != 1 || is_packable_type(field->type))
+				continue;
+		}
+		if (tmp.wire_type != PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED)
+			continue;
+		switch (field->type) {
+		case PROTOBUF_C_TYPE_STRING:
+			size += ARENA_ALIGN(payload + 1);
+			break;
+		case PROTOBUF_C_TYPE_BYTES:
+			if (payload != 0)
+				size += ARENA_ALIGN(payload);
+			break;
+		case PROTOBUF_C_TYPE_MESSAGE: {
+			SizingJob sub;
+
+			sub.desc = field->descriptor;
+			sub.depth = job->depth + 1;
+			sub.len = payload;
+			sub.data = tmp.data + tmp.length_prefix_len;
+			if (!sizing_stack_push(pending, &sub, allocator))
+				return FALSE;
+			break;
+		}
+		default:
+			break;
+		}
+	}
+
+	for (f = n_counted; f < desc->n_fields; f++) {
+		if (desc->fields[f].label == PROTOBUF_C_LABEL_REPEATED)
+			size += field_array_size(desc, f, len, data);
+	}
+	/* the data of the unknown fields is copied into one block */
+	if (unknown_size != 0)
+		size += ARENA_ALIGN(unknown_size);
+	if (p_n_unknown != NULL)
+		*p_n_unknown = n_unknown;
+	if (size > SIZE_MAX / 2 - *p_size)
+		return FALSE;
+	*p_size += size;
+	return TRUE;
+}
+
+/**
+ * Work out the number of bytes message_unpack() takes from an arena for a
+ * message tree. Sub-messages are kept on a stack rather than sized
+ * recursively, so that the depth of the tree doesn't matter.
+ *
+ * \param max_depth
+ *      Maximum nesting depth, or 0 for no limit.
+ * \param allocator
+ *      Allocator for the stack, should it outgrow the C stack.
+ * \param[out] p_size
+ *      Receives the size.
+ * \param[out] p_n_unknown
+ *      Receives the number of unknown fields of the top-level message,
+ *      whose array is left out of the size.
+ * \retval FALSE
+ *      If the message is malformed, too large, or nested too deep, or
+ *      memory runs out.
+ */
+static protobuf_c_boolean
+single_block_size(const ProtobufCMessageDescriptor *desc, unsigned flags,
+		  unsigned max_depth, ProtobufCAllocator *allocator,
+		  size_t len, const uint8_t *data,
+		  size_t *p_size, size_t *p_n_unknown)
+{
+	SizingStack pending;
+	SizingJob job;
+	protobuf_c_boolean rv;
+
+	pending.jobs = pending.local;
+	pending.n = 0;
+	pending.capacity = sizeof(pending.local) / sizeof(pending.local[0]);
+	job.desc = desc;
+	job.depth = 0;
+	job.len = len;
+	job.data = data;
+	*p_size = 0;
+	rv = single_block_message_size(&job, flags, max_depth, &pending,
+				       allocator, p_size, p_n_unknown);
+	while (rv && pending.n != 0) {
+		job = pending.jobs[--pending.n];
+		rv = single_block_message_size(&job, flags, max_depth,
+					       &pending, allocator,
+					       p_size, NULL);
+	}
+	if (pending.jobs != pending.local)
+		do_free(allocator, pending.jobs);
+	return rv;
+}
+
+/**
+ * Unpack a message tree into a single block obtained from `allocator`.
+ */
+static ProtobufCMessage *
+message_unpack_single_block(const ProtobufCMessageDescriptor *desc,
+			    ProtobufCAllocator *allocator,
+			    unsigned flags,
+			    ProtobufCUnpackContext *context,
+			    size_t len, const uint8_t *data)
+{
+	RetainedStorage retained_stack[RETAINED_STORAGE_STACK_ENTRIES];
+	RetainedStorage *retained = retained_stack;
+	ProtobufCMessageUnknownField *unknown_fields;
+	ProtobufCArena arena;
+	SingleBlockHeader *header;
+	ProtobufCMessage *rv;
+	size_t size;
+	size_t n_unknown;
+	size_t top_size;
+	void *block;
+
+	ASSERT_IS_MESSAGE_DESCRIPTOR(desc);
+
+	if (!single_block_size(desc, flags,
+			       context != NULL ? context->max_depth : 0,
+			       allocator, len, data, &size, &n_unknown))
+		return NULL;
+	/* the message, its header and its unknown fields, in one piece */
+	top_size = ARENA_ALIGN(desc->sizeof_message) + SINGLE_BLOCK_HEADER_SIZE +
+		ARENA_ALIGN(repeated_capacity(n_unknown) *
+			    sizeof(ProtobufCMessageUnknownField));
+	size += top_size - ARENA_ALIGN(desc->sizeof_message);
+	if (desc->n_fields + 1 > RETAINED_STORAGE_STACK_ENTRIES)
+		size += ARENA_ALIGN((desc->n_fields + 1) * sizeof(*retained));
+	/* room to align the start of the block */
+	size += ARENA_ALIGNMENT;
+	block = do_alloc(allocator, size);
+	if (block == NULL)
+		return NULL;
+	protobuf_c_arena_init(&arena, block, size, allocator);
+
+	rv = do_alloc(&arena.base, top_size);
+	if (rv == NULL)
+		goto error_cleanup;
+	header = (SingleBlockHeader *) ((uint8_t *) rv +
+					ARENA_ALIGN(desc->sizeof_message));
+	unknown_fields = (ProtobufCMessageUnknownField *)
+		((uint8_t *) header + SINGLE_BLOCK_HEADER_SIZE);
+
+	/* the unknown fields go straight into their place after the header */
+	if (desc->n_fields + 1 > RETAINED_STORAGE_STACK_ENTRIES) {
+		retained = do_alloc(&arena.base,
+				    (desc->n_fields + 1) * sizeof(*retained));
+		if (retained == NULL)
+			goto error_cleanup;
+	}
+	memset(retained, 0, (desc->n_fields + 1) * sizeof(*retained));
+	retained[desc->n_fields].data = unknown_fields;
+	retained[desc->n_fields].capacity = repeated_capacity(n_unknown);
+
+	message_reset(desc, rv);
+	if (!message_unpack_fields(rv, &arena.base, flags, context, len, data,
+				   retained, NULL))
+		goto error_cleanup;
+	rv->unknown_fields = unknown_fields;
+	header->block = block;
+	header->overflow = arena.blocks;
+	return rv;
+
+error_cleanup:
+	{
+		SingleBlockHeader tmp;
+
+		tmp.block = block;
+		tmp.overflow = arena.blocks;
+		single_block_free(&tmp, allocator);
+	}
+	return NULL;
+}
+
+static ProtobufCMessage *
+message_unpack(const ProtobufCMessageDescriptor *desc,
+	       ProtobufCAllocator *allocator,
+	       unsigned flags,
+	       ProtobufCUnpackContext *context,
+	       const ProtobufCFieldMask *mask,
+	       size_t len, const uint8_t *data)
+{
+	ProtobufCMessage *rv;
+
+	ASSERT_IS_MESSAGE_DESCRIPTOR(desc);
+
+	rv = do_alloc(allocator, desc->sizeof_message);
+	if (!rv)
+		return (NULL);
+	message_reset(desc, rv);
+	if (!message_unpack_fields(rv, allocator, flags, context, len, data,
+				   NULL, mask))
+	{
+		protobuf_c_message_free_unpacked(rv, allocator);
+		return NULL;
+	}
+	return rv;
+}
+
+ProtobufCMessage *
+protobuf_c_message_unpack(const ProtobufCMessageDescriptor *desc,
+			  ProtobufCAllocator *allocator,
+			  size_t len, const uint8_t *data)
+{
+	return protobuf_c_message_unpack_with_flags(desc, allocator, 0,
+						    len, data);
+}
+
+/**
+ * Unpack a message with `ProtobufCUnpackFlag` flags, and optionally a
+ * context.
+ */
+static ProtobufCMessage *
+unpack_with_flags(const ProtobufCMessageDescriptor *desc,
+		  ProtobufCAllocator *allocator,
+		  unsigned flags,
+		  ProtobufCUnpackContext *context,
+		  size_t len, const uint8_t *data)
+{
+	if (allocator == NULL)
+		allocator = &protobuf_c__allocator;
+
+	/*
+	 * Borrowed pointers must never reach a real free(); only an arena,
+	 * whose memory is released wholesale, can hand them out safely.
+	 */
+	if (allocator->free != &arena_free) {
+		flags &= ~PROTOBUF_C_UNPACK_FLAG_ZERO_COPY;
+		if (flags & PROTOBUF_C_UNPACK_FLAG_SINGLE_BLOCK)
+			return message_unpack_single_block(desc, allocator,
+							   flags, context,
+							   len, data);
+	}
+
+	return message_unpack(desc, allocator, flags, context, NULL,
+			      len, data);
+}
+
+ProtobufCMessage *
+protobuf_c_message_unpack_with_flags(const ProtobufCMessageDescriptor *desc,
+				     ProtobufCAllocator *allocator,
+				     unsigned flags,
+				     size_t len, const uint8_t *data)
+{
+	return unpack_with_flags(desc, allocator, flags, NULL, len, data);
+}
+
+void
+protobuf_c_unpack_context_init(ProtobufCUnpackContext *context,
+			       ProtobufCAllocator *allocator,
+			       unsigned flags)
+{
+	memset(context, 0, sizeof(*context));
+	context->allocator = allocator;
+	context->flags = flags;
+	protobuf_c_arena_init(&context->scratch, NULL, 0, allocator);
+}
+
+ProtobufCMessage *
+protobuf_c_message_unpack_with_context(ProtobufCUnpackContext *context,
+				       const ProtobufCMessageDescriptor *desc,
+				       size_t len, const uint8_t *data)
+{
+	ProtobufCMessage *rv;
+
+	context->depth = 0;
+	rv = unpack_with_flags(desc, context->allocator, context->flags,
+			       context, len, data);
+	/* keeps the scratch block for the next call */
+	protobuf_c_arena_reset(&context->scratch);
+	context->jobs = NULL;
+	context->n_jobs = 0;
+	context->jobs_capacity = 0;
+	if (rv == NULL) {
+		context->stats.n_failures++;
+	} else {
+		context->stats.n_messages++;
+		context->stats.n_bytes += len;
+	}
+	return rv;
+}
+
+void
+protobuf_c_unpack_context_destroy(ProtobufCUnpackContext *context)
+{
+	protobuf_c_arena_destroy(&context->scratch);
+}
+
+ProtobufCMessage *
+protobuf_c_message_unpack_masked(const ProtobufCFieldMask *mask,
+				 ProtobufCAllocator *allocator,
+				 unsigned flags,
+				 size_t len, const uint8_t *data)
+{
+	if (allocator == NULL)
+		allocator = &protobuf_c__allocator;
+	if (allocator->free != &arena_free)
+		flags &= ~PROTOBUF_C_UNPACK_FLAG_ZERO_COPY;
+
+	return message_unpack(mask->descriptor, allocator, flags, NULL, mask,
+			      len, data);
+}
+
+size_t
+protobuf_c_message_unpack_batch(const ProtobufCMessageDescriptor *descriptor,
+				ProtobufCAllocator *allocator,
+				unsigned flags,
+				size_t n,
+				const size_t *lens,
+				const uint8_t *const *datas,
+				ProtobufCMessage **messages)
+{
+	size_t size = descriptor->sizeof_message;
+	uint8_t *block = NULL;
+	size_t n_unpacked = 0;
+	size_t i;
+
+	ASSERT_IS_MESSAGE_DESCRIPTOR(descriptor);
+
+	if (allocator == NULL)
+		allocator = &protobuf_c__allocator;
+	if (allocator->free != &arena_free)
+		flags &= ~PROTOBUF_C_UNPACK_FLAG_ZERO_COPY;
+
+	if (n != 0 && n <= SIZE_MAX / size)
+		block = do_alloc(allocator, n * size);
+	if (block == NULL) {
+		for (i = 0; i < n; i++)
+			messages[i] = NULL;
+		return 0;
+	}
+	for (i = 0; i < n; i++) {
+		ProtobufCMessage *message = (ProtobufCMessage *) (block + i * size);
+
+		message_reset(descriptor, message);
+		if (message_unpack_fields(message, allocator, flags, NULL,
+					  lens[i], datas[i], NULL, NULL))
+		{
+			messages[i] = message;
+			n_unpacked++;
+		} else {
+			if (allocator->free != &arena_free)
+				free_message_members(message, allocator);
+			messages[i] = NULL;
+		}
+	}
+	if (n_unpacked == 0)
+		do_free(allocator, block);
+	return n_unpacked;
+}
+
+/*
+ * Parallel unpacking.
+ */
+
+/**
+ * Least number of elements a repeated message field needs for
+ * protobuf_c_message_unpack_parallel() to split it among tasks.
+ */
+#define PARALLEL_MIN_ELEMENTS	64
+
+/** An element of a repeated message field, decoded by a parallel task. */
+typedef struct {
+	const ProtobufCMessageDescriptor *descriptor;
+	ProtobufCMessage **out;
+	size_t len;
+	const uint8_t *data;
+} ParallelElement;
+
+typedef struct {
+	ParallelElement *elements;
+	size_t n_elements;
+	unsigned n_tasks;
+	ProtobufCAllocator *allocator;
+	ProtobufCAllocator **allocators;
+	unsigned flags;
+	/** One flag per task, set if it failed. */
+	protobuf_c_boolean *failed;
+} ParallelUnpack;
+
+/** Allocator used by task `index`. */
+static inline ProtobufCAllocator *
+parallel_task_allocator(const ParallelUnpack *pu, unsigned index)
+{
+	return pu->allocators != NULL ? pu->allocators[index] : pu->allocator;
+}
+
+/** Decode task `index`'s share of the elements. */
+static void
+parallel_unpack_task(unsigned index, void *task_data)
+{
+	ParallelUnpack *pu = task_data;
+	ProtobufCAllocator *allocator = parallel_task_allocator(pu, index);
+	unsigned flags = pu->flags;
+	size_t i = pu->n_elements / pu->n_tasks * index;
+	size_t end = pu->n_elements / pu->n_tasks * (index + 1);
+
+	if (index + 1 == pu->n_tasks)
+		end = pu->n_elements;
+	if (allocator->free != &arena_free)
+		flags &= ~PROTOBUF_C_UNPACK_FLAG_ZERO_COPY;
+	for (; i < end; i++) {
+		ParallelElement *e = pu->elements + i;
+
+		*e->out = message_unpack(e->descriptor, allocator, flags,
+					 NULL, NULL, e->len, e->data);
+		if (*e->out == NULL) {
+			pu->failed[index] = TRUE;
+			return;
+		}
+	}
+}
+
+/**
+ * Count the elements of each repeated message field of a serialised message,
+ * leaving 0 for the other fields.
+ *
+ * \return
+ *      Total number of elements of the fields that have at least
+ *      `PARALLEL_MIN_ELEMENTS`; the counts of the other fields are cleared.
+ */
+static size_t
+parallel_count_elements(const ProtobufCMessageDescriptor *desc,
+			size_t len, const uint8_t *data, size_t *counts)
+{
+	const uint8_t *at = data;
+	size_t rem = len;
+	unsigned last_field_index = 0;
+	size_t total = 0;
+	unsigned f;
 
-			earlier_elem = STRUCT_MEMBER_P(earlier_msg, field->offset);
-			latter_elem = STRUCT_MEMBER_P(latter_msg, field->offset);
-			def_val = field->default_value;
+	memset(counts, 0, desc->n_fields * sizeof(size_t));
+	while (rem > 0) {
+		ScannedMember tmp;
+		size_t used = scan_member(rem, at, &tmp);
+		int field_index;
 
-			switch (field->type) {
-			case PROTOBUF_C_TYPE_MESSAGE: {
-				ProtobufCMessage *em = *(ProtobufCMessage **) earlier_elem;
-				ProtobufCMessage *lm = *(ProtobufCMessage **) latter_elem;
-				if (em != NULL) {
-					if (lm != NULL) {
-						if (!merge_messages(em, lm, allocator))
-							return FALSE;
-						/* Already merged */
-						need_to_merge = FALSE;
-					} else {
-						/* Zero copy the message */
-						need_to_merge = TRUE;
-					}
-				}
-				break;
+		if (used == 0)
+			return 0;
+		field_index = find_field_index(desc, tmp.tag, last_field_index);
+		if (field_index >= 0) {
+			const ProtobufCFieldDescriptor *field =
+				desc->fields + field_index;
+
+			last_field_index = field_index;
+			if (field->label == PROTOBUF_C_LABEL_REPEATED &&
+			    field->type == PROTOBUF_C_TYPE_MESSAGE)
+			{
+				/* leave a malformed message to message_unpack() */
+				if (tmp.wire_type != PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED)
+					return 0;
+				counts[field_index]++;
 			}
-			case PROTOBUF_C_TYPE_BYTES: {
-				uint8_t *e_data =
-					((ProtobufCBinaryData *) earlier_elem)->data;
-				uint8_t *l_data =
-					((ProtobufCBinaryData *) latter_elem)->data;
-				const ProtobufCBinaryData *d_bd =
-					(ProtobufCBinaryData *) def_val;
+		}
+		at += used;
+		rem -= used;
+	}
+	for (f = 0; f < desc->n_fields; f++) {
+		if (counts[f] < PARALLEL_MIN_ELEMENTS)
+			counts[f] = 0;
+		total += counts[f];
+	}
+	return total;
+}
 
-				need_to_merge =
-					(e_data != NULL &&
-					 (d_bd == NULL ||
-					  e_data != d_bd->data)) &&
-					(l_data == NULL ||
-					 (d_bd != NULL &&
-					  l_data == d_bd->data));
-				break;
-			}
-			case PROTOBUF_C_TYPE_STRING: {
-				char *e_str = *(char **) earlier_elem;
-				char *l_str = *(char **) latter_elem;
-				const char *d_str = def_val;
+/**
+ * Allocate the arrays of the fields with a nonzero count in `counts`, and list
+ * their elements in `elements`, each pointing at its slot.
+ */
+static protobuf_c_boolean
+parallel_list_elements(ProtobufCMessage *message,
+		       ProtobufCAllocator *allocator,
+		       size_t len, const uint8_t *data,
+		       const size_t *counts, ParallelElement *elements)
+{
+	const ProtobufCMessageDescriptor *desc = message->descriptor;
+	const uint8_t *at = data;
+	size_t rem = len;
+	unsigned last_field_index = 0;
+	unsigned f;
 
-				need_to_merge = e_str != d_str && l_str == d_str;
-				break;
-			}
-			default: {
-				/* Could be has field or case enum, the logic is
-				 * equivalent, since 0 (FALSE) means not set for
-				 * oneof */
-				need_to_merge = (*earlier_case_p != 0) &&
-						(*latter_case_p == 0);
-				break;
-			}
+	for (f = 0; f < desc->n_fields; f++) {
+		const ProtobufCFieldDescriptor *field = desc->fields + f;
+		size_t cap = repeated_capacity(counts[f]);
+		ProtobufCMessage **arr;
+
+		if (counts[f] == 0)
+			continue;
+		arr = do_alloc(allocator, cap * sizeof(ProtobufCMessage *));
+		if (arr == NULL)
+			return FALSE;
+		memset(arr, 0, cap * sizeof(ProtobufCMessage *));
+		STRUCT_MEMBER(ProtobufCMessage **, message, field->offset) = arr;
+	}
+	while (rem > 0) {
+		ScannedMember tmp;
+		size_t used = scan_member(rem, at, &tmp);
+		int field_index;
+
+		if (used == 0)
+			return FALSE;
+		field_index = find_field_index(desc, tmp.tag, last_field_index);
+		if (field_index >= 0) {
+			const ProtobufCFieldDescriptor *field =
+				desc->fields + field_index;
+
+			last_field_index = field_index;
+			if (counts[field_index] != 0) {
+				size_t *p_n = STRUCT_MEMBER_PTR(size_t, message,
+						field->quantifier_offset);
+
+				elements->descriptor = field->descriptor;
+				elements->out = STRUCT_MEMBER(ProtobufCMessage **,
+						message, field->offset) + *p_n;
+				elements->len = tmp.len - tmp.length_prefix_len;
+				elements->data = tmp.data + tmp.length_prefix_len;
+				elements++;
+				++*p_n;
 			}
+		}
+		at += used;
+		rem -= used;
+	}
+	return TRUE;
+}
 
-			if (need_to_merge) {
-				size_t el_size =
-					sizeof_elt_in_repeated_array(field->type);
-				memcpy(latter_elem, earlier_elem, el_size);
-				/*
-				 * Reset the element from the old message to 0
-				 * to make sure earlier message deallocation
-				 * doesn't corrupt zero-copied data in the new
-				 * message, earlier message will be freed after
-				 * this function is called anyway
-				 */
-				memset(earlier_elem, 0, el_size);
+ProtobufCMessage *
+protobuf_c_message_unpack_parallel(const ProtobufCMessageDescriptor *descriptor,
+				   ProtobufCAllocator *allocator,
+				   unsigned flags,
+				   ProtobufCParallelExecutor *executor,
+				   size_t len, const uint8_t *data)
+{
+	ProtobufCMessage *rv = NULL;
+	ProtobufCFieldMask mask;
+	ParallelUnpack pu;
+	size_t *counts;
+	size_t n_elements;
+	unsigned f, i;
 
-				if (field->quantifier_offset != 0) {
-					/* Set the has field or the case enum,
-					 * if applicable */
-					*latter_case_p = *earlier_case_p;
-					*earlier_case_p = 0;
+	ASSERT_IS_MESSAGE_DESCRIPTOR(descriptor);
+
+	if (allocator == NULL)
+		allocator = &protobuf_c__allocator;
+	if (allocator->free != &arena_free)
+		flags &= ~PROTOBUF_C_UNPACK_FLAG_ZERO_COPY;
+	if (executor->n_tasks <= 1 || descriptor->n_fields == 0)
+		return message_unpack(descriptor, allocator, flags, NULL, NULL,
+				      len, data);
+
+	counts = do_alloc(allocator, descriptor->n_fields *
+			  (sizeof(size_t) + sizeof(ProtobufCFieldMask *)));
+	if (counts == NULL)
+		return NULL;
+	n_elements = parallel_count_elements(descriptor, len, data, counts);
+	if (n_elements == 0) {
+		/* nothing worth splitting, or an error message_unpack() reports */
+		do_free(allocator, counts);
+		return message_unpack(descriptor, allocator, flags, NULL, NULL,
+				      len, data);
+	}
+
+	/* decode everything but the fields to split */
+	mask.descriptor = descriptor;
+	mask.flags = 0;
+	mask.fields = (ProtobufCFieldMask **) (counts + descriptor->n_fields);
+	for (f = 0; f < descriptor->n_fields; f++)
+		mask.fields[f] = counts[f] != 0 ? NULL : &field_mask_all;
+	rv = message_unpack(descriptor, allocator, flags, NULL, &mask,
+			    len, data);
+	if (rv == NULL) {
+		do_free(allocator, counts);
+		return NULL;
+	}
+
+	memset(&pu, 0, sizeof(pu));
+	pu.n_elements = n_elements;
+	pu.n_tasks = executor->n_tasks;
+	pu.allocator = allocator;
+	pu.allocators = executor->allocators;
+	pu.flags = flags;
+	pu.elements = do_alloc(allocator, n_elements * sizeof(ParallelElement));
+	pu.failed = do_alloc(allocator, pu.n_tasks * sizeof(protobuf_c_boolean));
+	if (pu.elements == NULL || pu.failed == NULL)
+		goto error_cleanup;
+	memset(pu.elements, 0, n_elements * sizeof(ParallelElement));
+	memset(pu.failed, 0, pu.n_tasks * sizeof(protobuf_c_boolean));
+	if (!parallel_list_elements(rv, allocator, len, data, counts,
+				    pu.elements))
+		goto error_cleanup;
+
+	executor->run(executor, pu.n_tasks, parallel_unpack_task, &pu);
+
+	for (i = 0; i < pu.n_tasks; i++) {
+		if (pu.failed[i])
+			goto error_cleanup;
+	}
+	do_free(allocator, pu.failed);
+	do_free(allocator, pu.elements);
+	do_free(allocator, counts);
+	return rv;
+
+error_cleanup:
+	if (pu.elements != NULL && allocator->free != &arena_free) {
+		/* free each element with the allocator that decoded it */
+		for (i = 0; i < pu.n_tasks; i++) {
+			size_t j = n_elements / pu.n_tasks * i;
+			size_t end = n_elements / pu.n_tasks * (i + 1);
+
+			if (i + 1 == pu.n_tasks)
+				end = n_elements;
+			for (; j < end; j++) {
+				ParallelElement *e = pu.elements + j;
+
+				if (e->out != NULL && *e->out != NULL) {
+					protobuf_c_message_free_unpacked(*e->out,
+						parallel_task_allocator(&pu, i));
+					*e->out = NULL;
 				}
 			}
 		}
 	}
-	return TRUE;
+	/* the arrays are filled with NULL where elements are missing */
+	for (f = 0; f < descriptor->n_fields; f++) {
+		const ProtobufCFieldDescriptor *field = descriptor->fields + f;
+
+		if (counts[f] != 0)
+			STRUCT_MEMBER(size_t, rv, field->quantifier_offset) = 0;
+	}
+	protobuf_c_message_free_unpacked(rv, allocator);
+	do_free(allocator, pu.failed);
+	do_free(allocator, pu.elements);
+	do_free(allocator, counts);
+	return NULL;
+}
+
+static ProtobufCFieldMask *
+field_mask_node_new(const ProtobufCMessageDescriptor *desc, unsigned flags,
+		    ProtobufCAllocator *allocator)
+{
+	ProtobufCFieldMask *node;
+
+	node = do_alloc(allocator, sizeof(*node) +
+			desc->n_fields * sizeof(ProtobufCFieldMask *));
+	if (node == NULL)
+		return NULL;
+	node->descriptor = desc;
+	node->flags = flags;
+	node->fields = (ProtobufCFieldMask **) (node + 1);
+	memset(node->fields, 0, desc->n_fields * sizeof(ProtobufCFieldMask *));
+	return node;
 }
 
 /**
- * Count packed elements.
+ * Find the field whose name is the `len` bytes at `name`.
  *
- * Given a raw slab of packed-repeated values, determine the number of
- * elements. This function detects certain kinds of errors but not
- * others; the remaining error checking is done by
- * parse_packed_repeated_member().
+ * \return
+ *      The field index, or -1 if there is no such field.
  */
+static int
+field_mask_find_field(const ProtobufCMessageDescriptor *desc,
+		      const char *name, size_t len)
+{
+	unsigned i;
+
+	for (i = 0; i < desc->n_fields; i++) {
+		if (strncmp(desc->fields[i].name, name, len) == 0 &&
+		    desc->fields[i].name[len] == '\0')
+			return i;
+	}
+	return -1;
+}
+
+/** Add one dot-separated path to a field mask. */
 static protobuf_c_boolean
-count_packed_elements(ProtobufCType type,
-		      size_t len, const uint8_t *data, size_t *count_out)
+field_mask_add_path(ProtobufCFieldMask *node, const char *path,
+		    ProtobufCAllocator *allocator)
 {
-	switch (type) {
-	case PROTOBUF_C_TYPE_SFIXED32:
-	case PROTOBUF_C_TYPE_FIXED32:
-	case PROTOBUF_C_TYPE_FLOAT:
-		if (len % 4 != 0) {
-			PROTOBUF_C_UNPACK_ERROR("length must be a multiple of 4 for fixed-length 32-bit types");
+	for (;;) {
+		const char *dot = strchr(path, '.');
+		size_t len = dot != NULL ? (size_t) (dot - path) : strlen(path);
+		const ProtobufCFieldDescriptor *field;
+		ProtobufCFieldMask **pchild;
+		int index;
+
+		index = field_mask_find_field(node->descriptor, path, len);
+		if (index < 0)
 			return FALSE;
+		field = node->descriptor->fields + index;
+		pchild = node->fields + index;
+		if (dot == NULL) {
+			protobuf_c_field_mask_free(*pchild, allocator);
+			*pchild = &field_mask_all;
+			return TRUE;
 		}
-		*count_out = len / 4;
-		return TRUE;
-	case PROTOBUF_C_TYPE_SFIXED64:
-	case PROTOBUF_C_TYPE_FIXED64:
-	case PROTOBUF_C_TYPE_DOUBLE:
-		if (len % 8 != 0) {
-			PROTOBUF_C_UNPACK_ERROR("length must be a multiple of 8 for fixed-length 64-bit types");
+		if (field->type != PROTOBUF_C_TYPE_MESSAGE)
 			return FALSE;
+		if (*pchild == &field_mask_all)
+			return TRUE;
+		if (*pchild == NULL) {
+			*pchild = field_mask_node_new(field->descriptor,
+						      node->flags, allocator);
+			if (*pchild == NULL)
+				return FALSE;
 		}
-		*count_out = len / 8;
-		return TRUE;
-	case PROTOBUF_C_TYPE_ENUM:
-	case PROTOBUF_C_TYPE_INT32:
-	case PROTOBUF_C_TYPE_SINT32:
-	case PROTOBUF_C_TYPE_UINT32:
-	case PROTOBUF_C_TYPE_INT64:
-	case PROTOBUF_C_TYPE_SINT64:
-	case PROTOBUF_C_TYPE_UINT64:
-		*count_out = max_b128_numbers(len, data);
-		return TRUE;
-	case PROTOBUF_C_TYPE_BOOL:
-		*count_out = len;
-		return TRUE;
-	case PROTOBUF_C_TYPE_STRING:
-	case PROTOBUF_C_TYPE_BYTES:
-	case PROTOBUF_C_TYPE_MESSAGE:
-	default:
-		PROTOBUF_C_UNPACK_ERROR("bad protobuf-c type %u for packed-repeated", type);
-		return FALSE;
+		node = *pchild;
+		path = dot + 1;
+	}
+}
+
+ProtobufCFieldMask *
+protobuf_c_field_mask_new(const ProtobufCMessageDescriptor *desc,
+			  size_t n_paths, const char *const *paths,
+			  unsigned flags, ProtobufCAllocator *allocator)
+{
+	ProtobufCFieldMask *mask;
+	size_t i;
+
+	ASSERT_IS_MESSAGE_DESCRIPTOR(desc);
+
+	if (allocator == NULL)
+		allocator = &protobuf_c__allocator;
+	mask = field_mask_node_new(desc, flags, allocator);
+	if (mask == NULL)
+		return NULL;
+	for (i = 0; i < n_paths; i++) {
+		if (!field_mask_add_path(mask, paths[i], allocator)) {
+			protobuf_c_field_mask_free(mask, allocator);
+			return NULL;
+		}
+	}
+	return mask;
+}
+
+void
+protobuf_c_field_mask_free(ProtobufCFieldMask *mask,
+			   ProtobufCAllocator *allocator)
+{
+	unsigned i;
+
+	if (mask == NULL || mask == &field_mask_all)
+		return;
+	if (allocator == NULL)
+		allocator = &protobuf_c__allocator;
+	for (i = 0; i < mask->descriptor->n_fields; i++)
+		protobuf_c_field_mask_free(mask->fields[i], allocator);
+	do_free(allocator, mask);
+}
+
+/**
+ * Free the data of the unknown fields of an unpacked message, which comes in
+ * blocks of fields that follow each other (see copy_unknown_fields()).
+ */
+static void
+free_unknown_field_data(ProtobufCMessage *message,
+			ProtobufCAllocator *allocator)
+{
+	const ProtobufCMessageUnknownField *fields = message->unknown_fields;
+	unsigned f;
+
+	for (f = 0; f < message->n_unknown_fields; f++) {
+		if (f == 0 || !unknown_field_follows(fields + f - 1, fields + f))
+			do_free(allocator, fields[f].data -
+				get_tag_size(fields[f].tag));
+	}
+}
+
+/**
+ * Free a sub-message, or queue it on `*pending` to be freed by
+ * free_message_members() if `pending` is not NULL.
+ *
+ * A queued message has its unknown fields freed right away, and its
+ * `unknown_fields` member then links it to the next queued message. The
+ * stack of messages left to free is kept in the messages themselves, so that
+ * freeing a tree of any depth takes neither recursion nor memory.
+ */
+static void
+free_submessage(ProtobufCMessage *message, ProtobufCMessage **pending,
+		ProtobufCAllocator *allocator)
+{
+	if (pending == NULL) {
+		protobuf_c_message_free_unpacked(message, allocator);
+		return;
+	}
+	if (message == NULL)
+		return;
+	ASSERT_IS_MESSAGE(message);
+	free_unknown_field_data(message, allocator);
+	if (message->unknown_fields != NULL)
+		do_free(allocator, message->unknown_fields);
+	message->n_unknown_fields = 0;
+	message->unknown_fields = (ProtobufCMessageUnknownField *) (void *) *pending;
+	*pending = message;
+}
+
+/**
+ * Free the strings, byte buffers or sub-messages held by elements `start` to
+ * `end - 1` of a repeated field's array. Sub-messages are queued on
+ * `*pending` if `pending` is not NULL.
+ */
+static void
+free_repeated_elements(const ProtobufCFieldDescriptor *field, void *arr,
+		       size_t start, size_t end, ProtobufCMessage **pending,
+		       ProtobufCAllocator *allocator)
+{
+	size_t i;
+
+	if (field->type == PROTOBUF_C_TYPE_STRING) {
+		for (i = start; i < end; i++)
+			do_free(allocator, ((char **) arr)[i]);
+	} else if (field->type == PROTOBUF_C_TYPE_BYTES) {
+		for (i = start; i < end; i++)
+			do_free(allocator, ((ProtobufCBinaryData *) arr)[i].data);
+	} else if (field->type == PROTOBUF_C_TYPE_MESSAGE) {
+		for (i = start; i < end; i++)
+			free_submessage(((ProtobufCMessage **) arr)[i],
+					pending, allocator);
+	}
+}
+
+/**
+ * Free the string, byte buffer or sub-message held by a non-repeated member,
+ * unless it is the field's default value. A sub-message is queued on
+ * `*pending` if `pending` is not NULL.
+ */
+static void
+free_singular_member(const ProtobufCFieldDescriptor *field, void *member,
+		     ProtobufCMessage **pending,
+		     ProtobufCAllocator *allocator)
+{
+	if (field->type == PROTOBUF_C_TYPE_STRING) {
+		char *str = *(char **) member;
+
+		if (str && str != field->default_value)
+			do_free(allocator, str);
+	} else if (field->type == PROTOBUF_C_TYPE_BYTES) {
+		void *data = ((ProtobufCBinaryData *) member)->data;
+		const ProtobufCBinaryData *default_bd;
+
+		default_bd = field->default_value;
+		if (data != NULL &&
+		    (default_bd == NULL ||
+		     default_bd->data != data))
+		{
+			do_free(allocator, data);
+		}
+	} else if (field->type == PROTOBUF_C_TYPE_MESSAGE) {
+		ProtobufCMessage *sm = *(ProtobufCMessage **) member;
+
+		if (sm && sm != field->default_value)
+			free_submessage(sm, pending, allocator);
 	}
 }
 
-static inline uint32_t
-parse_uint32(unsigned len, const uint8_t *data)
-{
-	uint32_t rv = data[0] & 0x7f;
-	if (len > 1) {
-		rv |= ((uint32_t) (data[1] & 0x7f) << 7);
-		if (len > 2) {
-			rv |= ((uint32_t) (data[2] & 0x7f) << 14);
-			if (len > 3) {
-				rv |= ((uint32_t) (data[3] & 0x7f) << 21);
-				if (len > 4)
-					rv |= ((uint32_t) (data[4]) << 28);
+/**
+ * Free the fields of a message, but not its unknown fields nor the object
+ * itself, queueing its sub-messages on `*pending`.
+ */
+static void
+free_message_fields(ProtobufCMessage *message, ProtobufCMessage **pending,
+		    ProtobufCAllocator *allocator)
+{
+	const ProtobufCMessageDescriptor *desc = message->descriptor;
+	unsigned f;
+
+	message->descriptor = NULL;
+	for (f = 0; f < desc->n_fields; f++) {
+		if (0 != (desc->fields[f].flags & PROTOBUF_C_FIELD_FLAG_ONEOF) &&
+		    desc->fields[f].id !=
+		    STRUCT_MEMBER(uint32_t, message, desc->fields[f].quantifier_offset))
+		{
+			/* This is not the selected oneof, skip it */
+			continue;
+		}
+
+		if (desc->fields[f].label == PROTOBUF_C_LABEL_REPEATED) {
+			size_t n = STRUCT_MEMBER(size_t,
+						 message,
+						 desc->fields[f].quantifier_offset);
+			void *arr = STRUCT_MEMBER(void *,
+						  message,
+						  desc->fields[f].offset);
+
+			if (arr != NULL) {
+				free_repeated_elements(desc->fields + f, arr,
+						       0, n, pending,
+						       allocator);
+				do_free(allocator, arr);
 			}
+		} else {
+			free_singular_member(desc->fields + f,
+					     STRUCT_MEMBER_P(message,
+						desc->fields[f].offset),
+					     pending, allocator);
 		}
 	}
-	return rv;
 }
 
-static inline uint32_t
-parse_int32(unsigned len, const uint8_t *data)
+/**
+ * Free everything a message object points to, but not the object itself.
+ * `allocator` must not be an arena.
+ */
+static void
+free_message_members(ProtobufCMessage *message,
+		     ProtobufCAllocator *allocator)
 {
-	return parse_uint32(len, data);
+	ProtobufCMessage *pending = NULL;
+
+	free_unknown_field_data(message, allocator);
+	if (message->unknown_fields != NULL)
+		do_free(allocator, message->unknown_fields);
+	free_message_fields(message, &pending, allocator);
+	while (pending != NULL) {
+		ProtobufCMessage *sm = pending;
+
+		pending = (ProtobufCMessage *) (void *) sm->unknown_fields;
+		free_message_fields(sm, &pending, allocator);
+		do_free(allocator, sm);
+	}
 }
 
-static inline int32_t
-unzigzag32(uint32_t v)
+void
+protobuf_c_message_free_unpacked(ProtobufCMessage *message,
+				 ProtobufCAllocator *allocator)
 {
-	// Note:  Using unsigned types prevents undefined behavior
-	return (int32_t)((v >> 1) ^ -(v & 1));
+	if (message == NULL)
+		return;
+
+	ASSERT_IS_MESSAGE(message);
+
+	if (allocator == NULL)
+		allocator = &protobuf_c__allocator;
+	else if (allocator->free == &arena_free)
+		return;
+	free_message_members(message, allocator);
+	do_free(allocator, message);
 }
 
-static inline uint32_t
-parse_fixed_uint32(const uint8_t *data)
+void
+protobuf_c_message_free_unpacked_single_block(ProtobufCMessage *message,
+					      ProtobufCAllocator *allocator)
 {
-#if !defined(WORDS_BIGENDIAN)
-	uint32_t t;
-	memcpy(&t, data, 4);
-	return t;
-#else
-	return data[0] |
-		((uint32_t) (data[1]) << 8) |
-		((uint32_t) (data[2]) << 16) |
-		((uint32_t) (data[3]) << 24);
-#endif
+	if (message == NULL)
+		return;
+
+	ASSERT_IS_MESSAGE(message);
+
+	if (allocator == NULL)
+		allocator = &protobuf_c__allocator;
+	else if (allocator->free == &arena_free)
+		return;
+	single_block_free((SingleBlockHeader *) ((uint8_t *) message +
+		ARENA_ALIGN(message->descriptor->sizeof_message)), allocator);
 }
 
-static uint64_t
-parse_uint64(unsigned len, const uint8_t *data)
+void
+protobuf_c_message_free_unpacked_batch(size_t n,
+				       ProtobufCMessage **messages,
+				       ProtobufCAllocator *allocator)
 {
-	unsigned shift, i;
-	uint64_t rv;
+	uint8_t *block = NULL;
+	size_t i;
 
-	if (len < 5)
-		return parse_uint32(len, data);
-	rv = ((uint64_t) (data[0] & 0x7f)) |
-		((uint64_t) (data[1] & 0x7f) << 7) |
-		((uint64_t) (data[2] & 0x7f) << 14) |
-		((uint64_t) (data[3] & 0x7f) << 21);
-	shift = 28;
-	for (i = 4; i < len; i++) {
-		rv |= (((uint64_t) (data[i] & 0x7f)) << shift);
-		shift += 7;
+	if (allocator == NULL)
+		allocator = &protobuf_c__allocator;
+	else if (allocator->free == &arena_free)
+		return;
+	for (i = 0; i < n; i++) {
+		if (messages[i] == NULL)
+			continue;
+		ASSERT_IS_MESSAGE(messages[i]);
+		/* the messages are laid out in order from the start of the block */
+		if (block == NULL)
+			block = (uint8_t *) messages[i] -
+				i * messages[i]->descriptor->sizeof_message;
+		free_message_members(messages[i], allocator);
 	}
-	return rv;
+	if (block != NULL)
+		do_free(allocator, block);
 }
 
-static inline int64_t
-unzigzag64(uint64_t v)
+/**
+ * Record the capacity of an empty repeated array kept by
+ * protobuf_c_message_clear() in its first bytes. Every such array has room
+ * for at least four elements (see repeated_capacity()), which is enough.
+ */
+static inline void
+set_kept_array_capacity(void *arr, size_t capacity)
 {
-	// Note:  Using unsigned types prevents undefined behavior
-	return (int64_t)((v >> 1) ^ -(v & 1));
+	memcpy(arr, &capacity, sizeof(capacity));
 }
 
-static inline uint64_t
-parse_fixed_uint64(const uint8_t *data)
+/**
+ * Return the number of elements allocated for the array of a repeated field
+ * of an unpacked or cleared message that currently holds `n` elements.
+ */
+static inline size_t
+get_array_capacity(const void *arr, size_t n)
 {
-#if !defined(WORDS_BIGENDIAN)
-	uint64_t t;
-	memcpy(&t, data, 8);
-	return t;
-#else
-	return (uint64_t) parse_fixed_uint32(data) |
-		(((uint64_t) parse_fixed_uint32(data + 4)) << 32);
-#endif
+	size_t capacity;
+
+	if (n != 0)
+		return repeated_capacity(n);
+	memcpy(&capacity, arr, sizeof(capacity));
+	return capacity;
 }
 
-static protobuf_c_boolean
-parse_boolean(unsigned len, const uint8_t *data)
+/**
+ * Set a non-repeated field back to its default value, without freeing
+ * anything.
+ */
+static void
+reset_singular_member(const ProtobufCFieldDescriptor *field,
+		      ProtobufCMessage *message)
 {
-	unsigned i;
-	for (i = 0; i < len; i++)
-		if (data[i] & 0x7f)
-			return TRUE;
-	return FALSE;
+	void *member = STRUCT_MEMBER_P(message, field->offset);
+	const void *dv = field->default_value;
+	size_t el_size = sizeof_elt_in_repeated_array(field->type);
+
+	if (field->flags & PROTOBUF_C_FIELD_FLAG_ONEOF) {
+		STRUCT_MEMBER(uint32_t, message, field->quantifier_offset) = 0;
+		memset(member, 0, el_size);
+		return;
+	}
+	if (field->quantifier_offset != 0)
+		STRUCT_MEMBER(protobuf_c_boolean, message,
+			      field->quantifier_offset) = FALSE;
+	if (dv == NULL)
+		memset(member, 0, el_size);
+	else if (field->type == PROTOBUF_C_TYPE_STRING ||
+		 field->type == PROTOBUF_C_TYPE_MESSAGE)
+		*(const void **) member = dv;
+	else
+		memcpy(member, dv, el_size);
 }
 
-static protobuf_c_boolean
-parse_required_member(ScannedMember *scanned_member,
-		      void *member,
-		      ProtobufCAllocator *allocator,
-		      protobuf_c_boolean maybe_clear)
+void
+protobuf_c_message_clear(ProtobufCMessage *message,
+			 ProtobufCAllocator *allocator)
 {
-	unsigned len = scanned_member->len;
-	const uint8_t *data = scanned_member->data;
-	uint8_t wire_type = scanned_member->wire_type;
-
-	switch (scanned_member->field->type) {
-	case PROTOBUF_C_TYPE_ENUM:
-	case PROTOBUF_C_TYPE_INT32:
-		if (wire_type != PROTOBUF_C_WIRE_TYPE_VARINT)
-			return FALSE;
-		*(int32_t *) member = parse_int32(len, data);
-		return TRUE;
-	case PROTOBUF_C_TYPE_UINT32:
-		if (wire_type != PROTOBUF_C_WIRE_TYPE_VARINT)
-			return FALSE;
-		*(uint32_t *) member = parse_uint32(len, data);
-		return TRUE;
-	case PROTOBUF_C_TYPE_SINT32:
-		if (wire_type != PROTOBUF_C_WIRE_TYPE_VARINT)
-			return FALSE;
-		*(int32_t *) member = unzigzag32(parse_uint32(len, data));
-		return TRUE;
-	case PROTOBUF_C_TYPE_SFIXED32:
-	case PROTOBUF_C_TYPE_FIXED32:
-	case PROTOBUF_C_TYPE_FLOAT:
-		if (wire_type != PROTOBUF_C_WIRE_TYPE_32BIT)
-			return FALSE;
-		*(uint32_t *) member = parse_fixed_uint32(data);
-		return TRUE;
-	case PROTOBUF_C_TYPE_INT64:
-	case PROTOBUF_C_TYPE_UINT64:
-		if (wire_type != PROTOBUF_C_WIRE_TYPE_VARINT)
-			return FALSE;
-		*(uint64_t *) member = parse_uint64(len, data);
-		return TRUE;
-	case PROTOBUF_C_TYPE_SINT64:
-		if (wire_type != PROTOBUF_C_WIRE_TYPE_VARINT)
-			return FALSE;
-		*(int64_t *) member = unzigzag64(parse_uint64(len, data));
-		return TRUE;
-	case PROTOBUF_C_TYPE_SFIXED64:
-	case PROTOBUF_C_TYPE_FIXED64:
-	case PROTOBUF_C_TYPE_DOUBLE:
-		if (wire_type != PROTOBUF_C_WIRE_TYPE_64BIT)
-			return FALSE;
-		*(uint64_t *) member = parse_fixed_uint64(data);
-		return TRUE;
-	case PROTOBUF_C_TYPE_BOOL:
-		*(protobuf_c_boolean *) member = parse_boolean(len, data);
-		return TRUE;
-	case PROTOBUF_C_TYPE_STRING: {
-		char **pstr = member;
-		unsigned pref_len = scanned_member->length_prefix_len;
+	const ProtobufCMessageDescriptor *desc = message->descriptor;
+	unsigned f;
 
-		if (wire_type != PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED)
-			return FALSE;
+	ASSERT_IS_MESSAGE(message);
 
-		if (maybe_clear && *pstr != NULL) {
-			const char *def = scanned_member->field->default_value;
-			if (*pstr != def)
-				do_free(allocator, *pstr);
-		}
-		*pstr = do_alloc(allocator, len - pref_len + 1);
-		if (*pstr == NULL)
-			return FALSE;
-		memcpy(*pstr, data + pref_len, len - pref_len);
-		(*pstr)[len - pref_len] = 0;
-		return TRUE;
+	if (allocator == NULL) {
+		allocator = &protobuf_c__allocator;
+	} else if (allocator->free == &arena_free) {
+		message_reset(desc, message);
+		return;
 	}
-	case PROTOBUF_C_TYPE_BYTES: {
-		ProtobufCBinaryData *bd = member;
-		const ProtobufCBinaryData *def_bd;
-		unsigned pref_len = scanned_member->length_prefix_len;
-
-		if (wire_type != PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED)
-			return FALSE;
+	for (f = 0; f < desc->n_fields; f++) {
+		const ProtobufCFieldDescriptor *field = desc->fields + f;
+		void *member = STRUCT_MEMBER_P(message, field->offset);
 
-		def_bd = scanned_member->field->default_value;
-		if (maybe_clear &&
-		    bd->data != NULL &&
-		    (def_bd == NULL || bd->data != def_bd->data))
-		{
-			do_free(allocator, bd->data);
-		}
-		if (len > pref_len) {
-			bd->data = do_alloc(allocator, len - pref_len);
-			if (bd->data == NULL)
-				return FALSE;
-			memcpy(bd->data, data + pref_len, len - pref_len);
-		} else {
-			bd->data = NULL;
+		if (field->label == PROTOBUF_C_LABEL_REPEATED) {
+			size_t *p_n = STRUCT_MEMBER_PTR(size_t, message,
+							field->quantifier_offset);
+			void *arr = *(void **) member;
+
+			if (arr != NULL && *p_n != 0) {
+				free_repeated_elements(field, arr, 0, *p_n,
+						       NULL, allocator);
+				set_kept_array_capacity(arr,
+							repeated_capacity(*p_n));
+				*p_n = 0;
+			}
+			continue;
 		}
-		bd->len = len - pref_len;
-		return TRUE;
-	}
-	case PROTOBUF_C_TYPE_MESSAGE: {
-		ProtobufCMessage **pmessage = member;
-		ProtobufCMessage *subm;
-		const ProtobufCMessage *def_mess;
-		protobuf_c_boolean merge_successful = TRUE;
-		unsigned pref_len = scanned_member->length_prefix_len;
-
-		if (wire_type != PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED)
-			return FALSE;
-
-		def_mess = scanned_member->field->default_value;
-		if (len >= pref_len)
-			subm = protobuf_c_message_unpack(scanned_member->field->descriptor,
-							 allocator,
-							 len - pref_len,
-							 data + pref_len);
-		else
-			subm = NULL;
-
-		if (maybe_clear &&
-		    *pmessage != NULL &&
-		    *pmessage != def_mess)
+		if (0 == (field->flags & PROTOBUF_C_FIELD_FLAG_ONEOF) ||
+		    field->id ==
+		    STRUCT_MEMBER(uint32_t, message, field->quantifier_offset))
 		{
-			if (subm != NULL)
-				merge_successful = merge_messages(*pmessage, subm, allocator);
-			/* Delete the previous message */
-			protobuf_c_message_free_unpacked(*pmessage, allocator);
+			free_singular_member(field, member, NULL, allocator);
 		}
-		*pmessage = subm;
-		if (subm == NULL || !merge_successful)
-			return FALSE;
-		return TRUE;
 	}
+	for (f = 0; f < desc->n_fields; f++) {
+		if (desc->fields[f].label != PROTOBUF_C_LABEL_REPEATED)
+			reset_singular_member(desc->fields + f, message);
+	}
+
+	free_unknown_field_data(message, allocator);
+	if (message->n_unknown_fields != 0) {
+		set_kept_array_capacity(message->unknown_fields,
+			repeated_capacity(message->n_unknown_fields));
+		message->n_unknown_fields = 0;
 	}
-	return FALSE;
 }
 
-static protobuf_c_boolean
-parse_oneof_member (ScannedMember *scanned_member,
-		    void *member,
-		    ProtobufCMessage *message,
-		    ProtobufCAllocator *allocator)
+/**
+ * Move the memory held by a message into `retained`, one entry per field
+ * followed by one for the unknown fields, and reset the message to its
+ * default values. Only unknown field data is freed.
+ */
+static void
+message_retain_storage(ProtobufCMessage *message,
+		       RetainedStorage *retained,
+		       ProtobufCAllocator *allocator)
 {
-	uint32_t *oneof_case = STRUCT_MEMBER_PTR(uint32_t, message,
-					       scanned_member->field->quantifier_offset);
+	const ProtobufCMessageDescriptor *desc = message->descriptor;
+	RetainedStorage *r;
+	unsigned f;
 
-	/* If we have already parsed a member of this oneof, free it. */
-	if (*oneof_case != 0) {
-		const ProtobufCFieldDescriptor *old_field;
-		size_t el_size;
-		/* lookup field */
-		int field_index =
-			int_range_lookup(message->descriptor->n_field_ranges,
-					 message->descriptor->field_ranges,
-					 *oneof_case);
-		if (field_index < 0)
-			return FALSE;
-		old_field = message->descriptor->fields + field_index;
-		el_size = sizeof_elt_in_repeated_array(old_field->type);
-
-		switch (old_field->type) {
-	        case PROTOBUF_C_TYPE_STRING: {
-			char **pstr = member;
-			const char *def = old_field->default_value;
-			if (*pstr != NULL && *pstr != def)
-				do_free(allocator, *pstr);
+	for (f = 0; f < desc->n_fields; f++) {
+		const ProtobufCFieldDescriptor *field = desc->fields + f;
+		void *member = STRUCT_MEMBER_P(message, field->offset);
+
+		r = retained + f;
+		r->data = NULL;
+		r->capacity = 0;
+		r->n_spare = 0;
+		if (field->label == PROTOBUF_C_LABEL_REPEATED) {
+			size_t n = STRUCT_MEMBER(size_t, message,
+						 field->quantifier_offset);
+
+			r->data = *(void **) member;
+			if (r->data != NULL) {
+				r->capacity = get_array_capacity(r->data, n);
+				if (!is_packable_type(field->type))
+					r->n_spare = n;
+			}
+			continue;
+		}
+		if (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_ONEOF) &&
+		    field->id !=
+		    STRUCT_MEMBER(uint32_t, message, field->quantifier_offset))
+		{
+			/* This is not the selected oneof, skip it */
+			continue;
+		}
+		switch (field->type) {
+		case PROTOBUF_C_TYPE_STRING: {
+			char *str = *(char **) member;
+
+			if (str != NULL && str != field->default_value) {
+				r->data = str;
+				r->capacity = strlen(str) + 1;
+			}
 			break;
-	        }
+		}
 		case PROTOBUF_C_TYPE_BYTES: {
-			ProtobufCBinaryData *bd = member;
-			const ProtobufCBinaryData *def_bd = old_field->default_value;
+			const ProtobufCBinaryData *bd = member;
+			const ProtobufCBinaryData *def_bd = field->default_value;
+
 			if (bd->data != NULL &&
-			   (def_bd == NULL || bd->data != def_bd->data))
+			    (def_bd == NULL || bd->data != def_bd->data))
 			{
-				do_free(allocator, bd->data);
+				r->data = bd->data;
+				r->capacity = bd->len;
 			}
 			break;
-	        }
+		}
 		case PROTOBUF_C_TYPE_MESSAGE: {
-			ProtobufCMessage **pmessage = member;
-			const ProtobufCMessage *def_mess = old_field->default_value;
-			if (*pmessage != NULL && *pmessage != def_mess)
-				protobuf_c_message_free_unpacked(*pmessage, allocator);
+			ProtobufCMessage *sm = *(ProtobufCMessage **) member;
+
+			if (sm != NULL && sm != field->default_value)
+				r->data = sm;
 			break;
-	        }
+		}
 		default:
 			break;
 		}
-
-		memset (member, 0, el_size);
 	}
-	if (!parse_required_member (scanned_member, member, allocator, TRUE))
-		return FALSE;
 
-	*oneof_case = scanned_member->tag;
-	return TRUE;
+	r = retained + desc->n_fields;
+	free_unknown_field_data(message, allocator);
+	r->data = message->unknown_fields;
+	r->capacity = 0;
+	r->n_spare = 0;
+	if (r->data != NULL)
+		r->capacity = get_array_capacity(r->data,
+						 message->n_unknown_fields);
+
+	message_reset(desc, message);
 }
 
+/**
+ * Hand an array from `retained` that was not reused back to the (empty)
+ * field it came from, the way protobuf_c_message_clear() leaves it.
+ */
+static void
+keep_unused_array(void **parray, size_t n, const RetainedStorage *r,
+		  ProtobufCAllocator *allocator)
+{
+	if (*parray == NULL && n == 0) {
+		*parray = r->data;
+		set_kept_array_capacity(r->data, r->capacity);
+	} else {
+		do_free(allocator, r->data);
+	}
+}
 
-static protobuf_c_boolean
-parse_optional_member(ScannedMember *scanned_member,
-		      void *member,
-		      ProtobufCMessage *message,
-		      ProtobufCAllocator *allocator)
+/**
+ * Release the storage that message_unpack_fields() did not reuse after
+ * message_retain_storage(). Repeated arrays of fields that did not occur
+ * are kept in the message for next time; everything else is freed.
+ */
+static void
+message_release_storage(ProtobufCMessage *message,
+			RetainedStorage *retained,
+			ProtobufCAllocator *allocator)
 {
-	if (!parse_required_member(scanned_member, member, allocator, TRUE))
-		return FALSE;
-	if (scanned_member->field->quantifier_offset != 0)
-		STRUCT_MEMBER(protobuf_c_boolean,
-			      message,
-			      scanned_member->field->quantifier_offset) = TRUE;
-	return TRUE;
+	const ProtobufCMessageDescriptor *desc = message->descriptor;
+	RetainedStorage *r;
+	unsigned f;
+
+	for (f = 0; f < desc->n_fields; f++) {
+		const ProtobufCFieldDescriptor *field = desc->fields + f;
+
+		r = retained + f;
+		if (r->data == NULL)
+			continue;
+		if (field->label == PROTOBUF_C_LABEL_REPEATED) {
+			size_t n = STRUCT_MEMBER(size_t, message,
+						 field->quantifier_offset);
+			void **parray = STRUCT_MEMBER_PTR(void *, message,
+							  field->offset);
+
+			if (*parray == r->data) {
+				if (r->n_spare > n)
+					free_repeated_elements(field, r->data,
+						n, r->n_spare, NULL, allocator);
+			} else {
+				free_repeated_elements(field, r->data,
+						       0, r->n_spare, NULL,
+						       allocator);
+				keep_unused_array(parray, n, r, allocator);
+			}
+		} else if (field->type == PROTOBUF_C_TYPE_MESSAGE) {
+			protobuf_c_message_free_unpacked(r->data, allocator);
+		} else {
+			do_free(allocator, r->data);
+		}
+	}
+
+	r = retained + desc->n_fields;
+	if (r->data != NULL && (void *) message->unknown_fields != r->data)
+		keep_unused_array((void **) &message->unknown_fields,
+				  message->n_unknown_fields, r, allocator);
 }
 
 static protobuf_c_boolean
-parse_repeated_member(ScannedMember *scanned_member,
-		      void *member,
-		      ProtobufCMessage *message,
-		      ProtobufCAllocator *allocator)
+message_unpack_into(ProtobufCMessage *message,
+		    ProtobufCAllocator *allocator,
+		    unsigned flags,
+		    ProtobufCUnpackContext *context,
+		    size_t len, const uint8_t *data)
 {
-	const ProtobufCFieldDescriptor *field = scanned_member->field;
-	size_t *p_n = STRUCT_MEMBER_PTR(size_t, message, field->quantifier_offset);
-	size_t siz = sizeof_elt_in_repeated_array(field->type);
-	char *array = *(char **) member;
+	const ProtobufCMessageDescriptor *desc = message->descriptor;
+	RetainedStorage retained_stack[RETAINED_STORAGE_STACK_ENTRIES];
+	RetainedStorage *retained = retained_stack;
+	protobuf_c_boolean ok;
+
+	if (allocator->free == &arena_free) {
+		/* nothing to reuse: the arena reclaims the old tree wholesale */
+		message_reset(desc, message);
+		ok = message_unpack_fields(message, allocator, flags, context,
+					   len, data, NULL, NULL);
+		if (!ok)
+			message_reset(desc, message);
+		return ok;
+	}
 
-	if (!parse_required_member(scanned_member, array + siz * (*p_n),
-				   allocator, FALSE))
-	{
-		return FALSE;
+	if (desc->n_fields + 1 > RETAINED_STORAGE_STACK_ENTRIES) {
+		retained = do_alloc(allocator,
+				    (desc->n_fields + 1) * sizeof(*retained));
+		if (retained == NULL) {
+			protobuf_c_message_clear(message, allocator);
+			return FALSE;
+		}
 	}
-	*p_n += 1;
-	return TRUE;
+	message_retain_storage(message, retained, allocator);
+	ok = message_unpack_fields(message, allocator, flags, context,
+				   len, data, retained, NULL);
+	message_release_storage(message, retained, allocator);
+	if (retained != retained_stack)
+		do_free(allocator, retained);
+	if (!ok)
+		protobuf_c_message_clear(message, allocator);
+	return ok;
 }
 
-static unsigned
-scan_varint(unsigned len, const uint8_t *data)
+protobuf_c_boolean
+protobuf_c_message_unpack_into(ProtobufCMessage *message,
+			       ProtobufCAllocator *allocator,
+			       size_t len, const uint8_t *data)
 {
-	unsigned i;
-	if (len > 10)
-		len = 10;
-	for (i = 0; i < len; i++)
-		if ((data[i] & 0x80) == 0)
-			break;
-	if (i == len)
-		return 0;
-	return i + 1;
+	ASSERT_IS_MESSAGE(message);
+
+	if (allocator == NULL)
+		allocator = &protobuf_c__allocator;
+	return message_unpack_into(message, allocator, 0, NULL, len, data);
 }
 
+/*
+ * Incremental unpacking.
+ *
+ * A ProtobufCMessageParser keeps a stack of frames, one for each message whose
+ * encoding straddles the data fed so far: the outermost message, and any
+ * sub-message that didn't arrive in one piece. A field that is contained in a
+ * single call to protobuf_c_message_parser_feed() is parsed straight from the
+ * caller's data, like protobuf_c_message_unpack() would. Otherwise the start
+ * of the field, up to the end of its length prefix or scalar value, is
+ * gathered in `header`; the data of a sub-message is then parsed into a new
+ * frame as it comes, and that of any other length-prefixed field is gathered
+ * in `buf` until it is complete.
+ */
+
+/** Longest tag plus longest varint. */
+#define PARSER_HEADER_MAX	15
+
+typedef struct ParserFrame ParserFrame;
+/** A message being unpacked by a `ProtobufCMessageParser`. */
+struct ParserFrame {
+	/** The message, already linked into its parent. */
+	ProtobufCMessage *message;
+	/** Bytes of the message still to come. Unbounded for the outermost. */
+	size_t rem;
+	/** Index of the field seen last, for find_field_index(). */
+	unsigned last_field_index;
+	/** One bit per field, set once a required field has been seen. */
+	unsigned char *required_fields_bitmap;
+};
+
+struct ProtobufCMessageParser {
+	ProtobufCAllocator *allocator;
+	unsigned flags;
+	/** Set after an error; the parser then rejects everything. */
+	protobuf_c_boolean failed;
+
+	/** Messages being unpacked, outermost first. */
+	ParserFrame *frames;
+	unsigned n_frames;
+	unsigned frames_alloced;
+
+	/** Start of a field whose tag or value is split across feeds. */
+	uint8_t header[PARSER_HEADER_MAX];
+	unsigned header_len;
+
+	/** Length-prefixed field being gathered, if `buf_need` is non-zero. */
+	ScannedMember pending;
+	/** Its data, length prefix included. */
+	uint8_t *buf;
+	size_t buf_len;
+	size_t buf_need;
+	size_t buf_alloced;
+};
+
+/**
+ * Read the tag of the field starting at `at`, and the varint, fixed-size
+ * value or length prefix that follows it.
+ *
+ * \param avail
+ *      Number of bytes available at `at`.
+ * \param[out] member
+ *      The field. `data` points just after the tag, and `len` is the size of
+ *      the field data, which for a length-prefixed field extends past the
+ *      header.
+ * \param[out] header_len_out
+ *      Number of bytes taken up by the header, or 0 if more are needed to
+ *      complete it.
+ * \retval FALSE
+ *      If the header is malformed.
+ */
 static protobuf_c_boolean
-parse_packed_repeated_member(ScannedMember *scanned_member,
-			     void *member,
-			     ProtobufCMessage *message)
+parser_scan_header(size_t avail, const uint8_t *at, ScannedMember *member,
+		   size_t *header_len_out)
 {
-	const ProtobufCFieldDescriptor *field = scanned_member->field;
-	size_t *p_n = STRUCT_MEMBER_PTR(size_t, message, field->quantifier_offset);
-	size_t siz = sizeof_elt_in_repeated_array(field->type);
-	void *array = *(char **) member + siz * (*p_n);
-	const uint8_t *at = scanned_member->data + scanned_member->length_prefix_len;
-	size_t rem = scanned_member->len - scanned_member->length_prefix_len;
-	size_t count = 0;
-#if defined(WORDS_BIGENDIAN)
+	unsigned limit = 5;
+	unsigned max_len = avail < limit ? avail : limit;
+	size_t tag_len;
+	size_t val = 0;
 	unsigned i;
-#endif
-
-	switch (field->type) {
-	case PROTOBUF_C_TYPE_SFIXED32:
-	case PROTOBUF_C_TYPE_FIXED32:
-	case PROTOBUF_C_TYPE_FLOAT:
-		count = (scanned_member->len - scanned_member->length_prefix_len) / 4;
-#if !defined(WORDS_BIGENDIAN)
-		goto no_unpacking_needed;
-#else
-		for (i = 0; i < count; i++) {
-			((uint32_t *) array)[i] = parse_fixed_uint32(at);
-			at += 4;
-		}
-		break;
-#endif
-	case PROTOBUF_C_TYPE_SFIXED64:
-	case PROTOBUF_C_TYPE_FIXED64:
-	case PROTOBUF_C_TYPE_DOUBLE:
-		count = (scanned_member->len - scanned_member->length_prefix_len) / 8;
-#if !defined(WORDS_BIGENDIAN)
-		goto no_unpacking_needed;
-#else
-		for (i = 0; i < count; i++) {
-			((uint64_t *) array)[i] = parse_fixed_uint64(at);
-			at += 8;
-		}
-		break;
-#endif
-	case PROTOBUF_C_TYPE_ENUM:
-	case PROTOBUF_C_TYPE_INT32:
-		while (rem > 0) {
-			unsigned s = scan_varint(rem, at);
-			if (s == 0) {
-				PROTOBUF_C_UNPACK_ERROR("bad packed-repeated int32 value");
-				return FALSE;
-			}
-			((int32_t *) array)[count++] = parse_int32(s, at);
-			at += s;
-			rem -= s;
-		}
-		break;
-	case PROTOBUF_C_TYPE_SINT32:
-		while (rem > 0) {
-			unsigned s = scan_varint(rem, at);
-			if (s == 0) {
-				PROTOBUF_C_UNPACK_ERROR("bad packed-repeated sint32 value");
-				return FALSE;
-			}
-			((int32_t *) array)[count++] = unzigzag32(parse_uint32(s, at));
-			at += s;
-			rem -= s;
-		}
-		break;
-	case PROTOBUF_C_TYPE_UINT32:
-		while (rem > 0) {
-			unsigned s = scan_varint(rem, at);
-			if (s == 0) {
-				PROTOBUF_C_UNPACK_ERROR("bad packed-repeated enum or uint32 value");
-				return FALSE;
-			}
-			((uint32_t *) array)[count++] = parse_uint32(s, at);
-			at += s;
-			rem -= s;
-		}
-		break;
 
-	case PROTOBUF_C_TYPE_SINT64:
-		while (rem > 0) {
-			unsigned s = scan_varint(rem, at);
-			if (s == 0) {
-				PROTOBUF_C_UNPACK_ERROR("bad packed-repeated sint64 value");
-				return FALSE;
-			}
-			((int64_t *) array)[count++] = unzigzag64(parse_uint64(s, at));
-			at += s;
-			rem -= s;
-		}
-		break;
-	case PROTOBUF_C_TYPE_INT64:
-	case PROTOBUF_C_TYPE_UINT64:
-		while (rem > 0) {
-			unsigned s = scan_varint(rem, at);
-			if (s == 0) {
-				PROTOBUF_C_UNPACK_ERROR("bad packed-repeated int64/uint64 value");
-				return FALSE;
-			}
-			((int64_t *) array)[count++] = parse_uint64(s, at);
-			at += s;
-			rem -= s;
+	*header_len_out = 0;
+	for (i = 0; i < max_len; i++)
+		if ((at[i] & 0x80) == 0)
+			break;
+	if (i == max_len)
+		goto incomplete;
+	tag_len = parse_tag_and_wiretype(i + 1, at, &member->tag,
+					 &member->wire_type);
+	if (tag_len == 0) {
+		PROTOBUF_C_UNPACK_ERROR("error parsing tag/wiretype");
+		return FALSE;
+	}
+	at += tag_len;
+	avail -= tag_len;
+	member->data = at;
+	member->length_prefix_len = 0;
+
+	switch (member->wire_type) {
+	case PROTOBUF_C_WIRE_TYPE_VARINT:
+		limit = 10;
+		max_len = avail < limit ? avail : limit;
+		for (i = 0; i < max_len; i++)
+			if ((at[i] & 0x80) == 0)
+				break;
+		if (i == max_len)
+			goto incomplete;
+		member->len = i + 1;
+		*header_len_out = tag_len + member->len;
+		return TRUE;
+	case PROTOBUF_C_WIRE_TYPE_64BIT:
+		if (avail < 8)
+			return TRUE;
+		member->len = 8;
+		*header_len_out = tag_len + 8;
+		return TRUE;
+	case PROTOBUF_C_WIRE_TYPE_32BIT:
+		if (avail < 4)
+			return TRUE;
+		member->len = 4;
+		*header_len_out = tag_len + 4;
+		return TRUE;
+	case PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED:
+		max_len = avail < limit ? avail : limit;
+		for (i = 0; i < max_len; i++) {
+			val |= ((size_t) at[i] & 0x7f) << (7 * i);
+			if ((at[i] & 0x80) == 0)
+				break;
 		}
-		break;
-	case PROTOBUF_C_TYPE_BOOL:
-		while (rem > 0) {
-			unsigned s = scan_varint(rem, at);
-			if (s == 0) {
-				PROTOBUF_C_UNPACK_ERROR("bad packed-repeated boolean value");
-				return FALSE;
-			}
-			((protobuf_c_boolean *) array)[count++] = parse_boolean(s, at);
-			at += s;
-			rem -= s;
+		if (i == max_len)
+			goto incomplete;
+		if (val > INT_MAX) {
+			PROTOBUF_C_UNPACK_ERROR("length prefix of %lu is too large",
+						(unsigned long int) val);
+			return FALSE;
 		}
-		break;
+		member->length_prefix_len = i + 1;
+		member->len = i + 1 + val;
+		*header_len_out = tag_len + i + 1;
+		return TRUE;
 	default:
-		PROTOBUF_C__ASSERT_NOT_REACHED();
+		PROTOBUF_C_UNPACK_ERROR("unsupported tag %u", member->wire_type);
+		return FALSE;
 	}
-	*p_n += count;
-	return TRUE;
 
-#if !defined(WORDS_BIGENDIAN)
-no_unpacking_needed:
-	memcpy(array, at, count * siz);
-	*p_n += count;
+incomplete:
+	/* a varint is malformed if it runs on over all the bytes it may take */
+	if (max_len == limit) {
+		PROTOBUF_C_UNPACK_ERROR("unterminated varint");
+		return FALSE;
+	}
 	return TRUE;
-#endif
 }
 
+/**
+ * Push a frame for `message`, whose encoding is `rem` bytes long.
+ */
 static protobuf_c_boolean
-is_packable_type(ProtobufCType type)
+parser_push_frame(ProtobufCMessageParser *parser, ProtobufCMessage *message,
+		  size_t rem)
 {
-	return
-		type != PROTOBUF_C_TYPE_STRING &&
-		type != PROTOBUF_C_TYPE_BYTES &&
-		type != PROTOBUF_C_TYPE_MESSAGE;
+	ProtobufCAllocator *allocator = parser->allocator;
+	size_t bitmap_len = (message->descriptor->n_fields + 7) / 8 + 1;
+	ParserFrame *frame;
+
+	if (parser->n_frames == parser->frames_alloced) {
+		unsigned new_alloced = parser->frames_alloced * 2;
+		ParserFrame *frames;
+
+		frames = do_alloc(allocator, new_alloced * sizeof(ParserFrame));
+		if (frames == NULL)
+			return FALSE;
+		memcpy(frames, parser->frames,
+		       parser->n_frames * sizeof(ParserFrame));
+		do_free(allocator, parser->frames);
+		parser->frames = frames;
+		parser->frames_alloced = new_alloced;
+	}
+	frame = parser->frames + parser->n_frames;
+	frame->required_fields_bitmap = do_alloc(allocator, bitmap_len);
+	if (frame->required_fields_bitmap == NULL)
+		return FALSE;
+	memset(frame->required_fields_bitmap, 0, bitmap_len);
+	frame->message = message;
+	frame->rem = rem;
+	frame->last_field_index = 0;
+	parser->n_frames++;
+	return TRUE;
 }
 
+/**
+ * Pop the innermost frame, checking that its message has all its required
+ * fields.
+ */
 static protobuf_c_boolean
-parse_member(ScannedMember *scanned_member,
-	     ProtobufCMessage *message,
-	     ProtobufCAllocator *allocator)
+parser_pop_frame(ProtobufCMessageParser *parser)
 {
-	const ProtobufCFieldDescriptor *field = scanned_member->field;
-	void *member;
+	ParserFrame *frame = parser->frames + parser->n_frames - 1;
+	const ProtobufCMessageDescriptor *desc = frame->message->descriptor;
+	unsigned char *required_fields_bitmap = frame->required_fields_bitmap;
+	protobuf_c_boolean rv = TRUE;
+	unsigned f;
 
-	if (field == NULL) {
-		ProtobufCMessageUnknownField *ufield =
-			message->unknown_fields +
-			(message->n_unknown_fields++);
-		ufield->tag = scanned_member->tag;
-		ufield->wire_type = scanned_member->wire_type;
-		ufield->len = scanned_member->len;
-		ufield->data = do_alloc(allocator, scanned_member->len);
-		if (ufield->data == NULL)
-			return FALSE;
-		memcpy(ufield->data, scanned_member->data, ufield->len);
-		return TRUE;
-	}
-	member = (char *) message + field->offset;
-	switch (field->label) {
-	case PROTOBUF_C_LABEL_REQUIRED:
-		return parse_required_member(scanned_member, member,
-					     allocator, TRUE);
-	case PROTOBUF_C_LABEL_OPTIONAL:
-	case PROTOBUF_C_LABEL_NONE:
-		if (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_ONEOF)) {
-			return parse_oneof_member(scanned_member, member,
-						  message, allocator);
-		} else {
-			return parse_optional_member(scanned_member, member,
-						     message, allocator);
-		}
-	case PROTOBUF_C_LABEL_REPEATED:
-		if (scanned_member->wire_type ==
-		    PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED &&
-		    (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_PACKED) ||
-		     is_packable_type(field->type)))
+	for (f = 0; f < desc->n_fields; f++) {
+		const ProtobufCFieldDescriptor *field = desc->fields + f;
+		if (field->label == PROTOBUF_C_LABEL_REQUIRED &&
+		    field->default_value == NULL &&
+		    !REQUIRED_FIELD_BITMAP_IS_SET(f))
 		{
-			return parse_packed_repeated_member(scanned_member,
-							    member, message);
-		} else {
-			return parse_repeated_member(scanned_member,
-						     member, message,
-						     allocator);
+			PROTOBUF_C_UNPACK_ERROR("message '%s': missing required field '%s'",
+						desc->name, field->name);
+			rv = FALSE;
+			break;
 		}
 	}
-	PROTOBUF_C__ASSERT_NOT_REACHED();
-	return 0;
+	do_free(parser->allocator, required_fields_bitmap);
+	parser->n_frames--;
+	return rv;
 }
 
 /**
- * Initialise messages generated by old code.
- *
- * This function is used if desc->message_init == NULL (which occurs
- * for old code, and which would be useful to support allocating
- * descriptors dynamically).
+ * Look up the field read into `member` in the message of the innermost frame.
  */
 static void
-message_init_generic(const ProtobufCMessageDescriptor *desc,
-		     ProtobufCMessage *message)
+parser_find_field(ProtobufCMessageParser *parser, ScannedMember *member)
 {
-	unsigned i;
-
-	memset(message, 0, desc->sizeof_message);
-	message->descriptor = desc;
-	for (i = 0; i < desc->n_fields; i++) {
-		if (desc->fields[i].default_value != NULL &&
-		    desc->fields[i].label != PROTOBUF_C_LABEL_REPEATED)
-		{
-			void *field =
-				STRUCT_MEMBER_P(message, desc->fields[i].offset);
-			const void *dv = desc->fields[i].default_value;
+	ParserFrame *frame = parser->frames + parser->n_frames - 1;
+	const ProtobufCMessageDescriptor *desc = frame->message->descriptor;
+	unsigned char *required_fields_bitmap = frame->required_fields_bitmap;
+	int field_index;
+
+	member->retained = NULL;
+	member->mask = NULL;
+	member->context = NULL;
+	field_index = find_field_index(desc, member->tag,
+				       frame->last_field_index);
+	if (field_index < 0) {
+		member->field = NULL;
+		return;
+	}
+	member->field = desc->fields + field_index;
+	frame->last_field_index = field_index;
+	if (member->field->label == PROTOBUF_C_LABEL_REQUIRED)
+		REQUIRED_FIELD_BITMAP_SET(field_index);
+}
 
-			switch (desc->fields[i].type) {
-			case PROTOBUF_C_TYPE_INT32:
-			case PROTOBUF_C_TYPE_SINT32:
-			case PROTOBUF_C_TYPE_SFIXED32:
-			case PROTOBUF_C_TYPE_UINT32:
-			case PROTOBUF_C_TYPE_FIXED32:
-			case PROTOBUF_C_TYPE_FLOAT:
-			case PROTOBUF_C_TYPE_ENUM:
-				memcpy(field, dv, 4);
-				break;
-			case PROTOBUF_C_TYPE_INT64:
-			case PROTOBUF_C_TYPE_SINT64:
-			case PROTOBUF_C_TYPE_SFIXED64:
-			case PROTOBUF_C_TYPE_UINT64:
-			case PROTOBUF_C_TYPE_FIXED64:
-			case PROTOBUF_C_TYPE_DOUBLE:
-				memcpy(field, dv, 8);
-				break;
-			case PROTOBUF_C_TYPE_BOOL:
-				memcpy(field, dv, sizeof(protobuf_c_boolean));
-				break;
-			case PROTOBUF_C_TYPE_BYTES:
-				memcpy(field, dv, sizeof(ProtobufCBinaryData));
-				break;
+static protobuf_c_boolean
+parser_parse_member(ProtobufCMessageParser *parser, ScannedMember *member)
+{
+	ProtobufCMessage *message = parser->frames[parser->n_frames - 1].message;
 
-			case PROTOBUF_C_TYPE_STRING:
-			case PROTOBUF_C_TYPE_MESSAGE:
-				/*
-				 * The next line essentially implements a cast
-				 * from const, which is totally unavoidable.
-				 */
-				*(const void **) field = dv;
-				break;
-			}
-		}
+	if (!parse_member(member, message, parser->allocator, parser->flags)) {
+		PROTOBUF_C_UNPACK_ERROR("error parsing member %s of %s",
+					member->field ? member->field->name : "*unknown-field*",
+					message->descriptor->name);
+		return FALSE;
 	}
+	return TRUE;
 }
 
-/**@}*/
-
-/*
- * ScannedMember slabs (an unpacking implementation detail). Before doing real
- * unpacking, we first scan through the elements to see how many there are (for
- * repeated fields), and which field to use (for non-repeated fields given
- * twice).
+/**
+ * Start a sub-message whose data is split across feeds, and push a frame
+ * for it.
  *
- * In order to avoid allocations for small messages, we keep a stack-allocated
- * slab of ScannedMembers of size FIRST_SCANNED_MEMBER_SLAB_SIZE (16). After we
- * fill that up, we allocate each slab twice as large as the previous one.
- */
-#define FIRST_SCANNED_MEMBER_SLAB_SIZE_LOG2 4
-
-/*
- * The number of slabs, including the stack-allocated ones; choose the number so
- * that we would overflow if we needed a slab larger than provided.
+ * A singular sub-message that is already set is parsed into, which merges the
+ * two the same way protobuf_c_message_unpack() does. A repeated one gets a
+ * new element, and a oneof member replaces the oneof's value.
  */
-#define MAX_SCANNED_MEMBER_SLAB			\
-  (sizeof(unsigned int)*8 - 1			\
-   - BOUND_SIZEOF_SCANNED_MEMBER_LOG2		\
-   - FIRST_SCANNED_MEMBER_SLAB_SIZE_LOG2)
-
-#define REQUIRED_FIELD_BITMAP_SET(index)	\
-	(required_fields_bitmap[(index)/8] |= (1UL<<((index)%8)))
+static protobuf_c_boolean
+parser_start_submessage(ProtobufCMessageParser *parser,
+			const ProtobufCFieldDescriptor *field, size_t len)
+{
+	ProtobufCAllocator *allocator = parser->allocator;
+	ProtobufCMessage *parent = parser->frames[parser->n_frames - 1].message;
+	const ProtobufCMessageDescriptor *desc = field->descriptor;
+	void *member = STRUCT_MEMBER_P(parent, field->offset);
+	ProtobufCMessage **pmessage = member;
+	ProtobufCMessage *subm = NULL;
+
+	if (field->label == PROTOBUF_C_LABEL_REPEATED) {
+		size_t *p_n = STRUCT_MEMBER_PTR(size_t, parent,
+						field->quantifier_offset);
+
+		if (!reserve_array(member, sizeof(ProtobufCMessage *), *p_n, 1,
+				   NULL, allocator))
+			return FALSE;
+		pmessage = *(ProtobufCMessage ***) member + *p_n;
+		*pmessage = NULL;
+		*p_n += 1;
+	} else if (field->flags & PROTOBUF_C_FIELD_FLAG_ONEOF) {
+		uint32_t *oneof_case = STRUCT_MEMBER_PTR(uint32_t, parent,
+							 field->quantifier_offset);
+
+		if (!clear_oneof(parent, oneof_case, member, allocator, NULL))
+			return FALSE;
+		*oneof_case = field->id;
+	} else if (*pmessage != NULL && *pmessage != field->default_value) {
+		subm = *pmessage;
+	}
 
-#define REQUIRED_FIELD_BITMAP_IS_SET(index)	\
-	(required_fields_bitmap[(index)/8] & (1UL<<((index)%8)))
+	if (subm == NULL) {
+		subm = do_alloc(allocator, desc->sizeof_message);
+		if (subm == NULL)
+			return FALSE;
+		message_reset(desc, subm);
+		*pmessage = subm;
+	}
+	return parser_push_frame(parser, subm, len);
+}
 
-ProtobufCMessage *
-protobuf_c_message_unpack(const ProtobufCMessageDescriptor *desc,
-			  ProtobufCAllocator *allocator,
-			  size_t len, const uint8_t *data)
+/**
+ * Start a field that is split across feeds, once its header has been
+ * gathered: parse it if the header is all there is to it, push a frame if it
+ * is a sub-message, or else get ready to gather its data.
+ */
+static protobuf_c_boolean
+parser_start_member(ProtobufCMessageParser *parser, ScannedMember *member)
 {
-	ProtobufCMessage *rv;
-	size_t rem = len;
-	const uint8_t *at = data;
-	const ProtobufCFieldDescriptor *last_field = desc->fields + 0;
-	ScannedMember first_member_slab[1UL <<
-					FIRST_SCANNED_MEMBER_SLAB_SIZE_LOG2];
+	ProtobufCAllocator *allocator = parser->allocator;
+	size_t prefix_len = member->length_prefix_len;
+
+	parser_find_field(parser, member);
+	if (member->wire_type != PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED ||
+	    member->len == prefix_len)
+		return parser_parse_member(parser, member);
+	if (member->field != NULL &&
+	    member->field->type == PROTOBUF_C_TYPE_MESSAGE)
+		return parser_start_submessage(parser, member->field,
+					       member->len - prefix_len);
+
+	if (member->len > parser->buf_alloced) {
+		size_t new_alloced = repeated_capacity(member->len);
+		uint8_t *buf = do_alloc(allocator, new_alloced);
+
+		if (buf == NULL)
+			return FALSE;
+		do_free(allocator, parser->buf);
+		parser->buf = buf;
+		parser->buf_alloced = new_alloced;
+	}
+	memcpy(parser->buf, member->data, prefix_len);
+	parser->buf_len = prefix_len;
+	parser->buf_need = member->len;
+	parser->pending = *member;
+	return TRUE;
+}
 
-	/*
-	 * scanned_member_slabs[i] is an array of arrays of ScannedMember.
-	 * The first slab (scanned_member_slabs[0] is just a pointer to
-	 * first_member_slab), above. All subsequent slabs will be allocated
-	 * using the allocator.
-	 */
-	ScannedMember *scanned_member_slabs[MAX_SCANNED_MEMBER_SLAB + 1];
-	unsigned which_slab = 0; /* the slab we are currently populating */
-	unsigned in_slab_index = 0; /* number of members in the slab */
-	size_t n_unknown = 0;
-	unsigned f;
-	unsigned j;
-	unsigned i_slab;
-	unsigned last_field_index = 0;
-	unsigned required_fields_bitmap_len;
-	unsigned char required_fields_bitmap_stack[16];
-	unsigned char *required_fields_bitmap = required_fields_bitmap_stack;
-	protobuf_c_boolean required_fields_bitmap_alloced = FALSE;
+ProtobufCMessageParser *
+protobuf_c_message_parser_new(const ProtobufCMessageDescriptor *descriptor,
+			      ProtobufCAllocator *allocator,
+			      unsigned flags)
+{
+	ProtobufCMessageParser *parser;
+	ProtobufCMessage *message;
 
-	ASSERT_IS_MESSAGE_DESCRIPTOR(desc);
+	ASSERT_IS_MESSAGE_DESCRIPTOR(descriptor);
 
 	if (allocator == NULL)
 		allocator = &protobuf_c__allocator;
+	parser = do_alloc(allocator, sizeof(ProtobufCMessageParser));
+	if (parser == NULL)
+		return NULL;
+	memset(parser, 0, sizeof(ProtobufCMessageParser));
+	parser->allocator = allocator;
+	/* fed data need not outlive the call, so nothing may point into it */
+	parser->flags = flags & ~PROTOBUF_C_UNPACK_FLAG_ZERO_COPY;
+	parser->frames_alloced = 8;
+	parser->frames = do_alloc(allocator,
+				  parser->frames_alloced * sizeof(ParserFrame));
+	message = do_alloc(allocator, descriptor->sizeof_message);
+	if (parser->frames == NULL || message == NULL) {
+		do_free(allocator, message);
+		do_free(allocator, parser->frames);
+		do_free(allocator, parser);
+		return NULL;
+	}
+	message_reset(descriptor, message);
+	if (!parser_push_frame(parser, message, SIZE_MAX)) {
+		do_free(allocator, message);
+		do_free(allocator, parser->frames);
+		do_free(allocator, parser);
+		return NULL;
+	}
+	return parser;
+}
 
-	rv = do_alloc(allocator, desc->sizeof_message);
-	if (!rv)
-		return (NULL);
-	scanned_member_slabs[0] = first_member_slab;
+protobuf_c_boolean
+protobuf_c_message_parser_feed(ProtobufCMessageParser *parser,
+			       size_t len, const uint8_t *data)
+{
+	while (len > 0 && !parser->failed) {
+		ParserFrame *frame = parser->frames + parser->n_frames - 1;
+		ScannedMember tmp;
+		size_t header_len;
+		size_t field_len;
+		size_t avail;
+
+		if (parser->buf_need != 0) {
+			/* more data for the field being gathered */
+			avail = parser->buf_need - parser->buf_len;
+			if (avail > len)
+				avail = len;
+			memcpy(parser->buf + parser->buf_len, data, avail);
+			parser->buf_len += avail;
+			data += avail;
+			len -= avail;
+			if (parser->buf_len < parser->buf_need)
+				break;
+			parser->buf_need = 0;
+			tmp = parser->pending;
+			tmp.data = parser->buf;
+			if (!parser_parse_member(parser, &tmp))
+				parser->failed = TRUE;
+			goto next;
+		}
 
-	required_fields_bitmap_len = (desc->n_fields + 7) / 8;
-	if (required_fields_bitmap_len > sizeof(required_fields_bitmap_stack)) {
-		required_fields_bitmap = do_alloc(allocator, required_fields_bitmap_len);
-		if (!required_fields_bitmap) {
-			do_free(allocator, rv);
-			return (NULL);
+		if (parser->header_len == 0) {
+			avail = len < frame->rem ? len : frame->rem;
+			if (!parser_scan_header(avail, data, &tmp, &header_len)) {
+				parser->failed = TRUE;
+				break;
+			}
+			field_len = header_len == 0 ? SIZE_MAX :
+				(size_t) (tmp.data - data) + tmp.len;
+			if (field_len <= avail) {
+				/* the whole field is here */
+				if (parser->n_frames > 1)
+					frame->rem -= field_len;
+				parser_find_field(parser, &tmp);
+				if (!parser_parse_member(parser, &tmp))
+					parser->failed = TRUE;
+				data += field_len;
+				len -= field_len;
+				goto next;
+			}
+		}
+
+		/* the field is split: gather its header */
+		avail = PARSER_HEADER_MAX - parser->header_len;
+		if (avail > len)
+			avail = len;
+		if (avail > frame->rem - parser->header_len)
+			avail = frame->rem - parser->header_len;
+		memcpy(parser->header + parser->header_len, data, avail);
+		if (!parser_scan_header(parser->header_len + avail,
+					parser->header, &tmp, &header_len))
+		{
+			parser->failed = TRUE;
+			break;
+		}
+		if (header_len == 0) {
+			parser->header_len += avail;
+			if (parser->header_len == frame->rem)
+				goto truncated;
+			data += avail;
+			len -= avail;
+			continue;
+		}
+		data += header_len - parser->header_len;
+		len -= header_len - parser->header_len;
+		parser->header_len = 0;
+		field_len = (size_t) (tmp.data - parser->header) + tmp.len;
+		if (field_len > frame->rem)
+			goto truncated;
+		if (parser->n_frames > 1)
+			frame->rem -= field_len;
+		if (!parser_start_member(parser, &tmp))
+			parser->failed = TRUE;
+
+next:
+		/* finish the sub-messages that are complete */
+		while (!parser->failed && parser->n_frames > 1 &&
+		       parser->frames[parser->n_frames - 1].rem == 0 &&
+		       parser->buf_need == 0)
+		{
+			if (!parser_pop_frame(parser))
+				parser->failed = TRUE;
 		}
-		required_fields_bitmap_alloced = TRUE;
 	}
-	memset(required_fields_bitmap, 0, required_fields_bitmap_len);
+	return !parser->failed;
 
-	/*
-	 * Generated code always defines "message_init". However, we provide a
-	 * fallback for (1) users of old protobuf-c generated-code that do not
-	 * provide the function, and (2) descriptors constructed from some other
-	 * source (most likely, direct construction from the .proto file).
-	 */
-	if (desc->message_init != NULL)
-		protobuf_c_message_init(desc, rv);
-	else
-		message_init_generic(desc, rv);
+truncated:
+	PROTOBUF_C_UNPACK_ERROR("field runs past the end of %s",
+				parser->frames[parser->n_frames - 1].message->descriptor->name);
+	parser->failed = TRUE;
+	return FALSE;
+}
 
-	while (rem > 0) {
-		uint32_t tag;
-		uint8_t wire_type;
-		size_t used = parse_tag_and_wiretype(rem, at, &tag, &wire_type);
-		const ProtobufCFieldDescriptor *field;
-		ScannedMember tmp;
+ProtobufCMessage *
+protobuf_c_message_parser_finish(ProtobufCMessageParser *parser)
+{
+	ProtobufCMessage *rv = NULL;
 
-		if (used == 0) {
-			PROTOBUF_C_UNPACK_ERROR("error parsing tag/wiretype at offset %u",
-						(unsigned) (at - data));
-			goto error_cleanup_during_scan;
-		}
-		/*
-		 * \todo Consider optimizing for field[1].id == tag, if field[1]
-		 * exists!
-		 */
-		if (last_field == NULL || last_field->id != tag) {
-			/* lookup field */
-			int field_index =
-			    int_range_lookup(desc->n_field_ranges,
-					     desc->field_ranges,
-					     tag);
-			if (field_index < 0) {
-				field = NULL;
-				n_unknown++;
-			} else {
-				field = desc->fields + field_index;
-				last_field = field;
-				last_field_index = field_index;
-			}
-		} else {
-			field = last_field;
+	if (!parser->failed) {
+		if (parser->n_frames > 1 || parser->header_len != 0 ||
+		    parser->buf_need != 0)
+		{
+			PROTOBUF_C_UNPACK_ERROR("message '%s' is truncated",
+						parser->frames[0].message->descriptor->name);
+		} else if (parser_pop_frame(parser)) {
+			rv = parser->frames[0].message;
+			parser->frames[0].message = NULL;
 		}
+	}
+	protobuf_c_message_parser_free(parser);
+	return rv;
+}
 
-		if (field != NULL && field->label == PROTOBUF_C_LABEL_REQUIRED)
-			REQUIRED_FIELD_BITMAP_SET(last_field_index);
+void
+protobuf_c_message_parser_free(ProtobufCMessageParser *parser)
+{
+	ProtobufCAllocator *allocator;
+	unsigned i;
 
-		at += used;
-		rem -= used;
-		tmp.tag = tag;
-		tmp.wire_type = wire_type;
-		tmp.field = field;
-		tmp.data = at;
-		tmp.length_prefix_len = 0;
-
-		switch (wire_type) {
-		case PROTOBUF_C_WIRE_TYPE_VARINT: {
-			unsigned max_len = rem < 10 ? rem : 10;
-			unsigned i;
-
-			for (i = 0; i < max_len; i++)
-				if ((at[i] & 0x80) == 0)
-					break;
-			if (i == max_len) {
-				PROTOBUF_C_UNPACK_ERROR("unterminated varint at offset %u",
-							(unsigned) (at - data));
-				goto error_cleanup_during_scan;
-			}
-			tmp.len = i + 1;
-			break;
+	if (parser == NULL)
+		return;
+	allocator = parser->allocator;
+	for (i = 0; i < parser->n_frames; i++)
+		do_free(allocator, parser->frames[i].required_fields_bitmap);
+	/* sub-messages are linked into the outermost message */
+	if (parser->frames[0].message != NULL)
+		protobuf_c_message_free_unpacked(parser->frames[0].message,
+						 allocator);
+	do_free(allocator, parser->frames);
+	do_free(allocator, parser->buf);
+	do_free(allocator, parser);
+}
+
+ProtobufCMessage *
+protobuf_c_message_unpack_segments(const ProtobufCMessageDescriptor *descriptor,
+				   ProtobufCAllocator *allocator,
+				   unsigned flags,
+				   size_t n_segments,
+				   const ProtobufCSegment *segments)
+{
+	ProtobufCMessageParser *parser;
+	size_t n_nonempty = 0;
+	size_t last = 0;
+	size_t i;
+
+	for (i = 0; i < n_segments; i++) {
+		if (segments[i].len != 0) {
+			n_nonempty++;
+			last = i;
 		}
-		case PROTOBUF_C_WIRE_TYPE_64BIT:
-			if (rem < 8) {
-				PROTOBUF_C_UNPACK_ERROR("too short after 64bit wiretype at offset %u",
-							(unsigned) (at - data));
-				goto error_cleanup_during_scan;
-			}
-			tmp.len = 8;
+	}
+	flags &= ~PROTOBUF_C_UNPACK_FLAG_ZERO_COPY;
+	if (n_nonempty <= 1) {
+		/* contiguous after all */
+		return protobuf_c_message_unpack_with_flags(descriptor, allocator,
+			flags, n_nonempty == 0 ? 0 : segments[last].len,
+			n_nonempty == 0 ? NULL : segments[last].data);
+	}
+
+	parser = protobuf_c_message_parser_new(descriptor, allocator, flags);
+	if (parser == NULL)
+		return NULL;
+	for (i = 0; i < n_segments; i++) {
+		if (!protobuf_c_message_parser_feed(parser, segments[i].len,
+						    segments[i].data))
 			break;
-		case PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED: {
-			size_t pref_len;
+	}
+	return protobuf_c_message_parser_finish(parser);
+}
 
-			tmp.len = scan_length_prefixed_data(rem, at, &pref_len);
-			if (tmp.len == 0) {
-				/* NOTE: scan_length_prefixed_data calls UNPACK_ERROR */
-				goto error_cleanup_during_scan;
-			}
-			tmp.length_prefix_len = pref_len;
+/*
+ * Streams of length-delimited messages.
+ */
+
+/** Default size of the stream reader and writer buffers. */
+#define STREAM_BUFFER_SIZE	65536
+
+struct ProtobufCStreamReader {
+	const ProtobufCMessageDescriptor *descriptor;
+	ProtobufCAllocator *allocator;
+	unsigned flags;
+	/** Where to read more data from, or NULL if it is all in `buf`. */
+	ProtobufCStreamSource *source;
+	/** The data read, which the reader owns if `source` is not NULL. */
+	uint8_t *buf;
+	size_t buf_alloced;
+	/** The data not unpacked yet is `buf[start]` to `buf[end - 1]`. */
+	size_t start;
+	size_t end;
+	/** Set once `source` has returned 0 or an error. */
+	protobuf_c_boolean eof;
+	/** Set after an error; the reader then returns no more messages. */
+	protobuf_c_boolean failed;
+};
+
+struct ProtobufCStreamWriter {
+	ProtobufCBuffer *buffer;
+	ProtobufCAllocator *allocator;
+	/** Framed messages waiting to be handed to `buffer`. */
+	uint8_t *buf;
+	size_t buf_len;
+	size_t buf_alloced;
+};
+
+/**
+ * Move the unread data to the start of the buffer, and read more after it.
+ *
+ * \retval FALSE
+ *      At the end of the stream, or if reading failed, in which case
+ *      `reader->failed` is set.
+ */
+static protobuf_c_boolean
+stream_reader_fill(ProtobufCStreamReader *reader)
+{
+	size_t n;
+
+	if (reader->source == NULL || reader->eof)
+		return FALSE;
+	if (reader->start != 0) {
+		memmove(reader->buf, reader->buf + reader->start,
+			reader->end - reader->start);
+		reader->end -= reader->start;
+		reader->start = 0;
+	}
+	n = reader->source->read(reader->source,
+				 reader->buf_alloced - reader->end,
+				 reader->buf + reader->end);
+	if (n == PROTOBUF_C_STREAM_READ_ERROR) {
+		PROTOBUF_C_UNPACK_ERROR("error reading the stream");
+		reader->failed = TRUE;
+	}
+	if (n == 0 || reader->failed) {
+		reader->eof = TRUE;
+		return FALSE;
+	}
+	reader->end += n;
+	return TRUE;
+}
+
+/**
+ * Unpack a message too large for the buffer, feeding it to a parser as it is
+ * read.
+ *
+ * \param len
+ *      Length of the message, whose first bytes are at `buf[start]`.
+ */
+static ProtobufCMessage *
+stream_reader_parse_large(ProtobufCStreamReader *reader, size_t len)
+{
+	ProtobufCMessageParser *parser;
+	size_t n;
+
+	parser = protobuf_c_message_parser_new(reader->descriptor,
+					       reader->allocator, reader->flags);
+	if (parser == NULL)
+		return NULL;
+	for (;;) {
+		n = reader->end - reader->start;
+		if (n > len)
+			n = len;
+		if (!protobuf_c_message_parser_feed(parser, n,
+						    reader->buf + reader->start))
 			break;
-		}
-		case PROTOBUF_C_WIRE_TYPE_32BIT:
-			if (rem < 4) {
-				PROTOBUF_C_UNPACK_ERROR("too short after 32bit wiretype at offset %u",
-					      (unsigned) (at - data));
-				goto error_cleanup_during_scan;
-			}
-			tmp.len = 4;
+		reader->start += n;
+		len -= n;
+		if (len == 0)
+			break;
+		reader->start = reader->end = 0;
+		if (!stream_reader_fill(reader)) {
+			PROTOBUF_C_UNPACK_ERROR("stream ends in the middle of a message");
 			break;
-		default:
-			PROTOBUF_C_UNPACK_ERROR("unsupported tag %u at offset %u",
-						wire_type, (unsigned) (at - data));
-			goto error_cleanup_during_scan;
 		}
+	}
+	if (len != 0) {
+		protobuf_c_message_parser_free(parser);
+		return NULL;
+	}
+	return protobuf_c_message_parser_finish(parser);
+}
 
-		if (in_slab_index == (1UL <<
-			(which_slab + FIRST_SCANNED_MEMBER_SLAB_SIZE_LOG2)))
-		{
-			size_t size;
+/**
+ * Unpack the next message of a stream.
+ *
+ * \return
+ *      The message, or NULL at the end of the stream or after an error, in
+ *      which case `reader->failed` is set.
+ */
+static ProtobufCMessage *
+stream_reader_next(ProtobufCStreamReader *reader)
+{
+	ProtobufCMessage *rv;
+	size_t prefix_len;
+	size_t len = 0;
+
+	/* the length prefix */
+	for (;;) {
+		size_t avail = reader->end - reader->start;
+		const uint8_t *at = reader->buf + reader->start;
+		unsigned max_len = avail < 5 ? avail : 5;
+		unsigned i;
 
-			in_slab_index = 0;
-			if (which_slab == MAX_SCANNED_MEMBER_SLAB) {
-				PROTOBUF_C_UNPACK_ERROR("too many fields");
-				goto error_cleanup_during_scan;
-			}
-			which_slab++;
-			size = sizeof(ScannedMember)
-				<< (which_slab + FIRST_SCANNED_MEMBER_SLAB_SIZE_LOG2);
-			scanned_member_slabs[which_slab] = do_alloc(allocator, size);
-			if (scanned_member_slabs[which_slab] == NULL)
-				goto error_cleanup_during_scan;
-		}
-		scanned_member_slabs[which_slab][in_slab_index++] = tmp;
-
-		if (field != NULL && field->label == PROTOBUF_C_LABEL_REPEATED) {
-			size_t *n = STRUCT_MEMBER_PTR(size_t, rv,
-						      field->quantifier_offset);
-			if (wire_type == PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED &&
-			    (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_PACKED) ||
-			     is_packable_type(field->type)))
-			{
-				size_t count;
-				if (!count_packed_elements(field->type,
-							   tmp.len -
-							   tmp.length_prefix_len,
-							   tmp.data +
-							   tmp.length_prefix_len,
-							   &count))
-				{
-					PROTOBUF_C_UNPACK_ERROR("counting packed elements");
-					goto error_cleanup_during_scan;
-				}
-				*n += count;
-			} else {
-				*n += 1;
+		for (i = 0; i < max_len; i++) {
+			len |= ((size_t) at[i] & 0x7f) << (7 * i);
+			if ((at[i] & 0x80) == 0)
+				break;
+		}
+		if (i < max_len) {
+			prefix_len = i + 1;
+			break;
+		}
+		if (max_len == 5) {
+			PROTOBUF_C_UNPACK_ERROR("error parsing length for length-prefixed data");
+			reader->failed = TRUE;
+			return NULL;
+		}
+		len = 0;
+		if (!stream_reader_fill(reader)) {
+			if (avail != 0) {
+				PROTOBUF_C_UNPACK_ERROR("stream ends in the middle of a length prefix");
+				reader->failed = TRUE;
 			}
+			return NULL;
 		}
-
-		at += tmp.len;
-		rem -= tmp.len;
 	}
+	if (len > INT_MAX) {
+		PROTOBUF_C_UNPACK_ERROR("length prefix of %lu is too large",
+					(unsigned long int) len);
+		reader->failed = TRUE;
+		return NULL;
+	}
+	reader->start += prefix_len;
 
-	/* allocate space for repeated fields, also check that all required fields have been set */
-	for (f = 0; f < desc->n_fields; f++) {
-		const ProtobufCFieldDescriptor *field = desc->fields + f;
-		if (field == NULL) {
-			continue;
-		}
-		if (field->label == PROTOBUF_C_LABEL_REPEATED) {
-			size_t siz =
-			    sizeof_elt_in_repeated_array(field->type);
-			size_t *n_ptr =
-			    STRUCT_MEMBER_PTR(size_t, rv,
-					      field->quantifier_offset);
-			if (*n_ptr != 0) {
-				unsigned n = *n_ptr;
-				void *a;
-				*n_ptr = 0;
-				assert(rv->descriptor != NULL);
-#define CLEAR_REMAINING_N_PTRS()                                              \
-              for(f++;f < desc->n_fields; f++)                                \
-                {                                                             \
-                  field = desc->fields + f;                                   \
-                  if (field->label == PROTOBUF_C_LABEL_REPEATED)              \
-                    STRUCT_MEMBER (size_t, rv, field->quantifier_offset) = 0; \
-                }
-				a = do_alloc(allocator, siz * n);
-				if (!a) {
-					CLEAR_REMAINING_N_PTRS();
-					goto error_cleanup;
-				}
-				STRUCT_MEMBER(void *, rv, field->offset) = a;
-			}
-		} else if (field->label == PROTOBUF_C_LABEL_REQUIRED) {
-			if (field->default_value == NULL &&
-			    !REQUIRED_FIELD_BITMAP_IS_SET(f))
-			{
-				CLEAR_REMAINING_N_PTRS();
-				PROTOBUF_C_UNPACK_ERROR("message '%s': missing required field '%s'",
-							desc->name, field->name);
-				goto error_cleanup;
-			}
+	/* the message */
+	if (len > reader->buf_alloced - reader->start &&
+	    len <= reader->buf_alloced && reader->source != NULL)
+	{
+		/* make room for it after what's buffered */
+		memmove(reader->buf, reader->buf + reader->start,
+			reader->end - reader->start);
+		reader->end -= reader->start;
+		reader->start = 0;
+	}
+	while (len > reader->end - reader->start &&
+	       len <= reader->buf_alloced - reader->start)
+	{
+		if (!stream_reader_fill(reader)) {
+			PROTOBUF_C_UNPACK_ERROR("stream ends in the middle of a message");
+			reader->failed = TRUE;
+			return NULL;
 		}
 	}
-#undef CLEAR_REMAINING_N_PTRS
-
-	/* allocate space for unknown fields */
-	if (n_unknown) {
-		rv->unknown_fields = do_alloc(allocator,
-					      n_unknown * sizeof(ProtobufCMessageUnknownField));
-		if (rv->unknown_fields == NULL)
-			goto error_cleanup;
+	if (len <= reader->end - reader->start) {
+		rv = message_unpack(reader->descriptor, reader->allocator,
+				    reader->flags, NULL, NULL, len,
+				    reader->buf + reader->start);
+		reader->start += len;
 	} else {
-		rv->unknown_fields = NULL;
+		rv = stream_reader_parse_large(reader, len);
 	}
+	if (rv == NULL)
+		reader->failed = TRUE;
+	return rv;
+}
+
+ProtobufCStreamReader *
+protobuf_c_stream_reader_new(const ProtobufCMessageDescriptor *descriptor,
+			     ProtobufCAllocator *allocator,
+			     unsigned flags,
+			     size_t len, const uint8_t *data)
+{
+	ProtobufCStreamReader *reader;
 
-	/* do real parsing */
-	for (i_slab = 0; i_slab <= which_slab; i_slab++) {
-		unsigned max = (i_slab == which_slab) ?
-			in_slab_index : (1UL << (i_slab + 4));
-		ScannedMember *slab = scanned_member_slabs[i_slab];
+	ASSERT_IS_MESSAGE_DESCRIPTOR(descriptor);
 
-		for (j = 0; j < max; j++) {
-			if (!parse_member(slab + j, rv, allocator)) {
-				PROTOBUF_C_UNPACK_ERROR("error parsing member %s of %s",
-							slab->field ? slab->field->name : "*unknown-field*",
-					desc->name);
-				goto error_cleanup;
-			}
-		}
+	if (allocator == NULL)
+		allocator = &protobuf_c__allocator;
+	if (allocator->free != &arena_free)
+		flags &= ~PROTOBUF_C_UNPACK_FLAG_ZERO_COPY;
+	reader = do_alloc(allocator, sizeof(ProtobufCStreamReader));
+	if (reader == NULL)
+		return NULL;
+	memset(reader, 0, sizeof(ProtobufCStreamReader));
+	reader->descriptor = descriptor;
+	reader->allocator = allocator;
+	reader->flags = flags;
+	reader->buf = (uint8_t *) data;
+	reader->buf_alloced = reader->end = len;
+	return reader;
+}
+
+ProtobufCStreamReader *
+protobuf_c_stream_reader_new_from_source(const ProtobufCMessageDescriptor *descriptor,
+					 ProtobufCAllocator *allocator,
+					 unsigned flags,
+					 ProtobufCStreamSource *source,
+					 size_t buffer_size)
+{
+	ProtobufCStreamReader *reader;
+
+	if (buffer_size == 0)
+		buffer_size = STREAM_BUFFER_SIZE;
+	/* room for a length prefix, at least */
+	if (buffer_size < 16)
+		buffer_size = 16;
+	reader = protobuf_c_stream_reader_new(descriptor, allocator,
+			flags & ~PROTOBUF_C_UNPACK_FLAG_ZERO_COPY, 0, NULL);
+	if (reader == NULL)
+		return NULL;
+	reader->buf = do_alloc(reader->allocator, buffer_size);
+	if (reader->buf == NULL) {
+		do_free(reader->allocator, reader);
+		return NULL;
 	}
+	reader->buf_alloced = buffer_size;
+	reader->source = source;
+	return reader;
+}
 
-	/* cleanup */
-	for (j = 1; j <= which_slab; j++)
-		do_free(allocator, scanned_member_slabs[j]);
-	if (required_fields_bitmap_alloced)
-		do_free(allocator, required_fields_bitmap);
-	return rv;
+size_t
+protobuf_c_stream_reader_read(ProtobufCStreamReader *reader,
+			      size_t max_messages,
+			      ProtobufCMessage **messages)
+{
+	size_t n;
 
-error_cleanup:
-	protobuf_c_message_free_unpacked(rv, allocator);
-	for (j = 1; j <= which_slab; j++)
-		do_free(allocator, scanned_member_slabs[j]);
-	if (required_fields_bitmap_alloced)
-		do_free(allocator, required_fields_bitmap);
-	return NULL;
+	for (n = 0; n < max_messages && !reader->failed; n++) {
+		messages[n] = stream_reader_next(reader);
+		if (messages[n] == NULL)
+			break;
+	}
+	return n;
+}
 
-error_cleanup_during_scan:
-	do_free(allocator, rv);
-	for (j = 1; j <= which_slab; j++)
-		do_free(allocator, scanned_member_slabs[j]);
-	if (required_fields_bitmap_alloced)
-		do_free(allocator, required_fields_bitmap);
-	return NULL;
+protobuf_c_boolean
+protobuf_c_stream_reader_failed(const ProtobufCStreamReader *reader)
+{
+	return reader->failed;
 }
 
 void
-protobuf_c_message_free_unpacked(ProtobufCMessage *message,
-				 ProtobufCAllocator *allocator)
+protobuf_c_stream_reader_free(ProtobufCStreamReader *reader)
 {
-	const ProtobufCMessageDescriptor *desc;
-	unsigned f;
-
-	if (message == NULL)
+	if (reader == NULL)
 		return;
+	if (reader->source != NULL)
+		do_free(reader->allocator, reader->buf);
+	do_free(reader->allocator, reader);
+}
 
-	desc = message->descriptor;
-
-	ASSERT_IS_MESSAGE(message);
+ProtobufCStreamWriter *
+protobuf_c_stream_writer_new(ProtobufCBuffer *buffer,
+			     ProtobufCAllocator *allocator,
+			     size_t buffer_size)
+{
+	ProtobufCStreamWriter *writer;
 
 	if (allocator == NULL)
 		allocator = &protobuf_c__allocator;
-	message->descriptor = NULL;
-	for (f = 0; f < desc->n_fields; f++) {
-		if (0 != (desc->fields[f].flags & PROTOBUF_C_FIELD_FLAG_ONEOF) &&
-		    desc->fields[f].id !=
-		    STRUCT_MEMBER(uint32_t, message, desc->fields[f].quantifier_offset))
-		{
-			/* This is not the selected oneof, skip it */
-			continue;
-		}
+	if (buffer_size == 0)
+		buffer_size = STREAM_BUFFER_SIZE;
+	writer = do_alloc(allocator, sizeof(ProtobufCStreamWriter));
+	if (writer == NULL)
+		return NULL;
+	writer->buf = do_alloc(allocator, buffer_size);
+	if (writer->buf == NULL) {
+		do_free(allocator, writer);
+		return NULL;
+	}
+	writer->buffer = buffer;
+	writer->allocator = allocator;
+	writer->buf_len = 0;
+	writer->buf_alloced = buffer_size;
+	return writer;
+}
 
-		if (desc->fields[f].label == PROTOBUF_C_LABEL_REPEATED) {
-			size_t n = STRUCT_MEMBER(size_t,
-						 message,
-						 desc->fields[f].quantifier_offset);
-			void *arr = STRUCT_MEMBER(void *,
-						  message,
-						  desc->fields[f].offset);
+size_t
+protobuf_c_stream_writer_write(ProtobufCStreamWriter *writer,
+			       size_t n_messages,
+			       const ProtobufCMessage *const *messages)
+{
+	size_t rv = 0;
+	size_t i;
 
-			if (arr != NULL) {
-				if (desc->fields[f].type == PROTOBUF_C_TYPE_STRING) {
-					unsigned i;
-					for (i = 0; i < n; i++)
-						do_free(allocator, ((char **) arr)[i]);
-				} else if (desc->fields[f].type == PROTOBUF_C_TYPE_BYTES) {
-					unsigned i;
-					for (i = 0; i < n; i++)
-						do_free(allocator, ((ProtobufCBinaryData *) arr)[i].data);
-				} else if (desc->fields[f].type == PROTOBUF_C_TYPE_MESSAGE) {
-					unsigned i;
-					for (i = 0; i < n; i++)
-						protobuf_c_message_free_unpacked(
-							((ProtobufCMessage **) arr)[i],
-							allocator
-						);
-				}
-				do_free(allocator, arr);
-			}
-		} else if (desc->fields[f].type == PROTOBUF_C_TYPE_STRING) {
-			char *str = STRUCT_MEMBER(char *, message,
-						  desc->fields[f].offset);
+	for (i = 0; i < n_messages; i++) {
+		size_t len = protobuf_c_message_get_packed_size(messages[i]);
+		size_t prefix_len = uint64_size(len);
 
-			if (str && str != desc->fields[f].default_value)
-				do_free(allocator, str);
-		} else if (desc->fields[f].type == PROTOBUF_C_TYPE_BYTES) {
-			void *data = STRUCT_MEMBER(ProtobufCBinaryData, message,
-						   desc->fields[f].offset).data;
-			const ProtobufCBinaryData *default_bd;
-
-			default_bd = desc->fields[f].default_value;
-			if (data != NULL &&
-			    (default_bd == NULL ||
-			     default_bd->data != data))
-			{
-				do_free(allocator, data);
-			}
-		} else if (desc->fields[f].type == PROTOBUF_C_TYPE_MESSAGE) {
-			ProtobufCMessage *sm;
+		if (prefix_len + len > writer->buf_alloced - writer->buf_len)
+			protobuf_c_stream_writer_flush(writer);
+		if (prefix_len + len > writer->buf_alloced) {
+			uint8_t prefix[10];
+
+			uint64_pack(len, prefix);
+			writer->buffer->append(writer->buffer, prefix_len, prefix);
+			protobuf_c_message_pack_to_buffer(messages[i],
+							  writer->buffer);
+		} else {
+			uint8_t *out = writer->buf + writer->buf_len;
 
-			sm = STRUCT_MEMBER(ProtobufCMessage *, message,
-					   desc->fields[f].offset);
-			if (sm && sm != desc->fields[f].default_value)
-				protobuf_c_message_free_unpacked(sm, allocator);
+			uint64_pack(len, out);
+			protobuf_c_message_pack(messages[i], out + prefix_len);
+			writer->buf_len += prefix_len + len;
 		}
+		rv += prefix_len + len;
 	}
+	return rv;
+}
 
-	for (f = 0; f < message->n_unknown_fields; f++)
-		do_free(allocator, message->unknown_fields[f].data);
-	if (message->unknown_fields != NULL)
-		do_free(allocator, message->unknown_fields);
+void
+protobuf_c_stream_writer_flush(ProtobufCStreamWriter *writer)
+{
+	if (writer->buf_len != 0) {
+		writer->buffer->append(writer->buffer, writer->buf_len,
+				       writer->buf);
+		writer->buf_len = 0;
+	}
+}
 
-	do_free(allocator, message);
+void
+protobuf_c_stream_writer_free(ProtobufCStreamWriter *writer)
+{
+	if (writer == NULL)
+		return;
+	protobuf_c_stream_writer_flush(writer);
+	do_free(writer->allocator, writer->buf);
+	do_free(writer->allocator, writer);
 }
 
 void
@@ -3418,8 +8189,18 @@ protobuf_c_message_init(const ProtobufCMessageDescriptor * descriptor,
 	descriptor->message_init((ProtobufCMessage *) (message));
 }
 
-protobuf_c_boolean
-protobuf_c_message_check(const ProtobufCMessage *message)
+ProtobufCAllocator *
+protobuf_c_default_allocator(void)
+{
+	return &protobuf_c__allocator;
+}
+
+/**
+ * Check the fields of one message for protobuf_c_message_check(), pushing
+ * its sub-messages on `pending` to be checked in turn.
+ */
+static protobuf_c_boolean
+message_check_fields(const ProtobufCMessage *message, PointerStack *pending)
 {
 	unsigned i;
 
@@ -3454,7 +8235,9 @@ protobuf_c_message_check(const ProtobufCMessage *message)
 				ProtobufCMessage **submessage = *(ProtobufCMessage ***) field;
 				unsigned j;
 				for (j = 0; j < *quantity; j++) {
-					if (!protobuf_c_message_check(submessage[j]))
+					if (!pointer_stack_push(pending,
+								submessage[j],
+								&protobuf_c__allocator))
 						return FALSE;
 				}
 			} else if (type == PROTOBUF_C_TYPE_STRING) {
@@ -3478,7 +8261,8 @@ protobuf_c_message_check(const ProtobufCMessage *message)
 			if (type == PROTOBUF_C_TYPE_MESSAGE) {
 				ProtobufCMessage *submessage = *(ProtobufCMessage **) field;
 				if (label == PROTOBUF_C_LABEL_REQUIRED || submessage != NULL) {
-					if (!protobuf_c_message_check(submessage))
+					if (!pointer_stack_push(pending, submessage,
+								&protobuf_c__allocator))
 						return FALSE;
 				}
 			} else if (type == PROTOBUF_C_TYPE_STRING) {
@@ -3499,6 +8283,298 @@ protobuf_c_message_check(const ProtobufCMessage *message)
 	return TRUE;
 }
 
+protobuf_c_boolean
+protobuf_c_message_check(const ProtobufCMessage *message)
+{
+	PointerStack pending;
+	protobuf_c_boolean rv = TRUE;
+
+	/* the sub-messages left to check are kept on a stack, not recursed into */
+	pointer_stack_init(&pending);
+	pending.items[pending.n++] = (void *) message;
+	while (rv && pending.n != 0)
+		rv = message_check_fields(pending.items[--pending.n], &pending);
+	pointer_stack_clear(&pending, &protobuf_c__allocator);
+	return rv;
+}
+
+/* === validation === */
+
+/**
+ * Number of fields of a message whose presence protobuf_c_message_validate()
+ * tracks in a bitmap; required fields beyond those are looked for again.
+ */
+#define VALIDATE_BITMAP_FIELDS	512
+
+/**
+ * Check that `len` bytes are well-formed UTF-8: no truncated sequences,
+ * overlong encodings, surrogates or code points above U+10FFFF.
+ */
+static protobuf_c_boolean
+utf8_validate(size_t len, const uint8_t *data)
+{
+	size_t i = 0;
+
+	while (i < len) {
+		uint8_t c = data[i];
+		uint8_t lo = 0x80, hi = 0xbf;
+		unsigned n, j;
+
+		if (c < 0x80) {
+			uint64_t word;
+
+			/* skip ASCII eight bytes at a time */
+			for (i++; i + 8 <= len; i += 8) {
+				memcpy(&word, data + i, sizeof(word));
+				if (word & UINT64_C(0x8080808080808080))
+					break;
+			}
+			continue;
+		}
+		if (c >= 0xc2 && c <= 0xdf) {
+			n = 1;
+		} else if (c >= 0xe0 && c <= 0xef) {
+			n = 2;
+			if (c == 0xe0)
+				lo = 0xa0;
+			else if (c == 0xed)
+				hi = 0x9f;
+		} else if (c >= 0xf0 && c <= 0xf4) {
+			n = 3;
+			if (c == 0xf0)
+				lo = 0x90;
+			else if (c == 0xf4)
+				hi = 0x8f;
+		} else {
+			return FALSE;
+		}
+		if (len - i - 1 < n || data[i + 1] < lo || data[i + 1] > hi)
+			return FALSE;
+		for (j = 2; j <= n; j++)
+			if ((data[i + j] & 0xc0) != 0x80)
+				return FALSE;
+		i += n + 1;
+	}
+	return TRUE;
+}
+
+/**
+ * Check the contents of a packed repeated field, as
+ * parse_packed_repeated_member() would decode them.
+ */
+static protobuf_c_boolean
+validate_packed(ProtobufCType type, size_t len, const uint8_t *at)
+{
+	switch (type) {
+	case PROTOBUF_C_TYPE_SFIXED32:
+	case PROTOBUF_C_TYPE_FIXED32:
+	case PROTOBUF_C_TYPE_FLOAT:
+		return len % 4 == 0;
+	case PROTOBUF_C_TYPE_SFIXED64:
+	case PROTOBUF_C_TYPE_FIXED64:
+	case PROTOBUF_C_TYPE_DOUBLE:
+		return len % 8 == 0;
+	case PROTOBUF_C_TYPE_ENUM:
+	case PROTOBUF_C_TYPE_INT32:
+	case PROTOBUF_C_TYPE_SINT32:
+	case PROTOBUF_C_TYPE_UINT32:
+	case PROTOBUF_C_TYPE_INT64:
+	case PROTOBUF_C_TYPE_SINT64:
+	case PROTOBUF_C_TYPE_UINT64:
+	case PROTOBUF_C_TYPE_BOOL:
+		while (len > 0) {
+			unsigned s = (at[0] & 0x80) == 0 ? 1 :
+				scan_varint(len < 10 ? len : 10, at);
+
+			if (s == 0)
+				return FALSE;
+			at += s;
+			len -= s;
+		}
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+/**
+ * Check a known field, as parse_member() would decode it. A sub-message is
+ * pushed on `pending` to be checked in turn.
+ */
+static protobuf_c_boolean
+validate_member(const ScannedMember *member, unsigned flags,
+		SizingStack *pending)
+{
+	const ProtobufCFieldDescriptor *field = member->field;
+	const uint8_t *at = member->data + member->length_prefix_len;
+	size_t len = member->len - member->length_prefix_len;
+	uint8_t wire_type = member->wire_type;
+
+	if (field->label == PROTOBUF_C_LABEL_REPEATED &&
+	    wire_type == PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED &&
+	    (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_PACKED) ||
+	     is_packable_type(field->type)))
+		return validate_packed(field->type, len, at);
+
+	switch (field->type) {
+	case PROTOBUF_C_TYPE_ENUM:
+	case PROTOBUF_C_TYPE_INT32:
+	case PROTOBUF_C_TYPE_UINT32:
+	case PROTOBUF_C_TYPE_SINT32:
+	case PROTOBUF_C_TYPE_INT64:
+	case PROTOBUF_C_TYPE_UINT64:
+	case PROTOBUF_C_TYPE_SINT64:
+		return wire_type == PROTOBUF_C_WIRE_TYPE_VARINT;
+	case PROTOBUF_C_TYPE_SFIXED32:
+	case PROTOBUF_C_TYPE_FIXED32:
+	case PROTOBUF_C_TYPE_FLOAT:
+		return wire_type == PROTOBUF_C_WIRE_TYPE_32BIT;
+	case PROTOBUF_C_TYPE_SFIXED64:
+	case PROTOBUF_C_TYPE_FIXED64:
+	case PROTOBUF_C_TYPE_DOUBLE:
+		return wire_type == PROTOBUF_C_WIRE_TYPE_64BIT;
+	case PROTOBUF_C_TYPE_BOOL:
+		/* the unpacker accepts a boolean of any wire type */
+		return TRUE;
+	case PROTOBUF_C_TYPE_STRING:
+		if (wire_type != PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED)
+			return FALSE;
+		if ((flags & PROTOBUF_C_VALIDATE_FLAG_UTF8) &&
+		    !utf8_validate(len, at))
+		{
+			PROTOBUF_C_UNPACK_ERROR("invalid UTF-8 in string %s",
+						field->name);
+			return FALSE;
+		}
+		return TRUE;
+	case PROTOBUF_C_TYPE_BYTES:
+		return wire_type == PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
+	case PROTOBUF_C_TYPE_MESSAGE: {
+		SizingJob sub;
+
+		if (wire_type != PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED)
+			return FALSE;
+		sub.desc = field->descriptor;
+		sub.depth = 0;
+		sub.len = len;
+		sub.data = at;
+		return sizing_stack_push(pending, &sub, &protobuf_c__allocator);
+	}
+	}
+	return FALSE;
+}
+
+/**
+ * Whether a well-formed message contains a field with the number `id`.
+ */
+static protobuf_c_boolean
+validate_find_field(uint32_t id, size_t len, const uint8_t *data)
+{
+	const uint8_t *at = data;
+	size_t rem = len;
+
+	while (rem > 0) {
+		ScannedMember tmp;
+		size_t used = scan_member(rem, at, &tmp);
+
+		if (used == 0)
+			return FALSE;
+		if (tmp.tag == id)
+			return TRUE;
+		at += used;
+		rem -= used;
+	}
+	return FALSE;
+}
+
+/**
+ * Check the fields of one message for protobuf_c_message_validate(), pushing
+ * its sub-messages on `pending` to be checked in turn.
+ */
+static protobuf_c_boolean
+validate_message(const SizingJob *job, unsigned flags, SizingStack *pending)
+{
+	const ProtobufCMessageDescriptor *desc = job->desc;
+	size_t len = job->len;
+	const uint8_t *data = job->data;
+	unsigned char required_fields_bitmap[VALIDATE_BITMAP_FIELDS / 8];
+	unsigned n_tracked = desc->n_fields < VALIDATE_BITMAP_FIELDS ?
+		desc->n_fields : VALIDATE_BITMAP_FIELDS;
+	unsigned last_field_index = 0;
+	const uint8_t *at = data;
+	size_t rem = len;
+	unsigned f;
+
+	memset(required_fields_bitmap, 0, (n_tracked + 7) / 8);
+	while (rem > 0) {
+		ScannedMember tmp;
+		size_t used = scan_member(rem, at, &tmp);
+		int field_index;
+
+		if (used == 0)
+			return FALSE;
+		field_index = find_field_index(desc, tmp.tag, last_field_index);
+		if (field_index >= 0) {
+			tmp.field = desc->fields + field_index;
+			last_field_index = field_index;
+			if (!validate_member(&tmp, flags, pending)) {
+				PROTOBUF_C_UNPACK_ERROR("error parsing member %s of %s",
+							tmp.field->name, desc->name);
+				return FALSE;
+			}
+			if (tmp.field->label == PROTOBUF_C_LABEL_REQUIRED &&
+			    (unsigned) field_index < n_tracked)
+				REQUIRED_FIELD_BITMAP_SET(field_index);
+		}
+		at += used;
+		rem -= used;
+	}
+
+	/* check that all required fields have been seen */
+	for (f = 0; f < desc->n_fields; f++) {
+		const ProtobufCFieldDescriptor *field = desc->fields + f;
+
+		if (field->label == PROTOBUF_C_LABEL_REQUIRED &&
+		    field->default_value == NULL &&
+		    (f < n_tracked ? !REQUIRED_FIELD_BITMAP_IS_SET(f) :
+		     !validate_find_field(field->id, len, data)))
+		{
+			PROTOBUF_C_UNPACK_ERROR("message '%s': missing required field '%s'",
+						desc->name, field->name);
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+protobuf_c_boolean
+protobuf_c_message_validate(const ProtobufCMessageDescriptor *descriptor,
+			    size_t len, const uint8_t *data, unsigned flags)
+{
+	SizingStack pending;
+	SizingJob job;
+	protobuf_c_boolean rv;
+
+	ASSERT_IS_MESSAGE_DESCRIPTOR(descriptor);
+
+	/* the sub-messages left to check are kept on a stack, not recursed into */
+	pending.jobs = pending.local;
+	pending.n = 0;
+	pending.capacity = sizeof(pending.local) / sizeof(pending.local[0]);
+	job.desc = descriptor;
+	job.depth = 0;
+	job.len = len;
+	job.data = data;
+	rv = validate_message(&job, flags, &pending);
+	while (rv && pending.n != 0) {
+		job = pending.jobs[--pending.n];
+		rv = validate_message(&job, flags, &pending);
+	}
+	if (pending.jobs != pending.local)
+		do_free(&protobuf_c__allocator, pending.jobs);
+	return rv;
+}
+
 /* === services === */
 
 typedef void (*GenericHandler) (void *service,
@@ -146,6 +146,27 @@ Foo__Bar__BazBah *
 void   foo__bar__baz_bah__free_unpacked
                      (Foo__Bar__BazBah *message,
                       ProtobufCAllocator *allocator);
+~~~
+ *
+ * - `clear()`. Resets an unpacked message to its default values, keeping the
+ *   memory of its repeated fields for the next `unpack_into()`.
+ *
+~~~{.c}
+void   foo__bar__baz_bah__clear
+                     (Foo__Bar__BazBah *message,
+                      ProtobufCAllocator *allocator);
+~~~
+ *
+ * - `unpack_into()`. Unpacks data into an existing message object, reusing
+ *   the memory it already holds.
+ *
+~~~{.c}
+protobuf_c_boolean
+       foo__bar__baz_bah__unpack_into
+                     (Foo__Bar__BazBah    *message,
+                      ProtobufCAllocator  *allocator,
+                      size_t               len,
+                      const uint8_t       *data);
 ~~~
  *
  * - `get_packed_size()`. Calculates the length in bytes of the serialized
@@ -186,12 +207,50 @@ size_t foo__bar__baz_bah__pack_to_buffer
  * ProtobufCBuffer object which implements an "append" method that consumes
  * data.
  *
+ * protobuf_c_message_pack_reverse() and
+ * protobuf_c_message_pack_to_reverse_buffer() also need no sizing pass. They
+ * encode the message from the end of the output towards the front, so that
+ * every length prefix is known by the time it is written, and return a
+ * pointer to the first byte of the output.
+ *
  * To unpack a message, call the protobuf_c_message_unpack() function. The
  * result can be cast to an object of the type that matches the descriptor for
  * the message.
  *
  * The result of unpacking a message should be freed with
  * protobuf_c_message_free_unpacked().
+ *
+ * When many messages are unpacked in a loop, passing a `ProtobufCArena` as
+ * the allocator replaces the many small allocations made while unpacking with
+ * a few large ones, and the whole tree is released at once with
+ * protobuf_c_arena_reset().
+ *
+ * Alternatively, the same message object can be unpacked into over and over
+ * with protobuf_c_message_unpack_into(). Repeated field arrays, strings, byte
+ * buffers and sub-messages left over from the previous message are reused
+ * when they are big enough, so that once the object has grown to fit the
+ * typical input, unpacking allocates little or nothing.
+ *
+ * A service that only needs a few fields of a large message can compile them
+ * into a `ProtobufCFieldMask` with protobuf_c_field_mask_new() once, and then
+ * unpack with protobuf_c_message_unpack_masked(), which skips over everything
+ * else in the input without decoding it.
+ *
+ * A message that arrives in pieces, for example from a socket, can be
+ * unpacked as it comes with a `ProtobufCMessageParser`: create one with
+ * protobuf_c_message_parser_new(), hand it each piece with
+ * protobuf_c_message_parser_feed(), and get the message from
+ * protobuf_c_message_parser_finish() once all of it has been fed. Only the
+ * fields that are split between two pieces are buffered, never the whole
+ * message. protobuf_c_message_unpack_segments() does the same for a message
+ * that has been received into several buffers.
+ *
+ * Streams of messages, each preceded by its length as a varint, are read with
+ * a `ProtobufCStreamReader` and written with a `ProtobufCStreamWriter`. The
+ * reader takes its input from memory, such as a mapped file, or from a
+ * `ProtobufCStreamSource`, and the writer sends its output to a
+ * `ProtobufCBuffer`; both move data in large blocks, and handle any number of
+ * messages per call.
  */
 
 #ifndef PROTOBUF_C_H
@@ -328,6 +387,114 @@ typedef enum {
 	PROTOBUF_C_TYPE_MESSAGE,    /**< nested message */
 } ProtobufCType;
 
+/**
+ * Values for the `flags` argument of protobuf_c_message_unpack_with_flags().
+ */
+typedef enum {
+	/**
+	 * Don't copy variable-length data out of the input buffer. `bytes`
+	 * fields (including `string` fields with the `string_as_bytes` option),
+	 * unknown fields, and packed `fixed32`, `sfixed32`, `float`, `fixed64`,
+	 * `sfixed64` and `double` arrays on little-endian hosts point straight
+	 * into the input, which must outlive the unpacked message and must not
+	 * be modified. `string` fields are still copied, since they have to be
+	 * `NUL`-terminated.
+	 *
+	 * This flag is only honoured when the allocator is a `ProtobufCArena`
+	 * and is ignored otherwise, so that borrowed pointers are never freed.
+	 */
+	PROTOBUF_C_UNPACK_FLAG_ZERO_COPY	= (1 << 0),
+
+	/**
+	 * Allocate the whole message tree with a single call to the
+	 * allocator. The input is scanned first to find the size of the tree,
+	 * which is then laid out in one block, released with a single call too
+	 * by protobuf_c_message_free_unpacked_single_block().
+	 *
+	 * The tree must only be freed that way and as a whole: neither it nor
+	 * its sub-messages may be passed to protobuf_c_message_free_unpacked(),
+	 * protobuf_c_message_clear() or protobuf_c_message_unpack_into(), or
+	 * linked into a message that is. This flag has no effect with a
+	 * `ProtobufCArena`, whose messages already live in a few blocks, and is
+	 * only honoured by protobuf_c_message_unpack_with_flags() and
+	 * protobuf_c_message_unpack_with_context().
+	 */
+	PROTOBUF_C_UNPACK_FLAG_SINGLE_BLOCK	= (1 << 1),
+
+	/**
+	 * Skip fields that are not in the message descriptor instead of
+	 * keeping them in `unknown_fields`, at every level of the message.
+	 * Their data is neither counted nor copied.
+	 */
+	PROTOBUF_C_UNPACK_FLAG_DISCARD_UNKNOWN	= (1 << 2),
+} ProtobufCUnpackFlag;
+
+/**
+ * Flags of a message type, in the `reserved3` member of
+ * `ProtobufCMessageDescriptor`.
+ */
+typedef enum {
+	/**
+	 * Unknown fields of messages of this type are always skipped when
+	 * unpacking, as with `PROTOBUF_C_UNPACK_FLAG_DISCARD_UNKNOWN`. Set by
+	 * the `discard_unknown_fields` message option.
+	 */
+	PROTOBUF_C_MESSAGE_FLAG_DISCARD_UNKNOWN	= (1 << 0),
+} ProtobufCMessageFlag;
+
+/**
+ * Values for the `flags` argument of protobuf_c_field_mask_new().
+ */
+typedef enum {
+	/**
+	 * Drop fields that are not in the message descriptor instead of
+	 * keeping them in `unknown_fields`, at every level of the message.
+	 */
+	PROTOBUF_C_FIELD_MASK_DROP_UNKNOWN	= (1 << 0),
+} ProtobufCFieldMaskFlag;
+
+/**
+ * Values for the `flags` argument of protobuf_c_message_validate().
+ */
+typedef enum {
+	/** Also check that `string` fields hold well-formed UTF-8. */
+	PROTOBUF_C_VALIDATE_FLAG_UTF8	= (1 << 0),
+} ProtobufCValidateFlag;
+
+/**
+ * How the unpacker decodes a field found through a `ProtobufCFieldTableEntry`.
+ * Only meant to be used by generated code.
+ */
+typedef enum {
+	/** Decode through the generic, descriptor-driven path. */
+	PROTOBUF_C_FIELD_TABLE_OP_GENERIC = 0,
+	/** Singular `int32`, `uint32` or `enum`. */
+	PROTOBUF_C_FIELD_TABLE_OP_VARINT32,
+	/** Singular `sint32`. */
+	PROTOBUF_C_FIELD_TABLE_OP_SINT32,
+	/** Singular `int64` or `uint64`. */
+	PROTOBUF_C_FIELD_TABLE_OP_VARINT64,
+	/** Singular `sint64`. */
+	PROTOBUF_C_FIELD_TABLE_OP_SINT64,
+	/** Singular `bool`. */
+	PROTOBUF_C_FIELD_TABLE_OP_BOOL,
+	/** Singular `fixed32`, `sfixed32` or `float`. */
+	PROTOBUF_C_FIELD_TABLE_OP_FIXED32,
+	/** Singular `fixed64`, `sfixed64` or `double`. */
+	PROTOBUF_C_FIELD_TABLE_OP_FIXED64,
+} ProtobufCFieldTableOp;
+
+/**
+ * Number of entries in a message's field table.
+ */
+#define PROTOBUF_C_FIELD_TABLE_SIZE	32
+
+/**
+ * Marks the field numbers that a message doesn't use in its field index
+ * table.
+ */
+#define PROTOBUF_C_FIELD_INDEX_NONE	0xffff
+
 /**
  * Field wire types.
  *
@@ -345,6 +512,7 @@ typedef enum {
 } ProtobufCWireType;
 
 struct ProtobufCAllocator;
+struct ProtobufCArena;
 struct ProtobufCBinaryData;
 struct ProtobufCBuffer;
 struct ProtobufCBufferSimple;
@@ -352,6 +520,8 @@ struct ProtobufCEnumDescriptor;
 struct ProtobufCEnumValue;
 struct ProtobufCEnumValueIndex;
 struct ProtobufCFieldDescriptor;
+struct ProtobufCFieldMask;
+struct ProtobufCFieldTableEntry;
 struct ProtobufCIntRange;
 struct ProtobufCMessage;
 struct ProtobufCMessageDescriptor;
@@ -359,8 +529,11 @@ struct ProtobufCMessageUnknownField;
 struct ProtobufCMethodDescriptor;
 struct ProtobufCService;
 struct ProtobufCServiceDescriptor;
+struct ProtobufCUnpackContext;
+struct ProtobufCUnpackStats;
 
 typedef struct ProtobufCAllocator ProtobufCAllocator;
+typedef struct ProtobufCArena ProtobufCArena;
 typedef struct ProtobufCBinaryData ProtobufCBinaryData;
 typedef struct ProtobufCBuffer ProtobufCBuffer;
 typedef struct ProtobufCBufferSimple ProtobufCBufferSimple;
@@ -368,13 +541,24 @@ typedef struct ProtobufCEnumDescriptor ProtobufCEnumDescriptor;
 typedef struct ProtobufCEnumValue ProtobufCEnumValue;
 typedef struct ProtobufCEnumValueIndex ProtobufCEnumValueIndex;
 typedef struct ProtobufCFieldDescriptor ProtobufCFieldDescriptor;
+typedef struct ProtobufCFieldMask ProtobufCFieldMask;
+typedef struct ProtobufCFieldTableEntry ProtobufCFieldTableEntry;
 typedef struct ProtobufCIntRange ProtobufCIntRange;
 typedef struct ProtobufCMessage ProtobufCMessage;
 typedef struct ProtobufCMessageDescriptor ProtobufCMessageDescriptor;
+typedef struct ProtobufCMessageParser ProtobufCMessageParser;
 typedef struct ProtobufCMessageUnknownField ProtobufCMessageUnknownField;
 typedef struct ProtobufCMethodDescriptor ProtobufCMethodDescriptor;
+typedef struct ProtobufCParallelExecutor ProtobufCParallelExecutor;
+typedef struct ProtobufCReverseBuffer ProtobufCReverseBuffer;
+typedef struct ProtobufCSegment ProtobufCSegment;
+typedef struct ProtobufCStreamReader ProtobufCStreamReader;
+typedef struct ProtobufCStreamSource ProtobufCStreamSource;
+typedef struct ProtobufCStreamWriter ProtobufCStreamWriter;
 typedef struct ProtobufCService ProtobufCService;
 typedef struct ProtobufCServiceDescriptor ProtobufCServiceDescriptor;
+typedef struct ProtobufCUnpackContext ProtobufCUnpackContext;
+typedef struct ProtobufCUnpackStats ProtobufCUnpackStats;
 
 /** Boolean type. */
 typedef int protobuf_c_boolean;
@@ -397,6 +581,143 @@ struct ProtobufCAllocator {
 	void		*allocator_data;
 };
 
+/**
+ * Region ("arena") allocator "subclass" of `ProtobufCAllocator`.
+ *
+ * Allocations are carved from a chain of blocks with a bump pointer and are
+ * never freed individually. All of the memory is released at once by
+ * protobuf_c_arena_reset() or protobuf_c_arena_destroy(). This makes unpacking
+ * a message tree cheap, and since protobuf_c_message_free_unpacked() is a
+ * no-op for messages unpacked from an arena, tearing one down is free as well.
+ *
+ * A `ProtobufCArena` may be declared on the stack, optionally with a scratch
+ * buffer provided by the user for the first allocations:
+ *
+~~~{.c}
+uint8_t pad[4096];
+ProtobufCArena arena;
+
+protobuf_c_arena_init(&arena, pad, sizeof(pad), NULL);
+for (;;) {
+        Foo__Bar__BazBah *msg;
+
+        msg = foo__bar__baz_bah__unpack(&arena.base, len, data);
+        ...
+        protobuf_c_arena_reset(&arena);
+}
+protobuf_c_arena_destroy(&arena);
+~~~
+ *
+ * Resetting keeps the largest block obtained so far, so that a steady-state
+ * loop like the one above stops allocating from the system after the first few
+ * iterations.
+ *
+ * \see protobuf_c_arena_init
+ * \see protobuf_c_arena_reset
+ * \see protobuf_c_arena_destroy
+ */
+struct ProtobufCArena {
+	/** "Base class". Pass `&arena.base` wherever an allocator is needed. */
+	ProtobufCAllocator	base;
+	/** Allocator for overflow blocks. May be NULL for the system allocator. */
+	ProtobufCAllocator	*block_allocator;
+	/** Scratch buffer provided by the user. May be NULL. */
+	uint8_t			*initial_block;
+	/** Number of bytes in `initial_block`. */
+	size_t			initial_size;
+	/** Next free byte in the current block. */
+	uint8_t			*ptr;
+	/** End of the current block. */
+	uint8_t			*end;
+	/** Blocks obtained from `block_allocator`, newest first. */
+	void			*blocks;
+	/** Block kept around by protobuf_c_arena_reset() for reuse. */
+	void			*spare;
+	/** Minimum size of the next block to obtain. */
+	size_t			next_block_size;
+};
+
+/**
+ * Running totals kept by a `ProtobufCUnpackContext`.
+ */
+struct ProtobufCUnpackStats {
+	/** Number of messages unpacked successfully. */
+	size_t			n_messages;
+	/** Number of calls that failed. */
+	size_t			n_failures;
+	/** Total length of the successfully unpacked input. */
+	size_t			n_bytes;
+	/** Deepest nesting seen, counting the top-level message as 1. */
+	unsigned		max_depth;
+};
+
+/**
+ * Reusable state for protobuf_c_message_unpack_with_context().
+ *
+ * A context bundles the options of an unpacking loop with scratch memory
+ * that outlives a single call, so that a long-running decoder does not pay
+ * for its working storage on every message. It can also bound how deeply
+ * messages may nest.
+ *
+ * Sub-messages unpacked with a context are not parsed recursively. They are
+ * queued on a stack held in the context's scratch memory and parsed once
+ * their parent is done, so that the C stack used does not grow with the
+ * nesting depth of the input. This makes it safe to unpack untrusted
+ * messages on threads with small stacks. protobuf_c_message_free_unpacked(),
+ * protobuf_c_message_clear(), protobuf_c_message_check() and
+ * protobuf_c_message_validate() don't recurse either.
+ *
+ * The other functions still recurse once per level of nesting. That is
+ * every way of unpacking without a context, among them
+ * protobuf_c_message_unpack(), protobuf_c_message_unpack_into(), the
+ * incremental parser and the stream reader, as well as
+ * protobuf_c_message_get_packed_size() and the protobuf_c_message_pack()
+ * family. Setting `max_depth` bounds the depth of the messages a context
+ * produces, and so the stack these functions then use on them.
+ *
+ * A context must not be used by two threads at once. A program decoding on
+ * several threads can keep one per thread, for instance in a `_Thread_local`
+ * variable:
+ *
+~~~{.c}
+static _Thread_local ProtobufCUnpackContext *ctx;
+
+if (ctx == NULL) {
+        ctx = malloc(sizeof(*ctx));
+        protobuf_c_unpack_context_init(ctx, NULL, 0);
+        ctx->max_depth = 64;
+}
+msg = protobuf_c_message_unpack_with_context(ctx, &foo__bar__descriptor,
+                                             len, data);
+~~~
+ *
+ * \see protobuf_c_unpack_context_init
+ * \see protobuf_c_message_unpack_with_context
+ * \see protobuf_c_unpack_context_destroy
+ */
+struct ProtobufCUnpackContext {
+	/** Allocator for the unpacked messages. May be NULL for the default. */
+	ProtobufCAllocator	*allocator;
+	/** Bitwise-or of `ProtobufCUnpackFlag` values applied to every call. */
+	unsigned		flags;
+	/** Maximum nesting depth of messages, or 0 for no limit. */
+	unsigned		max_depth;
+	/** Totals over all calls made with this context. */
+	ProtobufCUnpackStats	stats;
+	/** Working storage released after each call but kept for reuse. */
+	ProtobufCArena		scratch;
+	/** Nesting depth of the message being unpacked. */
+	unsigned		depth;
+	/** Sub-messages waiting to be parsed, most recent last. */
+	void			*jobs;
+	/** Number of entries in `jobs`. */
+	size_t			n_jobs;
+	/** Number of entries `jobs` has room for. */
+	size_t			jobs_capacity;
+	/** First entry of `jobs` queued by the message being unpacked. */
+	size_t			jobs_base;
+};
+
 /**
  * Structure for the protobuf `bytes` scalar type.
  *
@@ -409,6 +730,19 @@ struct ProtobufCBinaryData {
 	uint8_t	*data;      /**< Data bytes. */
 };
 
+/**
+ * One of the buffers a serialised message is scattered over, for
+ * protobuf_c_message_unpack_segments().
+ *
+ * The members are those of POSIX `struct iovec`, in the same order, so that
+ * an `iovec` array filled in by `readv()` or `recvmsg()` can be passed
+ * without conversion.
+ */
+struct ProtobufCSegment {
+	const void	*data;      /**< Data bytes. */
+	size_t		len;        /**< Number of bytes in the `data` field. */
+};
+
 /**
  * Structure for defining a virtual append-only buffer. Used by
  * protobuf_c_message_pack_to_buffer() to abstract the consumption of serialized
@@ -494,6 +828,125 @@ struct ProtobufCBufferSimple {
 	ProtobufCAllocator	*allocator;
 };
 
+/**
+ * Return value of `ProtobufCStreamSource.read` that reports an error. The
+ * reader then fails, as told by protobuf_c_stream_reader_failed().
+ */
+#define PROTOBUF_C_STREAM_READ_ERROR	((size_t) -1)
+
+/**
+ * Structure for defining a source of data for a `ProtobufCStreamReader`.
+ *
+ * Like `ProtobufCBuffer`, it is meant to be "subclassed". For example, to read
+ * from a file descriptor:
+ *
+~~~{.c}
+typedef struct {
+        ProtobufCStreamSource base;
+        int fd;
+} SourceReadFromFd;
+
+static size_t
+my_source_fd_read(ProtobufCStreamSource *source,
+                  size_t len,
+                  uint8_t *data)
+{
+        SourceReadFromFd *fd_source = (SourceReadFromFd *) source;
+        ssize_t rv;
+
+        do
+                rv = read(fd_source->fd, data, len);
+        while (rv < 0 && errno == EINTR);
+        return rv < 0 ? PROTOBUF_C_STREAM_READ_ERROR : (size_t) rv;
+}
+~~~
+ */
+struct ProtobufCStreamSource {
+	/**
+	 * Read function. Stores up to `len` bytes at `data`, and returns how
+	 * many, 0 at the end of the data, or `PROTOBUF_C_STREAM_READ_ERROR` if
+	 * reading failed. It should block until at least one byte is available,
+	 * but need not fill `data`.
+	 */
+	size_t		(*read)(ProtobufCStreamSource *source,
+				size_t len,
+				uint8_t *data);
+};
+
+/**
+ * Structure through which protobuf_c_message_unpack_parallel() runs work on
+ * the caller's threads.
+ *
+ * protobuf-c does not create threads itself; `run` would typically hand the
+ * tasks to a thread pool and wait for them:
+ *
+~~~{.c}
+static void
+my_executor_run(ProtobufCParallelExecutor *executor,
+                unsigned n_tasks,
+                void (*task)(unsigned index, void *task_data),
+                void *task_data)
+{
+        unsigned i;
+
+        #pragma omp parallel for
+        for (i = 0; i < n_tasks; i++)
+                task(i, task_data);
+}
+~~~
+ */
+struct ProtobufCParallelExecutor {
+	/**
+	 * Call `task(i, task_data)` once for each `i` below `n_tasks`,
+	 * possibly concurrently, and return once all the calls have returned.
+	 */
+	void		(*run)(ProtobufCParallelExecutor *executor,
+			       unsigned n_tasks,
+			       void (*task)(unsigned index, void *task_data),
+			       void *task_data);
+
+	/** Number of tasks to split the work into, usually one per thread. */
+	unsigned	n_tasks;
+
+	/**
+	 * NULL, or an array of `n_tasks` allocators: task `i` then allocates
+	 * from `allocators[i]`, which no other task uses concurrently.
+	 */
+	ProtobufCAllocator **allocators;
+};
+
+/**
+ * Growable buffer filled from the end towards the front by
+ * protobuf_c_message_pack_to_reverse_buffer().
+ *
+ * The `len` bytes of content are stored at the end of `data`, starting at
+ * `data + alloced - len`. Like `ProtobufCBufferSimple`, it can start out with
+ * a scratch buffer provided by the user and grows by reallocating:
+ *
+~~~{.c}
+uint8_t pad[128];
+ProtobufCReverseBuffer rbuf = PROTOBUF_C_REVERSE_BUFFER_INIT(pad);
+const uint8_t *start = protobuf_c_message_pack_to_reverse_buffer(&message, &rbuf);
+...
+PROTOBUF_C_REVERSE_BUFFER_CLEAR(&rbuf);
+~~~
+ *
+ * \see PROTOBUF_C_REVERSE_BUFFER_INIT
+ * \see PROTOBUF_C_REVERSE_BUFFER_CLEAR
+ */
+struct ProtobufCReverseBuffer {
+	/** Number of bytes allocated in `data`. */
+	size_t			alloced;
+	/** Number of bytes currently stored at the end of `data`. */
+	size_t			len;
+	/** Data bytes. */
+	uint8_t			*data;
+	/** Whether `data` must be freed. */
+	protobuf_c_boolean	must_free_data;
+	/** Allocator to use. May be NULL to indicate the system allocator. */
+	ProtobufCAllocator	*allocator;
+};
+
 /**
  * Describes an enumeration as a whole, with all of its values.
  */
@@ -636,6 +1089,28 @@ struct ProtobufCIntRange {
 	 */
 };
 
+/**
+ * Entry in the field table that generated code attaches to a message
+ * descriptor, so that the unpacker can go from the encoded field tag straight
+ * to the field and its decoder.
+ *
+ * The table has `PROTOBUF_C_FIELD_TABLE_SIZE` entries and is indexed by bits 3
+ * to 7 of the first byte of the encoded tag: fields 1 to 15, whose tags fit in
+ * one byte, use entries 1 to 15, and fields with two-byte tags use entry
+ * 16 + (field number % 16). When two fields map to the same entry, the lower
+ * field number wins; the others are looked up through `field_ranges`.
+ */
+struct ProtobufCFieldTableEntry {
+	/** The encoded tag, as `byte0 | (byte1 << 8)`. */
+	uint16_t	encoded_tag;
+	/** Length of the encoded tag (1 or 2), or 0 for an unused entry. */
+	uint8_t		tag_len;
+	/** A `ProtobufCFieldTableOp`. */
+	uint8_t		op;
+	/** Index of the field in `ProtobufCMessageDescriptor.fields`. */
+	uint16_t	field_index;
+};
+
 /**
  * An instance of a message.
  *
@@ -697,11 +1172,23 @@ struct ProtobufCMessageDescriptor {
 	/** Message initialisation function. */
 	ProtobufCMessageInit		message_init;
 
-	/** Reserved for future use. */
+	/**
+	 * Field table (`PROTOBUF_C_FIELD_TABLE_SIZE` elements of type
+	 * `const ProtobufCFieldTableEntry`) used to speed up unpacking, or NULL.
+	 */
 	void				*reserved1;
-	/** Reserved for future use. */
+	/**
+	 * Field index table (`fields[n_fields - 1].id + 1` elements of type
+	 * `const uint16_t`) giving the index in `fields` of each field number,
+	 * or `PROTOBUF_C_FIELD_INDEX_NONE` for numbers that aren't used. Only
+	 * generated for messages whose field numbers are dense enough; NULL
+	 * otherwise, in which case `field_ranges` is searched.
+	 */
 	void				*reserved2;
-	/** Reserved for future use. */
+	/**
+	 * Bitwise-OR of `ProtobufCMessageFlag` values, converted to a
+	 * pointer; NULL in descriptors that predate them.
+	 */
 	void				*reserved3;
 };
 
@@ -715,7 +1202,11 @@ struct ProtobufCMessageUnknownField {
 	ProtobufCWireType	wire_type;
 	/** Number of bytes in `data`. */
 	size_t			len;
-	/** Field data. */
+	/**
+	 * Field data. In an unpacked message, the data of the unknown fields
+	 * is held in blocks shared by several fields, so it must not be
+	 * freed or replaced field by field.
+	 */
 	uint8_t			*data;
 };
 
@@ -938,6 +1429,53 @@ protobuf_c_message_pack_to_buffer(
 	const ProtobufCMessage *message,
 	ProtobufCBuffer *buffer);
 
+/**
+ * Serialise a message into the end of a caller-provided buffer.
+ *
+ * The message is encoded back to front, ending at `out + max_len`, so no
+ * call to protobuf_c_message_get_packed_size() is needed beforehand. The
+ * output is identical to that of protobuf_c_message_pack().
+ *
+ * \param message
+ *      The message object to serialise.
+ * \param[out] out
+ *      Buffer to write the message to.
+ * \param max_len
+ *      Size of `out` in bytes.
+ * \return
+ *      Pointer to the first byte of the message. The packed message is
+ *      `out + max_len - <return value>` bytes long.
+ * \retval NULL
+ *      If the message does not fit in `max_len` bytes.
+ */
+PROTOBUF_C__API
+uint8_t *
+protobuf_c_message_pack_reverse(
+	const ProtobufCMessage *message,
+	uint8_t *out,
+	size_t max_len);
+
+/**
+ * Serialise a message in front of the contents of a `ProtobufCReverseBuffer`,
+ * growing the buffer as needed.
+ *
+ * \param message
+ *      The message object to serialise.
+ * \param buffer
+ *      The buffer to prepend the message to.
+ * \return
+ *      Pointer to the first byte of the message, which is also the first byte
+ *      of the buffer's contents.
+ * \retval NULL
+ *      If memory could not be allocated. The contents of the buffer are left
+ *      unchanged.
+ */
+PROTOBUF_C__API
+uint8_t *
+protobuf_c_message_pack_to_reverse_buffer(
+	const ProtobufCMessage *message,
+	ProtobufCReverseBuffer *buffer);
+
 /**
  * Unpack a serialised message into an in-memory representation.
  *
@@ -964,75 +1502,791 @@ protobuf_c_message_unpack(
 	const uint8_t *data);
 
 /**
- * Free an unpacked message object.
+ * Unpack a serialised message, with options.
  *
- * This function should be used to deallocate the memory used by a call to
- * protobuf_c_message_unpack().
+ * Same as protobuf_c_message_unpack(), with its behaviour adjusted by `flags`.
  *
- * \param message
- *      The message object to free. May be NULL.
+ * \param descriptor
+ *      The message descriptor.
  * \param allocator
- *      `ProtobufCAllocator` to use for memory deallocation. May be NULL to
+ *      `ProtobufCAllocator` to use for memory allocation. May be NULL to
  *      specify the default allocator.
+ * \param flags
+ *      Bitwise-or of `ProtobufCUnpackFlag` values.
+ * \param len
+ *      Length in bytes of the serialised message.
+ * \param data
+ *      Pointer to the serialised message.
+ * \return
+ *      An unpacked message object.
+ * \retval NULL
+ *      If an error occurred during unpacking.
  */
 PROTOBUF_C__API
-void
-protobuf_c_message_free_unpacked(
-	ProtobufCMessage *message,
-	ProtobufCAllocator *allocator);
+ProtobufCMessage *
+protobuf_c_message_unpack_with_flags(
+	const ProtobufCMessageDescriptor *descriptor,
+	ProtobufCAllocator *allocator,
+	unsigned flags,
+	size_t len,
+	const uint8_t *data);
 
 /**
- * Check the validity of a message object.
+ * Initialise a `ProtobufCUnpackContext` object.
  *
- * Makes sure all required fields (`PROTOBUF_C_LABEL_REQUIRED`) are present.
- * Recursively checks nested messages.
+ * `max_depth` and `stats` start out zeroed and may be changed between calls.
  *
- * \retval TRUE
- *      Message is valid.
- * \retval FALSE
- *      Message is invalid.
+ * \param context
+ *      The context object to initialise.
+ * \param allocator
+ *      `ProtobufCAllocator` to use for the unpacked messages and for the
+ *      context's own scratch memory. May be NULL to specify the default
+ *      allocator.
+ * \param flags
+ *      Bitwise-or of `ProtobufCUnpackFlag` values.
  */
 PROTOBUF_C__API
-protobuf_c_boolean
-protobuf_c_message_check(const ProtobufCMessage *);
-
-/** Message initialiser. */
-#define PROTOBUF_C_MESSAGE_INIT(descriptor) { descriptor, 0, NULL }
+void
+protobuf_c_unpack_context_init(
+	ProtobufCUnpackContext *context,
+	ProtobufCAllocator *allocator,
+	unsigned flags);
 
 /**
- * Initialise a message object from a message descriptor.
+ * Unpack a serialised message using a `ProtobufCUnpackContext`.
+ *
+ * Same as protobuf_c_message_unpack_with_flags() with the context's allocator
+ * and flags, except that a message nested more than `context->max_depth` deep
+ * is an error, and that the context's statistics are updated.
  *
+ * \param context
+ *      The context, initialised by protobuf_c_unpack_context_init().
  * \param descriptor
- *      Message descriptor.
- * \param message
- *      Allocated block of memory of size `descriptor->sizeof_message`.
+ *      The message descriptor.
+ * \param len
+ *      Length in bytes of the serialised message.
+ * \param data
+ *      Pointer to the serialised message.
+ * \return
+ *      An unpacked message object, to be freed as with
+ *      protobuf_c_message_unpack_with_flags().
+ * \retval NULL
+ *      If an error occurred during unpacking.
  */
 PROTOBUF_C__API
-void
-protobuf_c_message_init(
+ProtobufCMessage *
+protobuf_c_message_unpack_with_context(
+	ProtobufCUnpackContext *context,
 	const ProtobufCMessageDescriptor *descriptor,
-	void *message);
+	size_t len,
+	const uint8_t *data);
 
 /**
- * Free a service.
+ * Free the scratch memory held by a `ProtobufCUnpackContext`.
  *
- * \param service
- *      The service object to free.
+ * Messages unpacked with the context are not affected.
+ *
+ * \param context
+ *      The context object to destroy.
  */
 PROTOBUF_C__API
 void
-protobuf_c_service_destroy(ProtobufCService *service);
+protobuf_c_unpack_context_destroy(ProtobufCUnpackContext *context);
 
 /**
- * Look up a `ProtobufCMethodDescriptor` by name.
+ * Compile a set of field paths into a `ProtobufCFieldMask` for
+ * protobuf_c_message_unpack_masked().
  *
- * \param desc
- *      Service descriptor.
- * \param name
- *      Name of the method.
+ * A path is a list of field names separated by dots, such as
+ * `"header.route.id"`. Every name but the last must be a message field, which
+ * may be repeated. Naming a message field selects it with all of its
+ * sub-fields.
  *
+ * \param descriptor
+ *      The descriptor of the message type the paths start from.
+ * \param n_paths
+ *      Number of elements in `paths`.
+ * \param paths
+ *      The field paths.
+ * \param flags
+ *      Bitwise-or of `ProtobufCFieldMaskFlag` values.
+ * \param allocator
+ *      `ProtobufCAllocator` to use for memory allocation. May be NULL to
+ *      specify the default allocator.
  * \return
- *      A `ProtobufCMethodDescriptor` object.
+ *      The compiled field mask, to be freed with protobuf_c_field_mask_free().
+ * \retval NULL
+ *      If a path does not name a field, or if memory could not be allocated.
+ */
+PROTOBUF_C__API
+ProtobufCFieldMask *
+protobuf_c_field_mask_new(
+	const ProtobufCMessageDescriptor *descriptor,
+	size_t n_paths,
+	const char *const *paths,
+	unsigned flags,
+	ProtobufCAllocator *allocator);
+
+/**
+ * Free a field mask returned by protobuf_c_field_mask_new().
+ *
+ * \param mask
+ *      The field mask to free. May be NULL.
+ * \param allocator
+ *      The `ProtobufCAllocator` the mask was created with. May be NULL to
+ *      specify the default allocator.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_field_mask_free(
+	ProtobufCFieldMask *mask,
+	ProtobufCAllocator *allocator);
+
+/**
+ * Unpack only the fields selected by a field mask.
+ *
+ * Same as protobuf_c_message_unpack_with_flags(), except that fields not
+ * selected by `mask` are skipped over in the input without being decoded,
+ * allocated or checked, and are left at their default values. This includes
+ * whole sub-messages, which are not descended into. Required fields are
+ * only checked for presence if they are selected.
+ *
+ * \param mask
+ *      Field mask from protobuf_c_field_mask_new(). Its descriptor determines
+ *      the message type.
+ * \param allocator
+ *      `ProtobufCAllocator` to use for memory allocation. May be NULL to
+ *      specify the default allocator.
+ * \param flags
+ *      Bitwise-or of `ProtobufCUnpackFlag` values.
+ * \param len
+ *      Length in bytes of the serialised message.
+ * \param data
+ *      Pointer to the serialised message.
+ * \return
+ *      An unpacked message object, to be freed with
+ *      protobuf_c_message_free_unpacked().
+ * \retval NULL
+ *      If an error occurred during unpacking.
+ */
+PROTOBUF_C__API
+ProtobufCMessage *
+protobuf_c_message_unpack_masked(
+	const ProtobufCFieldMask *mask,
+	ProtobufCAllocator *allocator,
+	unsigned flags,
+	size_t len,
+	const uint8_t *data);
+
+/**
+ * Unpack many serialised messages of the same type.
+ *
+ * Same as calling protobuf_c_message_unpack_with_flags() on each buffer in
+ * turn, except that the setup done for each call is done once for the whole
+ * batch, and the top-level message objects are allocated together in a single
+ * block: `messages[i]` is at `i * descriptor->sizeof_message` bytes from the
+ * start of that block. This makes unpacking many small messages considerably
+ * cheaper.
+ *
+ * \param descriptor
+ *      The message descriptor.
+ * \param allocator
+ *      `ProtobufCAllocator` to use for memory allocation. May be NULL to
+ *      specify the default allocator.
+ * \param flags
+ *      Bitwise-or of `ProtobufCUnpackFlag` values.
+ * \param n
+ *      Number of serialised messages.
+ * \param lens
+ *      Length in bytes of each serialised message.
+ * \param datas
+ *      Pointer to each serialised message.
+ * \param[out] messages
+ *      Array of `n` elements receiving the unpacked messages. An element is
+ *      set to NULL if its message could not be unpacked. The messages must be
+ *      freed together with protobuf_c_message_free_unpacked_batch(), not one
+ *      by one.
+ * \return
+ *      Number of messages successfully unpacked. If this is zero, nothing
+ *      needs to be freed.
+ */
+PROTOBUF_C__API
+size_t
+protobuf_c_message_unpack_batch(
+	const ProtobufCMessageDescriptor *descriptor,
+	ProtobufCAllocator *allocator,
+	unsigned flags,
+	size_t n,
+	const size_t *lens,
+	const uint8_t *const *datas,
+	ProtobufCMessage **messages);
+
+/**
+ * Unpack a serialised message, decoding the elements of its large repeated
+ * message fields in parallel.
+ *
+ * Same as protobuf_c_message_unpack_with_flags(), except that the elements of
+ * any repeated message field of the outermost message that occurs many times
+ * are split among `executor->n_tasks` tasks, which `executor` may run on
+ * several threads. Other fields are decoded by the calling thread.
+ *
+ * Unless `executor->allocators` is NULL, the elements decoded by each task are
+ * allocated from that task's allocator, but the message as a whole is still
+ * freed with protobuf_c_message_free_unpacked() and `allocator`. So either
+ * all the allocators must allocate compatible memory (for instance with
+ * `malloc()`, and be safe to use from any thread), or all of them, `allocator`
+ * included, must be arenas that outlive the message. If
+ * `executor->allocators` is NULL, the tasks share `allocator`, which must then
+ * be safe to use from several threads at once; an arena is not.
+ *
+ * \param descriptor
+ *      The message descriptor.
+ * \param allocator
+ *      `ProtobufCAllocator` to use for memory allocation. May be NULL to
+ *      specify the default allocator.
+ * \param flags
+ *      Bitwise-or of `ProtobufCUnpackFlag` values.
+ * \param executor
+ *      Runs the decoding tasks.
+ * \param len
+ *      Length in bytes of the serialised message.
+ * \param data
+ *      Pointer to the serialised message.
+ * \return
+ *      An unpacked message object, to be freed with
+ *      protobuf_c_message_free_unpacked().
+ * \retval NULL
+ *      If an error occurred during unpacking.
+ */
+PROTOBUF_C__API
+ProtobufCMessage *
+protobuf_c_message_unpack_parallel(
+	const ProtobufCMessageDescriptor *descriptor,
+	ProtobufCAllocator *allocator,
+	unsigned flags,
+	ProtobufCParallelExecutor *executor,
+	size_t len,
+	const uint8_t *data);
+
+/**
+ * Free an unpacked message object.
+ *
+ * This function should be used to deallocate the memory used by a call to
+ * protobuf_c_message_unpack().
+ *
+ * \param message
+ *      The message object to free. May be NULL.
+ * \param allocator
+ *      `ProtobufCAllocator` to use for memory deallocation. May be NULL to
+ *      specify the default allocator. If this is the `base` of a
+ *      `ProtobufCArena`, nothing is freed; the memory is reclaimed by
+ *      protobuf_c_arena_reset() instead.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_message_free_unpacked(
+	ProtobufCMessage *message,
+	ProtobufCAllocator *allocator);
+
+/**
+ * Free the messages unpacked by protobuf_c_message_unpack_batch().
+ *
+ * \param n
+ *      Number of elements in `messages`, as passed to
+ *      protobuf_c_message_unpack_batch().
+ * \param messages
+ *      The messages, some of which may be NULL.
+ * \param allocator
+ *      `ProtobufCAllocator` that was used to unpack them. May be NULL to
+ *      specify the default allocator.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_message_free_unpacked_batch(
+	size_t n,
+	ProtobufCMessage **messages,
+	ProtobufCAllocator *allocator);
+
+/**
+ * Free a message tree unpacked with `PROTOBUF_C_UNPACK_FLAG_SINGLE_BLOCK`.
+ *
+ * \param message
+ *      The top-level message, as returned by the unpacking function. May be
+ *      NULL.
+ * \param allocator
+ *      `ProtobufCAllocator` that was used to unpack it. May be NULL to
+ *      specify the default allocator. If this is the `base` of a
+ *      `ProtobufCArena`, nothing is freed, as the flag had no effect.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_message_free_unpacked_single_block(
+	ProtobufCMessage *message,
+	ProtobufCAllocator *allocator);
+
+/**
+ * Reset an unpacked message to its default values, keeping its repeated field
+ * arrays allocated.
+ *
+ * Strings, byte buffers, sub-messages and unknown field data are freed, and
+ * every field is set to its default value. A repeated field is left with zero
+ * elements but keeps its array, which protobuf_c_message_unpack_into() reuses
+ * for the next message; protobuf_c_message_free_unpacked() releases it.
+ *
+ * \param message
+ *      A message object returned by protobuf_c_message_unpack(), or obtained
+ *      from `allocator` and initialised with its `init()` function. Either way
+ *      it is eventually freed with protobuf_c_message_free_unpacked().
+ * \param allocator
+ *      `ProtobufCAllocator` to use for memory deallocation. May be NULL to
+ *      specify the default allocator. If this is the `base` of a
+ *      `ProtobufCArena`, nothing is freed or kept; the message is simply
+ *      reinitialised.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_message_clear(
+	ProtobufCMessage *message,
+	ProtobufCAllocator *allocator);
+
+/**
+ * Unpack a serialised message into an existing message object.
+ *
+ * The previous contents of `message` are discarded, as if by
+ * protobuf_c_message_clear(), but its memory is reused where possible:
+ * repeated field arrays keep their capacity, and strings, byte buffers and
+ * sub-messages are decoded into the storage of the values they replace when it
+ * is large enough. Whatever is left unused is freed.
+ *
+ * \param message
+ *      The message object to unpack into, as for protobuf_c_message_clear().
+ *      Its descriptor determines the message type.
+ * \param allocator
+ *      `ProtobufCAllocator` to use for memory allocation. Must be the one the
+ *      message's memory was obtained from. May be NULL to specify the default
+ *      allocator.
+ * \param len
+ *      Length in bytes of the serialised message.
+ * \param data
+ *      Pointer to the serialised message.
+ * \retval TRUE
+ *      The message was unpacked.
+ * \retval FALSE
+ *      If an error occurred during unpacking. `message` is left cleared.
+ */
+PROTOBUF_C__API
+protobuf_c_boolean
+protobuf_c_message_unpack_into(
+	ProtobufCMessage *message,
+	ProtobufCAllocator *allocator,
+	size_t len,
+	const uint8_t *data);
+
+/**
+ * Create a parser that unpacks a message from data fed to it in pieces.
+ *
+ * The message is built up as data is fed with
+ * protobuf_c_message_parser_feed(), and the result is the same as
+ * protobuf_c_message_unpack_with_flags() would give for all of the data at
+ * once. Fields that are contained in a single piece are parsed straight from
+ * it. A sub-message split across pieces is parsed into as its data comes, and
+ * any other field split across pieces is buffered until it is complete, so the
+ * parser holds at most one string, byte buffer, packed array or unknown field
+ * at a time.
+ *
+ * \param descriptor
+ *      The message descriptor.
+ * \param allocator
+ *      `ProtobufCAllocator` to use for memory allocation. May be NULL to
+ *      specify the default allocator.
+ * \param flags
+ *      Bitwise-or of `ProtobufCUnpackFlag` values.
+ *      `PROTOBUF_C_UNPACK_FLAG_ZERO_COPY` is ignored, since fed data doesn't
+ *      need to outlive the call.
+ * \return
+ *      The parser, to be disposed of with protobuf_c_message_parser_finish()
+ *      or protobuf_c_message_parser_free().
+ * \retval NULL
+ *      If memory could not be allocated.
+ */
+PROTOBUF_C__API
+ProtobufCMessageParser *
+protobuf_c_message_parser_new(
+	const ProtobufCMessageDescriptor *descriptor,
+	ProtobufCAllocator *allocator,
+	unsigned flags);
+
+/**
+ * Feed the next piece of a serialised message to a parser.
+ *
+ * \param parser
+ *      The parser.
+ * \param len
+ *      Length in bytes of the piece. May be 0.
+ * \param data
+ *      The piece, which is not referenced after the call returns.
+ * \retval TRUE
+ *      The data was parsed, or buffered until the field it belongs to is
+ *      complete.
+ * \retval FALSE
+ *      If an error occurred during unpacking. Everything fed afterwards is
+ *      rejected, and protobuf_c_message_parser_finish() returns NULL.
+ */
+PROTOBUF_C__API
+protobuf_c_boolean
+protobuf_c_message_parser_feed(
+	ProtobufCMessageParser *parser,
+	size_t len,
+	const uint8_t *data);
+
+/**
+ * Finish unpacking a message fed to a parser, and free the parser.
+ *
+ * \param parser
+ *      The parser.
+ * \return
+ *      The unpacked message object, to be freed with
+ *      protobuf_c_message_free_unpacked().
+ * \retval NULL
+ *      If an error occurred during unpacking, if the data fed so far stops
+ *      in the middle of a field, or if a required field is missing.
+ */
+PROTOBUF_C__API
+ProtobufCMessage *
+protobuf_c_message_parser_finish(
+	ProtobufCMessageParser *parser);
+
+/**
+ * Free a parser without finishing it, along with the partially unpacked
+ * message.
+ *
+ * \param parser
+ *      The parser to free. May be NULL.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_message_parser_free(
+	ProtobufCMessageParser *parser);
+
+/**
+ * Unpack a serialised message that is scattered over several buffers.
+ *
+ * Same as protobuf_c_message_unpack_with_flags() on the concatenation of the
+ * segments, without concatenating them: the segments are fed to a
+ * `ProtobufCMessageParser` in turn, so only fields that straddle a segment
+ * boundary are copied.
+ *
+ * \param descriptor
+ *      The message descriptor.
+ * \param allocator
+ *      `ProtobufCAllocator` to use for memory allocation. May be NULL to
+ *      specify the default allocator.
+ * \param flags
+ *      Bitwise-or of `ProtobufCUnpackFlag` values.
+ *      `PROTOBUF_C_UNPACK_FLAG_ZERO_COPY` is ignored.
+ * \param n_segments
+ *      Number of elements in `segments`.
+ * \param segments
+ *      The buffers, in order. Empty ones are allowed.
+ * \return
+ *      An unpacked message object, to be freed with
+ *      protobuf_c_message_free_unpacked().
+ * \retval NULL
+ *      If an error occurred during unpacking.
+ */
+PROTOBUF_C__API
+ProtobufCMessage *
+protobuf_c_message_unpack_segments(
+	const ProtobufCMessageDescriptor *descriptor,
+	ProtobufCAllocator *allocator,
+	unsigned flags,
+	size_t n_segments,
+	const ProtobufCSegment *segments);
+
+/**
+ * Create a reader for a stream of length-delimited messages held in memory.
+ *
+ * Each message in the stream is preceded by its length, encoded as a varint.
+ * The messages are unpacked straight from `data`, which must remain valid
+ * while the reader is in use, or as long as messages unpacked with
+ * `PROTOBUF_C_UNPACK_FLAG_ZERO_COPY` are.
+ *
+ * \param descriptor
+ *      The descriptor of the messages in the stream.
+ * \param allocator
+ *      `ProtobufCAllocator` to use for memory allocation. May be NULL to
+ *      specify the default allocator.
+ * \param flags
+ *      Bitwise-or of `ProtobufCUnpackFlag` values.
+ * \param len
+ *      Length in bytes of the stream.
+ * \param data
+ *      The stream, such as a file mapped into memory.
+ * \return
+ *      The reader, to be freed with protobuf_c_stream_reader_free().
+ * \retval NULL
+ *      If memory could not be allocated.
+ */
+PROTOBUF_C__API
+ProtobufCStreamReader *
+protobuf_c_stream_reader_new(
+	const ProtobufCMessageDescriptor *descriptor,
+	ProtobufCAllocator *allocator,
+	unsigned flags,
+	size_t len,
+	const uint8_t *data);
+
+/**
+ * Create a reader for a stream of length-delimited messages read from a
+ * `ProtobufCStreamSource`.
+ *
+ * The stream is read in blocks of `buffer_size` bytes. Messages that fit in
+ * the buffer are unpacked from it; larger ones are unpacked with a
+ * `ProtobufCMessageParser` as they are read, so the buffer never grows.
+ *
+ * \param descriptor
+ *      The descriptor of the messages in the stream.
+ * \param allocator
+ *      `ProtobufCAllocator` to use for memory allocation. May be NULL to
+ *      specify the default allocator.
+ * \param flags
+ *      Bitwise-or of `ProtobufCUnpackFlag` values.
+ *      `PROTOBUF_C_UNPACK_FLAG_ZERO_COPY` is ignored, since the buffer is
+ *      reused.
+ * \param source
+ *      Where to read the stream from.
+ * \param buffer_size
+ *      Size in bytes of the read buffer, or 0 for a default of 64 KiB.
+ * \return
+ *      The reader, to be freed with protobuf_c_stream_reader_free().
+ * \retval NULL
+ *      If memory could not be allocated.
+ */
+PROTOBUF_C__API
+ProtobufCStreamReader *
+protobuf_c_stream_reader_new_from_source(
+	const ProtobufCMessageDescriptor *descriptor,
+	ProtobufCAllocator *allocator,
+	unsigned flags,
+	ProtobufCStreamSource *source,
+	size_t buffer_size);
+
+/**
+ * Unpack the next messages of a stream.
+ *
+ * \param reader
+ *      The reader.
+ * \param max_messages
+ *      Maximum number of messages to unpack.
+ * \param[out] messages
+ *      Receives the unpacked message objects, to be freed with
+ *      protobuf_c_message_free_unpacked().
+ * \return
+ *      Number of messages unpacked. Fewer than `max_messages` means that the
+ *      end of the stream was reached, or that an error occurred, as told by
+ *      protobuf_c_stream_reader_failed().
+ */
+PROTOBUF_C__API
+size_t
+protobuf_c_stream_reader_read(
+	ProtobufCStreamReader *reader,
+	size_t max_messages,
+	ProtobufCMessage **messages);
+
+/**
+ * Tell whether a reader stopped because of an error.
+ *
+ * \param reader
+ *      The reader.
+ * \retval TRUE
+ *      If a message could not be unpacked, the stream ended in the middle of
+ *      a message, the source failed to read, or memory could not be
+ *      allocated. The reader returns no more messages.
+ * \retval FALSE
+ *      Otherwise.
+ */
+PROTOBUF_C__API
+protobuf_c_boolean
+protobuf_c_stream_reader_failed(
+	const ProtobufCStreamReader *reader);
+
+/**
+ * Free a reader.
+ *
+ * \param reader
+ *      The reader to free. May be NULL.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_stream_reader_free(
+	ProtobufCStreamReader *reader);
+
+/**
+ * Create a writer of length-delimited messages.
+ *
+ * Messages are framed and packed into a buffer of `buffer_size` bytes, which
+ * is handed to `buffer` whenever it fills up and when the writer is flushed.
+ * A message too large for the buffer is sent on its own with
+ * protobuf_c_message_pack_to_buffer().
+ *
+ * \param buffer
+ *      Where to send the stream.
+ * \param allocator
+ *      `ProtobufCAllocator` to use for memory allocation. May be NULL to
+ *      specify the default allocator.
+ * \param buffer_size
+ *      Size in bytes of the write buffer, or 0 for a default of 64 KiB.
+ * \return
+ *      The writer, to be freed with protobuf_c_stream_writer_free().
+ * \retval NULL
+ *      If memory could not be allocated.
+ */
+PROTOBUF_C__API
+ProtobufCStreamWriter *
+protobuf_c_stream_writer_new(
+	ProtobufCBuffer *buffer,
+	ProtobufCAllocator *allocator,
+	size_t buffer_size);
+
+/**
+ * Write messages to a stream, each preceded by its length as a varint.
+ *
+ * \param writer
+ *      The writer.
+ * \param n_messages
+ *      Number of elements in `messages`.
+ * \param messages
+ *      The messages to write.
+ * \return
+ *      Number of bytes written, framing included.
+ */
+PROTOBUF_C__API
+size_t
+protobuf_c_stream_writer_write(
+	ProtobufCStreamWriter *writer,
+	size_t n_messages,
+	const ProtobufCMessage *const *messages);
+
+/**
+ * Hand everything written so far to the writer's `ProtobufCBuffer`.
+ *
+ * \param writer
+ *      The writer.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_stream_writer_flush(
+	ProtobufCStreamWriter *writer);
+
+/**
+ * Flush and free a writer.
+ *
+ * \param writer
+ *      The writer to free. May be NULL.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_stream_writer_free(
+	ProtobufCStreamWriter *writer);
+
+/**
+ * Check the validity of a message object.
+ *
+ * Makes sure all required fields (`PROTOBUF_C_LABEL_REQUIRED`) are present.
+ * Nested messages are checked too, from a stack rather than by recursion.
+ *
+ * \retval TRUE
+ *      Message is valid.
+ * \retval FALSE
+ *      Message is invalid.
+ */
+PROTOBUF_C__API
+protobuf_c_boolean
+protobuf_c_message_check(const ProtobufCMessage *);
+
+/**
+ * Check that a serialised message would unpack successfully, without
+ * unpacking it.
+ *
+ * Walks the encoding as protobuf_c_message_unpack() would, descending into
+ * sub-messages, and checks the framing of every field, that known fields have
+ * a wire type matching their type, that varints are terminated, that packed
+ * arrays consist of whole elements, and that required fields are present.
+ * Sub-messages are checked from a stack rather than by recursion, so the
+ * nesting depth does not matter. Nothing is allocated but that stack, and
+ * only for deep or wide trees, so this is much cheaper than unpacking and
+ * freeing the message.
+ *
+ * \param descriptor
+ *      The message descriptor.
+ * \param len
+ *      Length in bytes of the serialised message.
+ * \param data
+ *      Pointer to the serialised message.
+ * \param flags
+ *      Bitwise-or of `ProtobufCValidateFlag` values.
+ * \retval TRUE
+ *      The message is well-formed.
+ * \retval FALSE
+ *      The message is malformed, or memory for the stack ran out.
+ */
+PROTOBUF_C__API
+protobuf_c_boolean
+protobuf_c_message_validate(
+	const ProtobufCMessageDescriptor *descriptor,
+	size_t len,
+	const uint8_t *data,
+	unsigned flags);
+
+/** Message initialiser. */
+#define PROTOBUF_C_MESSAGE_INIT(descriptor) { descriptor, 0, NULL }
+
+/**
+ * Initialise a message object from a message descriptor.
+ *
+ * \param descriptor
+ *      Message descriptor.
+ * \param message
+ *      Allocated block of memory of size `descriptor->sizeof_message`.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_message_init(
+	const ProtobufCMessageDescriptor *descriptor,
+	void *message);
+
+/**
+ * The allocator used wherever `NULL` is passed for one. Generated code
+ * allocating on behalf of the library calls this to match it.
+ *
+ * 
+eturn
+ *      The system allocator.
+ */
+PROTOBUF_C__API
+ProtobufCAllocator *
+protobuf_c_default_allocator(void);
+
+/**
+ * Free a service.
+ *
+ * \param service
+ *      The service object to free.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_service_destroy(ProtobufCService *service);
+
+/**
+ * Look up a `ProtobufCMethodDescriptor` by name.
+ *
+ * \param desc
+ *      Service descriptor.
+ * \param name
+ *      Name of the method.
+ *
+ * \return
+ *      A `ProtobufCMethodDescriptor` object.
  * \retval NULL
  *      If not found or if the optimize_for = CODE_SIZE option was set.
  */
@@ -1070,6 +2324,33 @@ do {                                                                    \
 	}                                                               \
 } while (0)
 
+/**
+ * Initialise a `ProtobufCReverseBuffer` object.
+ */
+#define PROTOBUF_C_REVERSE_BUFFER_INIT(array_of_bytes)                  \
+{                                                                       \
+	sizeof(array_of_bytes),                                         \
+	0,                                                              \
+	(array_of_bytes),                                               \
+	0,                                                              \
+	NULL                                                            \
+}
+
+/**
+ * Clear a `ProtobufCReverseBuffer` object, freeing any allocated memory.
+ */
+#define PROTOBUF_C_REVERSE_BUFFER_CLEAR(rev_buf)                        \
+do {                                                                    \
+	if ((rev_buf)->must_free_data) {                                \
+		if ((rev_buf)->allocator != NULL)                       \
+			(rev_buf)->allocator->free(                     \
+				(rev_buf)->allocator->allocator_data,   \
+				(rev_buf)->data);                       \
+		else                                                    \
+			free((rev_buf)->data);                          \
+	}                                                               \
+} while (0)
+
 /**
  * The `append` method for `ProtobufCBufferSimple`.
  *
@@ -1088,6 +2369,53 @@ protobuf_c_buffer_simple_append(
 	size_t len,
 	const unsigned char *data);
 
+/**
+ * Initialise a `ProtobufCArena` object.
+ *
+ * \param arena
+ *      The arena object to initialise.
+ * \param initial_block
+ *      Scratch buffer to carve the first allocations from. May be NULL.
+ * \param initial_size
+ *      Number of bytes in `initial_block`.
+ * \param block_allocator
+ *      `ProtobufCAllocator` used to obtain further blocks once
+ *      `initial_block` is exhausted. May be NULL to specify the default
+ *      allocator.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_arena_init(
+	ProtobufCArena *arena,
+	void *initial_block,
+	size_t initial_size,
+	ProtobufCAllocator *block_allocator);
+
+/**
+ * Release everything allocated from an arena, keeping it usable.
+ *
+ * All objects allocated from `arena`, including any messages unpacked with it,
+ * become invalid. The largest block obtained so far is retained for reuse.
+ *
+ * \param arena
+ *      The arena object to reset.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_arena_reset(ProtobufCArena *arena);
+
+/**
+ * Free all memory obtained by an arena.
+ *
+ * The arena may be used again after another call to protobuf_c_arena_init().
+ *
+ * \param arena
+ *      The arena object to destroy.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_arena_destroy(ProtobufCArena *arena);
+
 PROTOBUF_C__API
 void
 protobuf_c_service_generated_init(
@@ -64,6 +64,7 @@
 #include <google/protobuf/descriptor.h>
 #include <google/protobuf/io/printer.h>
 #include <google/protobuf/stubs/common.h>
+#include <google/protobuf/wire_format.h>
 
 #include <protobuf-c/protobuf-c.pb.h>
 
@@ -103,6 +104,17 @@ static bool is_packable_type(google::protobuf::FieldDescriptor::Type type)
     //TYPE_MESSAGE
 }
 
+// Whether the runtime packs this field with PROTOBUF_C_FIELD_FLAG_PACKED.
+static bool is_packed_field(const google::protobuf::FieldDescriptor* field)
+{
+  if (field->label() != google::protobuf::FieldDescriptor::LABEL_REPEATED
+   || !is_packable_type(field->type()))
+    return false;
+  if (field->options().packed())
+    return true;
+  return FieldSyntax(field) == 3 && !field->options().has_packed();
+}
+
 void FieldGenerator::GenerateDescriptorInitializerGeneric(google::protobuf::io::Printer* printer,
 							  bool optional_uses_has,
 							  const std::string &type_macro,
@@ -144,16 +156,8 @@ void FieldGenerator::GenerateDescriptorInitializerGeneric(google::protobuf::io::
 
   variables["flags"] = "0";
 
-  if (descriptor_->label() == google::protobuf::FieldDescriptor::LABEL_REPEATED
-   && is_packable_type (descriptor_->type())
-   && descriptor_->options().packed()) {
-    variables["flags"] += " | PROTOBUF_C_FIELD_FLAG_PACKED";
-  } else if (descriptor_->label() == google::protobuf::FieldDescriptor::LABEL_REPEATED
-   && is_packable_type (descriptor_->type())
-   && FieldSyntax(descriptor_) == 3
-   && !descriptor_->options().has_packed()) {
+  if (is_packed_field(descriptor_))
     variables["flags"] += " | PROTOBUF_C_FIELD_FLAG_PACKED";
-  }
 
   if (descriptor_->options().deprecated())
     variables["flags"] += " | PROTOBUF_C_FIELD_FLAG_DEPRECATED";
@@ -203,6 +207,635 @@ void FieldGenerator::GenerateDescriptorInitializerGeneric(google::protobuf::io::
   printer->Print("},\n");
 }
 
+// Returns the C expression for the encoded size (pack == false) of `value`,
+// or the statement-expression packing it at `out + rv` (pack == true), for the
+// optimize_for = SPEED helpers. Message fields are handled by the caller.
+static std::string
+speed_value_code(google::protobuf::FieldDescriptor::Type type,
+		 const std::string &value, bool pack)
+{
+  std::string fn;
+  std::string arg = value;
+  const char *size = NULL;
+
+  switch (type) {
+    case google::protobuf::FieldDescriptor::TYPE_INT32:
+    case google::protobuf::FieldDescriptor::TYPE_ENUM:
+      fn = "int32";
+      break;
+    case google::protobuf::FieldDescriptor::TYPE_SINT32:
+      fn = "uint32";
+      arg = "protobuf_c__speed_zigzag32 (" + value + ")";
+      break;
+    case google::protobuf::FieldDescriptor::TYPE_UINT32:
+      fn = "uint32";
+      break;
+    case google::protobuf::FieldDescriptor::TYPE_INT64:
+    case google::protobuf::FieldDescriptor::TYPE_UINT64:
+      fn = "uint64";
+      arg = "(uint64_t) " + value;
+      break;
+    case google::protobuf::FieldDescriptor::TYPE_SINT64:
+      fn = "uint64";
+      arg = "protobuf_c__speed_zigzag64 (" + value + ")";
+      break;
+    case google::protobuf::FieldDescriptor::TYPE_FIXED32:
+    case google::protobuf::FieldDescriptor::TYPE_SFIXED32:
+      fn = "fixed32";
+      arg = "(uint32_t) " + value;
+      size = "4";
+      break;
+    case google::protobuf::FieldDescriptor::TYPE_FLOAT:
+      fn = "float";
+      size = "4";
+      break;
+    case google::protobuf::FieldDescriptor::TYPE_FIXED64:
+    case google::protobuf::FieldDescriptor::TYPE_SFIXED64:
+      fn = "fixed64";
+      arg = "(uint64_t) " + value;
+      size = "8";
+      break;
+    case google::protobuf::FieldDescriptor::TYPE_DOUBLE:
+      fn = "double";
+      size = "8";
+      break;
+    case google::protobuf::FieldDescriptor::TYPE_BOOL:
+      fn = "boolean";
+      size = "1";
+      break;
+    case google::protobuf::FieldDescriptor::TYPE_STRING:
+      fn = "string";
+      break;
+    case google::protobuf::FieldDescriptor::TYPE_BYTES:
+      fn = "bytes";
+      arg = "&" + value;
+      break;
+    default:
+      GOOGLE_LOG(FATAL) << "Unexpected field type";
+      break;
+  }
+  if (pack)
+    return "protobuf_c__speed_" + fn + "_pack (" + arg + ", out + rv)";
+  if (size != NULL)
+    return size;
+  return "protobuf_c__speed_" + fn + "_size (" + arg + ")";
+}
+
+// Whether values of this type always take the same number of bytes.
+static bool
+speed_is_fixed_size(google::protobuf::FieldDescriptor::Type type)
+{
+  switch (type) {
+    case google::protobuf::FieldDescriptor::TYPE_FIXED32:
+    case google::protobuf::FieldDescriptor::TYPE_SFIXED32:
+    case google::protobuf::FieldDescriptor::TYPE_FLOAT:
+    case google::protobuf::FieldDescriptor::TYPE_FIXED64:
+    case google::protobuf::FieldDescriptor::TYPE_SFIXED64:
+    case google::protobuf::FieldDescriptor::TYPE_DOUBLE:
+    case google::protobuf::FieldDescriptor::TYPE_BOOL:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Returns the number of bytes of the encoded tag, and sets `code` to the
+// statements writing them at `out + rv`.
+static unsigned
+speed_tag_code(uint32_t tag, std::string *code)
+{
+  unsigned n = 0;
+  char buf[16];
+
+  code->clear();
+  do {
+    unsigned byte = tag & 0x7f;
+
+    tag >>= 7;
+    if (tag != 0)
+      byte |= 0x80;
+    if (n != 0)
+      *code += " ";
+    *code += std::string("out[rv++] = 0x") + FastHexToBuffer(byte, buf) + ";";
+    n++;
+  } while (tag != 0);
+  return n;
+}
+
+void FieldGenerator::GenerateSpeedPackCode(google::protobuf::io::Printer* printer,
+                                           int index, bool pack) const
+{
+  std::map<std::string, std::string> vars;
+  const google::protobuf::OneofDescriptor *oneof = descriptor_->containing_oneof();
+  const ProtobufCFieldOptions opt = descriptor_->options().GetExtension(pb_c_field);
+  google::protobuf::FieldDescriptor::Type type = descriptor_->type();
+  bool repeated = descriptor_->label() == google::protobuf::FieldDescriptor::LABEL_REPEATED;
+  bool packed = is_packed_field(descriptor_);
+  int wire_type;
+  std::string value, tag_code;
+
+  if (type == google::protobuf::FieldDescriptor::TYPE_STRING && opt.string_as_bytes())
+    type = google::protobuf::FieldDescriptor::TYPE_BYTES;
+  if (packed)
+    wire_type = 2;
+  else
+    wire_type = google::protobuf::internal::WireFormatLite::WireTypeForFieldType(
+      (google::protobuf::internal::WireFormatLite::FieldType) type);
+
+  vars["name"] = FieldName(descriptor_);
+  vars["lcclassname"] = FullNameToLower(descriptor_->containing_type()->full_name(),
+                                        descriptor_->file());
+  vars["index"] = SimpleItoa(index);
+  vars["number"] = SimpleItoa(descriptor_->number());
+  vars["tag_size"] = SimpleItoa(speed_tag_code(
+    ((uint32_t) descriptor_->number() << 3) | wire_type, &tag_code));
+  vars["tag"] = tag_code;
+  value = repeated ? "message->" + vars["name"] + "[i]" : "message->" + vars["name"];
+  vars["value"] = value;
+  if (type == google::protobuf::FieldDescriptor::TYPE_MESSAGE) {
+    const google::protobuf::Descriptor *mtype = descriptor_->message_type();
+
+    // Sub-messages are packed one byte in, then shifted if their length
+    // prefix turns out to be longer, as protobuf_c_message_pack() does.
+    if (mtype->file() == descriptor_->file()) {
+      std::string sublc = FullNameToLower(mtype->full_name(), mtype->file());
+      vars["subsize"] = sublc + "__speed_get_packed_size (" + value + ")";
+      vars["subpack"] = sublc + "__speed_pack (" + value + ", out + rv + 1)";
+    } else {
+      vars["subsize"] = "protobuf_c_message_get_packed_size ((const ProtobufCMessage *) " + value + ")";
+      vars["subpack"] = "protobuf_c_message_pack ((const ProtobufCMessage *) " + value + ", out + rv + 1)";
+    }
+  } else {
+    vars["size"] = speed_value_code(type, value, false);
+    vars["pack"] = speed_value_code(type, value, true);
+  }
+
+  // Same presence rules as the descriptor-driven packer.
+  std::string cond;
+  bool is_pointer = type == google::protobuf::FieldDescriptor::TYPE_STRING ||
+                    type == google::protobuf::FieldDescriptor::TYPE_MESSAGE;
+  bool has_default_pointer = type == google::protobuf::FieldDescriptor::TYPE_STRING &&
+    (descriptor_->has_default_value() || FieldSyntax(descriptor_) == 3);
+  if (repeated) {
+    cond = "message->n_" + vars["name"] + " != 0";
+  } else if (descriptor_->label() == google::protobuf::FieldDescriptor::LABEL_REQUIRED) {
+    cond = "";
+  } else if (oneof != NULL || FieldSyntax(descriptor_) == 2) {
+    if (oneof != NULL)
+      cond = "message->" + CamelToLower(oneof->name()) + "_case == " + vars["number"];
+    if (is_pointer) {
+      if (!cond.empty())
+        cond += "\n      && ";
+      cond += value + " != NULL";
+      if (has_default_pointer)
+        cond += "\n      && (const void *) " + value + " != " +
+          vars["lcclassname"] + "__descriptor.fields[" + vars["index"] + "].default_value";
+    } else if (oneof == NULL) {
+      cond = "message->has_" + vars["name"];
+    }
+  } else {
+    // proto3 fields without presence are skipped when zero or empty
+    switch (type) {
+      case google::protobuf::FieldDescriptor::TYPE_STRING:
+        cond = value + " != NULL && " + value + "[0] != '\\0'";
+        break;
+      case google::protobuf::FieldDescriptor::TYPE_BYTES:
+        cond = value + ".len != 0";
+        break;
+      case google::protobuf::FieldDescriptor::TYPE_MESSAGE:
+        cond = value + " != NULL";
+        break;
+      default:
+        cond = value + " != 0";
+        break;
+    }
+  }
+  vars["cond"] = cond;
+  // Only required and repeated sub-messages can be NULL past the condition.
+  if (repeated || cond.empty())
+    vars["nonnull"] = value + " != NULL";
+
+  if (!cond.empty())
+    printer->Print(vars, "if ($cond$) {\n");
+  else
+    printer->Print(vars, "{\n");
+  printer->Indent();
+
+  if (type == google::protobuf::FieldDescriptor::TYPE_MESSAGE) {
+    if (repeated) {
+      printer->Print(vars,
+        "size_t i;\n"
+        "for (i = 0; i < message->n_$name$; i++) {\n");
+      printer->Indent();
+    }
+    if (pack && vars.count("nonnull"))
+      printer->Print(vars,
+        "$tag$\n"
+        "if ($nonnull$) {\n"
+        "  size_t sub = $subpack$;\n"
+        "  rv += protobuf_c__speed_prefix_message (sub, out + rv);\n"
+        "} else {\n"
+        "  out[rv++] = 0;\n"
+        "}\n");
+    else if (pack)
+      printer->Print(vars,
+        "size_t sub;\n"
+        "$tag$\n"
+        "sub = $subpack$;\n"
+        "rv += protobuf_c__speed_prefix_message (sub, out + rv);\n");
+    else if (vars.count("nonnull"))
+      printer->Print(vars,
+        "size_t sub = $nonnull$ ? $subsize$ : 0;\n"
+        "rv += $tag_size$ + protobuf_c__speed_uint32_size (sub) + sub;\n");
+    else
+      printer->Print(vars,
+        "size_t sub = $subsize$;\n"
+        "rv += $tag_size$ + protobuf_c__speed_uint32_size (sub) + sub;\n");
+    if (repeated) {
+      printer->Outdent();
+      printer->Print("}\n");
+    }
+  } else if (packed) {
+    bool fixed = speed_is_fixed_size(type);
+
+    if (fixed)
+      printer->Print(vars,
+        "size_t payload = message->n_$name$ * $size$;\n");
+    else
+      printer->Print(vars,
+        "size_t i, payload = 0;\n"
+        "for (i = 0; i < message->n_$name$; i++)\n"
+        "  payload += $size$;\n");
+    if (pack) {
+      if (fixed)
+        printer->Print("size_t i;\n");
+      printer->Print(vars,
+        "$tag$\n"
+        "rv += protobuf_c__speed_uint32_pack (payload, out + rv);\n"
+        "for (i = 0; i < message->n_$name$; i++)\n"
+        "  rv += $pack$;\n");
+    } else {
+      printer->Print(vars,
+        "rv += $tag_size$ + protobuf_c__speed_uint32_size (payload) + payload;\n");
+    }
+  } else if (repeated) {
+    if (!pack && speed_is_fixed_size(type)) {
+      printer->Print(vars,
+        "rv += message->n_$name$ * ($tag_size$ + $size$);\n");
+    } else {
+      printer->Print(vars,
+        "size_t i;\n"
+        "for (i = 0; i < message->n_$name$; i++) {\n");
+      if (pack)
+        printer->Print(vars,
+          "  $tag$\n"
+          "  rv += $pack$;\n");
+      else
+        printer->Print(vars,
+          "  rv += $tag_size$ + $size$;\n");
+      printer->Print("}\n");
+    }
+  } else {
+    if (pack)
+      printer->Print(vars,
+        "$tag$\n"
+        "rv += $pack$;\n");
+    else
+      printer->Print(vars,
+        "rv += $tag_size$ + $size$;\n");
+  }
+
+  printer->Outdent();
+  printer->Print("}\n");
+}
+
+// Returns the statements parsing one value of a scalar field at `at`, no
+// further than `limit`, into `dst`, for the optimize_for = SPEED unpacker.
+// Malformed input makes the function return 0, to fall back on the
+// descriptor-driven unpacker.
+static std::string
+speed_parse_code(const google::protobuf::FieldDescriptor *field,
+		 google::protobuf::FieldDescriptor::Type type,
+		 const std::string &dst, const std::string &limit)
+{
+  std::string conv;
+  std::string fixed_size;
+
+  switch (type) {
+    case google::protobuf::FieldDescriptor::TYPE_INT32:
+      conv = "(int32_t) (uint32_t) v";
+      break;
+    case google::protobuf::FieldDescriptor::TYPE_ENUM:
+      conv = "(" + FullNameToC(field->enum_type()->full_name(),
+			       field->enum_type()->file()) +
+	") (int32_t) (uint32_t) v";
+      break;
+    case google::protobuf::FieldDescriptor::TYPE_UINT32:
+      conv = "(uint32_t) v";
+      break;
+    case google::protobuf::FieldDescriptor::TYPE_SINT32:
+      conv = "protobuf_c__speed_unzigzag32 ((uint32_t) v)";
+      break;
+    case google::protobuf::FieldDescriptor::TYPE_INT64:
+      conv = "(int64_t) v";
+      break;
+    case google::protobuf::FieldDescriptor::TYPE_UINT64:
+      conv = "v";
+      break;
+    case google::protobuf::FieldDescriptor::TYPE_SINT64:
+      conv = "protobuf_c__speed_unzigzag64 (v)";
+      break;
+    case google::protobuf::FieldDescriptor::TYPE_BOOL:
+      return "{\n"
+	"  protobuf_c_boolean b;\n"
+	"  used = protobuf_c__speed_boolean_parse (" + limit + " - at, at, &b);\n"
+	"  if (used == 0)\n"
+	"    return 0;\n"
+	"  " + dst + " = b;\n"
+	"  at += used;\n"
+	"}\n";
+    case google::protobuf::FieldDescriptor::TYPE_FIXED32:
+      fixed_size = "4";
+      conv = "protobuf_c__speed_fixed32_parse (at)";
+      break;
+    case google::protobuf::FieldDescriptor::TYPE_SFIXED32:
+      fixed_size = "4";
+      conv = "(int32_t) protobuf_c__speed_fixed32_parse (at)";
+      break;
+    case google::protobuf::FieldDescriptor::TYPE_FLOAT:
+      fixed_size = "4";
+      conv = "protobuf_c__speed_float_parse (at)";
+      break;
+    case google::protobuf::FieldDescriptor::TYPE_FIXED64:
+      fixed_size = "8";
+      conv = "protobuf_c__speed_fixed64_parse (at)";
+      break;
+    case google::protobuf::FieldDescriptor::TYPE_SFIXED64:
+      fixed_size = "8";
+      conv = "(int64_t) protobuf_c__speed_fixed64_parse (at)";
+      break;
+    case google::protobuf::FieldDescriptor::TYPE_DOUBLE:
+      fixed_size = "8";
+      conv = "protobuf_c__speed_double_parse (at)";
+      break;
+    default:
+      GOOGLE_LOG(FATAL) << "Unexpected field type";
+      break;
+  }
+  if (!fixed_size.empty())
+    return "if (" + limit + " - at < " + fixed_size + ")\n"
+      "  return 0;\n" +
+      dst + " = " + conv + ";\n"
+      "at += " + fixed_size + ";\n";
+  return "{\n"
+    "  uint64_t v;\n"
+    "  used = protobuf_c__speed_varint_parse (" + limit + " - at, at, &v);\n"
+    "  if (used == 0)\n"
+    "    return 0;\n"
+    "  " + dst + " = " + conv + ";\n"
+    "  at += used;\n"
+    "}\n";
+}
+
+void FieldGenerator::GenerateSpeedUnpackCode(google::protobuf::io::Printer* printer,
+                                             int index) const
+{
+  std::map<std::string, std::string> vars;
+  const google::protobuf::OneofDescriptor *oneof = descriptor_->containing_oneof();
+  const ProtobufCFieldOptions opt = descriptor_->options().GetExtension(pb_c_field);
+  google::protobuf::FieldDescriptor::Type type = descriptor_->type();
+  bool repeated = descriptor_->label() == google::protobuf::FieldDescriptor::LABEL_REPEATED;
+  std::string presence;
+
+  if (type == google::protobuf::FieldDescriptor::TYPE_STRING && opt.string_as_bytes())
+    type = google::protobuf::FieldDescriptor::TYPE_BYTES;
+
+  vars["name"] = FieldName(descriptor_);
+  vars["lcclassname"] = FullNameToLower(descriptor_->containing_type()->full_name(),
+                                        descriptor_->file());
+  vars["index"] = SimpleItoa(index);
+  vars["number"] = SimpleItoa(descriptor_->number());
+  vars["key"] = SimpleItoa(((uint32_t) descriptor_->number() << 3) |
+    google::protobuf::internal::WireFormatLite::WireTypeForFieldType(
+      (google::protobuf::internal::WireFormatLite::FieldType) type));
+  vars["packed_key"] = SimpleItoa(((uint32_t) descriptor_->number() << 3) | 2);
+  vars["default"] = vars["lcclassname"] + "__descriptor.fields[" + vars["index"] + "].default_value";
+  if (oneof != NULL) {
+    vars["case"] = "message->" + CamelToLower(oneof->name()) + "_case";
+    presence = vars["case"] + " = ($case_type$) $number$;\n";
+    vars["case_type"] = FullNameToC(oneof->full_name(), oneof->file()) + "Case";
+  } else if (!repeated &&
+             descriptor_->label() != google::protobuf::FieldDescriptor::LABEL_REQUIRED &&
+             FieldSyntax(descriptor_) == 2 &&
+             type != google::protobuf::FieldDescriptor::TYPE_STRING &&
+             type != google::protobuf::FieldDescriptor::TYPE_MESSAGE) {
+    presence = "message->has_$name$ = 1;\n";
+  }
+  if (descriptor_->label() == google::protobuf::FieldDescriptor::LABEL_REQUIRED &&
+      !descriptor_->has_default_value())
+    presence += "required[$index$ / 8] |= 1 << ($index$ % 8);\n";
+
+  printer->Print(vars, "case $key$u: {\n");
+  printer->Indent();
+  // Replacing another member of the oneof means freeing it: leave that to
+  // the descriptor-driven unpacker.
+  if (oneof != NULL) {
+    printer->Print(vars,
+      "if ($case$ != 0 && $case$ != $number$)\n"
+      "  return 0;\n"
+      "{\n");
+    printer->Indent();
+  }
+
+  if (type == google::protobuf::FieldDescriptor::TYPE_MESSAGE) {
+    const google::protobuf::Descriptor *mtype = descriptor_->message_type();
+
+    vars["subclass"] = FullNameToC(mtype->full_name(), mtype->file());
+    vars["sublc"] = FullNameToLower(mtype->full_name(), mtype->file());
+    printer->Print(vars,
+      "size_t sub_len;\n"
+      "$subclass$ *sub;\n"
+      "used = protobuf_c__speed_length_parse (end - at, at, &sub_len);\n"
+      "if (used == 0)\n"
+      "  return 0;\n"
+      "at += used;\n");
+    if (repeated) {
+      printer->Print(vars,
+        "if (!protobuf_c__speed_reserve (allocator, (void **) &message->$name$,\n"
+        "                                message->n_$name$, 1, sizeof (*message->$name$)))\n"
+        "  return 0;\n");
+    } else {
+      // Occurrences of a message field are merged by the generic unpacker.
+      printer->Print(vars,
+        "if (message->$name$ != NULL)\n"
+        "  return 0;\n");
+    }
+    if (mtype->file() == descriptor_->file()) {
+      // Linked into the message first, so that it is freed on failure.
+      printer->Print(vars,
+        "sub = allocator->alloc (allocator->allocator_data, sizeof ($subclass$));\n"
+        "if (sub == NULL)\n"
+        "  return 0;\n"
+        "protobuf_c_message_init (&$sublc$__descriptor, sub);\n");
+      if (repeated)
+        printer->Print(vars, "message->$name$[message->n_$name$++] = sub;\n");
+      else
+        printer->Print(vars, "message->$name$ = sub;\n");
+      // A oneof member is only freed once its case is set.
+      printer->Print(vars, presence.c_str());
+      presence.clear();
+      printer->Print(vars,
+        "if (!$sublc$__speed_unpack_fields (sub, allocator, depth - 1, sub_len, at))\n"
+        "  return 0;\n");
+    } else {
+      printer->Print(vars,
+        "sub = ($subclass$ *) protobuf_c_message_unpack (&$sublc$__descriptor,\n"
+        "                                                allocator, sub_len, at);\n"
+        "if (sub == NULL)\n"
+        "  return 0;\n");
+      if (repeated)
+        printer->Print(vars, "message->$name$[message->n_$name$++] = sub;\n");
+      else
+        printer->Print(vars, "message->$name$ = sub;\n");
+    }
+    printer->Print(vars, "at += sub_len;\n");
+  } else if (type == google::protobuf::FieldDescriptor::TYPE_STRING) {
+    printer->Print(vars,
+      "size_t str_len;\n"
+      "char *str;\n"
+      "used = protobuf_c__speed_length_parse (end - at, at, &str_len);\n"
+      "if (used == 0)\n"
+      "  return 0;\n"
+      "at += used;\n");
+    if (repeated)
+      printer->Print(vars,
+        "if (!protobuf_c__speed_reserve (allocator, (void **) &message->$name$,\n"
+        "                                message->n_$name$, 1, sizeof (*message->$name$)))\n"
+        "  return 0;\n");
+    printer->Print(vars,
+      "str = allocator->alloc (allocator->allocator_data, str_len + 1);\n"
+      "if (str == NULL)\n"
+      "  return 0;\n"
+      "memcpy (str, at, str_len);\n"
+      "str[str_len] = '\\0';\n"
+      "at += str_len;\n");
+    if (repeated)
+      printer->Print(vars, "message->$name$[message->n_$name$++] = str;\n");
+    else
+      printer->Print(vars,
+        "if (message->$name$ != NULL &&\n"
+        "    (const void *) message->$name$ != $default$)\n"
+        "  allocator->free (allocator->allocator_data, message->$name$);\n"
+        "message->$name$ = str;\n");
+  } else if (type == google::protobuf::FieldDescriptor::TYPE_BYTES) {
+    printer->Print(vars,
+      "size_t bytes_len;\n"
+      "uint8_t *bytes = NULL;\n"
+      "used = protobuf_c__speed_length_parse (end - at, at, &bytes_len);\n"
+      "if (used == 0)\n"
+      "  return 0;\n"
+      "at += used;\n");
+    if (repeated)
+      printer->Print(vars,
+        "if (!protobuf_c__speed_reserve (allocator, (void **) &message->$name$,\n"
+        "                                message->n_$name$, 1, sizeof (*message->$name$)))\n"
+        "  return 0;\n");
+    printer->Print(vars,
+      "if (bytes_len != 0) {\n"
+      "  bytes = allocator->alloc (allocator->allocator_data, bytes_len);\n"
+      "  if (bytes == NULL)\n"
+      "    return 0;\n"
+      "  memcpy (bytes, at, bytes_len);\n"
+      "}\n"
+      "at += bytes_len;\n");
+    if (repeated) {
+      printer->Print(vars,
+        "message->$name$[message->n_$name$].len = bytes_len;\n"
+        "message->$name$[message->n_$name$++].data = bytes;\n");
+    } else {
+      printer->Print(vars,
+        "if (message->$name$.data != NULL &&\n"
+        "    ($default$ == NULL ||\n"
+        "     message->$name$.data !=\n"
+        "     ((const ProtobufCBinaryData *) $default$)->data))\n"
+        "  allocator->free (allocator->allocator_data, message->$name$.data);\n"
+        "message->$name$.len = bytes_len;\n"
+        "message->$name$.data = bytes;\n");
+    }
+  } else if (repeated) {
+    printer->Print(vars,
+      "if (!protobuf_c__speed_reserve (allocator, (void **) &message->$name$,\n"
+      "                                message->n_$name$, 1, sizeof (*message->$name$)))\n"
+      "  return 0;\n");
+    printer->Print(speed_parse_code(descriptor_, type,
+      "message->" + vars["name"] + "[message->n_" + vars["name"] + "]",
+      "end").c_str());
+    printer->Print(vars, "message->n_$name$++;\n");
+  } else {
+    printer->Print(speed_parse_code(descriptor_, type, "message->" + vars["name"],
+      "end").c_str());
+  }
+  printer->Print(vars, presence.c_str());
+  if (oneof != NULL) {
+    printer->Outdent();
+    printer->Print("}\n");
+  }
+  printer->Print("break;\n");
+  printer->Outdent();
+  printer->Print("}\n");
+
+  // Repeated scalars are accepted packed whether or not they are declared so.
+  if (repeated && is_packable_type(descriptor_->type())) {
+    std::string count;
+
+    switch (type) {
+      case google::protobuf::FieldDescriptor::TYPE_FIXED32:
+      case google::protobuf::FieldDescriptor::TYPE_SFIXED32:
+      case google::protobuf::FieldDescriptor::TYPE_FLOAT:
+        count = "payload_len % 4 != 0 ? (size_t) -1 : payload_len / 4";
+        break;
+      case google::protobuf::FieldDescriptor::TYPE_FIXED64:
+      case google::protobuf::FieldDescriptor::TYPE_SFIXED64:
+      case google::protobuf::FieldDescriptor::TYPE_DOUBLE:
+        count = "payload_len % 8 != 0 ? (size_t) -1 : payload_len / 8";
+        break;
+      default:
+        count = "protobuf_c__speed_varint_count (payload_len, at)";
+        break;
+    }
+    vars["count"] = count;
+    printer->Print(vars,
+      "case $packed_key$u: {\n"
+      "  size_t payload_len;\n"
+      "  const uint8_t *payload_end;\n"
+      "  size_t count;\n"
+      "  used = protobuf_c__speed_length_parse (end - at, at, &payload_len);\n"
+      "  if (used == 0)\n"
+      "    return 0;\n"
+      "  at += used;\n"
+      "  payload_end = at + payload_len;\n"
+      "  count = $count$;\n"
+      "  if (count == (size_t) -1)\n"
+      "    return 0;\n"
+      "  if (!protobuf_c__speed_reserve (allocator, (void **) &message->$name$,\n"
+      "                                  message->n_$name$, count, sizeof (*message->$name$)))\n"
+      "    return 0;\n"
+      "  while (at < payload_end) {\n");
+    printer->Indent();
+    printer->Indent();
+    printer->Print(speed_parse_code(descriptor_, type,
+      "message->" + vars["name"] + "[message->n_" + vars["name"] + "]",
+      "payload_end").c_str());
+    printer->Print(vars, "message->n_$name$++;\n");
+    printer->Outdent();
+    printer->Outdent();
+    printer->Print(vars,
+      "  }\n"
+      "  break;\n"
+      "}\n");
+  }
+}
+
 FieldGeneratorMap::FieldGeneratorMap(const google::protobuf::Descriptor* descriptor)
   : descriptor_(descriptor),
     field_generators_(
@@ -90,6 +90,18 @@ class FieldGenerator {
   // Generate members to initialize this field from a static initializer
   virtual void GenerateStaticInit(google::protobuf::io::Printer* printer) const = 0;
 
+  // Generate the code for this field in the specialized get_packed_size
+  // (pack == false) or pack (pack == true) function emitted for files with
+  // optimize_for = SPEED. `index` is the position of the field in the
+  // message descriptor.
+  void GenerateSpeedPackCode(google::protobuf::io::Printer* printer,
+                             int index, bool pack) const;
+
+  // Generate the cases of the switch on the key of the next field in the
+  // specialized unpack function emitted for files with
+  // optimize_for = SPEED.
+  void GenerateSpeedUnpackCode(google::protobuf::io::Printer* printer,
+                               int index) const;
 
  protected:
   void GenerateDescriptorInitializerGeneric(google::protobuf::io::Printer* printer,
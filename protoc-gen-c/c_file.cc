@@ -226,6 +226,291 @@ void FileGenerator::GenerateHeader(google::protobuf::io::Printer* printer) {
     "filename_identifier", filename_identifier);
 }
 
+// Encoding and decoding primitives used by the specialized pack and unpack
+// functions of files with optimize_for = SPEED. They are guarded so that
+// several generated sources can be included in the same translation unit.
+static void GenerateSpeedHelpers(google::protobuf::io::Printer* printer) {
+  printer->Print(
+    "\n"
+    "#ifndef PROTOBUF_C__SPEED_HELPERS\n"
+    "#define PROTOBUF_C__SPEED_HELPERS\n"
+    "#include <string.h>\n"
+    "static inline size_t\n"
+    "protobuf_c__speed_uint32_size (uint32_t v)\n"
+    "{\n"
+    "  if (v < (1UL << 7)) return 1;\n"
+    "  if (v < (1UL << 14)) return 2;\n"
+    "  if (v < (1UL << 21)) return 3;\n"
+    "  if (v < (1UL << 28)) return 4;\n"
+    "  return 5;\n"
+    "}\n"
+    "static inline size_t\n"
+    "protobuf_c__speed_uint64_size (uint64_t v)\n"
+    "{\n"
+    "  size_t rv = 1;\n"
+    "  while (v >= 0x80) {\n"
+    "    v >>= 7;\n"
+    "    rv++;\n"
+    "  }\n"
+    "  return rv;\n"
+    "}\n"
+    "static inline size_t\n"
+    "protobuf_c__speed_int32_size (int32_t v)\n"
+    "{\n"
+    "  return v < 0 ? 10 : protobuf_c__speed_uint32_size ((uint32_t) v);\n"
+    "}\n"
+    "static inline uint32_t\n"
+    "protobuf_c__speed_zigzag32 (int32_t v)\n"
+    "{\n"
+    "  return ((uint32_t) v << 1) ^ -((uint32_t) v >> 31);\n"
+    "}\n"
+    "static inline uint64_t\n"
+    "protobuf_c__speed_zigzag64 (int64_t v)\n"
+    "{\n"
+    "  return ((uint64_t) v << 1) ^ -((uint64_t) v >> 63);\n"
+    "}\n"
+    "static inline size_t\n"
+    "protobuf_c__speed_string_size (const char *str)\n"
+    "{\n"
+    "  size_t len = str != NULL ? strlen (str) : 0;\n"
+    "  return protobuf_c__speed_uint32_size (len) + len;\n"
+    "}\n"
+    "static inline size_t\n"
+    "protobuf_c__speed_bytes_size (const ProtobufCBinaryData *bd)\n"
+    "{\n"
+    "  return protobuf_c__speed_uint32_size (bd->len) + bd->len;\n"
+    "}\n"
+    "static inline size_t\n"
+    "protobuf_c__speed_uint32_pack (uint32_t v, uint8_t *out)\n"
+    "{\n"
+    "  size_t rv = 0;\n"
+    "  while (v >= 0x80) {\n"
+    "    out[rv++] = (uint8_t) (v | 0x80);\n"
+    "    v >>= 7;\n"
+    "  }\n"
+    "  out[rv++] = (uint8_t) v;\n"
+    "  return rv;\n"
+    "}\n"
+    "static inline size_t\n"
+    "protobuf_c__speed_uint64_pack (uint64_t v, uint8_t *out)\n"
+    "{\n"
+    "  size_t rv = 0;\n"
+    "  while (v >= 0x80) {\n"
+    "    out[rv++] = (uint8_t) (v | 0x80);\n"
+    "    v >>= 7;\n"
+    "  }\n"
+    "  out[rv++] = (uint8_t) v;\n"
+    "  return rv;\n"
+    "}\n"
+    "static inline size_t\n"
+    "protobuf_c__speed_int32_pack (int32_t v, uint8_t *out)\n"
+    "{\n"
+    "  if (v < 0)\n"
+    "    return protobuf_c__speed_uint64_pack ((uint64_t) (int64_t) v, out);\n"
+    "  return protobuf_c__speed_uint32_pack ((uint32_t) v, out);\n"
+    "}\n"
+    "static inline size_t\n"
+    "protobuf_c__speed_fixed32_pack (uint32_t v, uint8_t *out)\n"
+    "{\n"
+    "  out[0] = (uint8_t) v;\n"
+    "  out[1] = (uint8_t) (v >> 8);\n"
+    "  out[2] = (uint8_t) (v >> 16);\n"
+    "  out[3] = (uint8_t) (v >> 24);\n"
+    "  return 4;\n"
+    "}\n"
+    "static inline size_t\n"
+    "protobuf_c__speed_fixed64_pack (uint64_t v, uint8_t *out)\n"
+    "{\n"
+    "  protobuf_c__speed_fixed32_pack ((uint32_t) v, out);\n"
+    "  protobuf_c__speed_fixed32_pack ((uint32_t) (v >> 32), out + 4);\n"
+    "  return 8;\n"
+    "}\n"
+    "static inline size_t\n"
+    "protobuf_c__speed_float_pack (float v, uint8_t *out)\n"
+    "{\n"
+    "  union { float f; uint32_t u; } u;\n"
+    "  u.f = v;\n"
+    "  return protobuf_c__speed_fixed32_pack (u.u, out);\n"
+    "}\n"
+    "static inline size_t\n"
+    "protobuf_c__speed_double_pack (double v, uint8_t *out)\n"
+    "{\n"
+    "  union { double d; uint64_t u; } u;\n"
+    "  u.d = v;\n"
+    "  return protobuf_c__speed_fixed64_pack (u.u, out);\n"
+    "}\n"
+    "static inline size_t\n"
+    "protobuf_c__speed_boolean_pack (protobuf_c_boolean v, uint8_t *out)\n"
+    "{\n"
+    "  out[0] = v ? 1 : 0;\n"
+    "  return 1;\n"
+    "}\n"
+    "static inline size_t\n"
+    "protobuf_c__speed_string_pack (const char *str, uint8_t *out)\n"
+    "{\n"
+    "  size_t len = str != NULL ? strlen (str) : 0;\n"
+    "  size_t rv = protobuf_c__speed_uint32_pack ((uint32_t) len, out);\n"
+    "  if (len != 0)\n"
+    "    memcpy (out + rv, str, len);\n"
+    "  return rv + len;\n"
+    "}\n"
+    "static inline size_t\n"
+    "protobuf_c__speed_bytes_pack (const ProtobufCBinaryData *bd, uint8_t *out)\n"
+    "{\n"
+    "  size_t rv = protobuf_c__speed_uint32_pack ((uint32_t) bd->len, out);\n"
+    "  if (bd->len != 0)\n"
+    "    memcpy (out + rv, bd->data, bd->len);\n"
+    "  return rv + bd->len;\n"
+    "}\n"
+    "/* `len` bytes of message were packed at out + 1; prefix them with their length */\n"
+    "static inline size_t\n"
+    "protobuf_c__speed_prefix_message (size_t len, uint8_t *out)\n"
+    "{\n"
+    "  size_t prefix_len = protobuf_c__speed_uint32_size ((uint32_t) len);\n"
+    "  if (prefix_len != 1)\n"
+    "    memmove (out + prefix_len, out + 1, len);\n"
+    "  return protobuf_c__speed_uint32_pack ((uint32_t) len, out) + len;\n"
+    "}\n"
+    "/* nesting handled by the specialized unpacker before it gives up */\n"
+    "#define PROTOBUF_C__SPEED_MAX_DEPTH 64\n"
+    "/* the decoders return the number of bytes used, or 0 if they are malformed */\n"
+    "static inline size_t\n"
+    "protobuf_c__speed_varint_parse (size_t rem, const uint8_t *at, uint64_t *v)\n"
+    "{\n"
+    "  uint64_t rv = 0;\n"
+    "  size_t i;\n"
+    "  if (rem != 0 && at[0] < 0x80) {\n"
+    "    *v = at[0];\n"
+    "    return 1;\n"
+    "  }\n"
+    "  for (i = 0; i < rem && i < 10; i++) {\n"
+    "    rv |= (uint64_t) (at[i] & 0x7f) << (7 * i);\n"
+    "    if ((at[i] & 0x80) == 0) {\n"
+    "      *v = rv;\n"
+    "      return i + 1;\n"
+    "    }\n"
+    "  }\n"
+    "  return 0;\n"
+    "}\n"
+    "/* true if any bit of the varint is set, as protobuf_c_message_unpack() has it */\n"
+    "static inline size_t\n"
+    "protobuf_c__speed_boolean_parse (size_t rem, const uint8_t *at, protobuf_c_boolean *b)\n"
+    "{\n"
+    "  unsigned any = 0;\n"
+    "  size_t i;\n"
+    "  for (i = 0; i < rem && i < 10; i++) {\n"
+    "    any |= at[i] & 0x7f;\n"
+    "    if ((at[i] & 0x80) == 0) {\n"
+    "      *b = any != 0;\n"
+    "      return i + 1;\n"
+    "    }\n"
+    "  }\n"
+    "  return 0;\n"
+    "}\n"
+    "/* the number and wire type of a field, as one value */\n"
+    "static inline size_t\n"
+    "protobuf_c__speed_key_parse (size_t rem, const uint8_t *at, uint32_t *key)\n"
+    "{\n"
+    "  uint64_t v;\n"
+    "  size_t used = protobuf_c__speed_varint_parse (rem < 5 ? rem : 5, at, &v);\n"
+    "  if (used == 0 || v > 0xffffffffu)\n"
+    "    return 0;\n"
+    "  *key = (uint32_t) v;\n"
+    "  return used;\n"
+    "}\n"
+    "/* the length prefix of a field, checked against the `rem` bytes left */\n"
+    "static inline size_t\n"
+    "protobuf_c__speed_length_parse (size_t rem, const uint8_t *at, size_t *len)\n"
+    "{\n"
+    "  uint64_t v;\n"
+    "  size_t used = protobuf_c__speed_varint_parse (rem < 5 ? rem : 5, at, &v);\n"
+    "  if (used == 0 || v > 0x7fffffff || v > rem - used)\n"
+    "    return 0;\n"
+    "  *len = (size_t) v;\n"
+    "  return used;\n"
+    "}\n"
+    "/* number of varints in a packed payload, or (size_t) -1 if the last is cut short */\n"
+    "static inline size_t\n"
+    "protobuf_c__speed_varint_count (size_t len, const uint8_t *at)\n"
+    "{\n"
+    "  size_t i, n = 0;\n"
+    "  for (i = 0; i < len; i++)\n"
+    "    n += at[i] < 0x80;\n"
+    "  if (len != 0 && at[len - 1] >= 0x80)\n"
+    "    return (size_t) -1;\n"
+    "  return n;\n"
+    "}\n"
+    "static inline int32_t\n"
+    "protobuf_c__speed_unzigzag32 (uint32_t v)\n"
+    "{\n"
+    "  return (int32_t) ((v >> 1) ^ -(v & 1));\n"
+    "}\n"
+    "static inline int64_t\n"
+    "protobuf_c__speed_unzigzag64 (uint64_t v)\n"
+    "{\n"
+    "  return (int64_t) ((v >> 1) ^ -(v & 1));\n"
+    "}\n"
+    "static inline uint32_t\n"
+    "protobuf_c__speed_fixed32_parse (const uint8_t *at)\n"
+    "{\n"
+    "  return (uint32_t) at[0] | ((uint32_t) at[1] << 8) |\n"
+    "         ((uint32_t) at[2] << 16) | ((uint32_t) at[3] << 24);\n"
+    "}\n"
+    "static inline uint64_t\n"
+    "protobuf_c__speed_fixed64_parse (const uint8_t *at)\n"
+    "{\n"
+    "  return (uint64_t) protobuf_c__speed_fixed32_parse (at) |\n"
+    "         ((uint64_t) protobuf_c__speed_fixed32_parse (at + 4) << 32);\n"
+    "}\n"
+    "static inline float\n"
+    "protobuf_c__speed_float_parse (const uint8_t *at)\n"
+    "{\n"
+    "  union { float f; uint32_t u; } u;\n"
+    "  u.u = protobuf_c__speed_fixed32_parse (at);\n"
+    "  return u.f;\n"
+    "}\n"
+    "static inline double\n"
+    "protobuf_c__speed_double_parse (const uint8_t *at)\n"
+    "{\n"
+    "  union { double d; uint64_t u; } u;\n"
+    "  u.u = protobuf_c__speed_fixed64_parse (at);\n"
+    "  return u.d;\n"
+    "}\n"
+    "/* grows a repeated field array the way protobuf_c_message_unpack() does */\n"
+    "static inline size_t\n"
+    "protobuf_c__speed_capacity (size_t n)\n"
+    "{\n"
+    "  size_t cap = 4;\n"
+    "  if (n == 0)\n"
+    "    return 0;\n"
+    "  while (cap < n)\n"
+    "    cap <<= 1;\n"
+    "  return cap;\n"
+    "}\n"
+    "static inline protobuf_c_boolean\n"
+    "protobuf_c__speed_reserve (ProtobufCAllocator *allocator, void **parray,\n"
+    "                           size_t n, size_t count, size_t siz)\n"
+    "{\n"
+    "  size_t cap;\n"
+    "  void *array;\n"
+    "  if (n + count <= protobuf_c__speed_capacity (n))\n"
+    "    return 1;\n"
+    "  cap = protobuf_c__speed_capacity (n + count);\n"
+    "  if (cap > (size_t) -1 / siz)\n"
+    "    return 0;\n"
+    "  array = allocator->alloc (allocator->allocator_data, cap * siz);\n"
+    "  if (array == NULL)\n"
+    "    return 0;\n"
+    "  if (n != 0)\n"
+    "    memcpy (array, *parray, n * siz);\n"
+    "  if (*parray != NULL)\n"
+    "    allocator->free (allocator->allocator_data, *parray);\n"
+    "  *parray = array;\n"
+    "  return 1;\n"
+    "}\n"
+    "#endif\n");
+}
+
 void FileGenerator::GenerateSource(google::protobuf::io::Printer* printer) {
   printer->Print(
     "/* Generated by the protocol buffer compiler.  DO NOT EDIT! */\n"
@@ -242,6 +527,15 @@ void FileGenerator::GenerateSource(google::protobuf::io::Printer* printer) {
 
   const ProtobufCFileOptions opt = file_->options().GetExtension(pb_c_file);
 
+  if (file_->options().has_optimize_for() &&
+      file_->options().optimize_for() ==
+      google::protobuf::FileOptions_OptimizeMode_SPEED) {
+    GenerateSpeedHelpers(printer);
+    for (int i = 0; i < file_->message_type_count(); i++) {
+      message_generators_[i]->GenerateSpeedFunctionDeclarations(printer);
+    }
+  }
+
   for (int i = 0; i < file_->message_type_count(); i++) {
     message_generators_[i]->GenerateHelperFunctionDefinitions(
 						printer,
@@ -337,6 +337,15 @@ GenerateHelperFunctionDeclarations(google::protobuf::io::Printer* printer,
 		 "void   $lcclassname$__free_unpacked\n"
 		 "                     ($classname$ *message,\n"
 		 "                      ProtobufCAllocator *allocator);\n"
+		 "void   $lcclassname$__clear\n"
+		 "                     ($classname$ *message,\n"
+		 "                      ProtobufCAllocator *allocator);\n"
+		 "protobuf_c_boolean\n"
+		 "       $lcclassname$__unpack_into\n"
+		 "                     ($classname$ *message,\n"
+		 "                      ProtobufCAllocator  *allocator,\n"
+		 "                      size_t               len,\n"
+		 "                      const uint8_t       *data);\n"
 		);
   }
 }
@@ -377,6 +386,277 @@ compare_pfields_by_number (const void *a, const void *b)
   return 0;
 }
 
+// Returns the PROTOBUF_C_FIELD_TABLE_OP_* suffix used to decode a field found
+// through the field table.
+static const char *
+FieldTableOp(const google::protobuf::FieldDescriptor* fd)
+{
+  // Repeated and oneof fields, and those with variable-length data, go
+  // through the generic path.
+  if (fd->is_repeated() || fd->containing_oneof() != NULL)
+    return "GENERIC";
+  switch (fd->type()) {
+    case google::protobuf::FieldDescriptor::TYPE_INT32:
+    case google::protobuf::FieldDescriptor::TYPE_UINT32:
+    case google::protobuf::FieldDescriptor::TYPE_ENUM:
+      return "VARINT32";
+    case google::protobuf::FieldDescriptor::TYPE_SINT32:
+      return "SINT32";
+    case google::protobuf::FieldDescriptor::TYPE_INT64:
+    case google::protobuf::FieldDescriptor::TYPE_UINT64:
+      return "VARINT64";
+    case google::protobuf::FieldDescriptor::TYPE_SINT64:
+      return "SINT64";
+    case google::protobuf::FieldDescriptor::TYPE_BOOL:
+      return "BOOL";
+    case google::protobuf::FieldDescriptor::TYPE_FIXED32:
+    case google::protobuf::FieldDescriptor::TYPE_SFIXED32:
+    case google::protobuf::FieldDescriptor::TYPE_FLOAT:
+      return "FIXED32";
+    case google::protobuf::FieldDescriptor::TYPE_FIXED64:
+    case google::protobuf::FieldDescriptor::TYPE_SFIXED64:
+    case google::protobuf::FieldDescriptor::TYPE_DOUBLE:
+      return "FIXED64";
+    default:
+      return "GENERIC";
+  }
+}
+
+void MessageGenerator::
+GenerateFieldTable(google::protobuf::io::Printer* printer,
+		   const google::protobuf::FieldDescriptor **sorted_fields)
+{
+  const int table_size = 32;  // PROTOBUF_C_FIELD_TABLE_SIZE
+  int slots[table_size];
+  int n_slots = 0;
+
+  // Fields are sorted by number, so the first one to claim a slot is the
+  // one with the lowest number.
+  for (int i = 0; i < table_size; i++)
+    slots[i] = -1;
+  for (int i = 0; i < descriptor_->field_count(); i++) {
+    uint32_t tag = google::protobuf::internal::WireFormat::MakeTag(sorted_fields[i]);
+    int wire_type = tag & 7;
+
+    if (tag > 0x3fff || wire_type == 3 || wire_type == 4)
+      continue;  // three-byte tag, or group
+    int slot = ((tag > 0x7f ? (tag | 0x80) : tag) >> 3) & 0x1f;
+    if (slots[slot] == -1)
+      slots[slot] = i;
+    if (slot >= n_slots)
+      n_slots = slot + 1;
+  }
+
+  std::map<std::string, std::string> vars;
+  vars["lcclassname"] = FullNameToLower(descriptor_->full_name(), descriptor_->file());
+  printer->Print(vars,
+      "#ifdef PROTOBUF_C_FIELD_TABLE_SIZE\n"
+      "static const ProtobufCFieldTableEntry $lcclassname$__field_table[PROTOBUF_C_FIELD_TABLE_SIZE] =\n"
+      "{\n");
+  for (int i = 0; i < n_slots; i++) {
+    if (slots[i] == -1) {
+      printer->Print("  { 0, 0, 0, 0 },\n");
+      continue;
+    }
+    const google::protobuf::FieldDescriptor* fd = sorted_fields[slots[i]];
+    uint32_t tag = google::protobuf::internal::WireFormat::MakeTag(fd);
+    uint32_t encoded_tag = tag;
+    char buf[16];
+
+    if (tag > 0x7f)
+      encoded_tag = (tag & 0x7f) | 0x80 | ((tag >> 7) << 8);
+    vars["encoded_tag"] = std::string("0x") + FastHexToBuffer(encoded_tag, buf);
+    vars["tag_len"] = tag > 0x7f ? "2" : "1";
+    vars["op"] = FieldTableOp(fd);
+    vars["index"] = SimpleItoa(slots[i]);
+    vars["name"] = fd->name();
+    printer->Print(vars,
+        "  { $encoded_tag$, $tag_len$, PROTOBUF_C_FIELD_TABLE_OP_$op$, $index$ },   /* field[$index$] = $name$ */\n");
+  }
+  printer->Print(vars,
+      "};\n"
+      "#else\n"
+      "#define $lcclassname$__field_table NULL\n"
+      "#endif\n");
+}
+
+void MessageGenerator::
+GenerateFieldIndexTable(google::protobuf::io::Printer* printer,
+			const google::protobuf::FieldDescriptor **sorted_fields,
+			int n_ranges)
+{
+  const int n_fields = descriptor_->field_count();
+  const int max_number = sorted_fields[n_fields - 1]->number();
+  std::map<std::string, std::string> vars;
+  vars["lcclassname"] = FullNameToLower(descriptor_->full_name(), descriptor_->file());
+
+  // A single range is looked up with a subtraction already. Otherwise the
+  // table replaces a binary search over the ranges, as long as at least half
+  // of the numbers it covers are used.
+  if (n_ranges <= 1 || max_number > 2 * n_fields || n_fields >= 0xffff) {
+    printer->Print(vars, "#define $lcclassname$__field_index_table NULL\n");
+    return;
+  }
+
+  int *indices = new int[max_number + 1];
+  for (int i = 0; i <= max_number; i++)
+    indices[i] = -1;
+  for (int i = 0; i < n_fields; i++)
+    indices[sorted_fields[i]->number()] = i;
+
+  vars["n_entries"] = SimpleItoa(max_number + 1);
+  printer->Print(vars,
+      "#ifdef PROTOBUF_C_FIELD_INDEX_NONE\n"
+      "static const uint16_t $lcclassname$__field_index_table[$n_entries$] =\n"
+      "{\n");
+  for (int i = 0; i <= max_number; i++) {
+    if (indices[i] == -1) {
+      printer->Print("  PROTOBUF_C_FIELD_INDEX_NONE,\n");
+      continue;
+    }
+    vars["index"] = SimpleItoa(indices[i]);
+    vars["name"] = sorted_fields[indices[i]]->name();
+    printer->Print(vars, "  $index$,   /* field[$index$] = $name$ */\n");
+  }
+  printer->Print(vars,
+      "};\n"
+      "#else\n"
+      "#define $lcclassname$__field_index_table NULL\n"
+      "#endif\n");
+  delete [] indices;
+}
+
+void MessageGenerator::
+GenerateSpeedFunctionDeclarations(google::protobuf::io::Printer* printer)
+{
+  for (int i = 0; i < descriptor_->nested_type_count(); i++) {
+    nested_generators_[i]->GenerateSpeedFunctionDeclarations(printer);
+  }
+
+  std::map<std::string, std::string> vars;
+  vars["classname"] = FullNameToC(descriptor_->full_name(), descriptor_->file());
+  vars["lcclassname"] = FullNameToLower(descriptor_->full_name(), descriptor_->file());
+  printer->Print(vars,
+		 "static inline size_t $lcclassname$__speed_get_packed_size\n"
+		 "                     (const $classname$ *message);\n"
+		 "static inline size_t $lcclassname$__speed_pack\n"
+		 "                     (const $classname$ *message,\n"
+		 "                      uint8_t       *out);\n"
+		 "static inline protobuf_c_boolean $lcclassname$__speed_unpack_fields\n"
+		 "                     ($classname$ *message,\n"
+		 "                      ProtobufCAllocator *allocator,\n"
+		 "                      unsigned       depth,\n"
+		 "                      size_t         len,\n"
+		 "                      const uint8_t *data);\n");
+}
+
+void MessageGenerator::
+GenerateSpeedFunctionDefinitions(google::protobuf::io::Printer* printer)
+{
+  const ProtobufCMessageOptions opt =
+	  descriptor_->options().GetExtension(pb_c_msg);
+  std::map<std::string, std::string> vars;
+  vars["classname"] = FullNameToC(descriptor_->full_name(), descriptor_->file());
+  vars["lcclassname"] = FullNameToLower(descriptor_->full_name(), descriptor_->file());
+  vars["base"] = opt.base_field_name();
+
+  // Fields are packed in the order of the descriptor, which is by number.
+  std::vector<const google::protobuf::FieldDescriptor*> sorted_fields;
+  for (int i = 0; i < descriptor_->field_count(); i++) {
+    sorted_fields.push_back(descriptor_->field(i));
+  }
+  std::sort(sorted_fields.begin(), sorted_fields.end(),
+	    [](const google::protobuf::FieldDescriptor* a,
+	       const google::protobuf::FieldDescriptor* b) {
+	      return a->number() < b->number();
+	    });
+
+  // Messages with unknown fields go through the descriptor-driven path.
+  for (int pack = 0; pack < 2; pack++) {
+    if (pack)
+      printer->Print(vars,
+		     "static inline size_t $lcclassname$__speed_pack\n"
+		     "                     (const $classname$ *message,\n"
+		     "                      uint8_t       *out)\n"
+		     "{\n"
+		     "  size_t rv = 0;\n"
+		     "  if (message->$base$.n_unknown_fields != 0)\n"
+		     "    return protobuf_c_message_pack ((const ProtobufCMessage*)message, out);\n");
+    else
+      printer->Print(vars,
+		     "static inline size_t $lcclassname$__speed_get_packed_size\n"
+		     "                     (const $classname$ *message)\n"
+		     "{\n"
+		     "  size_t rv = 0;\n"
+		     "  if (message->$base$.n_unknown_fields != 0)\n"
+		     "    return protobuf_c_message_get_packed_size ((const ProtobufCMessage*)message);\n");
+    printer->Indent();
+    for (size_t i = 0; i < sorted_fields.size(); i++) {
+      field_generators_.get(sorted_fields[i]).GenerateSpeedPackCode(printer, i, pack);
+    }
+    printer->Outdent();
+    printer->Print("  return rv;\n"
+		   "}\n");
+  }
+
+  // Anything the switch does not expect -- unknown fields, a second
+  // occurrence of a sub-message, another member of a oneof, malformed or
+  // too deeply nested input -- fails the fast path, and the caller unpacks
+  // again with the descriptor-driven unpacker.
+  int n_required = 0;
+  for (size_t i = 0; i < sorted_fields.size(); i++) {
+    if (sorted_fields[i]->label() == google::protobuf::FieldDescriptor::LABEL_REQUIRED &&
+	!sorted_fields[i]->has_default_value())
+      n_required++;
+  }
+  vars["required_size"] = SimpleItoa((sorted_fields.size() + 7) / 8);
+  printer->Print(vars,
+		 "static inline protobuf_c_boolean $lcclassname$__speed_unpack_fields\n"
+		 "                     ($classname$ *message,\n"
+		 "                      ProtobufCAllocator *allocator,\n"
+		 "                      unsigned       depth,\n"
+		 "                      size_t         len,\n"
+		 "                      const uint8_t *data)\n"
+		 "{\n"
+		 "  const uint8_t *at = data;\n"
+		 "  const uint8_t *end = data + len;\n"
+		 "  size_t used;\n");
+  if (n_required != 0)
+    printer->Print(vars, "  uint8_t required[$required_size$] = { 0 };\n");
+  printer->Print("  (void) allocator;\n"
+		 "  if (depth == 0)\n"
+		 "    return 0;\n"
+		 "  while (at < end) {\n"
+		 "    uint32_t key;\n"
+		 "    used = protobuf_c__speed_key_parse (end - at, at, &key);\n"
+		 "    if (used == 0)\n"
+		 "      return 0;\n"
+		 "    at += used;\n"
+		 "    switch (key) {\n");
+  printer->Indent();
+  printer->Indent();
+  for (size_t i = 0; i < sorted_fields.size(); i++) {
+    field_generators_.get(sorted_fields[i]).GenerateSpeedUnpackCode(printer, i);
+  }
+  printer->Outdent();
+  printer->Outdent();
+  printer->Print("    default:\n"
+		 "      return 0;\n"
+		 "    }\n"
+		 "  }\n");
+  for (size_t i = 0; i < sorted_fields.size(); i++) {
+    if (sorted_fields[i]->label() != google::protobuf::FieldDescriptor::LABEL_REQUIRED ||
+	sorted_fields[i]->has_default_value())
+      continue;
+    vars["index"] = SimpleItoa(i);
+    printer->Print(vars,
+		   "  if ((required[$index$ / 8] & (1 << ($index$ % 8))) == 0)\n"
+		   "    return 0;\n");
+  }
+  printer->Print("  return 1;\n"
+		 "}\n");
+}
+
 void MessageGenerator::
 GenerateHelperFunctionDefinitions(google::protobuf::io::Printer* printer,
 				  bool is_pack_deep,
@@ -399,6 +679,13 @@ GenerateHelperFunctionDefinitions(google::protobuf::io::Printer* printer,
 							     gen_init);
   }
 
+  bool optimize_speed = descriptor_->file()->options().has_optimize_for() &&
+    descriptor_->file()->options().optimize_for() ==
+    google::protobuf::FileOptions_OptimizeMode_SPEED;
+
+  if (optimize_speed)
+    GenerateSpeedFunctionDefinitions(printer);
+
   std::map<std::string, std::string> vars;
   vars["classname"] = FullNameToC(descriptor_->full_name(), descriptor_->file());
   vars["lcclassname"] = FullNameToLower(descriptor_->full_name(), descriptor_->file());
@@ -413,7 +700,36 @@ GenerateHelperFunctionDefinitions(google::protobuf::io::Printer* printer,
 		 "  *message = init_value;\n"
 		 "}\n");
   }
-  if (gen_pack) {
+  if (gen_pack && optimize_speed) {
+    printer->Print(vars,
+		 "size_t $lcclassname$__get_packed_size\n"
+		 "                     (const $classname$ *message)\n"
+		 "{\n"
+		 "  assert(message->$base$.descriptor == &$lcclassname$__descriptor);\n"
+		 "  return $lcclassname$__speed_get_packed_size (message);\n"
+		 "}\n"
+		 "size_t $lcclassname$__pack\n"
+		 "                     (const $classname$ *message,\n"
+		 "                      uint8_t       *out)\n"
+		 "{\n"
+		 "  assert(message->$base$.descriptor == &$lcclassname$__descriptor);\n"
+		 "  return $lcclassname$__speed_pack (message, out);\n"
+		 "}\n"
+		 "size_t $lcclassname$__pack_to_buffer\n"
+		 "                     (const $classname$ *message,\n"
+		 "                      ProtobufCBuffer *buffer)\n"
+		 "{\n"
+		 "  uint8_t scratch[512];\n"
+		 "  size_t len;\n"
+		 "  assert(message->$base$.descriptor == &$lcclassname$__descriptor);\n"
+		 "  len = $lcclassname$__speed_get_packed_size (message);\n"
+		 "  if (len > sizeof (scratch))\n"
+		 "    return protobuf_c_message_pack_to_buffer ((const ProtobufCMessage*)message, buffer);\n"
+		 "  $lcclassname$__speed_pack (message, scratch);\n"
+		 "  buffer->append (buffer, len, scratch);\n"
+		 "  return len;\n"
+		 "}\n");
+  } else if (gen_pack) {
     printer->Print(vars,
 		 "size_t $lcclassname$__get_packed_size\n"
 		 "                     (const $classname$ *message)\n"
@@ -434,7 +750,30 @@ GenerateHelperFunctionDefinitions(google::protobuf::io::Printer* printer,
 		 "{\n"
 		 "  assert(message->$base$.descriptor == &$lcclassname$__descriptor);\n"
 		 "  return protobuf_c_message_pack_to_buffer ((const ProtobufCMessage*)message, buffer);\n"
-		 "}\n"
+		 "}\n");
+  }
+  if (gen_pack && optimize_speed) {
+    printer->Print(vars,
+		 "$classname$ *\n"
+		 "       $lcclassname$__unpack\n"
+		 "                     (ProtobufCAllocator  *allocator,\n"
+		 "                      size_t               len,\n"
+		 "                      const uint8_t       *data)\n"
+		 "{\n"
+		 "  ProtobufCAllocator *a = allocator != NULL ? allocator : protobuf_c_default_allocator ();\n"
+		 "  $classname$ *message = a->alloc (a->allocator_data, sizeof ($classname$));\n"
+		 "  if (message == NULL)\n"
+		 "    return NULL;\n"
+		 "  protobuf_c_message_init (&$lcclassname$__descriptor, message);\n"
+		 "  if ($lcclassname$__speed_unpack_fields (message, a, PROTOBUF_C__SPEED_MAX_DEPTH, len, data))\n"
+		 "    return message;\n"
+		 "  protobuf_c_message_free_unpacked ((ProtobufCMessage*)message, a);\n"
+		 "  return ($classname$ *)\n"
+		 "     protobuf_c_message_unpack (&$lcclassname$__descriptor,\n"
+		 "                                allocator, len, data);\n"
+		 "}\n");
+  } else if (gen_pack) {
+    printer->Print(vars,
 		 "$classname$ *\n"
 		 "       $lcclassname$__unpack\n"
 		 "                     (ProtobufCAllocator  *allocator,\n"
@@ -444,7 +783,10 @@ GenerateHelperFunctionDefinitions(google::protobuf::io::Printer* printer,
 		 "  return ($classname$ *)\n"
 		 "     protobuf_c_message_unpack (&$lcclassname$__descriptor,\n"
 		 "                                allocator, len, data);\n"
-		 "}\n"
+		 "}\n");
+  }
+  if (gen_pack) {
+    printer->Print(vars,
 		 "void   $lcclassname$__free_unpacked\n"
 		 "                     ($classname$ *message,\n"
 		 "                      ProtobufCAllocator *allocator)\n"
@@ -454,6 +796,24 @@ GenerateHelperFunctionDefinitions(google::protobuf::io::Printer* printer,
 		 "  assert(message->$base$.descriptor == &$lcclassname$__descriptor);\n"
 		 "  protobuf_c_message_free_unpacked ((ProtobufCMessage*)message, allocator);\n"
 		 "}\n"
+		 "void   $lcclassname$__clear\n"
+		 "                     ($classname$ *message,\n"
+		 "                      ProtobufCAllocator *allocator)\n"
+		 "{\n"
+		 "  assert(message->$base$.descriptor == &$lcclassname$__descriptor);\n"
+		 "  protobuf_c_message_clear ((ProtobufCMessage*)message, allocator);\n"
+		 "}\n"
+		 "protobuf_c_boolean\n"
+		 "       $lcclassname$__unpack_into\n"
+		 "                     ($classname$ *message,\n"
+		 "                      ProtobufCAllocator  *allocator,\n"
+		 "                      size_t               len,\n"
+		 "                      const uint8_t       *data)\n"
+		 "{\n"
+		 "  assert(message->$base$.descriptor == &$lcclassname$__descriptor);\n"
+		 "  return protobuf_c_message_unpack_into ((ProtobufCMessage*)message,\n"
+		 "                                         allocator, len, data);\n"
+		 "}\n"
 		);
   }
 }
@@ -607,6 +967,15 @@ GenerateMessageDescriptor(google::protobuf::io::Printer* printer, bool gen_init)
 				descriptor_->field_count(), values,
 				vars["lcclassname"] + "__number_ranges");
   delete [] values;
+
+  if (optimize_code_size) {
+    printer->Print(vars,
+        "#define $lcclassname$__field_table NULL\n"
+        "#define $lcclassname$__field_index_table NULL\n");
+  } else {
+    GenerateFieldTable(printer, sorted_fields);
+    GenerateFieldIndexTable(printer, sorted_fields, n_ranges);
+  }
   delete [] sorted_fields;
 
   vars["n_ranges"] = SimpleItoa(n_ranges);
@@ -618,7 +987,9 @@ GenerateMessageDescriptor(google::protobuf::io::Printer* printer, bool gen_init)
   printer->Print(vars,
         "#define $lcclassname$__field_descriptors NULL\n"
         "#define $lcclassname$__field_indices_by_name NULL\n"
-        "#define $lcclassname$__number_ranges NULL\n");
+        "#define $lcclassname$__number_ranges NULL\n"
+        "#define $lcclassname$__field_table NULL\n"
+        "#define $lcclassname$__field_index_table NULL\n");
     }
 
   printer->Print(vars,
@@ -655,8 +1026,16 @@ GenerateMessageDescriptor(google::protobuf::io::Printer* printer, bool gen_init)
       "  NULL, /* gen_init_helpers = false */\n");
   }
   printer->Print(vars,
-      "  NULL,NULL,NULL    /* reserved[123] */\n"
-      "};\n");
+      "  (void *) $lcclassname$__field_table,\n"
+      "  (void *) $lcclassname$__field_index_table,\n");
+  if (opt.discard_unknown_fields()) {
+    printer->Print(
+      "  (void *) (uintptr_t) PROTOBUF_C_MESSAGE_FLAG_DISCARD_UNKNOWN\n");
+  } else {
+    printer->Print(
+      "  NULL    /* reserved3 */\n");
+  }
+  printer->Print("};\n");
 }
 
 int MessageGenerator::GetOneofUnionOrder(const google::protobuf::FieldDescriptor* fd)
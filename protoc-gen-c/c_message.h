@@ -120,10 +120,28 @@ class MessageGenerator {
 					 bool gen_pack,
 					 bool gen_init);
 
+  // Generate prototypes of the specialized get_packed_size and pack
+  // functions emitted for this class and all its nested types when the file
+  // is optimized for SPEED.
+  void GenerateSpeedFunctionDeclarations(google::protobuf::io::Printer* printer);
+
  private:
 
   int GetOneofUnionOrder(const google::protobuf::FieldDescriptor *fd);
 
+  // Generate the specialized get_packed_size and pack functions.
+  void GenerateSpeedFunctionDefinitions(google::protobuf::io::Printer* printer);
+
+  // Generate the table used by the runtime to look up fields by encoded tag.
+  void GenerateFieldTable(google::protobuf::io::Printer* printer,
+			  const google::protobuf::FieldDescriptor **sorted_fields);
+
+  // Generate the table used by the runtime to look up fields by number, if
+  // the message's field numbers are dense enough for it to pay off.
+  void GenerateFieldIndexTable(google::protobuf::io::Printer* printer,
+			       const google::protobuf::FieldDescriptor **sorted_fields,
+			       int n_ranges);
+
   const google::protobuf::Descriptor* descriptor_;
   std::string dllexport_decl_;
   FieldGeneratorMap field_generators_;
@@ -0,0 +1,299 @@
+/* Unpack benchmark.
+ *
+ * Each case packs one message once, then times unpack+free of it in a
+ * loop. A case is run several times and the fastest run is reported, as
+ * the time per unpack+free. This is not a test: it is built along with the
+ * tests but not run by them. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "t/test-full.pb-c.h"
+
+#define N_RUNS          6
+#define MIN_RUN_CLOCKS  (CLOCKS_PER_SEC / 20)
+
+typedef struct
+{
+  const char *name;
+  const ProtobufCMessageDescriptor *descriptor;
+  protobuf_c_boolean use_arena;
+  size_t len;
+  uint8_t *data;
+} BenchCase;
+
+static void *
+xmalloc (size_t size)
+{
+  void *rv = malloc (size ? size : 1);
+
+  if (rv == NULL)
+    {
+      fprintf (stderr, "out of memory\n");
+      exit (1);
+    }
+  return rv;
+}
+
+static uint8_t *
+pack_message (const ProtobufCMessage *message, size_t *len_out)
+{
+  uint8_t *data = xmalloc (protobuf_c_message_get_packed_size (message));
+
+  *len_out = protobuf_c_message_pack (message, data);
+  return data;
+}
+
+/* One million non-packed int32 values, each with its own tag. */
+static void
+setup_repeated_int32 (BenchCase *bc)
+{
+  Foo__TestMess mess = FOO__TEST_MESS__INIT;
+  size_t n = 1000000;
+  int32_t *values = xmalloc (n * sizeof (int32_t));
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    values[i] = (int32_t) (i * 7919);
+  mess.n_test_int32 = n;
+  mess.test_int32 = values;
+  bc->data = pack_message (&mess.base, &bc->len);
+  free (values);
+}
+
+/* 100k short strings. */
+static void
+setup_repeated_strings (BenchCase *bc)
+{
+  Foo__TestMess mess = FOO__TEST_MESS__INIT;
+  size_t n = 100000;
+  const char **values = xmalloc (n * sizeof (char *));
+  char *text = xmalloc (n * 16);
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    {
+      sprintf (text + i * 16, "string %lu", (unsigned long) i);
+      values[i] = text + i * 16;
+    }
+  mess.n_test_string = n;
+  mess.test_string = values;
+  bc->data = pack_message (&mess.base, &bc->len);
+  free (text);
+  free (values);
+}
+
+/* A small message with four optional fields set. */
+static void
+setup_small_optional (BenchCase *bc)
+{
+  Foo__TestMessOptional mess = FOO__TEST_MESS_OPTIONAL__INIT;
+
+  mess.has_test_int32 = 1;
+  mess.test_int32 = 150;
+  mess.has_test_sint64 = 1;
+  mess.test_sint64 = -12345678;
+  mess.has_test_fixed32 = 1;
+  mess.test_fixed32 = 0xdeadbeef;
+  mess.test_string = "hello";
+  bc->data = pack_message (&mess.base, &bc->len);
+}
+
+/* foo.TestMessManyFields with every numeric field set: 60 fields numbered
+   1, 3, ..., 119, so finding a field by number needs more than one range. */
+static void
+setup_many_fields (BenchCase *bc)
+{
+  const ProtobufCMessageDescriptor *desc = &foo__test_mess_many_fields__descriptor;
+  Foo__TestMessManyFields mess = FOO__TEST_MESS_MANY_FIELDS__INIT;
+  uint8_t *base = (uint8_t *) &mess;
+  unsigned i;
+
+  for (i = 0; i < desc->n_fields; i++)
+    {
+      const ProtobufCFieldDescriptor *field = desc->fields + i;
+      void *member = base + field->offset;
+
+      switch (field->type)
+        {
+        case PROTOBUF_C_TYPE_INT32:
+        case PROTOBUF_C_TYPE_FIXED32:
+          *(uint32_t *) member = 1000 + i;
+          break;
+        case PROTOBUF_C_TYPE_SINT64:
+        case PROTOBUF_C_TYPE_UINT64:
+          *(uint64_t *) member = 100000 * i;
+          break;
+        case PROTOBUF_C_TYPE_BOOL:
+          *(protobuf_c_boolean *) member = 1;
+          break;
+        default:
+          continue;
+        }
+      *(protobuf_c_boolean *) (base + field->quantifier_offset) = 1;
+    }
+  bc->data = pack_message (&mess.base, &bc->len);
+}
+
+static size_t
+skip_varint (const uint8_t *data)
+{
+  size_t i = 0;
+
+  while (data[i++] & 0x80)
+    ;
+  return i;
+}
+
+/* Same message, with its fields in a fixed pseudo-random order. */
+static void
+setup_many_fields_shuffled (BenchCase *bc)
+{
+  size_t starts[64];
+  size_t n_fields = 0;
+  size_t at = 0;
+  uint32_t seed = 12345;
+  uint8_t *shuffled;
+  size_t i;
+
+  setup_many_fields (bc);
+  while (at < bc->len)
+    {
+      unsigned wire_type = bc->data[at] & 7;
+
+      starts[n_fields++] = at;
+      at += skip_varint (bc->data + at);
+      if (wire_type == PROTOBUF_C_WIRE_TYPE_VARINT)
+        at += skip_varint (bc->data + at);
+      else if (wire_type == PROTOBUF_C_WIRE_TYPE_32BIT)
+        at += 4;
+      else
+        {
+          fprintf (stderr, "unexpected wire type %u\n", wire_type);
+          exit (1);
+        }
+    }
+  starts[n_fields] = bc->len;
+
+  /* Fisher-Yates over the field indices, with a small LCG. */
+  {
+    size_t order[64];
+    size_t out = 0;
+
+    for (i = 0; i < n_fields; i++)
+      order[i] = i;
+    for (i = n_fields - 1; i > 0; i--)
+      {
+        size_t j, tmp;
+
+        seed = seed * 1103515245 + 12345;
+        j = (seed >> 8) % (i + 1);
+        tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+      }
+    shuffled = xmalloc (bc->len);
+    for (i = 0; i < n_fields; i++)
+      {
+        size_t f = order[i];
+        size_t flen = starts[f + 1] - starts[f];
+
+        memcpy (shuffled + out, bc->data + starts[f], flen);
+        out += flen;
+      }
+  }
+  free (bc->data);
+  bc->data = shuffled;
+}
+
+/* Returns the number of seconds per unpack+free of the fastest run. */
+static double
+run_case (const BenchCase *bc)
+{
+  double best = 0;
+  ProtobufCArena arena;
+  ProtobufCAllocator *allocator = NULL;
+  unsigned run;
+
+  if (bc->use_arena)
+    {
+      protobuf_c_arena_init (&arena, NULL, 0, NULL);
+      allocator = &arena.base;
+    }
+
+  for (run = 0; run < N_RUNS; run++)
+    {
+      unsigned long iters = 0;
+      clock_t start = clock ();
+      clock_t elapsed;
+      double per_iter;
+
+      do
+        {
+          ProtobufCMessage *message =
+            protobuf_c_message_unpack (bc->descriptor, allocator,
+                                       bc->len, bc->data);
+          if (message == NULL)
+            {
+              fprintf (stderr, "%s: unpack failed\n", bc->name);
+              exit (1);
+            }
+          if (bc->use_arena)
+            protobuf_c_arena_reset (&arena);
+          else
+            protobuf_c_message_free_unpacked (message, NULL);
+          iters++;
+          elapsed = clock () - start;
+        }
+      while (elapsed < MIN_RUN_CLOCKS);
+
+      per_iter = (double) elapsed / CLOCKS_PER_SEC / iters;
+      if (run == 0 || per_iter < best)
+        best = per_iter;
+    }
+
+  if (bc->use_arena)
+    protobuf_c_arena_destroy (&arena);
+  return best;
+}
+
+static void
+print_time (const char *name, double seconds)
+{
+  if (seconds >= 1e-3)
+    printf ("  %-34s %8.2f ms\n", name, seconds * 1e3);
+  else if (seconds >= 1e-6)
+    printf ("  %-34s %8.2f us\n", name, seconds * 1e6);
+  else
+    printf ("  %-34s %8.0f ns\n", name, seconds * 1e9);
+}
+
+int
+main (void)
+{
+  BenchCase cases[] = {
+    { "1M non-packed repeated int32", &foo__test_mess__descriptor, 0, 0, NULL },
+    { "100k repeated strings", &foo__test_mess__descriptor, 0, 0, NULL },
+    { "100k repeated strings (arena)", &foo__test_mess__descriptor, 1, 0, NULL },
+    { "small message, 4 optional fields", &foo__test_mess_optional__descriptor, 0, 0, NULL },
+    { "60 fields, in field order", &foo__test_mess_many_fields__descriptor, 0, 0, NULL },
+    { "60 fields, shuffled", &foo__test_mess_many_fields__descriptor, 0, 0, NULL },
+  };
+  unsigned i;
+
+  setup_repeated_int32 (&cases[0]);
+  setup_repeated_strings (&cases[1]);
+  setup_repeated_strings (&cases[2]);
+  setup_small_optional (&cases[3]);
+  setup_many_fields (&cases[4]);
+  setup_many_fields_shuffled (&cases[5]);
+
+  printf ("unpack+free, best of %u runs:\n", N_RUNS);
+  for (i = 0; i < sizeof (cases) / sizeof (cases[0]); i++)
+    {
+      print_time (cases[i].name, run_case (&cases[i]));
+      free (cases[i].data);
+    }
+  return 0;
+}
@@ -3,6 +3,7 @@
 #include <string.h>
 #include "t/test-full.pb-c.h"
 #include "t/test-optimized.pb-c.h"
+#include "t/test-speed.pb-c.h"
 #include "t/generated-code2/test-full-cxx-output.inc"
 
 #pragma GCC diagnostic push
@@ -66,18 +67,38 @@ test_compare_pack_methods (ProtobufCMessage *message,
                            uint8_t **packed_out)
 {
   unsigned char scratch[16];
+  unsigned char rscratch[16];
   ProtobufCBufferSimple bs = PROTOBUF_C_BUFFER_SIMPLE_INIT (scratch);
+  ProtobufCReverseBuffer rbs = PROTOBUF_C_REVERSE_BUFFER_INIT (rscratch);
   size_t siz1 = protobuf_c_message_get_packed_size (message);
   size_t siz2;
   size_t siz3 = protobuf_c_message_pack_to_buffer (message, &bs.base);
   void *packed1 = malloc (siz1);
+  uint8_t *packed2 = malloc (siz1 + 1);
+  uint8_t *start;
   void *rv;
   assert (packed1 != NULL);
+  assert (packed2 != NULL);
   assert (siz1 == siz3);
   siz2 = protobuf_c_message_pack (message, packed1);
   assert (siz1 == siz2);
   assert (bs.len == siz1);
   assert (memcmp (bs.data, packed1, siz1) == 0);
+
+  /* back to front, into an exactly sized buffer and a growable one */
+  start = protobuf_c_message_pack_reverse (message, packed2, siz1 + 1);
+  assert (start == packed2 + 1);
+  assert (memcmp (start, packed1, siz1) == 0);
+  if (siz1 > 0)
+    assert (protobuf_c_message_pack_reverse (message, packed2, siz1 - 1) == NULL);
+  start = protobuf_c_message_pack_to_reverse_buffer (message, &rbs);
+  assert (start != NULL);
+  assert (rbs.len == siz1);
+  assert (start == rbs.data + rbs.alloced - rbs.len);
+  assert (memcmp (start, packed1, siz1) == 0);
+  PROTOBUF_C_REVERSE_BUFFER_CLEAR (&rbs);
+  free (packed2);
+
   rv = protobuf_c_message_unpack (message->descriptor, NULL, siz1, packed1);
   assert (rv != NULL);
   PROTOBUF_C_BUFFER_SIMPLE_CLEAR (&bs);
@@ -1611,6 +1632,60 @@ static void test_unknown_fields (void)
   foo__empty_mess__free_unpacked (mess2, NULL);
 }
 
+/* Repeated and unknown fields interleaved on the wire, in numbers large
+   enough to make their arrays grow several times while unpacking. */
+static void
+test_interleaved_repeated_fields (void)
+{
+  uint8_t scratch[64];
+  ProtobufCBufferSimple bs = PROTOBUF_C_BUFFER_SIMPLE_INIT (scratch);
+  Foo__TestMess *mess;
+  uint8_t field[16];
+  unsigned i;
+
+  for (i = 0; i < 1000; i++)
+    {
+      size_t n = 0;
+      /* test_int32 (1) as a varint */
+      field[n++] = (1 << 3) | PROTOBUF_C_WIRE_TYPE_VARINT;
+      field[n++] = i & 0x7f;
+      /* test_fixed32 (8), packed, two elements */
+      field[n++] = (8 << 3) | PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
+      field[n++] = 8;
+      memcpy (field + n, &i, 4); n += 4;
+      memcpy (field + n, &i, 4); n += 4;
+      /* unknown field 100, every other time */
+      if (i % 2 == 0)
+        {
+          field[n++] = 0x80 | ((100 << 3) & 0x7f) | PROTOBUF_C_WIRE_TYPE_VARINT;
+          field[n++] = 100 >> 4;
+          field[n++] = i & 0x7f;
+        }
+      bs.base.append (&bs.base, n, field);
+    }
+
+  mess = foo__test_mess__unpack (NULL, bs.len, bs.data);
+  assert (mess != NULL);
+  assert (mess->n_test_int32 == 1000);
+  assert (mess->n_test_fixed32 == 2000);
+  assert (mess->base.n_unknown_fields == 500);
+  for (i = 0; i < 1000; i++)
+    {
+      assert (mess->test_int32[i] == (int32_t) (i & 0x7f));
+      assert (mess->test_fixed32[2 * i] == i);
+      assert (mess->test_fixed32[2 * i + 1] == i);
+    }
+  for (i = 0; i < 500; i++)
+    {
+      assert (mess->base.unknown_fields[i].tag == 100);
+      assert (mess->base.unknown_fields[i].wire_type == PROTOBUF_C_WIRE_TYPE_VARINT);
+      assert (mess->base.unknown_fields[i].len == 1);
+      assert (mess->base.unknown_fields[i].data[0] == ((2 * i) & 0x7f));
+    }
+  foo__test_mess__free_unpacked (mess, NULL);
+  PROTOBUF_C_BUFFER_SIMPLE_CLEAR (&bs);
+}
+
 static void
 test_enum_descriptor (const ProtobufCEnumDescriptor *desc)
 {
@@ -2022,7 +2097,7 @@ test_alloc_free_all (void)
   free (packed);
 }
 
-/* TODO: test alloc failure for slab, unknown fields */
+/* TODO: test alloc failure for unknown fields */
 static void
 test_alloc_fail (void)
 {
@@ -2033,6 +2108,2526 @@ test_alloc_fail (void)
   free (packed);
 }
 
+static void
+test_arena (void)
+{
+  uint8_t scratch[256];
+  ProtobufCArena arena;
+  Foo__AllocValues *mess;
+  unsigned i;
+  SETUP_TEST_ALLOC_BUFFER (packed, len);
+
+  test_allocator_data.alloc_count = 0;
+  test_allocator_data.allocs_left = INT32_MAX;
+  protobuf_c_arena_init (&arena, scratch, sizeof (scratch), &test_allocator);
+  for (i = 0; i < 4; i++)
+    {
+      mess = foo__alloc_values__unpack (&arena.base, len, packed);
+      assert (mess != NULL);
+      /* the first allocation is carved from the scratch buffer */
+      assert ((uint8_t *) mess >= scratch &&
+              (uint8_t *) mess < scratch + sizeof (scratch));
+      assert (strcmp (mess->a_string, "some string") == 0);
+      assert (mess->n_r_string == N_ELEMENTS (repeated_strings_2));
+      for (unsigned j = 0; j < mess->n_r_string; j++)
+        assert (strcmp (mess->r_string[j], repeated_strings_2[j]) == 0);
+      assert (mess->a_bytes.len == sizeof (bytes));
+      assert (memcmp (mess->a_bytes.data, bytes, sizeof (bytes)) == 0);
+      assert (mess->a_mess != NULL);
+      assert ((uintptr_t) mess->a_mess % sizeof (void *) == 0);
+      foo__alloc_values__free_unpacked (mess, &arena.base);
+      protobuf_c_arena_reset (&arena);
+      /* the overflow block from the first pass is kept and reused */
+      assert (test_allocator_data.alloc_count == 1);
+    }
+  protobuf_c_arena_destroy (&arena);
+  assert (test_allocator_data.alloc_count == 0);
+  free (packed);
+}
+
+static void
+test_zero_copy (void)
+{
+  uint32_t fixed32s[] = { 1, 2, 3, 0xffffffff };
+  double doubles[] = { 0.5, -1.25, 1e100, 3.0 };
+  Foo__TestMessPacked packed_mess = FOO__TEST_MESS_PACKED__INIT;
+  Foo__TestMessPacked *mess;
+  Foo__SubMess__SubSubMess subsub = FOO__SUB_MESS__SUB_SUB_MESS__INIT;
+  Foo__SubMess__SubSubMess *subsub2;
+  uint8_t bytes[] = "bytes \0 data";
+  ProtobufCArena arena;
+  uint8_t *buf, *in;
+  size_t len;
+
+  packed_mess.n_test_fixed32 = N_ELEMENTS (fixed32s);
+  packed_mess.test_fixed32 = fixed32s;
+  packed_mess.n_test_double = N_ELEMENTS (doubles);
+  packed_mess.test_double = doubles;
+  len = foo__test_mess_packed__get_packed_size (&packed_mess);
+
+  /* place the message so that the fixed32 payload is 8-byte aligned and the
+   * double payload (18 bytes further on) is not */
+  buf = malloc (len + 8);
+  assert (buf != NULL);
+  in = buf + 6;
+  foo__test_mess_packed__pack (&packed_mess, in);
+
+  protobuf_c_arena_init (&arena, NULL, 0, NULL);
+  mess = (Foo__TestMessPacked *)
+    protobuf_c_message_unpack_with_flags (&foo__test_mess_packed__descriptor,
+                                          &arena.base,
+                                          PROTOBUF_C_UNPACK_FLAG_ZERO_COPY,
+                                          len, in);
+  assert (mess != NULL);
+  assert (mess->n_test_fixed32 == N_ELEMENTS (fixed32s));
+  assert ((uint8_t *) mess->test_fixed32 == buf + 8);
+  assert (memcmp (mess->test_fixed32, fixed32s, sizeof (fixed32s)) == 0);
+  assert (mess->n_test_double == N_ELEMENTS (doubles));
+  assert ((uint8_t *) mess->test_double < buf ||
+          (uint8_t *) mess->test_double >= buf + len + 8);
+  assert (memcmp (mess->test_double, doubles, sizeof (doubles)) == 0);
+  foo__test_mess_packed__free_unpacked (mess, &arena.base);
+  protobuf_c_arena_reset (&arena);
+
+  /* without an arena the flag is ignored and everything is copied */
+  mess = (Foo__TestMessPacked *)
+    protobuf_c_message_unpack_with_flags (&foo__test_mess_packed__descriptor,
+                                          NULL,
+                                          PROTOBUF_C_UNPACK_FLAG_ZERO_COPY,
+                                          len, in);
+  assert (mess != NULL);
+  assert ((uint8_t *) mess->test_fixed32 != buf + 8);
+  assert (memcmp (mess->test_fixed32, fixed32s, sizeof (fixed32s)) == 0);
+  foo__test_mess_packed__free_unpacked (mess, NULL);
+  free (buf);
+
+  subsub.has_bytes1 = 1;
+  subsub.bytes1.len = sizeof (bytes);
+  subsub.bytes1.data = bytes;
+  subsub.str1 = "copied";
+  subsub.has_str2 = 1;
+  subsub.str2.len = 8;
+  subsub.str2.data = (uint8_t *) "borrowed";
+  len = protobuf_c_message_get_packed_size (&subsub.base);
+  buf = malloc (len);
+  assert (buf != NULL);
+  protobuf_c_message_pack (&subsub.base, buf);
+
+  subsub2 = (Foo__SubMess__SubSubMess *)
+    protobuf_c_message_unpack_with_flags (&foo__sub_mess__sub_sub_mess__descriptor,
+                                          &arena.base,
+                                          PROTOBUF_C_UNPACK_FLAG_ZERO_COPY,
+                                          len, buf);
+  assert (subsub2 != NULL);
+  assert (subsub2->bytes1.data > buf && subsub2->bytes1.data < buf + len);
+  assert (binary_data_equals (subsub2->bytes1, subsub.bytes1));
+  assert (subsub2->str2.data > buf && subsub2->str2.data < buf + len);
+  assert (binary_data_equals (subsub2->str2, subsub.str2));
+  assert ((uint8_t *) subsub2->str1 < buf ||
+          (uint8_t *) subsub2->str1 >= buf + len);
+  assert (strcmp (subsub2->str1, "copied") == 0);
+  protobuf_c_message_free_unpacked (&subsub2->base, &arena.base);
+  protobuf_c_arena_destroy (&arena);
+  free (buf);
+}
+
+static void
+test_field_table (void)
+{
+  static const uint8_t data[] = {
+    /* test_int32 = -1 */
+    0x08, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x01,
+    0x28, 0x03,                                 /* test_sint64 = -2 */
+    0x61, 0, 0, 0, 0, 0, 0, 0xf8, 0x3f,         /* test_double = 1.5 */
+    0x68, 0x02,                                 /* test_boolean = TRUE */
+    0x82, 0x01, 0x02, 'h', 'i',                 /* test_string = "hi" */
+    0x08, 0x05,                                 /* test_int32 = 5 */
+  };
+  static const uint8_t truncated_varint[] = { 0x08, 0x80 };
+  static const uint8_t truncated_fixed64[] = { 0x61, 1, 2, 3 };
+  static const uint8_t wrong_wire_type[] = { 0x0d, 1, 2, 3, 4 };
+  Foo__TestMessOptional *mess;
+
+  assert (foo__test_mess_optional__descriptor.reserved1 != NULL);
+  /* not generated with optimize_for = CODE_SIZE */
+  assert (foo__test_mess_lite__descriptor.reserved1 == NULL);
+
+  mess = (Foo__TestMessOptional *)
+    protobuf_c_message_unpack (&foo__test_mess_optional__descriptor, NULL,
+                               sizeof (data), data);
+  assert (mess != NULL);
+  assert (mess->has_test_int32 && mess->test_int32 == 5);
+  assert (mess->has_test_sint64 && mess->test_sint64 == -2);
+  assert (mess->has_test_double && mess->test_double == 1.5);
+  assert (mess->has_test_boolean && mess->test_boolean);
+  assert (!mess->has_test_sint32 && !mess->has_test_fixed32);
+  assert (strcmp (mess->test_string, "hi") == 0);
+  protobuf_c_message_free_unpacked (&mess->base, NULL);
+
+  assert (protobuf_c_message_unpack (&foo__test_mess_optional__descriptor,
+                                     NULL, sizeof (truncated_varint),
+                                     truncated_varint) == NULL);
+  assert (protobuf_c_message_unpack (&foo__test_mess_optional__descriptor,
+                                     NULL, sizeof (truncated_fixed64),
+                                     truncated_fixed64) == NULL);
+  assert (protobuf_c_message_unpack (&foo__test_mess_optional__descriptor,
+                                     NULL, sizeof (wrong_wire_type),
+                                     wrong_wire_type) == NULL);
+}
+
+/* the generated optimize_for = SPEED unpacker must agree with the generic one */
+static void
+test_speed_unpack_one (size_t len, const uint8_t *data)
+{
+  ProtobufCMessage *generic;
+  Foo__TestMessSpeed *speed;
+  size_t packed_len;
+  uint8_t *expected, *out;
+
+  generic = protobuf_c_message_unpack (&foo__test_mess_speed__descriptor,
+                                       NULL, len, data);
+  test_allocator_data.alloc_count = 0;
+  test_allocator_data.allocs_left = INT32_MAX;
+  speed = foo__test_mess_speed__unpack (&test_allocator, len, data);
+  assert ((generic == NULL) == (speed == NULL));
+  if (generic == NULL)
+    {
+      assert (test_allocator_data.alloc_count == 0);
+      return;
+    }
+  packed_len = protobuf_c_message_get_packed_size (generic);
+  expected = malloc (packed_len + 1);
+  out = malloc (packed_len + 1);
+  assert (expected != NULL && out != NULL);
+  assert (protobuf_c_message_pack (generic, expected) == packed_len);
+  assert (protobuf_c_message_get_packed_size (&speed->base) == packed_len);
+  assert (protobuf_c_message_pack (&speed->base, out) == packed_len);
+  assert (memcmp (expected, out, packed_len) == 0);
+  foo__test_mess_speed__free_unpacked (speed, &test_allocator);
+  assert (test_allocator_data.alloc_count == 0);
+  protobuf_c_message_free_unpacked (generic, NULL);
+  free (expected);
+  free (out);
+}
+
+/* the generated optimize_for = SPEED functions must match the generic ones */
+static void
+test_speed_pack_one (const Foo__TestMessSpeed *mess)
+{
+  unsigned char scratch[16];
+  ProtobufCBufferSimple bs = PROTOBUF_C_BUFFER_SIMPLE_INIT (scratch);
+  size_t len = protobuf_c_message_get_packed_size (&mess->base);
+  uint8_t *generic = malloc (len);
+  uint8_t *speed = malloc (len);
+  Foo__TestMessSpeed *mess2;
+
+  assert (generic != NULL && speed != NULL);
+  assert (protobuf_c_message_pack (&mess->base, generic) == len);
+  assert (foo__test_mess_speed__get_packed_size (mess) == len);
+  assert (foo__test_mess_speed__pack (mess, speed) == len);
+  assert (memcmp (generic, speed, len) == 0);
+  assert (foo__test_mess_speed__pack_to_buffer (mess, &bs.base) == len);
+  assert (bs.len == len);
+  assert (memcmp (bs.data, generic, len) == 0);
+  PROTOBUF_C_BUFFER_SIMPLE_CLEAR (&bs);
+  test_speed_unpack_one (len, generic);
+
+  mess2 = foo__test_mess_speed__unpack (NULL, len, speed);
+  assert (mess2 != NULL);
+  assert (foo__test_mess_speed__get_packed_size (mess2) == len);
+  foo__test_mess_speed__free_unpacked (mess2, NULL);
+
+  /* the whole tree in a single allocation */
+  test_allocator_data.alloc_count = 0;
+  test_allocator_data.allocs_left = INT32_MAX;
+  mess2 = (Foo__TestMessSpeed *)
+    protobuf_c_message_unpack_with_flags (&foo__test_mess_speed__descriptor,
+                                          &test_allocator,
+                                          PROTOBUF_C_UNPACK_FLAG_SINGLE_BLOCK,
+                                          len, speed);
+  assert (mess2 != NULL);
+  assert (test_allocator_data.alloc_count == 1);
+  memset (speed, 0, len);
+  assert (foo__test_mess_speed__pack (mess2, speed) == len);
+  assert (memcmp (generic, speed, len) == 0);
+  protobuf_c_message_free_unpacked_single_block (&mess2->base, &test_allocator);
+  assert (test_allocator_data.alloc_count == 0);
+  free (generic);
+  free (speed);
+}
+
+static void
+test_speed_pack (void)
+{
+  static int32_t int32s[] = { 0, -1, 127, 128, INT32_MAX, INT32_MIN };
+  static int64_t int64s[] = { 0, -1, INT64_MAX, INT64_MIN };
+  static uint64_t uint64s[] = { 0, 1, 1ULL << 35, UINT64_MAX };
+  static uint32_t fixed32s[] = { 0, 1, UINT32_MAX };
+  static double doubles[] = { 0.0, -1.5, 1e300 };
+  static float floats[] = { 0.25f, -3.0f };
+  static protobuf_c_boolean booleans[] = { 1, 0, 1 };
+  static Foo__TestEnumSpeed enums[] = {
+    FOO__TEST_ENUM_SPEED__SPEED_NEG, FOO__TEST_ENUM_SPEED__SPEED_BIG
+  };
+  static char *strings[] = { "", "a", "some longer string" };
+  static uint8_t data[200];
+  ProtobufCBinaryData bytes[2] = { { 0, NULL }, { sizeof (data), data } };
+  Foo__TestMessSpeed mess = FOO__TEST_MESS_SPEED__INIT;
+  Foo__TestMessSpeedSub sub = FOO__TEST_MESS_SPEED_SUB__INIT;
+  Foo__TestMessSpeedSub child = FOO__TEST_MESS_SPEED_SUB__INIT;
+  Foo__TestMessSpeedSub *children[200];
+  Foo__SubMess foreign = FOO__SUB_MESS__INIT;
+  ProtobufCMessageUnknownField unknown;
+  uint8_t unknown_data[] = { 0x2a };
+  unsigned i;
+
+  /* only the required fields, with a NULL required message */
+  mess.req_string = "required";
+  test_speed_pack_one (&mess);
+
+  mess.req_message = &sub;
+  sub.has_val = 1;
+  sub.val = -7;
+  child.has_val = 1;
+  child.val = 300;
+  for (i = 0; i < N_ELEMENTS (children); i++)
+    children[i] = &child;
+  /* more than 127 bytes, so that the length prefix takes two bytes */
+  sub.n_children = N_ELEMENTS (children);
+  sub.children = children;
+  test_speed_pack_one (&mess);
+
+  mess.has_test_int32 = 1;
+  mess.test_int32 = -2;
+  mess.has_test_sint32 = 1;
+  mess.test_sint32 = INT32_MIN;
+  mess.has_test_sfixed32 = 1;
+  mess.test_sfixed32 = -3;
+  mess.has_test_int64 = 1;
+  mess.test_int64 = INT64_MIN;
+  mess.has_test_sint64 = 1;
+  mess.test_sint64 = -4;
+  mess.has_test_sfixed64 = 1;
+  mess.test_sfixed64 = -5;
+  mess.has_test_uint32 = 1;
+  mess.test_uint32 = UINT32_MAX;
+  mess.has_test_fixed32 = 1;
+  mess.test_fixed32 = 6;
+  mess.has_test_uint64 = 1;
+  mess.test_uint64 = UINT64_MAX;
+  mess.has_test_fixed64 = 1;
+  mess.test_fixed64 = 7;
+  mess.has_test_float = 1;
+  mess.test_float = 8.5f;
+  mess.has_test_double = 1;
+  mess.test_double = -9.25;
+  mess.has_test_boolean = 1;
+  mess.test_boolean = 1;
+  mess.has_test_enum = 1;
+  mess.test_enum = FOO__TEST_ENUM_SPEED__SPEED_NEG;
+  mess.test_string = "not the default";
+  mess.has_test_bytes = 1;
+  mess.test_bytes = bytes[1];
+  mess.has_test_string_as_bytes = 1;
+  mess.test_string_as_bytes = bytes[0];
+  mess.test_message = &child;
+  foreign.test = 10;
+  mess.test_foreign_message = &foreign;
+  mess.has_big_number = 1;
+  mess.big_number = 11;
+  test_speed_pack_one (&mess);
+
+  mess.n_r_int32 = mess.n_p_int32 = N_ELEMENTS (int32s);
+  mess.r_int32 = mess.p_int32 = int32s;
+  mess.n_r_sint64 = N_ELEMENTS (int64s);
+  mess.r_sint64 = int64s;
+  mess.n_p_uint64 = N_ELEMENTS (uint64s);
+  mess.p_uint64 = uint64s;
+  mess.n_r_fixed32 = N_ELEMENTS (fixed32s);
+  mess.r_fixed32 = fixed32s;
+  mess.n_p_sint32 = N_ELEMENTS (int32s);
+  mess.p_sint32 = int32s;
+  mess.n_r_double = N_ELEMENTS (doubles);
+  mess.r_double = doubles;
+  mess.n_p_float = N_ELEMENTS (floats);
+  mess.p_float = floats;
+  mess.n_r_boolean = mess.n_p_boolean = N_ELEMENTS (booleans);
+  mess.r_boolean = mess.p_boolean = booleans;
+  mess.n_r_enum = N_ELEMENTS (enums);
+  mess.r_enum = enums;
+  mess.n_r_string = N_ELEMENTS (strings);
+  mess.r_string = strings;
+  mess.n_r_bytes = N_ELEMENTS (bytes);
+  mess.r_bytes = bytes;
+  mess.n_r_message = 2;
+  mess.r_message = children;
+  test_speed_pack_one (&mess);
+
+  /* the default string pointer is not packed */
+  mess.test_string = (char *) foo__test_mess_speed__test_string__default_value;
+  test_speed_pack_one (&mess);
+
+  mess.choice_case = FOO__TEST_MESS_SPEED__CHOICE_O_UINT32;
+  mess.o_uint32 = 12;
+  test_speed_pack_one (&mess);
+  mess.choice_case = FOO__TEST_MESS_SPEED__CHOICE_O_STRING;
+  mess.o_string = "oneof";
+  test_speed_pack_one (&mess);
+  mess.choice_case = FOO__TEST_MESS_SPEED__CHOICE_O_MESSAGE;
+  mess.o_message = &sub;
+  test_speed_pack_one (&mess);
+
+  /* unknown fields are packed by the generic code */
+  unknown.tag = 1000;
+  unknown.wire_type = PROTOBUF_C_WIRE_TYPE_VARINT;
+  unknown.len = sizeof (unknown_data);
+  unknown.data = unknown_data;
+  child.base.n_unknown_fields = 1;
+  child.base.unknown_fields = &unknown;
+  test_speed_pack_one (&mess);
+}
+
+static void
+test_speed_unpack (void)
+{
+#define REQUIRED 0x08, 0x01, 0x12, 0x01, 'x', 0x1a, 0x00
+  /* every input is also cut short at every length */
+  static const uint8_t dup_int32[] = { REQUIRED, 0x08, 0x02 };
+  static const uint8_t dup_string[] = { REQUIRED, 0x12, 0x02, 'y', 'z' };
+  static const uint8_t dup_message[] = { REQUIRED, 0x1a, 0x02, 0x08, 0x05 };
+  static const uint8_t missing_required[] = { 0x08, 0x01, 0x12, 0x01, 'x' };
+  static const uint8_t strings[] = {
+    REQUIRED, 0x92, 0x01, 0x00, 0x92, 0x01, 0x01, 's', 0x9a, 0x01, 0x00,
+    0x9a, 0x01, 0x02, 'a', 'b', 0xd2, 0x06, 0x00, 0xd2, 0x06, 0x01, 'r'
+  };
+  /* r_int32 one at a time and packed, p_int32 packed and one at a time */
+  static const uint8_t repeated[] = {
+    REQUIRED, 0xa0, 0x06, 0x05, 0xa2, 0x06, 0x03, 0x07, 0xff, 0x01,
+    0xc2, 0x0c, 0x01, 0x05, 0xc0, 0x0c, 0x06, 0xda, 0x0c, 0x04, 0, 0, 0x80, 0x3e
+  };
+  static const uint8_t packed_overrun[] = { REQUIRED, 0xa2, 0x06, 0x02, 0x07 };
+  static const uint8_t packed_cut_varint[] = { REQUIRED, 0xa2, 0x06, 0x01, 0x87 };
+  static const uint8_t packed_bad_fixed[] = { REQUIRED, 0xda, 0x0c, 0x03, 0, 0, 0 };
+  static const uint8_t long_varint[] = {
+    REQUIRED, 0x20, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x01
+  };
+  static const uint8_t oneof_same[] = {
+    REQUIRED, 0xea, 0x12, 0x01, 'o', 0xea, 0x12, 0x01, 'p'
+  };
+  static const uint8_t oneof_switch[] = {
+    REQUIRED, 0xf2, 0x12, 0x02, 0x08, 0x01, 0xe0, 0x12, 0x07
+  };
+  static const uint8_t unknown[] = { REQUIRED, 0xc0, 0x3e, 0x01 };
+  static const uint8_t wrong_wire_type[] = {
+    REQUIRED, 0x21, 0x01, 0, 0, 0, 0, 0, 0, 0
+  };
+  static const uint8_t messages[] = {
+    REQUIRED, 0xaa, 0x01, 0x04, 0x12, 0x02, 0x08, 0x03,
+    0xe2, 0x06, 0x00, 0xe2, 0x06, 0x02, 0x08, 0x04,
+    0xb2, 0x01, 0x02, 0x20, 0x09
+  };
+#undef REQUIRED
+  static const struct {
+    size_t len;
+    const uint8_t *data;
+  } inputs[] = {
+    { sizeof (dup_int32), dup_int32 },
+    { sizeof (dup_string), dup_string },
+    { sizeof (dup_message), dup_message },
+    { sizeof (missing_required), missing_required },
+    { sizeof (strings), strings },
+    { sizeof (repeated), repeated },
+    { sizeof (packed_overrun), packed_overrun },
+    { sizeof (packed_cut_varint), packed_cut_varint },
+    { sizeof (packed_bad_fixed), packed_bad_fixed },
+    { sizeof (long_varint), long_varint },
+    { sizeof (oneof_same), oneof_same },
+    { sizeof (oneof_switch), oneof_switch },
+    { sizeof (unknown), unknown },
+    { sizeof (wrong_wire_type), wrong_wire_type },
+    { sizeof (messages), messages },
+  };
+  uint8_t chain[200 * 3];
+  size_t start;
+  Foo__TestMessSpeed *mess;
+  ProtobufCMessage *generic;
+  Foo__TestMessSpeedSub *sub;
+  int32_t allocs;
+  unsigned i;
+  size_t n;
+
+  for (i = 0; i < N_ELEMENTS (inputs); i++)
+    for (n = 0; n <= inputs[i].len; n++)
+      test_speed_unpack_one (n, inputs[i].data);
+
+  /* a failed allocation frees what the fast path had built */
+  for (allocs = 0; ; allocs++)
+    {
+      test_allocator_data.alloc_count = 0;
+      test_allocator_data.allocs_left = allocs;
+      mess = foo__test_mess_speed__unpack (&test_allocator,
+                                           sizeof (messages), messages);
+      if (mess != NULL)
+        {
+          assert (mess->test_message->n_children == 1);
+          assert (mess->n_r_message == 2);
+          foo__test_mess_speed__free_unpacked (mess, &test_allocator);
+          assert (test_allocator_data.alloc_count == 0);
+          break;
+        }
+      assert (test_allocator_data.alloc_count == 0);
+    }
+
+  /* nesting past PROTOBUF_C__SPEED_MAX_DEPTH is left to the generic code */
+  start = sizeof (chain);
+  for (i = 0; i < 200; i++)
+    {
+      size_t len = sizeof (chain) - start;
+      chain[--start] = (uint8_t) len;
+      if (len >= 0x80)
+        {
+          chain[start] = (uint8_t) (len >> 7);
+          chain[--start] = (uint8_t) (len | 0x80);
+        }
+      chain[--start] = 0x12;
+    }
+  n = sizeof (chain) - start;
+  generic = protobuf_c_message_unpack (&foo__test_mess_speed_sub__descriptor,
+                                       NULL, n, chain + start);
+  sub = foo__test_mess_speed_sub__unpack (NULL, n, chain + start);
+  assert (generic != NULL && sub != NULL);
+  assert (foo__test_mess_speed_sub__get_packed_size (sub) == n);
+  foo__test_mess_speed_sub__free_unpacked (sub, NULL);
+  protobuf_c_message_free_unpacked (generic, NULL);
+}
+
+/* pack_to_buffer of a deep and wide tree uses the sub-message size cache */
+static void
+test_pack_to_buffer_nested (void)
+{
+  Foo__TestMessSpeedSub nodes[300];
+  Foo__TestMessSpeedSub *wide[200];
+  Foo__TestMessSpeedSub *chain[300];
+  unsigned char scratch[16];
+  ProtobufCBufferSimple bs = PROTOBUF_C_BUFFER_SIMPLE_INIT (scratch);
+  size_t len;
+  uint8_t *packed;
+  unsigned i;
+
+  for (i = 0; i < N_ELEMENTS (nodes); i++)
+    {
+      foo__test_mess_speed_sub__init (&nodes[i]);
+      nodes[i].has_val = 1;
+      nodes[i].val = i;
+    }
+  /* a chain of 100 messages, the last of which has 200 children */
+  for (i = 0; i < 99; i++)
+    {
+      chain[i] = &nodes[i + 1];
+      nodes[i].n_children = 1;
+      nodes[i].children = &chain[i];
+    }
+  for (i = 0; i < N_ELEMENTS (wide); i++)
+    wide[i] = &nodes[100 + i];
+  nodes[99].n_children = N_ELEMENTS (wide);
+  nodes[99].children = wide;
+  /* and one more chain hanging off the first child */
+  for (i = 200; i < 299; i++)
+    {
+      chain[i] = &nodes[i + 1];
+      nodes[i].n_children = 1;
+      nodes[i].children = &chain[i];
+    }
+  chain[100] = &nodes[200];
+  nodes[100].n_children = 1;
+  nodes[100].children = &chain[100];
+
+  len = protobuf_c_message_get_packed_size (&nodes[0].base);
+  packed = malloc (len);
+  assert (packed != NULL);
+  assert (protobuf_c_message_pack (&nodes[0].base, packed) == len);
+  assert (protobuf_c_message_pack_to_buffer (&nodes[0].base, &bs.base) == len);
+  assert (bs.len == len);
+  assert (memcmp (bs.data, packed, len) == 0);
+  PROTOBUF_C_BUFFER_SIMPLE_CLEAR (&bs);
+  free (packed);
+}
+
+/* successive messages are prepended to a reverse buffer */
+static void
+test_pack_to_reverse_buffer (void)
+{
+  uint8_t scratch[4];
+  ProtobufCReverseBuffer rbs = PROTOBUF_C_REVERSE_BUFFER_INIT (scratch);
+  Foo__TestMessSpeedSub first = FOO__TEST_MESS_SPEED_SUB__INIT;
+  Foo__TestMessSpeedSub second = FOO__TEST_MESS_SPEED_SUB__INIT;
+  Foo__TestMessSpeedSub *children[1];
+  static const uint8_t expected[] = {
+    0x08, 0x02,                             /* second */
+    0x08, 0x01, 0x12, 0x02, 0x08, 0x02      /* first */
+  };
+  uint8_t *start;
+
+  first.has_val = 1;
+  first.val = 1;
+  second.has_val = 1;
+  second.val = 2;
+  children[0] = &second;
+  first.n_children = 1;
+  first.children = children;
+
+  start = protobuf_c_message_pack_to_reverse_buffer (&first.base, &rbs);
+  assert (start != NULL);
+  assert (rbs.must_free_data);
+  start = protobuf_c_message_pack_to_reverse_buffer (&second.base, &rbs);
+  assert (start == rbs.data + rbs.alloced - rbs.len);
+  TEST_VERSUS_STATIC_ARRAY (rbs.len, start, expected);
+  PROTOBUF_C_REVERSE_BUFFER_CLEAR (&rbs);
+}
+
+/* Reference encoding of a varint, one byte at a time. */
+static size_t
+ref_varint (uint64_t v, uint8_t *out)
+{
+  size_t n = 0;
+
+  while (v >= 0x80)
+    {
+      out[n++] = (uint8_t) (v | 0x80);
+      v >>= 7;
+    }
+  out[n++] = (uint8_t) v;
+  return n;
+}
+
+/* Reference encoding of a packed varint field with `n` values. */
+static size_t
+ref_packed_field (unsigned id, size_t n, const uint64_t *values, uint8_t *out)
+{
+  uint8_t payload[200 * 10];
+  size_t len = 0, rv;
+  size_t i;
+
+  assert (n <= 200);
+  for (i = 0; i < n; i++)
+    len += ref_varint (values[i], payload + len);
+  rv = ref_varint ((id << 3) | PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED, out);
+  rv += ref_varint (len, out + rv);
+  memcpy (out + rv, payload, len);
+  return rv + len;
+}
+
+/* long packed varint arrays mixing runs of one-byte and longer values */
+static void
+test_packed_varint_arrays (void)
+{
+  enum { N = 1000 };
+  static int32_t int32s[N], sint32s[N];
+  static uint32_t uint32s[N];
+  static int64_t int64s[N], sint64s[N];
+  static uint64_t uint64s[N];
+  static protobuf_c_boolean booleans[N];
+  Foo__TestMessPacked mess = FOO__TEST_MESS_PACKED__INIT;
+  Foo__TestMessPacked *mess2;
+  uint8_t bad[64];
+  uint8_t *packed;
+  size_t len;
+  unsigned i;
+
+  for (i = 0; i < N; i++)
+    {
+      /* 100 one-byte values, then 20 that are not */
+      int64_t v = (i % 120) < 100 ? (int64_t) (i % 60) : -(int64_t) i * 1000003;
+      int32s[i] = (int32_t) v;
+      sint32s[i] = (int32_t) ((i % 120) < 100 ? (int32_t) (i % 60) - 30 : v);
+      uint32s[i] = (uint32_t) v;
+      int64s[i] = v;
+      sint64s[i] = (i % 120) < 100 ? (int64_t) (i % 60) - 30 : v * 4096;
+      uint64s[i] = (uint64_t) v;
+      booleans[i] = (i % 3) == 0;
+    }
+  mess.n_test_int32 = N;
+  mess.test_int32 = int32s;
+  mess.n_test_sint32 = N;
+  mess.test_sint32 = sint32s;
+  mess.n_test_uint32 = N;
+  mess.test_uint32 = uint32s;
+  mess.n_test_int64 = N;
+  mess.test_int64 = int64s;
+  mess.n_test_sint64 = N;
+  mess.test_sint64 = sint64s;
+  mess.n_test_uint64 = N;
+  mess.test_uint64 = uint64s;
+  mess.n_test_boolean = N;
+  mess.test_boolean = booleans;
+
+  len = foo__test_mess_packed__get_packed_size (&mess);
+  packed = malloc (len);
+  assert (packed != NULL);
+  foo__test_mess_packed__pack (&mess, packed);
+  mess2 = foo__test_mess_packed__unpack (NULL, len, packed);
+  assert (mess2 != NULL);
+  assert (mess2->n_test_int32 == N);
+  assert (memcmp (mess2->test_int32, int32s, sizeof (int32s)) == 0);
+  assert (mess2->n_test_sint32 == N);
+  assert (memcmp (mess2->test_sint32, sint32s, sizeof (sint32s)) == 0);
+  assert (mess2->n_test_uint32 == N);
+  assert (memcmp (mess2->test_uint32, uint32s, sizeof (uint32s)) == 0);
+  assert (mess2->n_test_int64 == N);
+  assert (memcmp (mess2->test_int64, int64s, sizeof (int64s)) == 0);
+  assert (mess2->n_test_sint64 == N);
+  assert (memcmp (mess2->test_sint64, sint64s, sizeof (sint64s)) == 0);
+  assert (mess2->n_test_uint64 == N);
+  assert (memcmp (mess2->test_uint64, uint64s, sizeof (uint64s)) == 0);
+  assert (mess2->n_test_boolean == N);
+  assert (memcmp (mess2->test_boolean, booleans, sizeof (booleans)) == 0);
+  foo__test_mess_packed__free_unpacked (mess2, NULL);
+  free (packed);
+
+  /* one block of one-byte values and one with a two-byte value */
+  {
+    static int32_t vals[16] = { 1, 2, 3, 4, 5, 6, 7, 8, 300, 9, 10, 11, 12, 13, 14, 15 };
+    static const uint8_t expected[] = {
+      0x0a, 17,
+      1, 2, 3, 4, 5, 6, 7, 8, 0xac, 0x02, 9, 10, 11, 12, 13, 14, 15
+    };
+    Foo__TestMessPacked small = FOO__TEST_MESS_PACKED__INIT;
+    uint8_t out[sizeof (expected)];
+
+    small.n_test_int32 = 16;
+    small.test_int32 = vals;
+    assert (foo__test_mess_packed__get_packed_size (&small) == sizeof (expected));
+    assert (foo__test_mess_packed__pack (&small, out) == sizeof (expected));
+    TEST_VERSUS_STATIC_ARRAY (sizeof (out), out, expected);
+  }
+
+  /* arrays of every varint type around and past the 64-element chunks
+     pack_to_buffer() encodes them in */
+  {
+    static const size_t counts[] = { 1, 63, 64, 65, 128, 129, 200 };
+    static const unsigned ids[] = { 1, 2, 4, 5, 7, 9, 13, 15 };
+    static const Foo__TestEnum enums[] = {
+      FOO__TEST_ENUM__VALUE0, FOO__TEST_ENUM__VALUE1,
+      FOO__TEST_ENUM__VALUE127, FOO__TEST_ENUM__VALUE128,
+      FOO__TEST_ENUM__VALUE16384, FOO__TEST_ENUM__VALUENEG1,
+      FOO__TEST_ENUM__VALUE268435456, FOO__TEST_ENUM__VALUENEG123456
+    };
+    static int32_t i32[200], s32[200];
+    static int64_t i64[200], s64[200];
+    static uint32_t u32[200];
+    static uint64_t u64[200];
+    static protobuf_c_boolean b[200];
+    static Foo__TestEnum e[200];
+    static uint64_t wire[8][200];
+    static uint8_t expected[8 * (10 + 200 * 10)];
+    Foo__TestMessPacked big = FOO__TEST_MESS_PACKED__INIT;
+    Foo__TestMessPacked *big2;
+    uint8_t *out;
+    size_t out_len, exp_len, n;
+    unsigned c, f;
+
+    for (i = 0; i < 200; i++)
+      {
+        /* mostly one-byte values, with longer ones scattered across chunks */
+        int64_t v = (i % 7) == 3 ? -(int64_t) i * 1000003 : (int64_t) (i % 50);
+
+        i32[i] = (int32_t) v;
+        wire[0][i] = (uint64_t) (int64_t) i32[i];
+        s32[i] = (int32_t) v - 25;
+        wire[1][i] = ((uint32_t) s32[i] << 1) ^ (uint32_t) (s32[i] >> 31);
+        i64[i] = v * 4096;
+        wire[2][i] = (uint64_t) i64[i];
+        s64[i] = v * 4096 - 25;
+        wire[3][i] = ((uint64_t) s64[i] << 1) ^ (uint64_t) (s64[i] >> 63);
+        u32[i] = (uint32_t) v;
+        wire[4][i] = u32[i];
+        u64[i] = (uint64_t) v << 20;
+        wire[5][i] = u64[i];
+        b[i] = (i % 3) == 0;
+        wire[6][i] = b[i];
+        e[i] = enums[i % N_ELEMENTS (enums)];
+        wire[7][i] = (uint64_t) (int64_t) e[i];
+      }
+    big.test_int32 = i32;
+    big.test_sint32 = s32;
+    big.test_int64 = i64;
+    big.test_sint64 = s64;
+    big.test_uint32 = u32;
+    big.test_uint64 = u64;
+    big.test_boolean = b;
+    big.test_enum = e;
+
+    for (c = 0; c < N_ELEMENTS (counts); c++)
+      {
+        n = counts[c];
+        big.n_test_int32 = big.n_test_sint32 = n;
+        big.n_test_int64 = big.n_test_sint64 = n;
+        big.n_test_uint32 = big.n_test_uint64 = n;
+        big.n_test_boolean = big.n_test_enum = n;
+        exp_len = 0;
+        for (f = 0; f < N_ELEMENTS (ids); f++)
+          exp_len += ref_packed_field (ids[f], n, wire[f], expected + exp_len);
+
+        big2 = test_compare_pack_methods (&big.base, &out_len, &out);
+        assert (out_len == exp_len);
+        assert (memcmp (out, expected, exp_len) == 0);
+        assert (big2->n_test_int32 == n &&
+                memcmp (big2->test_int32, i32, n * sizeof (*i32)) == 0);
+        assert (big2->n_test_sint32 == n &&
+                memcmp (big2->test_sint32, s32, n * sizeof (*s32)) == 0);
+        assert (big2->n_test_int64 == n &&
+                memcmp (big2->test_int64, i64, n * sizeof (*i64)) == 0);
+        assert (big2->n_test_sint64 == n &&
+                memcmp (big2->test_sint64, s64, n * sizeof (*s64)) == 0);
+        assert (big2->n_test_uint32 == n &&
+                memcmp (big2->test_uint32, u32, n * sizeof (*u32)) == 0);
+        assert (big2->n_test_uint64 == n &&
+                memcmp (big2->test_uint64, u64, n * sizeof (*u64)) == 0);
+        assert (big2->n_test_boolean == n &&
+                memcmp (big2->test_boolean, b, n * sizeof (*b)) == 0);
+        assert (big2->n_test_enum == n &&
+                memcmp (big2->test_enum, e, n * sizeof (*e)) == 0);
+        foo__test_mess_packed__free_unpacked (big2, NULL);
+        free (out);
+      }
+  }
+
+  /* booleans encoded in more than one byte */
+  memset (bad, 0, sizeof (bad));
+  bad[0] = (13 << 3) | PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
+  bad[1] = 60;
+  bad[10] = 0x80;
+  bad[11] = 0x01;
+  bad[40] = 0x80;
+  bad[41] = 0x80;
+  bad[42] = 0x00;
+  mess2 = foo__test_mess_packed__unpack (NULL, 62, bad);
+  assert (mess2 != NULL);
+  assert (mess2->n_test_boolean == 57);
+  for (i = 0; i < 57; i++)
+    assert (mess2->test_boolean[i] == (i == 8));
+  foo__test_mess_packed__free_unpacked (mess2, NULL);
+
+  /* an 11-byte varint after a run of one-byte ones */
+  memset (bad, 1, sizeof (bad));
+  bad[0] = (4 << 3) | PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
+  bad[1] = 60;
+  memset (bad + 40, 0x80, 10);
+  assert (foo__test_mess_packed__unpack (NULL, 62, bad) == NULL);
+
+  /* a varint running past the end of the payload */
+  memset (bad, 1, sizeof (bad));
+  bad[0] = (5 << 3) | PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
+  bad[1] = 60;
+  bad[61] = 0x80;
+  assert (foo__test_mess_packed__unpack (NULL, 62, bad) == NULL);
+}
+
+/* pack `mess` and check that it comes out as `len` bytes of `expected` */
+static void
+check_repack (const ProtobufCMessage *mess, size_t len, const uint8_t *expected)
+{
+  uint8_t *out;
+
+  assert (protobuf_c_message_get_packed_size (mess) == len);
+  out = malloc (len + 1);
+  assert (out != NULL);
+  assert (protobuf_c_message_pack (mess, out) == len);
+  assert (memcmp (out, expected, len) == 0);
+  free (out);
+}
+
+/* one message object is unpacked into repeatedly, reusing its memory */
+static void
+test_unpack_into (void)
+{
+  int32_t int32s[10] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 1000 };
+  const char *strings[3] = { "hello", "world", "foo" };
+  const char *strings2[2] = { "hi", "longer than world" };
+  uint8_t bytes_data[] = "some bytes";
+  ProtobufCBinaryData bytes = { sizeof (bytes_data), bytes_data };
+  Foo__SubMess subs[2] = { FOO__SUB_MESS__INIT, FOO__SUB_MESS__INIT };
+  Foo__SubMess *psubs[2] = { &subs[0], &subs[1] };
+  Foo__SubMess__SubSubMess subsub = FOO__SUB_MESS__SUB_SUB_MESS__INIT;
+  Foo__TestMess big = FOO__TEST_MESS__INIT;
+  Foo__TestMess small = FOO__TEST_MESS__INIT;
+  Foo__TestMess *mess;
+  uint8_t *packed_big, *packed_small;
+  size_t len_big, len_small;
+  uint32_t outstanding;
+  unsigned i;
+
+  subs[0].test = 1;
+  subs[0].n_rep = 3;
+  subs[0].rep = int32s;
+  subs[1].test = 2;
+  subsub.str1 = "not the default";
+  subs[1].sub1 = &subsub;
+  big.n_test_int32 = N_ELEMENTS (int32s);
+  big.test_int32 = int32s;
+  big.n_test_string = N_ELEMENTS (strings);
+  big.test_string = strings;
+  big.n_test_bytes = 1;
+  big.test_bytes = &bytes;
+  big.n_test_message = 2;
+  big.test_message = psubs;
+  small.n_test_int32 = 3;
+  small.test_int32 = int32s + 7;
+  small.n_test_string = N_ELEMENTS (strings2);
+  small.test_string = strings2;
+  small.n_test_message = 1;
+  small.test_message = psubs + 1;
+
+  len_big = foo__test_mess__get_packed_size (&big);
+  packed_big = malloc (len_big);
+  assert (packed_big != NULL);
+  foo__test_mess__pack (&big, packed_big);
+  len_small = foo__test_mess__get_packed_size (&small);
+  packed_small = malloc (len_small);
+  assert (packed_small != NULL);
+  foo__test_mess__pack (&small, packed_small);
+
+  test_allocator_data.alloc_count = 0;
+  test_allocator_data.allocs_left = INT32_MAX;
+  mess = foo__test_mess__unpack (&test_allocator, len_big, packed_big);
+  assert (mess != NULL);
+  outstanding = test_allocator_data.alloc_count;
+
+  /* the same input again fits entirely in the memory already held */
+  test_allocator_data.allocs_left = INT32_MAX;
+  assert (foo__test_mess__unpack_into (mess, &test_allocator,
+                                       len_big, packed_big));
+  assert (test_allocator_data.allocs_left == INT32_MAX);
+  assert (test_allocator_data.alloc_count == outstanding);
+  check_repack (&mess->base, len_big, packed_big);
+
+  /*
+   * a smaller message: one string outgrows the one it replaces, and the
+   * reused sub-message gains a sub1 and its string
+   */
+  test_allocator_data.allocs_left = INT32_MAX;
+  assert (foo__test_mess__unpack_into (mess, &test_allocator,
+                                       len_small, packed_small));
+  assert (test_allocator_data.allocs_left == INT32_MAX - 3);
+  assert (mess->n_test_bytes == 0 && mess->test_bytes != NULL);
+  assert (mess->test_message[0]->sub1 != NULL);
+  assert (strcmp (mess->test_message[0]->sub1->str1, "not the default") == 0);
+  check_repack (&mess->base, len_small, packed_small);
+
+  assert (foo__test_mess__unpack_into (mess, &test_allocator,
+                                       len_big, packed_big));
+  check_repack (&mess->base, len_big, packed_big);
+
+  /* clearing keeps the arrays, and a failed unpack leaves the message clear */
+  foo__test_mess__clear (mess, &test_allocator);
+  assert (mess->n_test_int32 == 0 && mess->test_int32 != NULL);
+  assert (mess->n_test_message == 0 && mess->test_message != NULL);
+  check_repack (&mess->base, 0, packed_big);
+  assert (!foo__test_mess__unpack_into (mess, &test_allocator,
+                                        len_big - 1, packed_big));
+  assert (mess->n_test_int32 == 0 && mess->n_test_string == 0);
+  assert (mess->n_test_message == 0);
+  for (i = 0; i < 2; i++)
+    {
+      test_allocator_data.allocs_left = INT32_MAX;
+      assert (foo__test_mess__unpack_into (mess, &test_allocator,
+                                           len_big, packed_big));
+      check_repack (&mess->base, len_big, packed_big);
+    }
+  assert (test_allocator_data.allocs_left == INT32_MAX);
+
+  /* allocation failures part way through leave nothing behind */
+  for (i = 0; i < 8; i++)
+    {
+      assert (foo__test_mess__unpack_into (mess, &test_allocator,
+                                           len_small, packed_small));
+      test_allocator_data.allocs_left = i;
+      if (foo__test_mess__unpack_into (mess, &test_allocator,
+                                       len_big, packed_big))
+        check_repack (&mess->base, len_big, packed_big);
+      test_allocator_data.allocs_left = INT32_MAX;
+    }
+
+  foo__test_mess__free_unpacked (mess, &test_allocator);
+  assert (test_allocator_data.alloc_count == 0);
+  free (packed_big);
+  free (packed_small);
+}
+
+/* a field mask decodes only the selected fields, at any depth */
+static void
+test_unpack_masked (void)
+{
+  static const char *const paths[] = {
+    "test_int32", "test_message.val1", "test_message.sub1.str1"
+  };
+  static const char *const whole[] = { "test_message.val1", "test_message" };
+  static const char *const bad[][1] = {
+    { "nope" }, { "test_int32.x" }, { "test_message." }, { "" }
+  };
+  static const char *const required[] = { "test" };
+  static const uint8_t unknown[] = { 0xa0, 0x06, 0x01 }; /* field 100 */
+  int32_t int32s[3] = { 1, 2, 300 };
+  const char *strings[1] = { "skipped" };
+  Foo__SubMess__SubSubMess subsub1 = FOO__SUB_MESS__SUB_SUB_MESS__INIT;
+  Foo__SubMess__SubSubMess subsub2 = FOO__SUB_MESS__SUB_SUB_MESS__INIT;
+  Foo__SubMess subs[2] = { FOO__SUB_MESS__INIT, FOO__SUB_MESS__INIT };
+  Foo__SubMess *psubs[2] = { &subs[0], &subs[1] };
+  Foo__TestMess mess = FOO__TEST_MESS__INIT;
+  Foo__TestMess *out;
+  Foo__SubMess *sub_out;
+  ProtobufCFieldMask *mask;
+  uint8_t *packed;
+  size_t len;
+  unsigned i;
+
+  subsub1.n_rep = 3;
+  subsub1.rep = int32s;
+  subsub1.str1 = "kept";
+  subsub2.str1 = "dropped";
+  for (i = 0; i < 2; i++)
+    {
+      subs[i].test = 10 + i;
+      subs[i].has_val1 = subs[i].has_val2 = 1;
+      subs[i].val1 = 20 + i;
+      subs[i].val2 = 30 + i;
+      subs[i].n_rep = 3;
+      subs[i].rep = int32s;
+      subs[i].sub1 = &subsub1;
+      subs[i].sub2 = &subsub2;
+    }
+  mess.n_test_int32 = 3;
+  mess.test_int32 = int32s;
+  mess.n_test_string = 1;
+  mess.test_string = strings;
+  mess.n_test_message = 2;
+  mess.test_message = psubs;
+  len = foo__test_mess__get_packed_size (&mess);
+  packed = malloc (len + sizeof (unknown));
+  assert (packed != NULL);
+  foo__test_mess__pack (&mess, packed);
+  memcpy (packed + len, unknown, sizeof (unknown));
+  len += sizeof (unknown);
+
+  test_allocator_data.alloc_count = 0;
+  test_allocator_data.allocs_left = INT32_MAX;
+  mask = protobuf_c_field_mask_new (&foo__test_mess__descriptor,
+                                    N_ELEMENTS (paths), paths, 0,
+                                    &test_allocator);
+  assert (mask != NULL);
+  out = (Foo__TestMess *)
+    protobuf_c_message_unpack_masked (mask, &test_allocator, 0, len, packed);
+  assert (out != NULL);
+  assert (out->n_test_int32 == 3 && out->test_int32[2] == 300);
+  assert (out->n_test_string == 0);
+  assert (out->base.n_unknown_fields == 1);
+  assert (out->n_test_message == 2);
+  for (i = 0; i < 2; i++)
+    {
+      /* "test" is required but not selected, so it may be missing */
+      sub_out = out->test_message[i];
+      assert (sub_out->test == 0);
+      assert (sub_out->has_val1 && sub_out->val1 == 20 + (int) i);
+      assert (!sub_out->has_val2 && sub_out->n_rep == 0);
+      assert (sub_out->sub2 == NULL);
+      assert (sub_out->sub1 != NULL && sub_out->sub1->n_rep == 0);
+      assert (strcmp (sub_out->sub1->str1, "kept") == 0);
+    }
+  foo__test_mess__free_unpacked (out, &test_allocator);
+  protobuf_c_field_mask_free (mask, &test_allocator);
+
+  /* unknown fields can be dropped too */
+  mask = protobuf_c_field_mask_new (&foo__test_mess__descriptor,
+                                    1, paths, PROTOBUF_C_FIELD_MASK_DROP_UNKNOWN,
+                                    &test_allocator);
+  assert (mask != NULL);
+  out = (Foo__TestMess *)
+    protobuf_c_message_unpack_masked (mask, &test_allocator, 0, len, packed);
+  assert (out != NULL);
+  assert (out->n_test_int32 == 3);
+  assert (out->n_test_message == 0);
+  assert (out->base.n_unknown_fields == 0);
+  foo__test_mess__free_unpacked (out, &test_allocator);
+  protobuf_c_field_mask_free (mask, &test_allocator);
+
+  /* naming a message selects all of it, whatever else names its fields */
+  mask = protobuf_c_field_mask_new (&foo__test_mess__descriptor,
+                                    N_ELEMENTS (whole), whole, 0,
+                                    &test_allocator);
+  assert (mask != NULL);
+  out = (Foo__TestMess *)
+    protobuf_c_message_unpack_masked (mask, &test_allocator, 0, len, packed);
+  assert (out != NULL);
+  assert (out->n_test_int32 == 0 && out->n_test_message == 2);
+  assert (out->test_message[1]->test == 11);
+  assert (out->test_message[1]->val2 == 31);
+  assert (out->test_message[1]->sub2 != NULL);
+  foo__test_mess__free_unpacked (out, &test_allocator);
+  protobuf_c_field_mask_free (mask, &test_allocator);
+
+  for (i = 0; i < N_ELEMENTS (bad); i++)
+    assert (protobuf_c_field_mask_new (&foo__test_mess__descriptor, 1, bad[i],
+                                       0, &test_allocator) == NULL);
+
+  /* selected required fields must still be present */
+  subs[0].test = 0;
+  len = foo__sub_mess__get_packed_size (&subs[0]);
+  assert (foo__sub_mess__pack (&subs[0], packed) == len);
+  mask = protobuf_c_field_mask_new (&foo__sub_mess__descriptor,
+                                    1, required, 0, &test_allocator);
+  assert (mask != NULL);
+  assert (protobuf_c_message_unpack_masked (mask, &test_allocator, 0,
+                                            len - 2, packed + 2) == NULL);
+  protobuf_c_field_mask_free (mask, &test_allocator);
+  assert (test_allocator_data.alloc_count == 0);
+  free (packed);
+}
+
+/* feed `data` to a parser `piece` bytes at a time */
+static ProtobufCMessage *
+parse_in_pieces (const ProtobufCMessageDescriptor *desc,
+                 size_t len, const uint8_t *data, size_t piece)
+{
+  ProtobufCMessageParser *parser;
+  size_t at;
+
+  parser = protobuf_c_message_parser_new (desc, &test_allocator, 0);
+  if (parser == NULL)
+    return NULL;
+  for (at = 0; at < len; at += piece)
+    if (!protobuf_c_message_parser_feed (parser, len - at < piece ?
+                                         len - at : piece, data + at))
+      {
+        assert (protobuf_c_message_parser_finish (parser) == NULL);
+        return NULL;
+      }
+  return protobuf_c_message_parser_finish (parser);
+}
+
+/* a message fed in pieces unpacks the same as all at once */
+static void
+test_message_parser (void)
+{
+  static const size_t pieces[] = { 1, 2, 3, 7, 64, 1000, SIZE_MAX };
+  static int32_t int32s[] = { 0, -1, 127, 128, INT32_MAX, INT32_MIN };
+  static char *strings[] = { "", "a", "some longer string" };
+  static uint8_t data[200];
+  ProtobufCBinaryData bytes = { sizeof (data), data };
+  Foo__TestMessSpeed mess = FOO__TEST_MESS_SPEED__INIT;
+  Foo__TestMessSpeedSub sub = FOO__TEST_MESS_SPEED_SUB__INIT;
+  Foo__TestMessSpeedSub child = FOO__TEST_MESS_SPEED_SUB__INIT;
+  Foo__TestMessSpeedSub *children[100];
+  Foo__SubMess foreign = FOO__SUB_MESS__INIT;
+  ProtobufCMessageUnknownField unknown;
+  uint8_t unknown_data[] = { 0x2a };
+  /* required fields, then a foreign SubMess with and without its "test" */
+  static const uint8_t missing_required[] = {
+    0x08, 0x00, 0x12, 0x00, 0x1a, 0x00, 0xb2, 0x01, 0x02, 0x30, 0x01
+  };
+  static const uint8_t with_required[] = {
+    0x08, 0x00, 0x12, 0x00, 0x1a, 0x00, 0xb2, 0x01, 0x04, 0x30, 0x01,
+    0x20, 0x01
+  };
+  ProtobufCMessage *out;
+  uint8_t *packed, *twice, *merged;
+  size_t len, merged_len;
+  unsigned i, j;
+
+  mess.req_string = "required";
+  mess.req_message = &sub;
+  sub.has_val = 1;
+  sub.val = -7;
+  child.has_val = 1;
+  child.val = 300;
+  for (i = 0; i < N_ELEMENTS (children); i++)
+    children[i] = &child;
+  sub.n_children = N_ELEMENTS (children);
+  sub.children = children;
+  mess.has_test_fixed64 = 1;
+  mess.test_fixed64 = 7;
+  mess.has_test_bytes = 1;
+  mess.test_bytes = bytes;
+  mess.test_message = &child;
+  foreign.test = 10;
+  foreign.n_rep = N_ELEMENTS (int32s);
+  foreign.rep = int32s;
+  mess.test_foreign_message = &foreign;
+  mess.n_r_string = N_ELEMENTS (strings);
+  mess.r_string = strings;
+  mess.n_r_message = 3;
+  mess.r_message = children;
+  mess.n_p_int32 = N_ELEMENTS (int32s);
+  mess.p_int32 = int32s;
+  mess.choice_case = FOO__TEST_MESS_SPEED__CHOICE_O_MESSAGE;
+  mess.o_message = &sub;
+  mess.has_big_number = 1;
+  mess.big_number = 11;
+  unknown.tag = 1000;
+  unknown.wire_type = PROTOBUF_C_WIRE_TYPE_VARINT;
+  unknown.len = sizeof (unknown_data);
+  unknown.data = unknown_data;
+  child.base.n_unknown_fields = 1;
+  child.base.unknown_fields = &unknown;
+
+  len = foo__test_mess_speed__get_packed_size (&mess);
+  packed = malloc (2 * len);
+  twice = malloc (2 * len);
+  assert (packed != NULL && twice != NULL);
+  foo__test_mess_speed__pack (&mess, packed);
+
+  for (i = 0; i < N_ELEMENTS (pieces); i++)
+    {
+      out = parse_in_pieces (&foo__test_mess_speed__descriptor,
+                             len, packed, pieces[i]);
+      assert (out != NULL);
+      check_repack (out, len, packed);
+      protobuf_c_message_free_unpacked (out, &test_allocator);
+    }
+  assert (test_allocator_data.alloc_count == 0);
+
+  /* a sub-message given twice is merged, and a oneof keeps the last one */
+  memcpy (twice, packed, len);
+  memcpy (twice + len, packed, len);
+  out = protobuf_c_message_unpack (&foo__test_mess_speed__descriptor,
+                                   &test_allocator, 2 * len, twice);
+  assert (out != NULL);
+  merged_len = protobuf_c_message_get_packed_size (out);
+  merged = malloc (merged_len);
+  assert (merged != NULL);
+  protobuf_c_message_pack (out, merged);
+  protobuf_c_message_free_unpacked (out, &test_allocator);
+  for (i = 0; i < N_ELEMENTS (pieces); i++)
+    {
+      out = parse_in_pieces (&foo__test_mess_speed__descriptor,
+                             2 * len, twice, pieces[i]);
+      assert (out != NULL);
+      check_repack (out, merged_len, merged);
+      protobuf_c_message_free_unpacked (out, &test_allocator);
+    }
+
+  /* every prefix of the input is accepted or rejected like unpack() does */
+  for (j = 0; j < len; j++)
+    for (i = 0; i < 3; i++)
+      {
+        ProtobufCMessage *expected;
+
+        expected = protobuf_c_message_unpack (&foo__test_mess_speed__descriptor,
+                                              &test_allocator, j, packed);
+        out = parse_in_pieces (&foo__test_mess_speed__descriptor,
+                               j, packed, pieces[i]);
+        assert ((out == NULL) == (expected == NULL));
+        if (out != NULL)
+          {
+            merged_len = protobuf_c_message_pack (expected, merged);
+            check_repack (out, merged_len, merged);
+          }
+        protobuf_c_message_free_unpacked (out, &test_allocator);
+        protobuf_c_message_free_unpacked (expected, &test_allocator);
+      }
+
+  /* required fields are checked in sub-messages split across pieces */
+  for (i = 0; i < N_ELEMENTS (pieces); i++)
+    {
+      out = parse_in_pieces (&foo__test_mess_speed__descriptor,
+                             sizeof (missing_required), missing_required,
+                             pieces[i]);
+      assert (out == NULL);
+      out = parse_in_pieces (&foo__test_mess_speed__descriptor,
+                             sizeof (with_required), with_required,
+                             pieces[i]);
+      assert (out != NULL);
+      assert (((Foo__TestMessSpeed *) out)->test_foreign_message->test == 1);
+      protobuf_c_message_free_unpacked (out, &test_allocator);
+    }
+
+  /* allocation failures part way through leave nothing behind */
+  for (i = 0; i < 64; i++)
+    {
+      test_allocator_data.allocs_left = i;
+      out = parse_in_pieces (&foo__test_mess_speed__descriptor,
+                             len, packed, 5);
+      test_allocator_data.allocs_left = INT32_MAX;
+      if (out != NULL)
+        check_repack (out, len, packed);
+      protobuf_c_message_free_unpacked (out, &test_allocator);
+    }
+  protobuf_c_message_parser_free (NULL);
+  assert (test_allocator_data.alloc_count == 0);
+
+  free (merged);
+  free (packed);
+  free (twice);
+}
+
+/* a message split over buffers at any points unpacks as a whole */
+static void
+test_unpack_segments (void)
+{
+  static int32_t int32s[] = { 0, -1, 127, 128, INT32_MAX, INT32_MIN };
+  static char *strings[] = { "", "a", "some longer string" };
+  Foo__TestMessSpeed mess = FOO__TEST_MESS_SPEED__INIT;
+  Foo__TestMessSpeedSub sub = FOO__TEST_MESS_SPEED_SUB__INIT;
+  Foo__TestMessSpeedSub *children[20];
+  ProtobufCSegment segments[4];
+  ProtobufCMessage *out;
+  uint8_t packed[512];
+  size_t len, j, k;
+  unsigned i;
+
+  mess.req_string = "required";
+  mess.req_message = &sub;
+  sub.has_val = 1;
+  sub.val = 300;
+  for (i = 0; i < N_ELEMENTS (children); i++)
+    children[i] = &sub;
+  mess.n_r_message = N_ELEMENTS (children);
+  mess.r_message = children;
+  mess.n_r_string = N_ELEMENTS (strings);
+  mess.r_string = strings;
+  mess.n_p_int32 = N_ELEMENTS (int32s);
+  mess.p_int32 = int32s;
+  mess.has_test_double = 1;
+  mess.test_double = -9.25;
+  mess.has_big_number = 1;
+  mess.big_number = 11;
+  len = foo__test_mess_speed__get_packed_size (&mess);
+  assert (len <= sizeof (packed));
+  foo__test_mess_speed__pack (&mess, packed);
+
+  /* three pieces, and an empty one */
+  for (j = 0; j <= len; j++)
+    for (k = j; k <= len; k += 1 + j % 5)
+      {
+        segments[0].data = packed;
+        segments[0].len = j;
+        segments[1].data = NULL;
+        segments[1].len = 0;
+        segments[2].data = packed + j;
+        segments[2].len = k - j;
+        segments[3].data = packed + k;
+        segments[3].len = len - k;
+        out = protobuf_c_message_unpack_segments (&foo__test_mess_speed__descriptor,
+                                                  &test_allocator, 0,
+                                                  N_ELEMENTS (segments),
+                                                  segments);
+        assert (out != NULL);
+        check_repack (out, len, packed);
+        protobuf_c_message_free_unpacked (out, &test_allocator);
+
+        /* without its last byte, the input is truncated */
+        if (k < len)
+          segments[3].len--;
+        else if (j < k)
+          segments[2].len--;
+        else
+          segments[0].len--;
+        assert (protobuf_c_message_unpack_segments (&foo__test_mess_speed__descriptor,
+                                                    &test_allocator, 0,
+                                                    N_ELEMENTS (segments),
+                                                    segments) == NULL);
+      }
+  assert (protobuf_c_message_unpack_segments (&foo__test_mess_speed__descriptor,
+                                              &test_allocator, 0, 0,
+                                              NULL) == NULL);
+  assert (test_allocator_data.alloc_count == 0);
+}
+
+/* A stream source handing out at most `chunk` bytes at a time, and failing
+   instead of ending if `fail` is set. */
+typedef struct {
+  ProtobufCStreamSource base;
+  const uint8_t *data;
+  size_t len;
+  size_t chunk;
+  int fail;
+} ChunkedSource;
+
+static size_t
+chunked_source_read (ProtobufCStreamSource *source, size_t len, uint8_t *data)
+{
+  ChunkedSource *cs = (ChunkedSource *) source;
+
+  if (len > cs->chunk)
+    len = cs->chunk;
+  if (len > cs->len)
+    len = cs->len;
+  if (len == 0 && cs->fail)
+    return PROTOBUF_C_STREAM_READ_ERROR;
+  memcpy (data, cs->data, len);
+  cs->data += len;
+  cs->len -= len;
+  return len;
+}
+
+/* Read every message of a stream in batches of `batch`, checking each one
+   against the expected packings. */
+static void
+check_stream (ProtobufCStreamReader *reader, size_t batch,
+              size_t n_expected, uint8_t **expected, const size_t *lens)
+{
+  ProtobufCMessage *out[5];
+  size_t i, n, total = 0;
+
+  assert (batch <= N_ELEMENTS (out));
+  do
+    {
+      n = protobuf_c_stream_reader_read (reader, batch, out);
+      for (i = 0; i < n; i++, total++)
+        {
+          assert (total < n_expected);
+          check_repack (out[i], lens[total], expected[total]);
+          protobuf_c_message_free_unpacked (out[i], &test_allocator);
+        }
+    }
+  while (n == batch);
+  assert (total == n_expected);
+  assert (!protobuf_c_stream_reader_failed (reader));
+  protobuf_c_stream_reader_free (reader);
+}
+
+static void
+test_stream_reader_writer (void)
+{
+  static const size_t chunks[] = { 1, 3, 100, SIZE_MAX };
+  static const size_t buffer_sizes[] = { 16, 100, 0 };
+  static const size_t batches[] = { 1, 2, 5 };
+  static char *strings[] = { "", "a", "some longer string" };
+  uint8_t scratch[16];
+  ProtobufCBufferSimple bs = PROTOBUF_C_BUFFER_SIMPLE_INIT (scratch);
+  Foo__TestMessSpeed mess[12];
+  Foo__TestMessSpeedSub sub = FOO__TEST_MESS_SPEED_SUB__INIT;
+  Foo__TestMessSpeedSub *children[100];
+  const ProtobufCMessage *in[N_ELEMENTS (mess)];
+  uint8_t *expected[N_ELEMENTS (mess)];
+  size_t lens[N_ELEMENTS (mess)];
+  ProtobufCStreamWriter *writer;
+  ProtobufCStreamReader *reader;
+  ChunkedSource source;
+  ProtobufCMessage *out;
+  size_t total = 0, written;
+  unsigned i, j, k;
+
+  sub.has_val = 1;
+  sub.val = 300;
+  for (i = 0; i < N_ELEMENTS (children); i++)
+    children[i] = &sub;
+  for (i = 0; i < N_ELEMENTS (mess); i++)
+    {
+      foo__test_mess_speed__init (&mess[i]);
+      mess[i].req_string = "required";
+      mess[i].req_message = &sub;
+      mess[i].n_r_message = i * 8;
+      mess[i].r_message = children;
+      mess[i].n_r_string = i % 4;
+      mess[i].r_string = strings;
+      in[i] = &mess[i].base;
+      lens[i] = foo__test_mess_speed__get_packed_size (&mess[i]);
+      expected[i] = malloc (lens[i]);
+      assert (expected[i] != NULL);
+      foo__test_mess_speed__pack (&mess[i], expected[i]);
+      total += protobuf_c_message_get_packed_size (in[i]);
+    }
+
+  /* the later messages are larger than the writer's buffer */
+  writer = protobuf_c_stream_writer_new (&bs.base, &test_allocator, 64);
+  assert (writer != NULL);
+  written = protobuf_c_stream_writer_write (writer, 3, in);
+  written += protobuf_c_stream_writer_write (writer, N_ELEMENTS (in) - 3,
+                                             in + 3);
+  protobuf_c_stream_writer_free (writer);
+  assert (bs.len == written);
+  assert (bs.len > total);
+
+  for (k = 0; k < N_ELEMENTS (batches); k++)
+    {
+      reader = protobuf_c_stream_reader_new (&foo__test_mess_speed__descriptor,
+                                             &test_allocator, 0,
+                                             bs.len, bs.data);
+      assert (reader != NULL);
+      check_stream (reader, batches[k], N_ELEMENTS (mess), expected, lens);
+
+      for (i = 0; i < N_ELEMENTS (chunks); i++)
+        for (j = 0; j < N_ELEMENTS (buffer_sizes); j++)
+          {
+            source.base.read = chunked_source_read;
+            source.data = bs.data;
+            source.len = bs.len;
+            source.chunk = chunks[i];
+            source.fail = 0;
+            reader = protobuf_c_stream_reader_new_from_source (&foo__test_mess_speed__descriptor,
+                                                               &test_allocator, 0,
+                                                               &source.base,
+                                                               buffer_sizes[j]);
+            assert (reader != NULL);
+            check_stream (reader, batches[k], N_ELEMENTS (mess),
+                          expected, lens);
+          }
+    }
+
+  /* a stream cut short fails after its last whole message */
+  for (i = 1; i < 40; i++)
+    for (j = 0; j < N_ELEMENTS (buffer_sizes); j++)
+      {
+        size_t n = 0;
+
+        source.base.read = chunked_source_read;
+        source.data = bs.data;
+        source.len = bs.len - i;
+        source.chunk = 7;
+        source.fail = 0;
+        reader = protobuf_c_stream_reader_new_from_source (&foo__test_mess_speed__descriptor,
+                                                           &test_allocator, 0,
+                                                           &source.base,
+                                                           buffer_sizes[j]);
+        assert (reader != NULL);
+        while (protobuf_c_stream_reader_read (reader, 1, &out) == 1)
+          {
+            protobuf_c_message_free_unpacked (out, &test_allocator);
+            n++;
+          }
+        assert (n == N_ELEMENTS (mess) - 1);
+        assert (protobuf_c_stream_reader_failed (reader));
+        assert (protobuf_c_stream_reader_read (reader, 1, &out) == 0);
+        protobuf_c_stream_reader_free (reader);
+      }
+
+  /* a read error between two messages is not the end of the stream */
+  for (j = 0; j < N_ELEMENTS (buffer_sizes); j++)
+    {
+      size_t n = 0;
+
+      source.base.read = chunked_source_read;
+      source.data = bs.data;
+      source.len = bs.len;
+      source.chunk = 7;
+      source.fail = 1;
+      reader = protobuf_c_stream_reader_new_from_source (&foo__test_mess_speed__descriptor,
+                                                         &test_allocator, 0,
+                                                         &source.base,
+                                                         buffer_sizes[j]);
+      assert (reader != NULL);
+      while (protobuf_c_stream_reader_read (reader, 1, &out) == 1)
+        {
+          protobuf_c_message_free_unpacked (out, &test_allocator);
+          n++;
+        }
+      assert (n == N_ELEMENTS (mess));
+      assert (protobuf_c_stream_reader_failed (reader));
+      protobuf_c_stream_reader_free (reader);
+    }
+
+  /* a length prefix that never ends, and an empty stream */
+  memset (scratch, 0xff, sizeof (scratch));
+  reader = protobuf_c_stream_reader_new (&foo__test_mess_speed__descriptor,
+                                         &test_allocator, 0,
+                                         sizeof (scratch), scratch);
+  assert (protobuf_c_stream_reader_read (reader, 1, &out) == 0);
+  assert (protobuf_c_stream_reader_failed (reader));
+  protobuf_c_stream_reader_free (reader);
+  reader = protobuf_c_stream_reader_new (&foo__test_mess_speed__descriptor,
+                                         &test_allocator, 0, 0, NULL);
+  assert (protobuf_c_stream_reader_read (reader, 1, &out) == 0);
+  assert (!protobuf_c_stream_reader_failed (reader));
+  protobuf_c_stream_reader_free (reader);
+
+  for (i = 0; i < N_ELEMENTS (mess); i++)
+    free (expected[i]);
+  PROTOBUF_C_BUFFER_SIMPLE_CLEAR (&bs);
+  assert (test_allocator_data.alloc_count == 0);
+}
+
+static void
+test_unpack_batch (void)
+{
+  static char *strings[] = { "", "a", "some longer string" };
+  Foo__TestMessSpeed mess = FOO__TEST_MESS_SPEED__INIT;
+  Foo__TestMessSpeedSub sub = FOO__TEST_MESS_SPEED_SUB__INIT;
+  uint8_t packed[10][64];
+  const uint8_t *datas[10];
+  size_t lens[10], bad_lens[10];
+  ProtobufCMessage *out[10];
+  uint8_t scratch[4096];
+  ProtobufCArena arena;
+  unsigned i;
+
+  mess.req_string = "required";
+  mess.req_message = &sub;
+  for (i = 0; i < N_ELEMENTS (packed); i++)
+    {
+      sub.has_val = 1;
+      sub.val = i * 100;
+      mess.n_r_string = i % 4;
+      mess.r_string = strings;
+      mess.has_big_number = i % 2;
+      mess.big_number = i;
+      lens[i] = foo__test_mess_speed__get_packed_size (&mess);
+      assert (lens[i] <= sizeof (packed[i]));
+      foo__test_mess_speed__pack (&mess, packed[i]);
+      datas[i] = packed[i];
+      /* every third message loses its last byte */
+      bad_lens[i] = i % 3 == 0 ? lens[i] - 1 : lens[i];
+    }
+
+  assert (protobuf_c_message_unpack_batch (&foo__test_mess_speed__descriptor,
+                                           &test_allocator, 0,
+                                           N_ELEMENTS (out), lens, datas,
+                                           out) == N_ELEMENTS (out));
+  for (i = 0; i < N_ELEMENTS (out); i++)
+    check_repack (out[i], lens[i], packed[i]);
+  protobuf_c_message_free_unpacked_batch (N_ELEMENTS (out), out,
+                                          &test_allocator);
+  assert (test_allocator_data.alloc_count == 0);
+
+  assert (protobuf_c_message_unpack_batch (&foo__test_mess_speed__descriptor,
+                                           &test_allocator, 0,
+                                           N_ELEMENTS (out), bad_lens, datas,
+                                           out) == 6);
+  for (i = 0; i < N_ELEMENTS (out); i++)
+    {
+      if (i % 3 == 0)
+        assert (out[i] == NULL);
+      else
+        check_repack (out[i], lens[i], packed[i]);
+    }
+  protobuf_c_message_free_unpacked_batch (N_ELEMENTS (out), out,
+                                          &test_allocator);
+  assert (test_allocator_data.alloc_count == 0);
+
+  /* nothing to free if nothing was unpacked */
+  for (i = 0; i < N_ELEMENTS (bad_lens); i++)
+    bad_lens[i] = lens[i] - 1;
+  assert (protobuf_c_message_unpack_batch (&foo__test_mess_speed__descriptor,
+                                           &test_allocator, 0,
+                                           N_ELEMENTS (out), bad_lens, datas,
+                                           out) == 0);
+  for (i = 0; i < N_ELEMENTS (out); i++)
+    assert (out[i] == NULL);
+  assert (protobuf_c_message_unpack_batch (&foo__test_mess_speed__descriptor,
+                                           &test_allocator, 0, 0, NULL, NULL,
+                                           out) == 0);
+  assert (test_allocator_data.alloc_count == 0);
+
+  /* with an arena, the whole batch is reclaimed at once */
+  protobuf_c_arena_init (&arena, scratch, sizeof (scratch), &test_allocator);
+  assert (protobuf_c_message_unpack_batch (&foo__test_mess_speed__descriptor,
+                                           &arena.base,
+                                           PROTOBUF_C_UNPACK_FLAG_ZERO_COPY,
+                                           N_ELEMENTS (out), lens, datas,
+                                           out) == N_ELEMENTS (out));
+  for (i = 0; i < N_ELEMENTS (out); i++)
+    check_repack (out[i], lens[i], packed[i]);
+  protobuf_c_message_free_unpacked_batch (N_ELEMENTS (out), out, &arena.base);
+  protobuf_c_arena_destroy (&arena);
+  assert (test_allocator_data.alloc_count == 0);
+}
+
+/* Runs the tasks one after the other, last first. */
+static void
+serial_executor_run (ProtobufCParallelExecutor *executor,
+                     unsigned n_tasks,
+                     void (*task) (unsigned index, void *task_data),
+                     void *task_data)
+{
+  (void) executor;
+  while (n_tasks-- > 0)
+    task (n_tasks, task_data);
+}
+
+static void
+test_unpack_parallel (void)
+{
+  static Foo__TestMessSpeedSub subs[1000];
+  static Foo__TestMessSpeedSub *children[N_ELEMENTS (subs)];
+  static char *strings[] = { "", "a", "some longer string" };
+  Foo__TestMessSpeed mess = FOO__TEST_MESS_SPEED__INIT;
+  Foo__TestMessSpeedSub leaf = FOO__TEST_MESS_SPEED_SUB__INIT;
+  Foo__TestMessSpeedSub *leaves[] = { &leaf, &leaf };
+  ProtobufCAllocator *allocators[5];
+  ProtobufCParallelExecutor executor = {
+    .run = serial_executor_run,
+  };
+  ProtobufCArena arenas[N_ELEMENTS (allocators) + 1];
+  /* subs[701], whose "val" is 801 */
+  static const uint8_t bad_element[] = { 0x03, 0x08, 0xa1, 0x06 };
+  ProtobufCMessage *out;
+  uint8_t *packed, *p;
+  size_t len;
+  unsigned i, j;
+
+  for (i = 0; i < N_ELEMENTS (subs); i++)
+    {
+      foo__test_mess_speed_sub__init (&subs[i]);
+      subs[i].has_val = 1;
+      subs[i].val = 100 + i;
+      if (i % 10 == 0)
+        {
+          subs[i].n_children = N_ELEMENTS (leaves);
+          subs[i].children = leaves;
+        }
+      children[i] = &subs[i];
+    }
+  leaf.has_val = 1;
+  leaf.val = -1;
+  mess.req_string = "required";
+  mess.req_message = &subs[1];
+  mess.n_r_message = N_ELEMENTS (children);
+  mess.r_message = children;
+  mess.n_r_string = N_ELEMENTS (strings);
+  mess.r_string = strings;
+  mess.has_big_number = 1;
+  mess.big_number = 11;
+  len = foo__test_mess_speed__get_packed_size (&mess);
+  packed = malloc (len);
+  assert (packed != NULL);
+  foo__test_mess_speed__pack (&mess, packed);
+
+  for (i = 0; i < N_ELEMENTS (allocators); i++)
+    allocators[i] = &test_allocator;
+  for (i = 1; i <= N_ELEMENTS (allocators); i++)
+    for (j = 0; j < 2; j++)
+      {
+        executor.n_tasks = i;
+        executor.allocators = j ? allocators : NULL;
+        out = protobuf_c_message_unpack_parallel (&foo__test_mess_speed__descriptor,
+                                                  &test_allocator, 0,
+                                                  &executor, len, packed);
+        assert (out != NULL);
+        check_repack (out, len, packed);
+        protobuf_c_message_free_unpacked (out, &test_allocator);
+        assert (test_allocator_data.alloc_count == 0);
+      }
+
+  /* one arena per task, and one for the rest */
+  for (i = 0; i < N_ELEMENTS (arenas); i++)
+    {
+      protobuf_c_arena_init (&arenas[i], NULL, 0, &test_allocator);
+      if (i < N_ELEMENTS (allocators))
+        allocators[i] = &arenas[i].base;
+    }
+  executor.n_tasks = N_ELEMENTS (allocators);
+  executor.allocators = allocators;
+  out = protobuf_c_message_unpack_parallel (&foo__test_mess_speed__descriptor,
+                                            &arenas[N_ELEMENTS (allocators)].base,
+                                            PROTOBUF_C_UNPACK_FLAG_ZERO_COPY,
+                                            &executor, len, packed);
+  assert (out != NULL);
+  check_repack (out, len, packed);
+  for (i = 0; i < N_ELEMENTS (arenas); i++)
+    protobuf_c_arena_destroy (&arenas[i]);
+  assert (test_allocator_data.alloc_count == 0);
+
+  /* an element that fails to unpack, in the fourth task's share */
+  for (i = 0; i < N_ELEMENTS (allocators); i++)
+    allocators[i] = &test_allocator;
+  for (p = packed; memcmp (p, bad_element, sizeof (bad_element)) != 0; p++)
+    assert (p + sizeof (bad_element) < packed + len);
+  p[1] = 0x0f;
+  for (i = 1; i <= N_ELEMENTS (allocators); i++)
+    {
+      executor.n_tasks = i;
+      assert (protobuf_c_message_unpack_parallel (&foo__test_mess_speed__descriptor,
+                                                  &test_allocator, 0,
+                                                  &executor, len,
+                                                  packed) == NULL);
+      assert (test_allocator_data.alloc_count == 0);
+    }
+  free (packed);
+
+  /* too few elements to split */
+  mess.n_r_message = 10;
+  len = foo__test_mess_speed__get_packed_size (&mess);
+  packed = malloc (len);
+  assert (packed != NULL);
+  foo__test_mess_speed__pack (&mess, packed);
+  out = protobuf_c_message_unpack_parallel (&foo__test_mess_speed__descriptor,
+                                            &test_allocator, 0,
+                                            &executor, len, packed);
+  assert (out != NULL);
+  check_repack (out, len, packed);
+  protobuf_c_message_free_unpacked (out, &test_allocator);
+  free (packed);
+  assert (test_allocator_data.alloc_count == 0);
+}
+
+/* Encode TestMessSpeedSub children { children { ... { val = 1 } } }, nested
+   `depth` deep, from the inside out. */
+static uint8_t *
+deep_speed_sub (unsigned depth, size_t *p_len)
+{
+  size_t deep_len = 4 * depth + 2;
+  uint8_t *deep = malloc (deep_len);
+  uint8_t *at;
+  unsigned i;
+
+  assert (deep != NULL);
+  at = deep + deep_len - 2;
+  at[0] = 0x08;
+  at[1] = 0x01;
+  for (i = 0; i < depth; i++)
+    {
+      size_t len = deep + deep_len - at;
+      uint8_t prefix[10];
+      size_t n = 0;
+
+      do
+        {
+          prefix[n++] = (len & 0x7f) | (len >= 0x80 ? 0x80 : 0);
+          len >>= 7;
+        }
+      while (len != 0);
+      at -= n;
+      memcpy (at, prefix, n);
+      *--at = 0x12;
+    }
+  *p_len = deep + deep_len - at;
+  memmove (deep, at, *p_len);
+  return deep;
+}
+
+/* Check that validating agrees with unpacking, for the data and for every
+   single-byte change to it and every truncation of it. */
+static void
+check_validate_matches_unpack (const ProtobufCMessageDescriptor *desc,
+                               size_t len, uint8_t *data)
+{
+  static const uint8_t values[] = { 0x00, 0x01, 0x02, 0x05, 0x7f, 0x80, 0xff };
+  ProtobufCMessage *out;
+  size_t i, j;
+
+  for (i = 0; i <= len; i++)
+    {
+      for (j = 0; j <= N_ELEMENTS (values); j++)
+        {
+          uint8_t orig = i < len ? data[i] : 0;
+
+          if (i < len && j < N_ELEMENTS (values))
+            data[i] = values[j];
+          out = protobuf_c_message_unpack (desc, &test_allocator,
+                                           j < N_ELEMENTS (values) ? len : i,
+                                           data);
+          assert (protobuf_c_message_validate (desc,
+                                               j < N_ELEMENTS (values) ? len : i,
+                                               data, 0) == (out != NULL));
+          protobuf_c_message_free_unpacked (out, &test_allocator);
+          if (i < len)
+            data[i] = orig;
+        }
+    }
+  assert (test_allocator_data.alloc_count == 0);
+}
+
+static void
+test_message_validate (void)
+{
+  static int32_t int32s[] = { 0, -1, 127, 128, INT32_MAX, INT32_MIN };
+  static int64_t int64s[] = { 0, -1, INT64_MAX };
+  static double doubles[] = { 1.5, -2 };
+  static protobuf_c_boolean bools[] = { 1, 0, 1 };
+  static char *strings[] = { "", "a", "some longer string" };
+  static const char *good_utf8[] = {
+    "", "plain ASCII that is longer than eight bytes",
+    "h\xc3\xa9llo \xe2\x82\xac \xf0\x9d\x84\x9e", "\xef\xbf\xbf\xf4\x8f\xbf\xbf"
+  };
+  static const char *bad_utf8[] = {
+    "\x80", "\xc0\x80", "\xc1\xbf", "caf\xc3", "\xe0\x9f\xbf",
+    "\xed\xa0\x80", "\xe2\x82", "\xf0\x8f\xbf\xbf", "\xf4\x90\x80\x80",
+    "\xf5\x80\x80\x80", "more than eight bytes of ASCII first \xff"
+  };
+  Foo__TestMessSpeed mess = FOO__TEST_MESS_SPEED__INIT;
+  Foo__TestMessSpeedSub sub = FOO__TEST_MESS_SPEED_SUB__INIT;
+  Foo__TestMessSpeedSub *children[] = { &sub, &sub };
+  Foo__TestMessPacked packed_mess = FOO__TEST_MESS_PACKED__INIT;
+  Foo__SubMess foreign = FOO__SUB_MESS__INIT;
+  uint8_t packed[512];
+  uint8_t *deep;
+  size_t len;
+  unsigned i;
+
+  mess.req_string = "required";
+  mess.req_message = &sub;
+  sub.has_val = 1;
+  sub.val = -3;
+  mess.n_r_message = N_ELEMENTS (children);
+  mess.r_message = children;
+  mess.n_r_string = N_ELEMENTS (strings);
+  mess.r_string = strings;
+  mess.n_p_int32 = N_ELEMENTS (int32s);
+  mess.p_int32 = int32s;
+  mess.has_test_double = 1;
+  mess.test_double = -9.25;
+  mess.has_test_boolean = 1;
+  mess.test_boolean = 1;
+  mess.has_test_fixed32 = 1;
+  mess.test_fixed32 = 5;
+  foreign.test = 10;
+  mess.test_foreign_message = &foreign;
+  len = foo__test_mess_speed__get_packed_size (&mess);
+  assert (len <= sizeof (packed));
+  foo__test_mess_speed__pack (&mess, packed);
+  assert (protobuf_c_message_validate (&foo__test_mess_speed__descriptor,
+                                       len, packed,
+                                       PROTOBUF_C_VALIDATE_FLAG_UTF8));
+  check_validate_matches_unpack (&foo__test_mess_speed__descriptor,
+                                 len, packed);
+
+  packed_mess.n_test_int32 = N_ELEMENTS (int32s);
+  packed_mess.test_int32 = int32s;
+  packed_mess.n_test_sint64 = N_ELEMENTS (int64s);
+  packed_mess.test_sint64 = int64s;
+  packed_mess.n_test_fixed32 = N_ELEMENTS (int32s);
+  packed_mess.test_fixed32 = (uint32_t *) int32s;
+  packed_mess.n_test_double = N_ELEMENTS (doubles);
+  packed_mess.test_double = doubles;
+  packed_mess.n_test_boolean = N_ELEMENTS (bools);
+  packed_mess.test_boolean = bools;
+  len = foo__test_mess_packed__get_packed_size (&packed_mess);
+  assert (len <= sizeof (packed));
+  foo__test_mess_packed__pack (&packed_mess, packed);
+  check_validate_matches_unpack (&foo__test_mess_packed__descriptor,
+                                 len, packed);
+
+  /* UTF-8 is only checked on request */
+  mess.n_r_string = 0;
+  for (i = 0; i < N_ELEMENTS (good_utf8) + N_ELEMENTS (bad_utf8); i++)
+    {
+      protobuf_c_boolean good = i < N_ELEMENTS (good_utf8);
+
+      mess.req_string = (char *) (good ? good_utf8[i]
+                                  : bad_utf8[i - N_ELEMENTS (good_utf8)]);
+      len = foo__test_mess_speed__pack (&mess, packed);
+      assert (protobuf_c_message_validate (&foo__test_mess_speed__descriptor,
+                                           len, packed, 0));
+      assert (protobuf_c_message_validate (&foo__test_mess_speed__descriptor,
+                                           len, packed,
+                                           PROTOBUF_C_VALIDATE_FLAG_UTF8) == good);
+    }
+
+  /* sub-messages are not recursed into, so any depth can be validated */
+  deep = deep_speed_sub (100000, &len);
+  assert (protobuf_c_message_validate (&foo__test_mess_speed_sub__descriptor,
+                                       len, deep, 0));
+  assert (!protobuf_c_message_validate (&foo__test_mess_speed_sub__descriptor,
+                                        len - 1, deep, 0));
+  free (deep);
+}
+
+static void
+test_merge_repeated_occurrences (void)
+{
+  static Foo__TestMessSpeedSub subs[300], leaves[N_ELEMENTS (subs)];
+  static Foo__TestMessSpeedSub *children[N_ELEMENTS (subs)];
+  static char *strings[N_ELEMENTS (subs)];
+  Foo__TestMessSpeed mess = FOO__TEST_MESS_SPEED__INIT;
+  Foo__TestMessSpeedSub req = FOO__TEST_MESS_SPEED_SUB__INIT;
+  Foo__TestMessSpeedSub merged = FOO__TEST_MESS_SPEED_SUB__INIT;
+  uint8_t *packed, *expected, *at;
+  size_t len = 0, expected_len;
+  uint8_t scratch[4096];
+  ProtobufCArena arena;
+  ProtobufCMessage *out;
+  unsigned i;
+
+  mess.req_string = "required";
+  mess.req_message = &req;
+  for (i = 0; i < N_ELEMENTS (subs); i++)
+    {
+      foo__test_mess_speed_sub__init (&leaves[i]);
+      leaves[i].has_val = 1;
+      leaves[i].val = i;
+      children[i] = &leaves[i];
+      strings[i] = "s";
+      foo__test_mess_speed_sub__init (&subs[i]);
+      subs[i].has_val = 1;
+      subs[i].val = 1000 + i;
+      subs[i].n_children = 1;
+      subs[i].children = &children[i];
+      mess.test_message = &subs[i];
+      mess.n_r_string = 1;
+      mess.r_string = &strings[i];
+      len += foo__test_mess_speed__get_packed_size (&mess);
+    }
+
+  /* one message per update, concatenated */
+  packed = malloc (len);
+  assert (packed != NULL);
+  at = packed;
+  for (i = 0; i < N_ELEMENTS (subs); i++)
+    {
+      mess.test_message = &subs[i];
+      mess.r_string = &strings[i];
+      at += foo__test_mess_speed__pack (&mess, at);
+    }
+
+  /* the last value of "val", and every child and string */
+  merged.has_val = 1;
+  merged.val = 1000 + N_ELEMENTS (subs) - 1;
+  merged.n_children = N_ELEMENTS (children);
+  merged.children = children;
+  mess.test_message = &merged;
+  mess.n_r_string = N_ELEMENTS (strings);
+  mess.r_string = strings;
+  expected_len = foo__test_mess_speed__get_packed_size (&mess);
+  expected = malloc (expected_len);
+  assert (expected != NULL);
+  foo__test_mess_speed__pack (&mess, expected);
+
+  out = protobuf_c_message_unpack (&foo__test_mess_speed__descriptor,
+                                   &test_allocator, len, packed);
+  assert (out != NULL);
+  check_repack (out, expected_len, expected);
+  protobuf_c_message_free_unpacked (out, &test_allocator);
+  assert (test_allocator_data.alloc_count == 0);
+
+  protobuf_c_arena_init (&arena, scratch, sizeof (scratch), &test_allocator);
+  out = protobuf_c_message_unpack_with_flags (&foo__test_mess_speed__descriptor,
+                                              &arena.base,
+                                              PROTOBUF_C_UNPACK_FLAG_ZERO_COPY,
+                                              len, packed);
+  assert (out != NULL);
+  check_repack (out, expected_len, expected);
+  protobuf_c_arena_destroy (&arena);
+  assert (test_allocator_data.alloc_count == 0);
+
+  /* an occurrence that fails to unpack */
+  assert (protobuf_c_message_unpack (&foo__test_mess_speed__descriptor,
+                                     &test_allocator, len - 1,
+                                     packed) == NULL);
+  assert (test_allocator_data.alloc_count == 0);
+  free (expected);
+  free (packed);
+}
+
+/* a message tree unpacked into a single block is freed with a single call */
+static void
+test_single_block_unpack (void)
+{
+  static char *strings[] = { "a", "bb", "ccc" };
+  Foo__TestMessSpeed mess = FOO__TEST_MESS_SPEED__INIT;
+  Foo__TestMessSpeedSub sub = FOO__TEST_MESS_SPEED_SUB__INIT;
+  Foo__TestMessSpeedSub child = FOO__TEST_MESS_SPEED_SUB__INIT;
+  Foo__TestMessSpeedSub *children[40];
+  ProtobufCMessageUnknownField unknown[5];
+  uint8_t unknown_data[] = { 3, 'x', 'y', 'z' };
+  uint8_t packed[1024], packed2[2 * sizeof (packed)], out_data[sizeof (packed2)];
+  size_t len, len2;
+  uint8_t scratch[4096];
+  ProtobufCArena arena;
+  Foo__TestMessSpeed *out;
+  unsigned i;
+
+  mess.req_string = "required";
+  mess.req_message = &sub;
+  for (i = 0; i < N_ELEMENTS (children); i++)
+    children[i] = &child;
+  sub.n_children = N_ELEMENTS (children);
+  sub.children = children;
+  child.has_val = 1;
+  child.val = 5;
+  for (i = 0; i < N_ELEMENTS (unknown); i++)
+    {
+      unknown[i].tag = 1000 + i;
+      unknown[i].wire_type = PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
+      unknown[i].len = sizeof (unknown_data);
+      unknown[i].data = unknown_data;
+    }
+  mess.base.n_unknown_fields = N_ELEMENTS (unknown);
+  mess.base.unknown_fields = unknown;
+  child.base.n_unknown_fields = 1;
+  child.base.unknown_fields = unknown;
+  mess.n_r_string = N_ELEMENTS (strings);
+  mess.r_string = strings;
+  mess.test_message = &sub;
+  len = foo__test_mess_speed__get_packed_size (&mess);
+  assert (len <= sizeof (packed));
+  foo__test_mess_speed__pack (&mess, packed);
+
+  test_allocator_data.alloc_count = 0;
+  test_allocator_data.allocs_left = INT32_MAX;
+  out = (Foo__TestMessSpeed *)
+    protobuf_c_message_unpack_with_flags (&foo__test_mess_speed__descriptor,
+                                          &test_allocator,
+                                          PROTOBUF_C_UNPACK_FLAG_SINGLE_BLOCK,
+                                          len, packed);
+  assert (out != NULL);
+  assert (test_allocator_data.alloc_count == 1);
+  assert (out->base.n_unknown_fields == N_ELEMENTS (unknown));
+  assert (out->test_message->children[0]->base.n_unknown_fields == 1);
+  check_repack (&out->base, len, packed);
+  protobuf_c_message_free_unpacked_single_block (&out->base, &test_allocator);
+  assert (test_allocator_data.alloc_count == 0);
+  protobuf_c_message_free_unpacked_single_block (NULL, &test_allocator);
+
+  /*
+   * The message twice over: "test_message" is merged, and its children
+   * outgrow the array sized for either occurrence.
+   */
+  memcpy (packed2, packed, len);
+  memcpy (packed2 + len, packed, len);
+  len2 = 2 * len;
+  out = (Foo__TestMessSpeed *)
+    protobuf_c_message_unpack_with_flags (&foo__test_mess_speed__descriptor,
+                                          &test_allocator,
+                                          PROTOBUF_C_UNPACK_FLAG_SINGLE_BLOCK,
+                                          len2, packed2);
+  assert (out != NULL);
+  assert (out->test_message->n_children == 2 * N_ELEMENTS (children));
+  assert (out->n_r_string == 2 * N_ELEMENTS (strings));
+  assert (out->base.n_unknown_fields == 2 * N_ELEMENTS (unknown));
+  len = foo__test_mess_speed__pack (out, out_data);
+  protobuf_c_message_free_unpacked_single_block (&out->base, &test_allocator);
+  assert (test_allocator_data.alloc_count == 0);
+
+  /* the flag has no effect with an arena */
+  protobuf_c_arena_init (&arena, scratch, sizeof (scratch), &test_allocator);
+  out = (Foo__TestMessSpeed *)
+    protobuf_c_message_unpack_with_flags (&foo__test_mess_speed__descriptor,
+                                          &arena.base,
+                                          PROTOBUF_C_UNPACK_FLAG_SINGLE_BLOCK,
+                                          len2, packed2);
+  assert (out != NULL);
+  check_repack (&out->base, len, out_data);
+  protobuf_c_message_free_unpacked_single_block (&out->base, &arena.base);
+  protobuf_c_arena_destroy (&arena);
+  assert (test_allocator_data.alloc_count == 0);
+
+  /* failures leave nothing behind */
+  assert (protobuf_c_message_unpack_with_flags (&foo__test_mess_speed__descriptor,
+                                                &test_allocator,
+                                                PROTOBUF_C_UNPACK_FLAG_SINGLE_BLOCK,
+                                                len2 - 1, packed2) == NULL);
+  assert (test_allocator_data.alloc_count == 0);
+  for (i = 0; i < 3; i++)
+    {
+      test_allocator_data.allocs_left = i;
+      out = (Foo__TestMessSpeed *)
+        protobuf_c_message_unpack_with_flags (&foo__test_mess_speed__descriptor,
+                                              &test_allocator,
+                                              PROTOBUF_C_UNPACK_FLAG_SINGLE_BLOCK,
+                                              len2, packed2);
+      if (out != NULL)
+        protobuf_c_message_free_unpacked_single_block (&out->base,
+                                                       &test_allocator);
+      assert (test_allocator_data.alloc_count == 0);
+    }
+  test_allocator_data.allocs_left = INT32_MAX;
+}
+
+/* unknown fields are copied into one block, and packed back from it */
+static void
+test_unknown_field_block (void)
+{
+  uint8_t packed[1024], scratch[1024];
+  ProtobufCBufferSimple bs = PROTOBUF_C_BUFFER_SIMPLE_INIT (scratch);
+  uint8_t overlong[] = {
+    (1 << 3) | PROTOBUF_C_WIRE_TYPE_VARINT, 7,
+    /* unknown field 3 with a tag of two bytes instead of one */
+    0x80 | (3 << 3) | PROTOBUF_C_WIRE_TYPE_VARINT, 0, 5,
+    (4 << 3) | PROTOBUF_C_WIRE_TYPE_VARINT, 6
+  };
+  const uint8_t canonical[] = {
+    (1 << 3) | PROTOBUF_C_WIRE_TYPE_VARINT, 7,
+    (3 << 3) | PROTOBUF_C_WIRE_TYPE_VARINT, 5,
+    (4 << 3) | PROTOBUF_C_WIRE_TYPE_VARINT, 6
+  };
+  ProtobufCArena arena;
+  Foo__TestMessSpeedSub *mess;
+  size_t len = 0;
+  unsigned i;
+
+  /* "val", then unknown fields of every wire type and tag size */
+  packed[len++] = (1 << 3) | PROTOBUF_C_WIRE_TYPE_VARINT;
+  packed[len++] = 7;
+  for (i = 0; i < 60; i++)
+    {
+      static const ProtobufCWireType wire_types[] = {
+        PROTOBUF_C_WIRE_TYPE_VARINT, PROTOBUF_C_WIRE_TYPE_64BIT,
+        PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED, PROTOBUF_C_WIRE_TYPE_32BIT
+      };
+      uint32_t tag = i % 3 == 0 ? 3 + i : i % 3 == 1 ? 100 * i : 100000 + i;
+      uint32_t v = (tag << 3) | wire_types[i % 4];
+
+      for (; v >= 0x80; v >>= 7)
+        packed[len++] = v | 0x80;
+      packed[len++] = v;
+      switch (i % 4)
+        {
+        case 0:
+          packed[len++] = i;
+          break;
+        case 1:
+          memset (packed + len, i, 8);
+          len += 8;
+          break;
+        case 2:
+          packed[len++] = i % 5;
+          memset (packed + len, 'a' + i % 26, i % 5);
+          len += i % 5;
+          break;
+        default:
+          memset (packed + len, i, 4);
+          len += 4;
+          break;
+        }
+    }
+  assert (len <= sizeof (packed));
+
+  /* the message, its unknown field array and one block of data */
+  test_allocator_data.alloc_count = 0;
+  test_allocator_data.allocs_left = INT32_MAX;
+  mess = foo__test_mess_speed_sub__unpack (&test_allocator, len, packed);
+  assert (mess != NULL);
+  assert (test_allocator_data.alloc_count == 3);
+  assert (mess->val == 7);
+  assert (mess->base.n_unknown_fields == 60);
+  check_repack (&mess->base, len, packed);
+  assert (foo__test_mess_speed_sub__pack_to_buffer (mess, &bs.base) == len);
+  assert (bs.len == len && memcmp (bs.data, packed, len) == 0);
+  PROTOBUF_C_BUFFER_SIMPLE_CLEAR (&bs);
+
+  /* a second block when unpacking into the message again */
+  assert (foo__test_mess_speed_sub__unpack_into (mess, &test_allocator,
+                                                 len, packed));
+  assert (test_allocator_data.alloc_count == 3);
+  check_repack (&mess->base, len, packed);
+  foo__test_mess_speed_sub__free_unpacked (mess, &test_allocator);
+  assert (test_allocator_data.alloc_count == 0);
+
+  /* the message parser copies unknown fields as they come */
+  mess = (Foo__TestMessSpeedSub *)
+    parse_in_pieces (&foo__test_mess_speed_sub__descriptor, len, packed, 3);
+  assert (mess != NULL);
+  check_repack (&mess->base, len, packed);
+  foo__test_mess_speed_sub__free_unpacked (mess, &test_allocator);
+  assert (test_allocator_data.alloc_count == 0);
+
+  /* unpacking fails after the unknown fields */
+  packed[len] = (2 << 3) | PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
+  packed[len + 1] = 1;
+  assert (foo__test_mess_speed_sub__unpack (&test_allocator, len + 2,
+                                            packed) == NULL);
+  assert (test_allocator_data.alloc_count == 0);
+  for (i = 0; i < 3; i++)
+    {
+      test_allocator_data.allocs_left = i;
+      assert (foo__test_mess_speed_sub__unpack (&test_allocator, len,
+                                                packed) == NULL);
+      assert (test_allocator_data.alloc_count == 0);
+    }
+  test_allocator_data.allocs_left = INT32_MAX;
+
+  /* borrowed unknown fields are packed with canonical tags */
+  protobuf_c_arena_init (&arena, scratch, sizeof (scratch), NULL);
+  mess = (Foo__TestMessSpeedSub *)
+    protobuf_c_message_unpack_with_flags (&foo__test_mess_speed_sub__descriptor,
+                                          &arena.base,
+                                          PROTOBUF_C_UNPACK_FLAG_ZERO_COPY,
+                                          sizeof (overlong), overlong);
+  assert (mess != NULL);
+  assert (mess->base.n_unknown_fields == 2);
+  check_repack (&mess->base, sizeof (canonical), canonical);
+  protobuf_c_arena_destroy (&arena);
+}
+
+/* unknown fields skipped by an unpack flag, or by a message option */
+static void
+test_discard_unknown (void)
+{
+  const uint8_t packed[] = {
+    0x08, 0x07,                         /* val = 7 */
+    0x12, 0x04, 0x08, 0x01, 0x18, 0x06, /* children { val = 1, unknown 3 } */
+    0x18, 0x05                          /* unknown field 3 */
+  };
+  const uint8_t repacked[] = { 0x08, 0x07, 0x12, 0x02, 0x08, 0x01 };
+  const uint8_t packed_option[] = {
+    0x28, 0x07,                         /* unknown field 5 */
+    0x08, 0x01,                         /* test = 1 */
+    0x12, 0x04, 0x08, 0x02, 0x30, 0x08, /* child { test = 2, unknown 6 } */
+    0x1a, 0x05, 0x20, 0x04, 0xa0, 0x01, 0x09 /* sub { test = 4, unknown 20 } */
+  };
+  const uint8_t repacked_option[] = {
+    0x08, 0x01, 0x12, 0x02, 0x08, 0x02, 0x1a, 0x05, 0x20, 0x04, 0xa0, 0x01, 0x09
+  };
+  Foo__TestMessSpeedSub *mess;
+  Foo__TestMessDiscardUnknown *dmess;
+  unsigned single_block;
+
+  test_allocator_data.alloc_count = 0;
+  test_allocator_data.allocs_left = INT32_MAX;
+  for (single_block = 0; single_block < 2; single_block++)
+    {
+      mess = (Foo__TestMessSpeedSub *)
+        protobuf_c_message_unpack_with_flags (&foo__test_mess_speed_sub__descriptor,
+                                              &test_allocator,
+                                              PROTOBUF_C_UNPACK_FLAG_DISCARD_UNKNOWN |
+                                              (single_block ?
+                                               PROTOBUF_C_UNPACK_FLAG_SINGLE_BLOCK : 0),
+                                              sizeof (packed), packed);
+      assert (mess != NULL);
+      /* the message, its children array and the child */
+      assert (test_allocator_data.alloc_count == (single_block ? 1 : 3));
+      assert (mess->base.n_unknown_fields == 0);
+      assert (mess->n_children == 1);
+      assert (mess->children[0]->base.n_unknown_fields == 0);
+      check_repack (&mess->base, sizeof (repacked), repacked);
+      if (single_block)
+        protobuf_c_message_free_unpacked_single_block (&mess->base,
+                                                       &test_allocator);
+      else
+        foo__test_mess_speed_sub__free_unpacked (mess, &test_allocator);
+      assert (test_allocator_data.alloc_count == 0);
+    }
+
+  /* without the flag, the unknown fields are kept */
+  mess = foo__test_mess_speed_sub__unpack (&test_allocator,
+                                           sizeof (packed), packed);
+  assert (mess != NULL);
+  check_repack (&mess->base, sizeof (packed), packed);
+  foo__test_mess_speed_sub__free_unpacked (mess, &test_allocator);
+
+  /* the option only applies to the messages that have it */
+  dmess = foo__test_mess_discard_unknown__unpack (&test_allocator,
+                                                  sizeof (packed_option),
+                                                  packed_option);
+  assert (dmess != NULL);
+  assert (dmess->base.n_unknown_fields == 0);
+  assert (dmess->child->base.n_unknown_fields == 0);
+  assert (dmess->sub->base.n_unknown_fields == 1);
+  check_repack (&dmess->base, sizeof (repacked_option), repacked_option);
+  foo__test_mess_discard_unknown__free_unpacked (dmess, &test_allocator);
+  assert (test_allocator_data.alloc_count == 0);
+}
+
+/* options, depth limit and scratch memory shared across unpack calls */
+static void
+test_unpack_context (void)
+{
+  const uint8_t nested[] = {
+    0x12, 0x04, 0x12, 0x02, 0x08, 0x01  /* children { children { val = 1 } } */
+  };
+  const uint8_t many[] = {
+    0x0a, 0x01, 'a',                    /* field1 = "a" */
+    0x8a, 0x08, 0x01, 'b'               /* field129 = "b" */
+  };
+  ProtobufCUnpackContext context;
+  Foo__TestMessSpeedSub *mess;
+  Foo__TestRequiredFieldsBitmap *bmess;
+  unsigned i;
+
+  test_allocator_data.alloc_count = 0;
+  test_allocator_data.allocs_left = INT32_MAX;
+  protobuf_c_unpack_context_init (&context, &test_allocator, 0);
+
+  /* a limit below the nesting of the input fails without leaking; only the
+   * scratch memory holding the queued sub-messages is kept */
+  context.max_depth = 2;
+  mess = (Foo__TestMessSpeedSub *)
+    protobuf_c_message_unpack_with_context (&context,
+                                            &foo__test_mess_speed_sub__descriptor,
+                                            sizeof (nested), nested);
+  assert (mess == NULL);
+  assert (context.stats.n_failures == 1);
+  assert (test_allocator_data.alloc_count == 1);
+
+  context.max_depth = 3;
+  mess = (Foo__TestMessSpeedSub *)
+    protobuf_c_message_unpack_with_context (&context,
+                                            &foo__test_mess_speed_sub__descriptor,
+                                            sizeof (nested), nested);
+  assert (mess != NULL);
+  assert (mess->children[0]->children[0]->val == 1);
+  assert (context.stats.max_depth == 3);
+  check_repack (&mess->base, sizeof (nested), nested);
+  foo__test_mess_speed_sub__free_unpacked (mess, &test_allocator);
+  assert (test_allocator_data.alloc_count == 1);
+
+  /* the bitmap of a large message comes from the scratch memory, which is
+   * obtained once and then reused */
+  for (i = 0; i < 3; i++)
+    {
+      bmess = (Foo__TestRequiredFieldsBitmap *)
+        protobuf_c_message_unpack_with_context (&context,
+                                                &foo__test_required_fields_bitmap__descriptor,
+                                                sizeof (many), many);
+      assert (bmess != NULL);
+      assert (strcmp (bmess->field1, "a") == 0);
+      assert (strcmp (bmess->field129, "b") == 0);
+      foo__test_required_fields_bitmap__free_unpacked (bmess, &test_allocator);
+      assert (test_allocator_data.alloc_count == 1);
+    }
+  assert (context.stats.n_messages == 4);
+  assert (context.stats.n_failures == 1);
+  assert (context.stats.n_bytes == sizeof (nested) + 3 * sizeof (many));
+
+  protobuf_c_unpack_context_destroy (&context);
+  assert (test_allocator_data.alloc_count == 0);
+}
+
+/* sub-messages queued on a context are parsed in order, to any depth */
+static void
+test_iterative_unpack (void)
+{
+  const uint8_t merged[] = {
+    0x12, 0x06, 0x08, 0x01, 0x12, 0x02, 0x08, 0x05, /* child { test = 1, child { test = 5 } } */
+    0x12, 0x02, 0x08, 0x02                          /* child { test = 2 } */
+  };
+  const uint8_t replaced[] = {
+    0x92, 0x01, 0x02, 0x20, 0x04,       /* test_message { test = 4 } */
+    0x92, 0x01, 0x02, 0x20, 0x09,       /* test_message { test = 9 } */
+    0x08, 0x07,                         /* test_int32 = 7 */
+    0x92, 0x01, 0x02, 0x20, 0x03        /* test_message { test = 3 } */
+  };
+  /* rep_mess { test_fixed32 = [1] }, rep_mess { test_fixed32 = [2] }, ... */
+  const uint8_t borrowed[] = {
+    0x0a, 0x06, 0x42, 0x04, 0x01, 0x00, 0x00, 0x00,
+    0x0a, 0x06, 0x42, 0x04, 0x02, 0x00, 0x00, 0x00,
+    0x12, 0x00, 0x1a, 0x00, 0x22, 0x02, 0x20, 0x00, 0x2a, 0x00
+  };
+  /* keeps the packed arrays 4-byte aligned, so that they are borrowed */
+  union {
+    uint32_t align;
+    uint8_t bytes[sizeof (borrowed)];
+  } input;
+  const unsigned depth = 5000;
+  ProtobufCUnpackContext context;
+  ProtobufCArena arena;
+  Foo__TestMessDiscardUnknown *dmess;
+  Foo__TestMessOneof *omess;
+  Foo__TestMessSubMess *smess;
+  Foo__TestMessSpeedSub *mess, *sub;
+  uint8_t *deep;
+  size_t deep_len;
+  unsigned i;
+
+  test_allocator_data.alloc_count = 0;
+  test_allocator_data.allocs_left = INT32_MAX;
+  protobuf_c_unpack_context_init (&context, &test_allocator, 0);
+
+  /* occurrences of a field are merged in the order they come in */
+  dmess = (Foo__TestMessDiscardUnknown *)
+    protobuf_c_message_unpack_with_context (&context,
+                                            &foo__test_mess_discard_unknown__descriptor,
+                                            sizeof (merged), merged);
+  assert (dmess != NULL);
+  assert (dmess->child->test == 2);
+  assert (dmess->child->child->test == 5);
+  foo__test_mess_discard_unknown__free_unpacked (dmess, &test_allocator);
+
+  /* oneof messages replaced before they are parsed are dropped */
+  omess = (Foo__TestMessOneof *)
+    protobuf_c_message_unpack_with_context (&context,
+                                            &foo__test_mess_oneof__descriptor,
+                                            sizeof (replaced), replaced);
+  assert (omess != NULL);
+  assert (omess->test_oneof_case == FOO__TEST_MESS_ONEOF__TEST_ONEOF_TEST_MESSAGE);
+  assert (omess->test_message->test == 3);
+  foo__test_mess_oneof__free_unpacked (omess, &test_allocator);
+
+  /* zero-copy arrays are copied before a later occurrence grows them */
+  protobuf_c_arena_init (&arena, NULL, 0, &test_allocator);
+  context.allocator = &arena.base;
+  context.flags = PROTOBUF_C_UNPACK_FLAG_ZERO_COPY;
+  memcpy (input.bytes, borrowed, sizeof (borrowed));
+  smess = (Foo__TestMessSubMess *)
+    protobuf_c_message_unpack_with_context (&context,
+                                            &foo__test_mess_sub_mess__descriptor,
+                                            sizeof (input.bytes), input.bytes);
+  assert (smess != NULL);
+  assert (smess->rep_mess->n_test_fixed32 == 2);
+  assert (smess->rep_mess->test_fixed32[0] == 1);
+  assert (smess->rep_mess->test_fixed32[1] == 2);
+  assert (memcmp (input.bytes, borrowed, sizeof (borrowed)) == 0);
+  protobuf_c_arena_destroy (&arena);
+  context.allocator = &test_allocator;
+  context.flags = 0;
+  assert (test_allocator_data.alloc_count == 1);
+
+  deep = deep_speed_sub (depth, &deep_len);
+  mess = (Foo__TestMessSpeedSub *)
+    protobuf_c_message_unpack_with_context (&context,
+                                            &foo__test_mess_speed_sub__descriptor,
+                                            deep_len, deep);
+  assert (mess != NULL);
+  assert (context.stats.max_depth == depth + 1);
+  for (sub = mess, i = 0; i < depth; i++)
+    {
+      assert (sub->n_children == 1);
+      sub = sub->children[0];
+    }
+  assert (sub->val == 1);
+  assert (protobuf_c_message_check (&mess->base));
+  foo__test_mess_speed_sub__free_unpacked (mess, &test_allocator);
+
+  context.max_depth = depth;
+  mess = (Foo__TestMessSpeedSub *)
+    protobuf_c_message_unpack_with_context (&context,
+                                            &foo__test_mess_speed_sub__descriptor,
+                                            deep_len, deep);
+  assert (mess == NULL);
+  free (deep);
+
+  protobuf_c_unpack_context_destroy (&context);
+  assert (test_allocator_data.alloc_count == 0);
+}
+
+/* fields are found by number whatever order they come in */
+static void
+test_field_index_table (void)
+{
+  /* f119, f61, unknown 2, f31, unknown 120, f1, unknown 1000 */
+  static const uint8_t reordered[] = {
+    0xb8, 0x07, 0x05,
+    0xe8, 0x03, 0x07,
+    0x10, 0x01,
+    0xfd, 0x01, 0x2a, 0x00, 0x00, 0x00,
+    0xc0, 0x07, 0x02,
+    0x08, 0x03,
+    0xc0, 0x3e, 0x01,
+  };
+  Foo__TestMessManyFields mess = FOO__TEST_MESS_MANY_FIELDS__INIT;
+  Foo__TestMessManyFields *mess2;
+  uint8_t packed[128];
+  size_t len;
+
+  /* only messages with dense, non-contiguous numbering get a table */
+  assert (foo__test_mess_many_fields__descriptor.reserved2 != NULL);
+  assert (foo__test_mess__descriptor.reserved2 == NULL);
+  assert (foo__test_mess_speed__descriptor.reserved2 == NULL);
+
+  mess.has_f1 = 1;
+  mess.f1 = -1;
+  mess.f3 = "three";
+  mess.has_f5 = 1;
+  mess.f5 = -5;
+  mess.has_f61 = 1;
+  mess.f61 = 61;
+  mess.has_f73 = 1;
+  mess.f73 = 73;
+  mess.f111 = "one hundred and eleven";
+  mess.has_f119 = 1;
+  mess.f119 = 119;
+  len = foo__test_mess_many_fields__get_packed_size (&mess);
+  assert (len <= sizeof (packed));
+  assert (foo__test_mess_many_fields__pack (&mess, packed) == len);
+  mess2 = foo__test_mess_many_fields__unpack (NULL, len, packed);
+  assert (mess2 != NULL);
+  check_repack (&mess2->base, len, packed);
+  foo__test_mess_many_fields__free_unpacked (mess2, NULL);
+
+  mess2 = foo__test_mess_many_fields__unpack (NULL, sizeof (reordered),
+                                              reordered);
+  assert (mess2 != NULL);
+  assert (mess2->has_f1 && mess2->f1 == 3);
+  assert (mess2->has_f31 && mess2->f31 == 42);
+  assert (mess2->has_f61 && mess2->f61 == 7);
+  assert (mess2->has_f119 && mess2->f119 == 5);
+  assert (!mess2->has_f73 && mess2->f3 == NULL);
+  assert (mess2->base.n_unknown_fields == 3);
+  assert (mess2->base.unknown_fields[0].tag == 2);
+  assert (mess2->base.unknown_fields[1].tag == 120);
+  assert (mess2->base.unknown_fields[2].tag == 1000);
+  foo__test_mess_many_fields__free_unpacked (mess2, NULL);
+}
+
 static void
 test_free_unpacked_input_check_for_null_message (void)
 {
@@ -2345,6 +4940,30 @@ static Test tests[] =
   { "test packed repeated TestEnum", test_packed_repeated_TestEnum },
 
   { "test unknown fields", test_unknown_fields },
+  { "test interleaved repeated fields", test_interleaved_repeated_fields },
+  { "test arena allocator", test_arena },
+  { "test zero-copy unpack", test_zero_copy },
+  { "test field table", test_field_table },
+  { "test optimize_for = SPEED pack", test_speed_pack },
+  { "test optimize_for = SPEED unpack", test_speed_unpack },
+  { "test pack_to_buffer of nested messages", test_pack_to_buffer_nested },
+  { "test pack_to_reverse_buffer", test_pack_to_reverse_buffer },
+  { "test packed varint arrays", test_packed_varint_arrays },
+  { "test unpack_into and clear", test_unpack_into },
+  { "test unpack with a field mask", test_unpack_masked },
+  { "test field index table", test_field_index_table },
+  { "test message parser", test_message_parser },
+  { "test unpack from segments", test_unpack_segments },
+  { "test stream reader and writer", test_stream_reader_writer },
+  { "test batch unpack", test_unpack_batch },
+  { "test parallel unpack", test_unpack_parallel },
+  { "test message validation", test_message_validate },
+  { "test merging repeated occurrences", test_merge_repeated_occurrences },
+  { "test single-block unpack", test_single_block_unpack },
+  { "test unknown field block", test_unknown_field_block },
+  { "test discarding unknown fields", test_discard_unknown },
+  { "test unpack context", test_unpack_context },
+  { "test iterative unpack", test_iterative_unpack },
 
   { "test enum lookups", test_enum_lookups },
   { "test message lookups", test_message_lookups },